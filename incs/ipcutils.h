@@ -26,6 +26,8 @@
 #ifndef _IPCUTILS_H
 #define _IPCUTILS_H
 
+#include <pthread.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,6 +40,15 @@ extern "C" {
 										// for memWrite() and memRead() in mem_utils.c
 
 #define MAX_SEGNAME		32
+
+#define MEM_BACKEND_SYSV	0			// shmget()/shmat(), the default
+#define MEM_BACKEND_POSIX	1			// shm_open()/mmap()
+#define MEM_BACKEND_MEMFD	2			// memfd_create()/mmap()
+
+#define MEM_HUGEPAGE	0x01			// memInitBackend() flags
+#define MEM_POPULATE	0x02
+#define MEM_MLOCK		0x04
+#define MAX_MEM_STRIPES	1024			// max lock stripes for memCreateStriped()
 #define MAX_MEMMASTERS	16
 #define MEMMASTER_ID	0x54A9FCF		// unique memory ID (hopefully)
 
@@ -45,11 +56,43 @@ extern "C" {
 #define MAX_SEMMASTERS	16
 #define SEMMASTER_ID	0x4A48198		// unique semaphore ID
 
+#define SEM_BACKEND_SYSV	0			// semget()/semop(), the default
+#define SEM_BACKEND_FUTEX	1			// futex words in a shared memory segment
+#define MAX_SEM_OPS		32				// max operations for semOpMany() and friends
+
 #define MAX_MSGNAME		32
 #define MAX_MSGMASTERS	16
 #define MAX_MSG_SIZE	64
 #define MSGMASTER_ID	0x5F42A96		// unique message queue ID
 
+#define MEM_HDR_MAGIC	0x4D454D48		// "MEMH", marks a segment created with a MemHeader
+
+/*
+ * Every segment created by memCreate() starts with a MemHeader, the user data
+ * follows at hdrSize bytes.  memAttach() returns a pointer to the user data.
+ * Segments from memCreateStriped() have numStripes MemStripe entries between
+ * the MemHeader and the user data.
+ */
+typedef struct _memHeader {
+	unsigned int magic;
+	unsigned int hdrSize;		// offset of user data from start of segment
+	long memSize;				// size of user data
+	pthread_mutex_t memLock;	// robust process shared lock for this segment
+	unsigned long memSeq;		// seqlock counter, odd while memSeqWrite() is copying
+	int numStripes;				// 0 means memLock protects the whole segment
+	long stripeSize;			// bytes of user data covered by each stripe
+} MemHeader;
+
+// One stripe per cache line.  Writers take the robust lock, readers copy
+// without it and retry if stripeSeq was odd or changed, like memSeqRead().
+typedef struct _memStripe {
+	pthread_mutex_t stripeLock;
+	unsigned long stripeSeq;
+} __attribute__((aligned(64))) MemStripe;
+
+// Header size rounded up to a cache line so user data starts aligned.
+#define MEM_HDR_SIZE	((sizeof(MemHeader) + 63) & ~63UL)
+
 typedef struct _memMaster {
 	int id;
 	int inUse;
@@ -58,15 +101,39 @@ typedef struct _memMaster {
 	long memSize;
 	key_t shmId;
 	unsigned char *shmPtr;   // This pointer shouldn't be stored in SHM as it varies from process to process
+	MemHeader *memHdr;       // Same as shmPtr, start of the attached segment.
+	int backend;             // MEM_BACKEND_* the segment was created with.
+	int memFlags;            // MEM_HUGEPAGE, MEM_POPULATE, MEM_MLOCK
+	long segSize;            // header plus user data as mapped.
+	pid_t ownerPid;          // MEM_BACKEND_MEMFD, process holding memFd.
+	int memFd;
 } MemMaster;
 
+#define NAME_CACHE_BITS	6
+#define NAME_CACHE_SIZE	(1 << NAME_CACHE_BITS)
+
+typedef struct _nameCacheEntry {
+	const char *name;        // address the caller passed, not a copy.
+	unsigned long gen;
+	int idx;                 // master array offset plus one, 0 if empty.
+} NameCacheEntry;
+
+// Per-process name to master array offset cache used by the name based functions.
+typedef struct _nameCache {
+	NameCacheEntry entry[NAME_CACHE_SIZE];
+} NameCache;
+
+int nameCacheGet(NameCache *nc, const char *name, unsigned long gen);
+void nameCachePut(NameCache *nc, const char *name, int idx, unsigned long gen);
+
 typedef struct _semMaster {
 	int id;
 	int inUse;
 	int usingCnt;
 	char semName[32];
 	long semSize;
-	key_t semId;
+	key_t semId;             // shmid of the futex words for SEM_BACKEND_FUTEX.
+	int backend;             // SEM_BACKEND_SYSV or SEM_BACKEND_FUTEX
 } SemMaster;
 
 typedef struct _msgMaster {
@@ -78,8 +145,11 @@ typedef struct _msgMaster {
 } MsgMaster;
 
 int memInit(void);
+int memInitBackend(int backend, int memFlags);
+int memGetFd(const char *memName);
 int memList(char *buffer);
 int memCreate(const char *segName, long memSize);
+int memCreateStriped(const char *segName, long memSize, int numStripes);
 int memDestroy(const char *memName);
 void *memAttach(const char *segName);
 void memDetach(const char *segName);
@@ -89,6 +159,10 @@ int memRead(const char *segName, char *data, int offset, int length);
 int memReadWL(const char *segName, char *data, int offset, int length);
 int memFastWrite(int memNum, const char *data, int offset, int length);
 int memFastRead(int memNum, char *data, int offset, int length);
+int memSeqWrite(const char *segName, const char *data, int offset, int length);
+int memSeqRead(const char *segName, char *data, int offset, int length);
+int memFastSeqWrite(int memNum, const char *data, int offset, int length);
+int memFastSeqRead(int memNum, char *data, int offset, int length);
 int memAddrWrite(char *shmAddr, const char *data, int length);
 int memAddrRead(char *shmAddr, char *data, int length);
 int memUnlockMemory();
@@ -96,6 +170,49 @@ int memLockMemory();
 int memCheckAndSet(const char *memName, int offset, int length, char *checkVal, char *setVal);
 int memGetSize(const char *memName);
 
+#define MAX_CHANNELS	16				// channels a process can have open
+
+// A message in a channel, data points into the shared payload arena.
+typedef struct _chanMsg {
+	char *data;
+	int length;
+	unsigned long seq;			// used by chanCommit() and chanRelease()
+} ChanMsg;
+
+int chanCreate(const char *chanName, long arenaSize, int maxMsgs);
+int chanGetNum(const char *chanName);
+int chanReserve(int chanNum, ChanMsg *cm, int length, int block);
+int chanCommit(int chanNum, ChanMsg *cm);
+int chanSend(int chanNum, const char *msg, int length, int block);
+int chanRecv(int chanNum, ChanMsg *cm, int block);
+int chanRelease(int chanNum, ChanMsg *cm);
+int chanRecvCopy(int chanNum, char *buf, int bufLen, int block);
+int chanCount(int chanNum);
+int chanDestroy(const char *chanName);
+
+#define MAX_HEAPS		16				// heaps a process can have open
+#define HEAP_CLASSES	24				// block sizes 32 bytes to 256MB
+#define HEAP_ROOTS		8				// offsets published with heapSetRoot()
+
+int heapCreate(const char *heapName, long heapSize);
+int heapGetNum(const char *heapName);
+unsigned long heapAlloc(int heapNum, long size);
+int heapFree(int heapNum, unsigned long offset);
+long heapAllocSize(int heapNum, unsigned long offset);
+void *heapPtr(int heapNum, unsigned long offset);
+unsigned long heapOffset(int heapNum, const void *ptr);
+unsigned long heapSetRoot(int heapNum, int slot, unsigned long offset);
+unsigned long heapGetRoot(int heapNum, int slot);
+int heapDestroy(const char *heapName);
+
+#define SHASH_LOCKS		64				// bucket locks per shared hash table
+
+unsigned long shashCreate(int heapNum, int slot, int numBuckets);
+int shashPut(int heapNum, unsigned long tblOff, const char *key, int keyLen, const char *val, int valLen);
+int shashGet(int heapNum, unsigned long tblOff, const char *key, int keyLen, char *buf, int bufLen);
+int shashDelete(int heapNum, unsigned long tblOff, const char *key, int keyLen);
+long shashCount(int heapNum, unsigned long tblOff);
+
 typedef union _semun {
 	int val;                    /* value for SETVAL */
 	struct semid_ds *buf;       /* buffer for IPC_STAT, IPC_SET */
@@ -103,7 +220,14 @@ typedef union _semun {
 	struct seminfo *__buf;      /* buffer for IPC_INFO */
 } Semun;
 
+// One operation for semOpMany(), op is added to semaphore semIdx.
+typedef struct _semOp {
+	int semIdx;
+	int op;
+} SemOp;
+
 int semInit(void);
+int semInitBackend(int backend);
 int semCreate(const char *semName, int semSize);
 int semGetId(const char *semName);
 int semGetNum(const char *semName);
@@ -111,6 +235,11 @@ int semLock(const char *semName, int semIdx);
 int semUnlock(const char *semName, int semIdx);
 int semFastLock(int semNum, int semIdx);
 int semFastUnlock(int semNum, int semIdx);
+int semOpMany(const char *semName, const SemOp *ops, int count);
+int semLockMany(const char *semName, const int *semIdx, int count);
+int semUnlockMany(const char *semName, const int *semIdx, int count);
+int semFastLockMany(int semNum, const int *semIdx, int count);
+int semFastUnlockMany(int semNum, const int *semIdx, int count);
 
 #ifdef _GNU_SOURCE		// use compiler switch -D_GNU_SOURCE
 int semTimedLock(const char *semName, int semIdx, int timeout);
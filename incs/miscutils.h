@@ -9,6 +9,7 @@
 #include <sys/syslog.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <stdatomic.h>
 
@@ -71,6 +72,30 @@ int udpRecv (int sock, char *buf, int bufLen, struct sockaddr_in *remote, sockle
 int udpSetTimeout(int sock, struct timeval *tv);
 void udpClose(int sock);
 
+typedef struct _udpMsg {
+	char *buf;					// datagram, or several of segSize bytes with GSO/GRO
+	int bufLen;					// size of buf, for receives
+	int len;					// bytes received, or bytes to send
+	struct sockaddr_in *addr;	// sender or destination, NULL if not wanted
+	int segSize;				// GSO/GRO datagram size, 0 for one datagram
+} UdpMsg;
+
+int udpRecvBatch(int sock, UdpMsg *msgs, int num, int wait);
+int udpSendBatch(int sock, UdpMsg *msgs, int num);
+int udpSetGso(int sock, int segSize);
+int udpSetGro(int sock, int on);
+
+typedef struct _udpShards UdpShards;	// sharded server from udpShardServer()
+struct sock_fprog;
+
+typedef void (*UdpShardCb)(int idx, int sock, UdpMsg *msgs, int num, void *arg);
+
+UdpShards *udpShardServer(const char *server, int port, int numThreads, UdpShardCb cb, void *arg);
+int udpShardSock(UdpShards *us, int idx);
+int udpShardSteerProg(UdpShards *us, struct sock_fprog *prog);
+int udpShardSteerCpu(UdpShards *us);
+void udpShardStop(UdpShards *us);
+
 /* Connected UDP sockets */
 
 int udpConnClient(const char *client, int cPort, const char *server, int sPort);
@@ -79,6 +104,8 @@ int udpConnSend(int sock, const char *msg, int len);
 int udpConnRecv(int sock, char *buf, int buf_len);
 void udpConnClose(int sock);
 int udpConnBytesRecvd(int sock);
+int udpConnRecvBatch(int sock, UdpMsg *msgs, int num, int wait);
+int udpConnSendBatch(int sock, UdpMsg *msgs, int num);
 
 
 
@@ -172,14 +199,28 @@ typedef struct _treeNode {
 #define MAX_BTNAME		32
 #define MAX_BTREES		16
 #define MAX_KEY_SIZE	96
+#define BT_ORDER		32		// max keys per B+tree node
+
+// Record stored in the leaves of a B+tree, ordered by timestamp.
+typedef struct _btRecord {
+	char key[MAX_KEY_SIZE + 1];
+	char call_type;           // 'V'oice or 'S'MS
+	time_t timestamp;
+} BtRecord;
+
+struct _btNode;
 
 typedef struct _btree {
 	int inUse;
+	int itemCount;
 	char btName[MAX_BTNAME + 1];
-	pthread_mutex_t btreeLock;
-	Tree *root;
+	pthread_rwlock_t btreeLock;
+	struct _btNode *root;
 } Btree;
 
+// Callback used by btRange() and btForEach(), return non-zero to stop the walk.
+typedef int (*BtCallback)(const BtRecord *rec, void *arg);
+
 #define MAX_LLQNAME		32
 #define MAX_LLQUEUES	16
 
@@ -270,6 +311,58 @@ int tcpRecvJson(int sock, char *json, int json_len);
 int tcpRecvString(int sock, char *buf, int buf_len);
 int isIPv4Address(const char *addr);
 void tcpClose(int sock);
+long tcpSendFile(int sock, int fd, off_t offset, long count);
+int tcpZcEnable(int sock);
+long tcpZcSend(int sock, const char *msg, long numBytes, int *copied);
+
+typedef struct _jsonScan {
+	int depth;				// braces open
+	int inString;
+	int escape;				// last byte was a backslash in a string
+} JsonScan;
+
+typedef struct _tcpReader TcpReader;	// buffered reader from trCreate()
+
+int jsonScan(JsonScan *js, const char *data, int len);
+TcpReader *trCreate(int sock, int maxFrame);
+void trFree(TcpReader *tr);
+int trBuffered(TcpReader *tr);
+char *trNextJson(TcpReader *tr, int *len);
+char *trNextRec(TcpReader *tr, int *len);
+char *trNextIDRec(TcpReader *tr, unsigned int *id, int *len);
+int trSetMaxFrame(TcpReader *tr, int maxFrame);
+
+int recSend(int sock, const char *msg);
+int recNumSend(int sock, const char *msg, int numBytes);
+int recIDSend(int sock, unsigned int id, const char *msg);
+int recNumIDSend(int sock, unsigned int id, const char *msg, int numBytes);
+int recRecv(int sock, char *buf, int buf_len);
+int recIDRecv(int sock, unsigned int *id, char *buf, int buf_len);
+int recRecvString(int sock, char *buf, int buf_len);
+void recClose(int sock);
+void recPutWord(char *p, unsigned int val);
+unsigned int recGetWord(const unsigned char *h);
+
+typedef struct _tcpPoolOpts {
+	int maxPerHost;			// connections to one server, idle or checked out
+	int idleSecs;			// idle connections are closed after this
+	int connectTimeout;		// seconds to connect or wait for a free connection
+	int keepIdle;			// TCP keepalive, seconds idle before the first probe
+	int keepIntvl;			// seconds between probes
+	int keepCnt;			// probes lost before the connection is dropped
+	int userTimeout;		// TCP_USER_TIMEOUT, ms sent data may go unacked
+	// connects instead of tcpTimeoutConnect, sctpTimeoutConnect for one.  The
+	// TCP options above are not set on its sockets.
+	int (*connect)(const char *server, int port, int timeout);
+} TcpPoolOpts;
+
+typedef struct _tcpPool TcpPool;		// connection pool from tcpPoolCreate()
+
+TcpPool *tcpPoolCreate(TcpPoolOpts *opts);
+int tcpPoolGet(TcpPool *tp, const char *server, int port);
+void tcpPoolPut(TcpPool *tp, int sock, int broken);
+int tcpPoolStats(TcpPool *tp, const char *server, int port, int *numIdle);
+void tcpPoolDestroy(TcpPool *tp);
 
 int mcastServer(McastInfo *mi);
 int mcastJoin(McastInfo *mi);
@@ -279,20 +372,119 @@ int mcastNumSend(McastInfo *mi, const char *msg, int numBytes);
 int mcastRecv(McastInfo *mi, char *buf, int buf_len);
 int mcastRecvJson(McastInfo *mi, char *json, int json_len);
 int mcastRecvString(McastInfo *mi, char *buf, int buf_len);
+int mcastSeqSend(McastInfo *mi, unsigned int seq, const char *msg, int numBytes);
 void mcastClose(McastInfo *mi);
 
+typedef struct _mcastPkt {
+	char *data;					// payload, NKX1 or NKX2 header taken off
+	int len;
+	struct sockaddr_in from;
+	struct timespec ts;			// kernel receive time
+	unsigned int seq;			// NKX2 sequence number
+	int hasSeq;
+	int late;					// seq older than one already seen
+	unsigned int missingBefore;	// sequence numbers lost just before this one
+	unsigned int dropsBefore;	// dropped by this host just before this one
+} McastPkt;
+
+typedef struct _mcastStats {
+	unsigned long packets;
+	unsigned long bytes;
+	unsigned long kernelDrops;	// socket buffer overruns, SO_RXQ_OVFL
+	unsigned long gaps;			// times sequence numbers were skipped
+	unsigned long missing;		// sequence numbers never received
+	unsigned long outOfOrder;	// late or repeated sequence numbers
+	struct timespec lastGapTime;
+	unsigned int lastGapSeq;	// first sequence number of the last gap
+	unsigned int lastGapSize;
+	int rcvBuf;					// socket receive buffer the kernel gave
+} McastStats;
+
+typedef struct _mcastRx McastRx;		// batched receiver from mcastRxOpen()
+
+McastRx *mcastRxOpen(McastInfo *mi, int rcvBuf, int batch);
+int mcastRxRecv(McastRx *rx, McastPkt **pkts, int wait);
+void mcastRxStats(McastRx *rx, McastStats *st);
+void mcastRxClose(McastRx *rx);
+
+#define SCTP_MSG_UNORDERED	1	// SctpMsgInfo flag, deliver without waiting for earlier messages
+#define SCTP_MSG_PARTIAL	2	// SctpMsgInfo flag, more of this message follows
+
+typedef struct _sctpMsgInfo {
+	int stream;					// stream number, less than sctpStreams()
+	unsigned int ppid;			// payload protocol identifier
+	int flags;					// SCTP_MSG_ flags
+	int assocId;				// association on a one-to-many socket
+	struct sockaddr_in addr;	// peer address
+} SctpMsgInfo;
+
 int sctpConnect(const char *server, int port);
 int sctpTimeoutConnect(const char *server, int port, int timeout);
 int sctpServer(int port, int maxPending);
 int sctpServerSubnet(int port, int maxPending, const char *subnet);
+int sctpManyServer(int port, int maxPending, int autoClose);
 int sctpAccept(int sock, struct sockaddr *clientAddr);
 int sctpSend(int sock, const char *msg);
 int sctpNumSend(int sock, const char *msg, int numBytes);
 int sctpRecv(int sock, char *buf, int buf_len);
 int sctpRecvJson(int sock, char *json, int json_len);
 int sctpRecvString(int sock, char *buf, int buf_len);
+int sctpSendStream(int sock, const char *msg, int numBytes, SctpMsgInfo *info);
+int sctpRecvStream(int sock, char *buf, int buf_len, SctpMsgInfo *info);
+int sctpStreams(int sock, int assocId, int *inStreams);
 void sctpClose(int sock);
 
+typedef struct _evLoop EvLoop;		// event loop from evCreate()
+typedef struct _evConn EvConn;		// connection in an event loop
+
+typedef void (*EvAcceptCb)(EvConn *conn, void *arg);
+// returns bytes of data used, called again with the rest until it uses none, -1 closes.
+typedef int (*EvReadCb)(EvConn *conn, char *data, int len, void *arg);
+typedef void (*EvCloseCb)(EvConn *conn, void *arg);
+typedef void (*EvTimerCb)(EvLoop *loop, void *arg);
+typedef void (*EvSetupCb)(EvLoop *loop, int idx, void *arg);
+
+EvLoop *evCreate(int maxConns);
+void evSetCallbacks(EvLoop *loop, EvAcceptCb acceptCb, EvReadCb readCb, EvCloseCb closeCb, void *arg);
+void evSetMaxRead(EvLoop *loop, int maxRead);
+int evListen(EvLoop *loop, int port, int maxPending, int reusePort);
+EvConn *evAddConn(EvLoop *loop, int sock);
+int evSend(EvConn *conn, const char *data, int len);
+void evCloseConn(EvConn *conn);
+int evTimer(EvLoop *loop, int ms, int repeat, EvTimerCb cb, void *arg);
+int evCancelTimer(EvLoop *loop, int id);
+int evRun(EvLoop *loop);
+void evStop(EvLoop *loop);
+void evDestroy(EvLoop *loop);
+int evConnSock(EvConn *conn);
+EvLoop *evConnLoop(EvConn *conn);
+void *evConnData(EvConn *conn);
+void evConnSetData(EvConn *conn, void *data);
+int evConnPending(EvConn *conn);
+int evRunThreads(int port, int maxPending, int numLoops, int maxConns, EvSetupCb setup, void *arg);
+
+#define UR_EPOLL	1			// urCreate() flag, use epoll even when io_uring works
+
+typedef struct _urLoop UrLoop;		// io_uring loop from urCreate()
+
+typedef void (*UrAcceptCb)(UrLoop *ul, int sock, void *arg);
+// len 0 when the connection closed, returns -1 to close it.
+typedef int (*UrRecvCb)(UrLoop *ul, int sock, char *data, int len, void *arg);
+// flags has MSG_TRUNC when the datagram was longer than the loop's bufSize and len is what was kept.
+typedef void (*UrDgramCb)(UrLoop *ul, int sock, char *data, int len, struct sockaddr_in *from, int flags, void *arg);
+
+UrLoop *urCreate(int numBufs, int bufSize, int flags);
+int urIsUring(UrLoop *ul);
+int urAccept(UrLoop *ul, int listenSock, UrAcceptCb cb, void *arg);
+int urRecv(UrLoop *ul, int sock, UrRecvCb cb, void *arg);
+int urRecvFrom(UrLoop *ul, int sock, UrDgramCb cb, void *arg);
+int urSend(UrLoop *ul, int sock, const char *data, int len);
+int urSendTo(UrLoop *ul, int sock, const char *data, int len, struct sockaddr_in *to);
+void urClose(UrLoop *ul, int sock);
+int urRun(UrLoop *ul);
+void urStop(UrLoop *ul);
+void urDestroy(UrLoop *ul);
+
 typedef struct _fdata {
 	int needsFreeing;
 	int length;
@@ -336,6 +528,19 @@ char *sllList(int sllNum);
 int sllDestroy(int sllNum);
 char *sllGetName(int sllNUm);
 
+int btInit(int btreeCnt);
+int btCreate(const char *btName);
+int btGetNum(const char *btName);
+char *btGetName(int btNum);
+int btInsert(int btNum, const char *key, char callType, time_t timestamp);
+int btFind(int btNum, const char *key, time_t timestamp, BtRecord *rec);
+int btRemove(int btNum, const char *key, time_t timestamp);
+int btRemoveExpired(int btNum, time_t before);
+int btRange(int btNum, time_t from, time_t to, BtCallback cb, void *arg);
+int btForEach(int btNum, BtCallback cb, void *arg);
+int btCount(int btNum);
+int btDestroy(int btNum);
+
 int lolInit();
 MList *lolGetList();
 int lolMainListCount();
@@ -9,6 +9,10 @@
 #ifndef INCS_MMAPUTILS_H_
 #define INCS_MMAPUTILS_H_
 
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
 // On a 64bit system pointers are 8 bytes in length.
 typedef enum {
 	CHAR_FIELD,			// uint8_t type field
@@ -26,9 +30,101 @@ typedef struct _mmapField {
 	uint32_t fldLength;
 } MmapField;
 
+#define MMAP_FALLOCATE	0x01		// mmapOpen() flags, allocate disk blocks up front
+#define MMAP_POPULATE	0x02		// fault in the whole map
+#define MMAP_SEQUENTIAL	0x04		// madvise() hints
+#define MMAP_RANDOM		0x08
+#define MMAP_WILLNEED	0x10
+#define MMAP_HUGEPAGE	0x20
+
+#define MMAP_DIRTY_CHUNK	(1024 * 1024)	// bytes tracked by each mmapDirty() mark
+
+typedef struct _mmapHandle {
+	char fileName[256];
+	int fd;
+	void *addr;					// start of the map
+	size_t size;
+	size_t reserved;			// address space held at addr, see mmapOpenMax()
+	int flags;
+	uint8_t *dirty;				// one mark per MMAP_DIRTY_CHUNK, see mmapDirty()
+	size_t numChunks;
+	pthread_rwlock_t dirtyLock;	// shared by flushes, mmapGrow() holds it alone to change the map
+	pthread_t syncThread;		// mmapSyncEvery() flusher
+	pthread_mutex_t syncMutex;
+	pthread_cond_t syncCond;
+	int syncMs;					// 0 if no flusher is running
+} MmapHandle;
+
+typedef struct _wal Wal;		// write ahead log handle from walOpen()
+typedef struct _snapshot Snapshot;	// running snapshot from walSnapshot()
+
+typedef struct _snapStatus {
+	int done;					// 0 running, 1 complete, -1 failed
+	size_t totalBytes;			// size of the map
+	size_t copiedBytes;			// copied so far
+	long recsApplied;			// log records written over the copy
+	double copySecs;			// from start to finish
+	double pauseUsecs;			// writers were held off this long in all
+} SnapStatus;
+
+#define IMDB_MAX_FIELDS	64
+#define IMDB_LOCKS		64			// record lock stripes per table
+
+typedef struct _imdbSchema {
+	char schemaName[32];
+	int fieldLen;				// number of entries in fields
+	MmapField *fields;
+} ImdbSchema;
+
+typedef struct _imdb Imdb;		// table handle from imdbOpen()
+
+MmapHandle *mmapOpen(const char *fileName, size_t size, int flags);
+MmapHandle *mmapOpenMax(const char *fileName, size_t size, size_t maxSize, int flags);
+int mmapGrow(MmapHandle *mh, size_t newSize);
+int mmapRefresh(MmapHandle *mh);
+int mmapAdvise(MmapHandle *mh, size_t offset, size_t length, int flags);
+void mmapClose(MmapHandle *mh);
+int mmapSync(MmapHandle *mh, size_t offset, size_t length, int wait);
+void mmapDirty(MmapHandle *mh, size_t offset, size_t length);
+int mmapFlush(MmapHandle *mh, int wait);
+int mmapSyncEvery(MmapHandle *mh, int ms);
 void *mmapInit(char *fileName, unsigned int sizeInPages);
 int mmapLock();
 int mmapUnlock();
 
+Imdb *imdbOpen(const char *fileName, ImdbSchema *schema, int keyField, unsigned long maxRecs, int mmapFlags);
+Imdb *imdbOpenMax(const char *fileName, ImdbSchema *schema, int keyField, unsigned long maxRecs,
+		int mmapFlags, size_t reserve);
+void imdbClose(Imdb *db);
+int imdbFieldIdx(Imdb *db, const char *fieldName);
+long imdbInsert(Imdb *db, const void *key);
+long imdbFind(Imdb *db, const void *key);
+int imdbDelete(Imdb *db, const void *key);
+long imdbCount(Imdb *db);
+int imdbGrow(Imdb *db, unsigned long maxRecs);
+int imdbLockRec(Imdb *db, long recNo);
+int imdbUnlockRec(Imdb *db, long recNo);
+void *imdbFieldPtr(Imdb *db, long recNo, int fld);
+int imdbGet(Imdb *db, long recNo, int fld, void *val);
+int imdbSet(Imdb *db, long recNo, int fld, const void *val);
+long imdbGetLong(Imdb *db, long recNo, int fld);
+int imdbSetLong(Imdb *db, long recNo, int fld, long val);
+long imdbAddLong(Imdb *db, long recNo, int fld, long delta);
+int imdbWal(Imdb *db, const char *walFile, int syncMs);
+int imdbCommit(Imdb *db);
+Snapshot *imdbSnapshot(Imdb *db, const char *imageFile);
+
+Wal *walOpen(MmapHandle *mh, const char *walFile, int syncMs);
+void walClose(Wal *w);
+int walBegin(Wal *w);
+int walEnd(Wal *w);
+int walLog(Wal *w, size_t offset, size_t length);
+int walWrite(Wal *w, size_t offset, const void *data, size_t length);
+int walCommit(Wal *w);
+int walCheckpoint(Wal *w);
+Snapshot *walSnapshot(Wal *w, const char *imageFile);
+void walSnapStatus(Snapshot *sp, SnapStatus *st);
+int walSnapWait(Snapshot *sp, SnapStatus *st);
+
 
 #endif /* INCS_MMAPUTILS_H_ */
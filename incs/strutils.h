@@ -106,6 +106,13 @@ char *uoi2Str(char *s, unsigned char *mac);
 char *uoi2HexStr(char *s, unsigned char *mac);
 int uoi2Int(unsigned char *mac);
 
+int ipv4Parse(const char *s, unsigned int *ip);
+int ipv4Format(char *s, unsigned int ip);
+int ipv6Parse(const char *s, unsigned char *ip);
+int ipv6Format(char *s, const unsigned char *ip);
+int macParse(const char *s, unsigned char *mac);
+int macFormat(char *s, const unsigned char *mac, int len, char sep);
+
 char *sipBitString(unsigned int n, char *t);
 char *tcpBitString(unsigned int n, char *t);
 char *tcpBitNString(unsigned int n, char *t, int nBits);
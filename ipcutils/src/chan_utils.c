@@ -0,0 +1,516 @@
+
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Message channels between processes for messages of any size.
+ *
+ * A channel lives in a shared memory segment made with memCreate().  Senders
+ * reserve space in a payload arena, build the message in place and commit it.
+ * The queue itself only holds descriptors (arena position and length), so
+ * receivers get a pointer to the payload and work on it in place, then release it.
+ * The arena is used as a ring, space is given back in the order messages were sent.
+ *
+ * The channel lock is only held to update descriptors, never while copying.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ipcutils.h"
+
+#define CHAN_MAGIC		0x4348414E		// "CHAN"
+#define CHAN_INIT_WAITS	10000			// 100 usec waits for a creator to fill in the header
+
+#define DESC_FREE		0
+#define DESC_RESERVED	1
+#define DESC_COMMITTED	2
+#define DESC_RECEIVED	3
+#define DESC_RELEASED	4
+
+typedef struct _chanDesc {
+	unsigned long pos;			// arena position, offset is pos % arenaSize
+	int length;
+	int state;
+} ChanDesc;
+
+typedef struct _chanHeader {
+	unsigned int magic;
+	int maxMsgs;
+	long arenaSize;
+	long arenaOffset;			// from the start of the ChanHeader
+	pthread_mutex_t chanLock;
+	pthread_cond_t dataCond;	// signaled when a message is committed
+	pthread_cond_t spaceCond;	// signaled when a message is released
+	unsigned long descHead;		// next descriptor to reserve
+	unsigned long descRecv;		// next descriptor to receive
+	unsigned long descTail;		// oldest descriptor not yet freed
+	unsigned long headPos;		// next free arena byte
+	unsigned long tailPos;		// oldest arena byte in use
+	ChanDesc desc[0];
+} ChanHeader;
+
+typedef struct _chanEntry {
+	char chanName[MAX_SEGNAME + 1];
+	ChanHeader *ch;
+	char *arena;
+} ChanEntry;
+
+static ChanEntry chans[MAX_CHANNELS];
+
+#define CHAN_ALIGN(x)	(((x) + 7) & ~7L)
+
+/*
+ * This function chanLock is private to this file.
+ * Locks the channel, recovering the lock if its owner died.
+ */
+static int chanLock(ChanHeader *ch) {
+	int r = pthread_mutex_lock(&ch->chanLock);
+	if (r == EOWNERDEAD) {
+		pthread_mutex_consistent(&ch->chanLock);
+		r = 0;
+	}
+
+	if (r != 0) {
+		fprintf(stderr, "%s (%d): Could not lock channel. errno: %d\n", __FILE__, __LINE__, r);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int chanWait(ChanHeader *ch, pthread_cond_t *cond) {
+	int r = pthread_cond_wait(cond, &ch->chanLock);
+	if (r == EOWNERDEAD) {
+		pthread_mutex_consistent(&ch->chanLock);
+		r = 0;
+	}
+
+	return r;
+}
+
+/*
+ * This function chanDrop detaches a channel chanCreate() attached but could not
+ * use, unless this process already had it.
+ * This function is private to this file.
+ */
+static void chanDrop(const char *chanName) {
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		if (chans[i].ch != NULL && strcmp(chans[i].chanName, chanName) == 0)
+			return;
+	}
+
+	memDetach(chanName);
+}
+
+/*
+ * This function chanCreate creates or attaches to an existing channel.
+ * memInit() or memInitBackend() must be called first, the channel is a
+ * shared memory segment with the same name.
+ *
+ *   chanName = Channel name to create or attach to.
+ *   arenaSize = Bytes of payload space, largest message that can be sent.
+ *   maxMsgs = Max number of messages queued at one time.
+ *
+ *   returns -1 on failure, or the creator died before the channel was ready.
+ *           -2 arenaSize or maxMsgs does not match existing channel.
+ *           0 if channel already exists
+ *           1 if channel was created.
+ */
+int chanCreate(const char *chanName, long arenaSize, int maxMsgs) {
+	if (arenaSize <= 0 || maxMsgs <= 0) {
+		fprintf(stderr, "%s (%d): arenaSize and maxMsgs must be greater than zero.\n", __FILE__, __LINE__);
+		return -1;
+	}
+
+	arenaSize = CHAN_ALIGN(arenaSize);
+	long arenaOffset = CHAN_ALIGN(sizeof(ChanHeader) + (maxMsgs * sizeof(ChanDesc)));
+
+	int ret = memCreate(chanName, arenaOffset + arenaSize);
+	if (ret < 0)
+		return ret;
+
+	ChanHeader *ch = (ChanHeader *)memAttach(chanName);
+	if (ch == NULL)
+		return -1;
+
+	if (ret == 1) {
+		pthread_mutexattr_t attr;
+		pthread_condattr_t cAttr;
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&ch->chanLock, &attr);
+		pthread_mutexattr_destroy(&attr);
+
+		pthread_condattr_init(&cAttr);
+		pthread_condattr_setpshared(&cAttr, PTHREAD_PROCESS_SHARED);
+		pthread_cond_init(&ch->dataCond, &cAttr);
+		pthread_cond_init(&ch->spaceCond, &cAttr);
+		pthread_condattr_destroy(&cAttr);
+
+		ch->maxMsgs = maxMsgs;
+		ch->arenaSize = arenaSize;
+		ch->arenaOffset = arenaOffset;
+		__atomic_store_n(&ch->magic, CHAN_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		// Created by another process, it may still be filling in the header.
+		int waits = 0;
+		while (__atomic_load_n(&ch->magic, __ATOMIC_ACQUIRE) != CHAN_MAGIC) {
+			if (++waits > CHAN_INIT_WAITS) {
+				fprintf(stderr, "%s (%d): Channel '%s' was never set up by its creator, destroy it and create it again.\n",
+						__FILE__, __LINE__, chanName);
+				chanDrop(chanName);
+				return -1;
+			}
+			usleep(100);
+		}
+
+		if (ch->maxMsgs != maxMsgs || ch->arenaSize != arenaSize) {
+			chanDrop(chanName);
+			return -2;
+		}
+	}
+
+	// Remember the mapping in this process.
+	int freeSpot = -1;
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		if (chans[i].ch == NULL) {
+			if (freeSpot == -1)
+				freeSpot = i;
+		} else if (strcmp(chans[i].chanName, chanName) == 0) {
+			return ret;
+		}
+	}
+
+	if (freeSpot == -1) {
+		fprintf(stderr, "%s (%d): No free slot left in channel table, %d max.\n",
+				__FILE__, __LINE__, MAX_CHANNELS);
+		return -1;
+	}
+
+	strcpy(chans[freeSpot].chanName, chanName);
+	chans[freeSpot].ch = ch;
+	chans[freeSpot].arena = (char *)ch + ch->arenaOffset;
+
+	return ret;
+}
+
+/*
+ * This function chanGetNum returns the chanNum used by the other chan functions.
+ *
+ *   chanName = Channel name.
+ *
+ *   returns -1 if not found, chanCreate() must be called first in each process.
+ *           else chanNum.
+ */
+int chanGetNum(const char *chanName) {
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		if (chans[i].ch != NULL && strcmp(chans[i].chanName, chanName) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static ChanEntry *getChan(int chanNum) {
+	if (chanNum < 0 || chanNum >= MAX_CHANNELS || chans[chanNum].ch == NULL) {
+		fprintf(stderr, "%s (%d): chanNum not valid %d.\n", __FILE__, __LINE__, chanNum);
+		return NULL;
+	}
+
+	return &chans[chanNum];
+}
+
+/*
+ * This function chanReserve reserves space for a message of length bytes.
+ * Write the message at cm->data then call chanCommit().
+ *
+ *   chanNum = Number from chanGetNum().
+ *   cm = filled in with the place to write the message.
+ *   length = Size of message.
+ *   block = if true wait for space else return -2 when full.
+ *
+ *   returns -1 on error
+ *           -2 channel full and block is false.
+ *           0 on success
+ */
+int chanReserve(int chanNum, ChanMsg *cm, int length, int block) {
+	ChanEntry *ce = getChan(chanNum);
+	if (ce == NULL)
+		return -1;
+
+	ChanHeader *ch = ce->ch;
+	long need = CHAN_ALIGN(length);
+
+	if (length < 0 || need > ch->arenaSize) {
+		fprintf(stderr, "%s (%d): Message length %d larger than channel arena %ld.\n",
+				__FILE__, __LINE__, length, ch->arenaSize);
+		return -1;
+	}
+
+	if (chanLock(ch) != 0)
+		return -1;
+
+	for (;;) {
+		if (ch->descTail == ch->descHead) {
+			// Empty, start at the beginning of the arena so padding never counts against a message.
+			unsigned long pos = (ch->headPos + ch->arenaSize - 1) / ch->arenaSize * ch->arenaSize;
+			ch->headPos = pos;
+			ch->tailPos = pos;
+		}
+
+		long off = ch->headPos % ch->arenaSize;
+		// A message that does not fit before the end of the arena starts at the beginning.
+		long pad = (off + need > ch->arenaSize) ? ch->arenaSize - off : 0;
+
+		if ((ch->descHead - ch->descTail) < (unsigned long)ch->maxMsgs &&
+				(ch->headPos + pad + need - ch->tailPos) <= (unsigned long)ch->arenaSize) {
+			ChanDesc *dp = &ch->desc[ch->descHead % ch->maxMsgs];
+			dp->pos = ch->headPos + pad;
+			dp->length = length;
+			dp->state = DESC_RESERVED;
+			ch->headPos += pad + need;
+
+			cm->data = ce->arena + (dp->pos % ch->arenaSize);
+			cm->length = length;
+			cm->seq = ch->descHead++;
+			break;
+		}
+
+		if (block == 0) {
+			pthread_mutex_unlock(&ch->chanLock);
+			return -2;
+		}
+
+		chanWait(ch, &ch->spaceCond);
+	}
+
+	pthread_mutex_unlock(&ch->chanLock);
+
+	return 0;
+}
+
+/*
+ * This function chanCommit makes a reserved message available to receivers.
+ *
+ *   chanNum = Number from chanGetNum().
+ *   cm = message from chanReserve().
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int chanCommit(int chanNum, ChanMsg *cm) {
+	ChanEntry *ce = getChan(chanNum);
+	if (ce == NULL)
+		return -1;
+
+	ChanHeader *ch = ce->ch;
+
+	if (chanLock(ch) != 0)
+		return -1;
+
+	ch->desc[cm->seq % ch->maxMsgs].state = DESC_COMMITTED;
+	pthread_cond_broadcast(&ch->dataCond);
+
+	pthread_mutex_unlock(&ch->chanLock);
+
+	return 0;
+}
+
+/*
+ * This function chanSend copies msg into the channel.
+ * Same as chanReserve(), memcpy() and chanCommit().
+ *
+ *   returns -1 on error
+ *           -2 channel full and block is false.
+ *           0 on success
+ */
+int chanSend(int chanNum, const char *msg, int length, int block) {
+	ChanMsg cm;
+
+	int r = chanReserve(chanNum, &cm, length, block);
+	if (r != 0)
+		return r;
+
+	memcpy(cm.data, msg, length);
+
+	return chanCommit(chanNum, &cm);
+}
+
+/*
+ * This function chanRecv returns the next message in place.
+ * cm->data points into the shared arena and stays valid until chanRelease().
+ * Messages are received in the order they were reserved.
+ *
+ *   chanNum = Number from chanGetNum().
+ *   cm = filled in with the message.
+ *   block = if true wait for a message else return 0 when empty.
+ *
+ *   returns -1 on error
+ *           0 if no message
+ *           1 if cm holds a message
+ */
+int chanRecv(int chanNum, ChanMsg *cm, int block) {
+	ChanEntry *ce = getChan(chanNum);
+	if (ce == NULL)
+		return -1;
+
+	ChanHeader *ch = ce->ch;
+
+	if (chanLock(ch) != 0)
+		return -1;
+
+	for (;;) {
+		if (ch->descRecv != ch->descHead) {
+			ChanDesc *dp = &ch->desc[ch->descRecv % ch->maxMsgs];
+			if (dp->state == DESC_COMMITTED) {
+				dp->state = DESC_RECEIVED;
+				cm->data = ce->arena + (dp->pos % ch->arenaSize);
+				cm->length = dp->length;
+				cm->seq = ch->descRecv++;
+				break;
+			}
+		}
+
+		if (block == 0) {
+			pthread_mutex_unlock(&ch->chanLock);
+			return 0;
+		}
+
+		chanWait(ch, &ch->dataCond);
+	}
+
+	pthread_mutex_unlock(&ch->chanLock);
+
+	return 1;
+}
+
+/*
+ * This function chanRelease gives a received message's space back.
+ * Space is reused in send order, so a message held for a long time
+ * keeps later messages' space from being reused.
+ *
+ *   chanNum = Number from chanGetNum().
+ *   cm = message from chanRecv().
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int chanRelease(int chanNum, ChanMsg *cm) {
+	ChanEntry *ce = getChan(chanNum);
+	if (ce == NULL)
+		return -1;
+
+	ChanHeader *ch = ce->ch;
+
+	if (chanLock(ch) != 0)
+		return -1;
+
+	ch->desc[cm->seq % ch->maxMsgs].state = DESC_RELEASED;
+
+	int freed = 0;
+	while (ch->descTail != ch->descRecv) {
+		ChanDesc *dp = &ch->desc[ch->descTail % ch->maxMsgs];
+		if (dp->state != DESC_RELEASED)
+			break;
+
+		ch->tailPos = dp->pos + CHAN_ALIGN(dp->length);
+		dp->state = DESC_FREE;
+		ch->descTail++;
+		freed = 1;
+	}
+
+	if (ch->descTail == ch->descHead)
+		ch->tailPos = ch->headPos;		// empty, nothing wasted on padding.
+
+	if (freed)
+		pthread_cond_broadcast(&ch->spaceCond);
+
+	pthread_mutex_unlock(&ch->chanLock);
+
+	return 0;
+}
+
+/*
+ * This function chanRecvCopy copies the next message into buf and releases it.
+ *
+ *   chanNum = Number from chanGetNum().
+ *   buf = Buffer to place message into.
+ *   bufLen = size of buf, longer messages are truncated.
+ *   block = if true wait for a message else return 0 when empty.
+ *
+ *   returns -1 on error
+ *           0 if no message
+ *           else number of bytes placed into buf.
+ */
+int chanRecvCopy(int chanNum, char *buf, int bufLen, int block) {
+	ChanMsg cm;
+
+	int r = chanRecv(chanNum, &cm, block);
+	if (r <= 0)
+		return r;
+
+	int len = (cm.length < bufLen) ? cm.length : bufLen;
+	memcpy(buf, cm.data, len);
+
+	chanRelease(chanNum, &cm);
+
+	return len;
+}
+
+/*
+ * This function chanCount returns the number of messages waiting to be received.
+ */
+int chanCount(int chanNum) {
+	ChanEntry *ce = getChan(chanNum);
+	if (ce == NULL)
+		return -1;
+
+	return (int)(__atomic_load_n(&ce->ch->descHead, __ATOMIC_RELAXED) -
+			__atomic_load_n(&ce->ch->descRecv, __ATOMIC_RELAXED));
+}
+
+/*
+ * This function chanDestroy detaches the channel and removes its segment.
+ *
+ *   chanName = Channel name.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int chanDestroy(const char *chanName) {
+	int chanNum = chanGetNum(chanName);
+
+	if (chanNum >= 0)
+		memset(&chans[chanNum], 0, sizeof(ChanEntry));
+
+	memDetach(chanName);
+
+	return memDestroy(chanName);
+}
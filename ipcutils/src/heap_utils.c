@@ -0,0 +1,424 @@
+
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Allocator for memory inside a shared memory segment.
+ *
+ * A heap is a segment made with memCreate().  Each process may map it at a
+ * different address, so allocations are handed out as offsets from the start of
+ * the heap, use heapPtr() to turn one into a pointer in this process.  Offset 0
+ * is never a valid allocation and is used as the NULL offset.
+ *
+ * Block sizes are powers of two, each size class has its own free list.  The free
+ * lists are lock-free stacks whose heads carry a change count in the upper bits,
+ * so a block that is popped and pushed back between a load and a compare and swap
+ * is not mistaken for the old head.  Blocks never move between classes and the heap
+ * never gives memory back to the segment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "ipcutils.h"
+
+#define HEAP_MAGIC		0x48454150		// "HEAP"
+#define HEAP_INIT_WAITS	10000			// 100 usec waits for a creator to fill in the header
+
+#define BLK_USED		0x55534544		// "USED"
+#define BLK_FREE		0x46524545		// "FREE"
+
+#define MIN_BLOCK		32				// smallest block, header included
+#define OFF_BITS		40				// low bits of a free list head hold the offset
+#define OFF_MASK		((1UL << OFF_BITS) - 1)
+
+typedef struct _heapHeader {
+	unsigned int magic;
+	int numClasses;
+	unsigned long heapSize;		// bytes from the start of the header
+	unsigned long top;			// first byte never handed out
+	unsigned long roots[HEAP_ROOTS];
+	unsigned long freeList[HEAP_CLASSES];
+} HeapHeader;
+
+// In front of every allocation.
+typedef struct _heapBlock {
+	unsigned int state;			// BLK_USED or BLK_FREE
+	unsigned int cls;
+	unsigned long next;			// next free block, only while on a free list
+} HeapBlock;
+
+typedef struct _heapEntry {
+	char heapName[MAX_SEGNAME + 1];
+	HeapHeader *hh;
+} HeapEntry;
+
+static HeapEntry heaps[MAX_HEAPS];
+
+#define HEAP_ALIGN(x)	(((x) + 15) & ~15UL)
+
+/*
+ * This function heapCreate creates or attaches to an existing heap.
+ * memInit() or memInitBackend() must be called first, the heap is a
+ * shared memory segment with the same name.
+ *
+ *   heapName = Heap name to create or attach to.
+ *   heapSize = Size of the heap in bytes, including its header.
+ *
+ *   returns -1 on failure, or the creator died before the heap was ready.
+ *           -2 heapSize does not match existing heap.
+ *           0 if heap already exists
+ *           1 if heap was created.
+ */
+int heapCreate(const char *heapName, long heapSize) {
+	long first = HEAP_ALIGN(sizeof(HeapHeader));
+
+	if (heapSize < first + MIN_BLOCK || (unsigned long)heapSize > OFF_MASK) {
+		fprintf(stderr, "%s (%d): heapSize must be between %ld and %lu.\n",
+				__FILE__, __LINE__, first + MIN_BLOCK, OFF_MASK);
+		return -1;
+	}
+
+	int ret = memCreate(heapName, heapSize);
+	if (ret < 0)
+		return ret;
+
+	HeapHeader *hh = (HeapHeader *)memAttach(heapName);
+	if (hh == NULL)
+		return -1;
+
+	if (ret == 1) {
+		hh->numClasses = HEAP_CLASSES;
+		hh->heapSize = heapSize;
+		hh->top = first;
+		memset(hh->roots, 0, sizeof(hh->roots));
+		memset(hh->freeList, 0, sizeof(hh->freeList));
+		__atomic_store_n(&hh->magic, HEAP_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		// Created by another process, it may still be filling in the header.
+		int waits = 0;
+		while (__atomic_load_n(&hh->magic, __ATOMIC_ACQUIRE) != HEAP_MAGIC) {
+			if (++waits > HEAP_INIT_WAITS) {
+				fprintf(stderr, "%s (%d): Heap '%s' was never set up by its creator, destroy it and create it again.\n",
+						__FILE__, __LINE__, heapName);
+				memDetach(heapName);
+				return -1;
+			}
+			usleep(100);
+		}
+	}
+
+	// Remember the mapping in this process.
+	int freeSpot = -1;
+	for (int i = 0; i < MAX_HEAPS; i++) {
+		if (heaps[i].hh == NULL) {
+			if (freeSpot == -1)
+				freeSpot = i;
+		} else if (strcmp(heaps[i].heapName, heapName) == 0) {
+			return ret;
+		}
+	}
+
+	if (freeSpot == -1) {
+		fprintf(stderr, "%s (%d): No free slot left in heap table, %d max.\n",
+				__FILE__, __LINE__, MAX_HEAPS);
+		return -1;
+	}
+
+	strcpy(heaps[freeSpot].heapName, heapName);
+	heaps[freeSpot].hh = hh;
+
+	return ret;
+}
+
+/*
+ * This function heapGetNum returns the heapNum used by the other heap functions.
+ *
+ *   heapName = Heap name.
+ *
+ *   returns -1 if not found, heapCreate() must be called first in each process.
+ *           else heapNum.
+ */
+int heapGetNum(const char *heapName) {
+	for (int i = 0; i < MAX_HEAPS; i++) {
+		if (heaps[i].hh != NULL && strcmp(heaps[i].heapName, heapName) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static HeapHeader *getHeap(int heapNum) {
+	if (heapNum < 0 || heapNum >= MAX_HEAPS || heaps[heapNum].hh == NULL) {
+		fprintf(stderr, "%s (%d): heapNum not valid %d.\n", __FILE__, __LINE__, heapNum);
+		return NULL;
+	}
+
+	return heaps[heapNum].hh;
+}
+
+static HeapBlock *blockAt(HeapHeader *hh, unsigned long off) {
+	return (HeapBlock *)((char *)hh + off);
+}
+
+/*
+ * This function popFree takes a block off the free list of class cls.
+ * This function is private to this file.
+ *
+ *   returns 0 if the list is empty
+ *           else offset of the block.
+ */
+static unsigned long popFree(HeapHeader *hh, int cls) {
+	unsigned long head = __atomic_load_n(&hh->freeList[cls], __ATOMIC_ACQUIRE);
+
+	while ((head & OFF_MASK) != 0) {
+		// The block may be taken by someone else while we look at it, its next is
+		// then stale but the change count makes the swap below fail.
+		unsigned long next = __atomic_load_n(&blockAt(hh, head & OFF_MASK)->next, __ATOMIC_RELAXED);
+		unsigned long newHead = (((head >> OFF_BITS) + 1) << OFF_BITS) | (next & OFF_MASK);
+
+		if (__atomic_compare_exchange_n(&hh->freeList[cls], &head, newHead, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return head & OFF_MASK;
+	}
+
+	return 0;
+}
+
+/*
+ * This function pushFree puts the block at off on the free list of class cls.
+ * This function is private to this file.
+ */
+static void pushFree(HeapHeader *hh, int cls, unsigned long off) {
+	HeapBlock *bp = blockAt(hh, off);
+	unsigned long head = __atomic_load_n(&hh->freeList[cls], __ATOMIC_RELAXED);
+	unsigned long newHead;
+
+	do {
+		__atomic_store_n(&bp->next, head & OFF_MASK, __ATOMIC_RELAXED);
+		newHead = (((head >> OFF_BITS) + 1) << OFF_BITS) | off;
+	} while (__atomic_compare_exchange_n(&hh->freeList[cls], &head, newHead, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED) == 0);
+}
+
+/*
+ * This function heapAlloc allocates size bytes from a heap.
+ * The memory is 16 byte aligned and not cleared.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   size = Bytes to allocate.
+ *
+ *   returns 0 on error or if the heap is full.
+ *           else offset of the memory, see heapPtr().
+ */
+unsigned long heapAlloc(int heapNum, long size) {
+	HeapHeader *hh = getHeap(heapNum);
+	if (hh == NULL)
+		return 0;
+
+	int cls = 0;
+	while (cls < hh->numClasses && ((long)MIN_BLOCK << cls) - (long)sizeof(HeapBlock) < size)
+		cls++;
+
+	if (size < 0 || cls == hh->numClasses) {
+		fprintf(stderr, "%s (%d): Allocation size %ld not supported.\n", __FILE__, __LINE__, size);
+		return 0;
+	}
+
+	unsigned long off = popFree(hh, cls);
+	if (off == 0) {
+		unsigned long blockSize = (unsigned long)MIN_BLOCK << cls;
+		unsigned long top = __atomic_load_n(&hh->top, __ATOMIC_RELAXED);
+
+		do {
+			if (top + blockSize > hh->heapSize) {
+				fprintf(stderr, "%s (%d): Heap '%s' is full.\n", __FILE__, __LINE__, heaps[heapNum].heapName);
+				return 0;
+			}
+		} while (__atomic_compare_exchange_n(&hh->top, &top, top + blockSize, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0);
+
+		off = top;
+		blockAt(hh, off)->cls = cls;
+	}
+
+	__atomic_store_n(&blockAt(hh, off)->state, BLK_USED, __ATOMIC_RELAXED);
+
+	return off + sizeof(HeapBlock);
+}
+
+/*
+ * This function heapFree gives memory from heapAlloc() back to the heap.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   offset = Offset returned by heapAlloc().
+ *
+ *   returns -1 on error, offset not allocated or already freed.
+ *           0 on success
+ */
+int heapFree(int heapNum, unsigned long offset) {
+	HeapHeader *hh = getHeap(heapNum);
+	if (hh == NULL)
+		return -1;
+
+	if (offset < HEAP_ALIGN(sizeof(HeapHeader)) + sizeof(HeapBlock) ||
+			offset >= __atomic_load_n(&hh->top, __ATOMIC_RELAXED) || (offset & 15) != 0) {
+		fprintf(stderr, "%s (%d): Offset %lu is not in heap.\n", __FILE__, __LINE__, offset);
+		return -1;
+	}
+
+	unsigned long off = offset - sizeof(HeapBlock);
+	HeapBlock *bp = blockAt(hh, off);
+	unsigned int state = BLK_USED;
+
+	if (__atomic_compare_exchange_n(&bp->state, &state, BLK_FREE, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0) {
+		fprintf(stderr, "%s (%d): Offset %lu is not allocated.\n", __FILE__, __LINE__, offset);
+		return -1;
+	}
+
+	pushFree(hh, bp->cls, off);
+
+	return 0;
+}
+
+/*
+ * This function heapAllocSize returns the usable size of an allocation,
+ * which may be more than was asked for.  offset is checked against the heap
+ * first, so a stale offset read without a lock gives -1 or a size that stays
+ * inside the heap, never a bad pointer.
+ *
+ *   returns -1 on error
+ *           else bytes usable at offset.
+ */
+long heapAllocSize(int heapNum, unsigned long offset) {
+	HeapHeader *hh = getHeap(heapNum);
+	if (hh == NULL)
+		return -1;
+
+	unsigned long top = __atomic_load_n(&hh->top, __ATOMIC_RELAXED);
+	if (offset < HEAP_ALIGN(sizeof(HeapHeader)) + sizeof(HeapBlock) || offset >= top || (offset & 15) != 0)
+		return -1;
+
+	unsigned int cls = __atomic_load_n(&blockAt(hh, offset - sizeof(HeapBlock))->cls, __ATOMIC_RELAXED);
+	if (cls >= (unsigned int)hh->numClasses)
+		return -1;
+
+	long size = ((long)MIN_BLOCK << cls) - (long)sizeof(HeapBlock);
+	if (offset + size > top)
+		return -1;
+
+	return size;
+}
+
+/*
+ * This function heapPtr returns the address of offset in this process.
+ *
+ *   returns NULL for offset 0 or a bad heapNum.
+ *           else pointer to the memory.
+ */
+void *heapPtr(int heapNum, unsigned long offset) {
+	if (offset == 0 || heapNum < 0 || heapNum >= MAX_HEAPS || heaps[heapNum].hh == NULL)
+		return NULL;
+
+	return (char *)heaps[heapNum].hh + offset;
+}
+
+/*
+ * This function heapOffset returns the heap offset of a pointer from heapPtr().
+ *
+ *   returns 0 if ptr is NULL or not in the heap.
+ *           else offset of ptr.
+ */
+unsigned long heapOffset(int heapNum, const void *ptr) {
+	HeapHeader *hh = getHeap(heapNum);
+	if (hh == NULL || ptr == NULL)
+		return 0;
+
+	if ((const char *)ptr <= (char *)hh || (const char *)ptr >= (char *)hh + hh->heapSize)
+		return 0;
+
+	return (const char *)ptr - (char *)hh;
+}
+
+/*
+ * This function heapSetRoot publishes an offset in one of the heap's root slots,
+ * so other processes can find the structures kept in the heap.
+ * The slot is only set if it is empty.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   slot = Root slot, 0 to HEAP_ROOTS - 1.
+ *   offset = Offset to publish.
+ *
+ *   returns 0 on error
+ *           else the offset now in the slot, offset or the one set before.
+ */
+unsigned long heapSetRoot(int heapNum, int slot, unsigned long offset) {
+	HeapHeader *hh = getHeap(heapNum);
+	if (hh == NULL)
+		return 0;
+
+	if (slot < 0 || slot >= HEAP_ROOTS) {
+		fprintf(stderr, "%s (%d): Root slot out of range %d.\n", __FILE__, __LINE__, slot);
+		return 0;
+	}
+
+	unsigned long old = 0;
+	if (__atomic_compare_exchange_n(&hh->roots[slot], &old, offset, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return offset;
+
+	return old;
+}
+
+/*
+ * This function heapGetRoot returns the offset in one of the heap's root slots.
+ *
+ *   returns 0 on error or if the slot is empty.
+ *           else the offset in the slot.
+ */
+unsigned long heapGetRoot(int heapNum, int slot) {
+	HeapHeader *hh = getHeap(heapNum);
+	if (hh == NULL || slot < 0 || slot >= HEAP_ROOTS)
+		return 0;
+
+	return __atomic_load_n(&hh->roots[slot], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * This function heapDestroy forgets the heap in this process and destroys its segment.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int heapDestroy(const char *heapName) {
+	int heapNum = heapGetNum(heapName);
+	if (heapNum >= 0)
+		memset(&heaps[heapNum], 0, sizeof(HeapEntry));
+
+	return memDestroy(heapName);
+}
@@ -23,6 +23,8 @@
 
 /* Originally written in 1993, modified to bring it up to coding and format standards. */
 
+#define _GNU_SOURCE		// memfd_create()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,9 +33,16 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "ipcutils.h"
 
+#define SEQ_MAX_TRIES	10000		// seqRead() retries before it takes the segment lock
+
 /* Pointer to Actual shared memory that hold the Master Segment*/
 MemMaster *sharedMemMaster = NULL;
 /* Copy of shared memory Master Segment - allocated for each process */
@@ -43,6 +52,15 @@ key_t memMasterId;
 
 key_t masterSemId;
 
+/* Bumped when memMaster changes, tags the entries in memCache. */
+static unsigned long memGen = 0;
+
+static NameCache memCache;
+
+/* Backend and MEM_* flags used for segments this process creates. */
+static int memBackend = MEM_BACKEND_SYSV;
+static int memBackendFlags = 0;
+
 /*
  * This function memInit attaches or creates the master memory segment.
  * This segment keeps track of all segments created through this library.
@@ -107,6 +125,63 @@ int memInit() {
 	return 0;
 }
 
+/*
+ * This function memInitBackend is memInit() plus the choice of how segments
+ * created by this process are backed.  The master table stays in SysV
+ * shared memory, attaching processes use whatever backend a segment was
+ * created with.
+ *
+ *   backend = MEM_BACKEND_SYSV, shmget() the same as memInit().
+ *             MEM_BACKEND_POSIX, shm_open() not limited by SHMMAX.
+ *             MEM_BACKEND_MEMFD, memfd_create(), fd can be passed with memGetFd().
+ *   memFlags = MEM_HUGEPAGE, back with huge pages (SHM_HUGETLB, MFD_HUGETLB or
+ *              MADV_HUGEPAGE for POSIX), segment is rounded to a huge page.
+ *              MEM_POPULATE, pre-fault the pages on attach.
+ *              MEM_MLOCK, lock the pages in memory on attach.
+ *
+ * returns  0 on success.
+ *         -1 on failure.
+ */
+int memInitBackend(int backend, int memFlags) {
+	if (backend < MEM_BACKEND_SYSV || backend > MEM_BACKEND_MEMFD) {
+		fprintf(stderr, "%s (%d): Unknown memory backend %d.\n", __FILE__, __LINE__, backend);
+		return -1;
+	}
+
+	if (memInit() != 0)
+		return -1;
+
+	memBackend = backend;
+	memBackendFlags = memFlags;
+
+	return 0;
+}
+
+/*
+ * This function memGetFd returns a file descriptor for a MEM_BACKEND_MEMFD
+ * segment attached by this process, to pass to another process.
+ *
+ *   memName = Segment name.
+ *
+ *   returns -1 on error or if segment is not a memfd segment.
+ *           else file descriptor.
+ */
+int memGetFd(const char *memName) {
+	int memNum = memGetNum(memName);
+
+	if (memNum < 0)
+		return -1;
+
+	MemMaster *mmp = &memMaster[memNum];
+	if (mmp->backend != MEM_BACKEND_MEMFD || mmp->memHdr == NULL) {
+		fprintf(stderr, "%s (%d): Segment '%s' is not an attached memfd segment.\n",
+				__FILE__, __LINE__, memName);
+		return -1;
+	}
+
+	return mmp->memFd;
+}
+
 /*
  * This function is used to lock the master semaphore.
  * This single threads access to the master memory array.
@@ -211,47 +286,534 @@ int memUnlockMemory() {
 	return 0;
 }
 
+/*
+ * This function lockSegment locks the process shared mutex kept in the
+ * segment header.  An uncontended lock is taken without a system call.
+ * If the previous owner died holding the lock, the lock is recovered
+ * and given to the caller.
+ * This function is private to this file.
+ *
+ * returns -1 on error
+ *         0 on success
+ */
+static int lockSegment(MemMaster *mmp) {
+	if (mmp->memHdr == NULL) {
+		fprintf(stderr, "%s (%d): Segment '%s' is not attached, call memAttach() first.\n",
+				__FILE__, __LINE__, mmp->memName);
+		return -1;
+	}
+
+	int r = pthread_mutex_lock(&mmp->memHdr->memLock);
+	if (r == EOWNERDEAD) {
+		fprintf(stderr, "%s (%d): Owner of segment '%s' lock died, data may be inconsistent.\n",
+				__FILE__, __LINE__, mmp->memName);
+		pthread_mutex_consistent(&mmp->memHdr->memLock);
+
+		// A memSeqWrite() cut short leaves memSeq odd, readers would wait on it forever.
+		unsigned long seq = __atomic_load_n(&mmp->memHdr->memSeq, __ATOMIC_RELAXED);
+		if (seq & 1)
+			__atomic_store_n(&mmp->memHdr->memSeq, seq + 1, __ATOMIC_RELEASE);
+		r = 0;
+	}
+
+	if (r != 0) {
+		fprintf(stderr, "%s (%d): Could not lock segment '%s'. errno: %d\n",
+				__FILE__, __LINE__, mmp->memName, r);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function unlockSegment unlocks the segment header lock.
+ * This function is private to this file.
+ */
+static void unlockSegment(MemMaster *mmp) {
+	pthread_mutex_unlock(&mmp->memHdr->memLock);
+}
+
+/*
+ * This function segHdrSize returns the bytes in front of the user data
+ * for a segment with numStripes lock stripes.
+ * This function is private to this file.
+ */
+static size_t segHdrSize(int numStripes) {
+	return (MEM_HDR_SIZE + (numStripes * sizeof(MemStripe)) + 63) & ~63UL;
+}
+
+static MemStripe *segStripes(MemHeader *hdr) {
+	return (MemStripe *)((char *)hdr + MEM_HDR_SIZE);
+}
+
+/*
+ * This function badRange checks offset and length are inside a segment.
+ * This function is private to this file.
+ *
+ * returns 1 and prints an error if not, else 0.
+ */
+static int badRange(MemMaster *mmp, int offset, int length) {
+	if (offset < 0 || length < 0) {
+		fprintf(stderr, "%s (%d): Offset %d and length %d must not be negative.\n",
+				__FILE__, __LINE__, offset, length);
+		return 1;
+	}
+
+	if (mmp->memSize < (long)offset + length) {
+		fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
+				__FILE__, __LINE__);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function stripeRange sets first and last to the stripes covering
+ * offset to offset + length.
+ * This function is private to this file.
+ */
+static void stripeRange(MemHeader *hdr, int offset, int length, int *first, int *last) {
+	*first = offset / hdr->stripeSize;
+	*last = (length > 0) ? (offset + length - 1) / hdr->stripeSize : *first;
+
+	if (*last >= hdr->numStripes)
+		*last = hdr->numStripes - 1;
+	if (*first > *last)
+		*first = *last;
+}
+
+/*
+ * This function lockRange locks the part of a segment from offset to
+ * offset + length for writing.  Striped segments take the lock of each stripe
+ * in the range, lowest stripe first, and make its sequence number odd so
+ * readers retry.  Other segments use the segment lock.  Stripe locks are
+ * robust, the lock of a process that died holding one is recovered.
+ * This function is private to this file.
+ *
+ * returns -1 on error
+ *         0 on success
+ */
+static int lockRange(MemMaster *mmp, int offset, int length) {
+	MemHeader *hdr = mmp->memHdr;
+	int first, last;
+
+	if (hdr == NULL || hdr->numStripes == 0)
+		return lockSegment(mmp);
+
+	MemStripe *sp = segStripes(hdr);
+	stripeRange(hdr, offset, length, &first, &last);
+
+	for (int i = first; i <= last; i++) {
+		int r = pthread_mutex_lock(&sp[i].stripeLock);
+
+		if (r == EOWNERDEAD) {
+			fprintf(stderr, "%s (%d): Owner of stripe %d of segment '%s' died, data may be inconsistent.\n",
+					__FILE__, __LINE__, i, mmp->memName);
+			pthread_mutex_consistent(&sp[i].stripeLock);
+			// it may have died mid write, leaving the sequence number odd.
+			sp[i].stripeSeq |= 1;
+			r = 0;
+		} else if (r == 0) {
+			__atomic_store_n(&sp[i].stripeSeq, sp[i].stripeSeq + 1, __ATOMIC_RELAXED);
+		}
+
+		if (r != 0) {
+			fprintf(stderr, "%s (%d): Could not lock stripe %d of segment '%s'. errno: %d\n",
+					__FILE__, __LINE__, i, mmp->memName, r);
+			while (--i >= first) {
+				__atomic_store_n(&sp[i].stripeSeq, sp[i].stripeSeq + 1, __ATOMIC_RELEASE);
+				pthread_mutex_unlock(&sp[i].stripeLock);
+			}
+			return -1;
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * This function unlockRange undoes lockRange().
+ * This function is private to this file.
+ */
+static void unlockRange(MemMaster *mmp, int offset, int length) {
+	MemHeader *hdr = mmp->memHdr;
+	int first, last;
+
+	if (hdr->numStripes == 0) {
+		unlockSegment(mmp);
+		return;
+	}
+
+	MemStripe *sp = segStripes(hdr);
+	stripeRange(hdr, offset, length, &first, &last);
+
+	for (int i = last; i >= first; i--) {
+		__atomic_store_n(&sp[i].stripeSeq, sp[i].stripeSeq + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&sp[i].stripeLock);
+	}
+}
+
+/*
+ * This function readRange copies length bytes at offset out of a segment.
+ * Striped segments are read without a lock, the copy is retried until no
+ * stripe in the range was being written, so readers never block each other
+ * and a reader that dies holds nothing.  After SEQ_MAX_TRIES it copies under
+ * the stripe locks.  Other segments copy under the segment lock.
+ * This function is private to this file.
+ *
+ * returns -1 on error
+ *         0 on success
+ */
+static int readRange(MemMaster *mmp, char *data, int offset, int length) {
+	MemHeader *hdr = mmp->memHdr;
+	unsigned long seqs[MAX_MEM_STRIPES];
+	int first, last, i;
+
+	if (hdr != NULL && hdr->numStripes > 0) {
+		MemStripe *sp = segStripes(hdr);
+		stripeRange(hdr, offset, length, &first, &last);
+
+		for (int tries = 0; tries < SEQ_MAX_TRIES; tries++) {
+			for (i = first; i <= last; i++) {
+				seqs[i - first] = __atomic_load_n(&sp[i].stripeSeq, __ATOMIC_ACQUIRE);
+				if (seqs[i - first] & 1)
+					break;		// writer in progress.
+			}
+			if (i <= last)
+				continue;
+
+			memcpy(data, (mmp->shmPtr + offset), length);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			for (i = first; i <= last; i++) {
+				if (seqs[i - first] != __atomic_load_n(&sp[i].stripeSeq, __ATOMIC_RELAXED))
+					break;
+			}
+			if (i > last)
+				return 0;
+		}
+	}
+
+	if (lockRange(mmp, offset, length) != 0)
+		return -1;
+	memcpy(data, (mmp->shmPtr + offset), length);
+	unlockRange(mmp, offset, length);
+
+	return 0;
+}
+
+/*
+ * This function initSegHeader fills in the MemHeader of a newly created segment.
+ * This function is private to this file.
+ */
+static void initSegHeader(MemHeader *hdr, long memSize, int numStripes) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&hdr->memLock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	if (numStripes > 0) {
+		MemStripe *sp = segStripes(hdr);
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		for (int i = 0; i < numStripes; i++) {
+			pthread_mutex_init(&sp[i].stripeLock, &attr);
+			sp[i].stripeSeq = 0;
+		}
+		pthread_mutexattr_destroy(&attr);
+
+		hdr->stripeSize = (memSize + numStripes - 1) / numStripes;
+	}
+
+	hdr->numStripes = numStripes;
+	hdr->hdrSize = segHdrSize(numStripes);
+	hdr->memSize = memSize;
+	hdr->memSeq = 0;
+	hdr->magic = MEM_HDR_MAGIC;
+}
+
+/*
+ * This function hugePageSize returns the default huge page size from
+ * /proc/meminfo, 2MB if it can not be read.
+ * This function is private to this file.
+ */
+static long hugePageSize() {
+	long size = 2048;
+	char line[128];
+
+	FILE *fp = fopen("/proc/meminfo", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if (sscanf(line, "Hugepagesize: %ld kB", &size) == 1)
+				break;
+		}
+		fclose(fp);
+	}
+
+	return size * 1024;
+}
+
+/*
+ * This function segBytes returns the total size of a segment, header plus
+ * user data, rounded up to a huge page when MEM_HUGEPAGE is used.
+ * This function is private to this file.
+ */
+static long segBytes(long memSize, int numStripes, int memFlags) {
+	long size = memSize + segHdrSize(numStripes);
+
+	if (memFlags & MEM_HUGEPAGE) {
+		long hp = hugePageSize();
+		size = ((size + hp - 1) / hp) * hp;
+	}
+
+	return size;
+}
+
+/*
+ * This function posixShmName builds the shm_open() name for a segment.
+ * This function is private to this file.
+ */
+static void posixShmName(MemMaster *mmp, char *name) {
+	sprintf(name, "/ipcutils.%s", mmp->memName);
+}
+
+/*
+ * This function mapSeg maps a segment into this process using the backend
+ * it was created with and applies the MEM_POPULATE, MEM_MLOCK and
+ * MEM_HUGEPAGE options.
+ * This function is private to this file.
+ *
+ *   returns NULL on error
+ *           else start of the segment.
+ */
+static void *mapSeg(MemMaster *mmp) {
+	void *base = NULL;
+	int fd = -1;
+	char name[MAX_SEGNAME + 16];
+	int mapFlags = MAP_SHARED;
+
+	if (mmp->memFlags & MEM_POPULATE)
+		mapFlags |= MAP_POPULATE;
+
+	switch (mmp->backend) {
+	case MEM_BACKEND_POSIX:
+		posixShmName(mmp, name);
+		fd = shm_open(name, O_RDWR, 0666);
+		if (fd == -1) {
+			fprintf(stderr, "%s (%d): shm_open of '%s' failed. errno: %d\n",
+					__FILE__, __LINE__, name, errno);
+			return NULL;
+		}
+
+		base = mmap(NULL, mmp->segSize, (PROT_READ | PROT_WRITE), mapFlags, fd, 0);
+		close(fd);
+		break;
+	case MEM_BACKEND_MEMFD:
+		if (mmp->ownerPid == getpid()) {
+			fd = mmp->memFd;
+		} else {
+			// Not the creator, open the memfd through the owner's fd table.
+			sprintf(name, "/proc/%d/fd/%d", (int)mmp->ownerPid, mmp->memFd);
+			fd = open(name, O_RDWR);
+			if (fd == -1) {
+				fprintf(stderr, "%s (%d): Could not open memfd '%s' of segment '%s'. errno: %d\n",
+						__FILE__, __LINE__, name, mmp->memName, errno);
+				return NULL;
+			}
+			mmp->memFd = fd;		// this process's copy, kept for memGetFd().
+			mmp->ownerPid = getpid();
+		}
+
+		base = mmap(NULL, mmp->segSize, (PROT_READ | PROT_WRITE), mapFlags, fd, 0);
+		break;
+	default:
+		base = shmat(mmp->shmId, NULL, 0);
+		if (base == (void *)-1) {
+			base = MAP_FAILED;
+		} else if (mmp->memFlags & MEM_POPULATE) {
+			// shmat() has no populate flag, touch each page instead.
+			long pageSize = (mmp->memFlags & MEM_HUGEPAGE) ? hugePageSize() : getpagesize();
+			for (long off = 0; off < mmp->segSize; off += pageSize)
+				(void)*(volatile char *)((char *)base + off);
+		}
+		break;
+	}
+
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s (%d): failed to attach to shared memory segment '%s'. errno: %d\n",
+				__FILE__, __LINE__, mmp->memName, errno);
+		return NULL;
+	}
+
+	if ((mmp->memFlags & MEM_HUGEPAGE) && mmp->backend == MEM_BACKEND_POSIX) {
+		// tmpfs can not use MAP_HUGETLB, ask for transparent huge pages.
+		madvise(base, mmp->segSize, MADV_HUGEPAGE);
+	}
+
+	if (mmp->memFlags & MEM_MLOCK) {
+		if (mlock(base, mmp->segSize) == -1) {
+			fprintf(stderr, "%s (%d): mlock of segment '%s' failed, check RLIMIT_MEMLOCK. errno: %d\n",
+					__FILE__, __LINE__, mmp->memName, errno);
+		}
+	}
+
+	return base;
+}
+
+/*
+ * This function unmapSeg undoes mapSeg().
+ * This function is private to this file.
+ */
+static void unmapSeg(MemMaster *mmp, void *base) {
+	if (mmp->backend == MEM_BACKEND_SYSV)
+		shmdt(base);
+	else
+		munmap(base, mmp->segSize);
+}
+
 /*
  * This function allocateShm updates the MemMasters segment and creates
  * the user shared memory segment if needed.
+ * The segment is created with the backend and flags given to memInitBackend().
  * NOTE: This function is private to this library and should not be called by user.
  *
  *   mmp = Pointer to MemMaster entry for this user segment.
  *   memSize = size of shared memory to allocate for segment.
+ *   numStripes = number of lock stripes, 0 for none.
  *
  *   returns -1 on failure
  *           0 on success
  */
-int allocateShm(MemMaster *mmp, long memSize) {
-	// Attach or create the user memory segment.
-	mmp->shmId = shmget(mmp->id, memSize, 0666);
-
-	if (mmp->shmId == -1) {
-		if (errno == ENOENT) {
-			// Memory segment not allocated yet.
-
-			mmp->shmId = shmget(mmp->id, memSize,
-					(IPC_CREAT | IPC_EXCL | 0666));
-		} else {
-			fprintf(stderr, "%s (%d): Could not create shared memory segment '%s'.\n",
-					__FILE__, __LINE__, mmp->memName);
+int allocateShm(MemMaster *mmp, long memSize, int numStripes) {
+	char name[MAX_SEGNAME + 16];
+	int fd = -1;
+
+	mmp->backend = memBackend;
+	mmp->memFlags = memBackendFlags;
+	mmp->segSize = segBytes(memSize, numStripes, mmp->memFlags);
+
+	switch (mmp->backend) {
+	case MEM_BACKEND_POSIX:
+		posixShmName(mmp, name);
+		fd = shm_open(name, (O_RDWR | O_CREAT | O_TRUNC), 0666);
+		if (fd == -1 || ftruncate(fd, mmp->segSize) == -1) {
+			fprintf(stderr, "%s (%d): Could not create shared memory segment '%s'. errno: %d\n",
+					__FILE__, __LINE__, mmp->memName, errno);
+			if (fd != -1) {
+				close(fd);
+				shm_unlink(name);
+			}
 			return -1;
 		}
-	} else {
-		struct shmid_ds ds;
-		shmctl(mmp->shmId, IPC_STAT, &ds);
+		close(fd);
+		break;
+	case MEM_BACKEND_MEMFD:
+#ifdef MFD_HUGETLB
+		fd = memfd_create(mmp->memName, (mmp->memFlags & MEM_HUGEPAGE) ? MFD_HUGETLB : 0);
+#else
+		errno = ENOSYS;
+#endif
+		if (fd == -1 || ftruncate(fd, mmp->segSize) == -1) {
+			fprintf(stderr, "%s (%d): Could not create memfd segment '%s'. errno: %d\n",
+					__FILE__, __LINE__, mmp->memName, errno);
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		mmp->memFd = fd;
+		mmp->ownerPid = getpid();
+		break;
+	default:
+		// Attach or create the user memory segment.
+		mmp->shmId = shmget(mmp->id, mmp->segSize, 0666);
+
+		if (mmp->shmId == -1) {
+			if (errno == ENOENT) {
+				// Memory segment not allocated yet.
+				int shmFlags = (IPC_CREAT | IPC_EXCL | 0666);
+
+				if (mmp->memFlags & MEM_HUGEPAGE)
+					shmFlags |= SHM_HUGETLB;
+
+				mmp->shmId = shmget(mmp->id, mmp->segSize, shmFlags);
+				if (mmp->shmId == -1) {
+					fprintf(stderr, "%s (%d): Could not create shared memory segment '%s'. errno: %d\n",
+							__FILE__, __LINE__, mmp->memName, errno);
+					return -1;
+				}
+			} else {
+				fprintf(stderr, "%s (%d): Could not create shared memory segment '%s'.\n",
+						__FILE__, __LINE__, mmp->memName);
+				return -1;
+			}
+		} else {
+			struct shmid_ds ds;
+			shmctl(mmp->shmId, IPC_STAT, &ds);
 #if (__SIZEOF_LONG__ == 4)
-		fprintf(stdout, "%s (%d): Size of shared memory segment: %u\n",
-				__FILE__, __LINE__, ds.shm_segsz);
+			fprintf(stdout, "%s (%d): Size of shared memory segment: %u\n",
+					__FILE__, __LINE__, ds.shm_segsz);
 #else
-		fprintf(stdout, "%s (%d): Size of shared memory segment: %lu\n",
-				__FILE__, __LINE__, ds.shm_segsz);
+			fprintf(stdout, "%s (%d): Size of shared memory segment: %lu\n",
+					__FILE__, __LINE__, ds.shm_segsz);
 #endif
+		}
+		break;
+	}
+
+	MemHeader *hdr = (MemHeader *)mapSeg(mmp);
+	if (hdr == NULL) {
+		// Typically no huge pages reserved, remove what was created.
+		if (mmp->backend == MEM_BACKEND_POSIX)
+			shm_unlink(name);
+		else if (mmp->backend == MEM_BACKEND_MEMFD)
+			close(mmp->memFd);
+		else
+			shmctl(mmp->shmId, IPC_RMID, NULL);
+		return -1;
 	}
 
+	if (hdr->magic != MEM_HDR_MAGIC)
+		initSegHeader(hdr, memSize, numStripes);
+
+	unmapSeg(mmp, hdr);
+
 	return 0;
 }
 
+/*
+ * This function lookupMem returns the master memory array offset for memName,
+ * using this process's name cache before scanning memMaster.
+ * This function is private to this file.
+ *
+ *   returns -1 if not found
+ *           else master memory array offset.
+ */
+static int lookupMem(const char *memName) {
+	unsigned long gen = __atomic_load_n(&memGen, __ATOMIC_ACQUIRE);
+
+	int i = nameCacheGet(&memCache, memName, gen);
+	if (i >= 0 && memMaster[i].inUse && strcmp(memMaster[i].memName, memName) == 0) {
+		return i;
+	}
+
+	MemMaster *mmp = memMaster;
+	for (i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
+		if (mmp->inUse && strcmp(mmp->memName, memName) == 0) {
+			nameCachePut(&memCache, memName, i, gen);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 /*
  * This function memGetNum returns a shared memory memId.
  * Use this function to get the memId.
@@ -262,38 +824,19 @@ int allocateShm(MemMaster *mmp, long memSize) {
  *           else master memory array offset.
  */
 int memGetNum(const char *memName) {
-	int memNum = -1;
-
 	if (memMaster == NULL) {
 		fprintf(stderr, "%s (%d): Need to call memInit() first.\n", __FILE__, __LINE__);
-		return memNum;
-	}
-
-	MemMaster *mp = memMaster;
-	for (int i = 0; i < MAX_MEMMASTERS; i++, mp++) {
-		if (mp->inUse) {
-			if (strcmp(mp->memName, memName) == 0) {
-				memNum = i;
-				break;
-			}
-		}
+		return -1;
 	}
 
-	return memNum;
+	return lookupMem(memName);
 }
 
 /*
- * This function memCreate creates or attaches to existing segment.
- *
- *   memName = Segment name to attach to or create.
- *   memSize = Size of segment to create if is does not exist.
- *
- *   returns -1 on failure
- *   		 -2 memSize does not match found segment.
- *           0 if segment already exists
- *           1 if segment was created.
+ * This function createSeg does the work for memCreate() and memCreateStriped().
+ * This function is private to this file.
  */
-int memCreate(const char *memName, long memSize) {
+static int createSeg(const char *memName, long memSize, int numStripes) {
 	int ret = -1;
         int index = 0;
 
@@ -319,10 +862,7 @@ int memCreate(const char *memName, long memSize) {
                         index = i;
 		} else if (mp->inUse) {
 			if (strcmp(memName, mp->memName) == 0) {
-				struct shmid_ds buf;
-
-				shmctl(mp->shmId, IPC_STAT, &buf);
-				if (buf.shm_segsz != memSize) {
+				if (mp->segSize != segBytes(memSize, numStripes, mp->memFlags)) {
 					unlockMasterSem();
 					return -2;
 				}
@@ -338,13 +878,18 @@ int memCreate(const char *memName, long memSize) {
 			fprintf(stderr, "%s (%d): No free slot left in master memory segment.\n", __FILE__, __LINE__);
 			ret = -1;
 		} else {
-			foundSpot->inUse = 1;
 			foundSpot->memSize = memSize;
 			strcpy(foundSpot->memName, memName);
 
-			allocateShm(foundSpot, memSize);
-            memcpy(&memMaster[index], foundSpot, sizeof(MemMaster));
-			ret = 1;
+			if (allocateShm(foundSpot, memSize, numStripes) == 0) {
+				// Only publish the entry once the segment header is ready.
+				foundSpot->inUse = 1;
+				memcpy(&memMaster[index], foundSpot, sizeof(MemMaster));
+				__atomic_add_fetch(&memGen, 1, __ATOMIC_RELEASE);
+				ret = 1;
+			} else {
+				memset(foundSpot, 0, sizeof(MemMaster));
+			}
 		}
 	}
 
@@ -353,6 +898,46 @@ int memCreate(const char *memName, long memSize) {
 	return ret;
 }
 
+/*
+ * This function memCreate creates or attaches to existing segment.
+ *
+ *   memName = Segment name to attach to or create.
+ *   memSize = Size of segment to create if is does not exist.
+ *
+ *   returns -1 on failure
+ *   		 -2 memSize does not match found segment.
+ *           0 if segment already exists
+ *           1 if segment was created.
+ */
+int memCreate(const char *memName, long memSize) {
+	return createSeg(memName, memSize, 0);
+}
+
+/*
+ * This function memCreateStriped creates or attaches to an existing segment
+ * split into numStripes equal ranges, each with its own robust lock.
+ * memWrite() then only locks the stripes it touches and memRead() takes no
+ * lock, so writers of different records and readers do not block each other.
+ *
+ *   memName = Segment name to attach to or create.
+ *   memSize = Size of segment to create if is does not exist.
+ *   numStripes = Number of lock stripes, 1 to MAX_MEM_STRIPES.
+ *
+ *   returns -1 on failure
+ *   		 -2 memSize or numStripes does not match found segment.
+ *           0 if segment already exists
+ *           1 if segment was created.
+ */
+int memCreateStriped(const char *memName, long memSize, int numStripes) {
+	if (numStripes < 1 || numStripes > MAX_MEM_STRIPES || numStripes > memSize) {
+		fprintf(stderr, "%s (%d): numStripes must be 1 to %d and not more than memSize.\n",
+				__FILE__, __LINE__, MAX_MEM_STRIPES);
+		return -1;
+	}
+
+	return createSeg(memName, memSize, numStripes);
+}
+
 /*
  * This function memAttach returns a memory pointer to segment.
  *
@@ -374,20 +959,37 @@ void *memAttach(const char *memName) {
 		if (mmp->inUse) {
 			if (strcmp(mmp->memName, memName) == 0) {
 
-				memMaster[i].shmPtr = (unsigned char *)shmat(mmp->shmId, NULL, 0);
-                ptr = memMaster[i].shmPtr;
-				if (memMaster[i].shmPtr == (void*)-1) {
-					fprintf(stderr, "%s (%d): failed to attach to shared memory segment '%s'.\n",
-							__FILE__, __LINE__, mmp->memName);
-                                        perror("shm error:\n");
-					return NULL;
-				}
+				if (memMaster[i].memHdr != NULL)
+					return memMaster[i].shmPtr;		// already attached.
+
                 memMaster[i].id = sharedMemMaster[i].id;
                 memMaster[i].inUse = sharedMemMaster[i].inUse;
                 memMaster[i].usingCnt = sharedMemMaster[i].usingCnt;
                 strcpy(memMaster[i].memName, sharedMemMaster[i].memName);
                 memMaster[i].memSize = sharedMemMaster[i].memSize;
                 memMaster[i].shmId = sharedMemMaster[i].shmId;
+				memMaster[i].backend = sharedMemMaster[i].backend;
+				memMaster[i].memFlags = sharedMemMaster[i].memFlags;
+				memMaster[i].segSize = sharedMemMaster[i].segSize;
+				if (memMaster[i].ownerPid != getpid()) {
+					memMaster[i].ownerPid = sharedMemMaster[i].ownerPid;
+					memMaster[i].memFd = sharedMemMaster[i].memFd;
+				}
+
+				MemHeader *hdr = (MemHeader *)mapSeg(&memMaster[i]);
+				if (hdr == NULL)
+					return NULL;
+
+				if (hdr->magic != MEM_HDR_MAGIC) {
+					fprintf(stderr, "%s (%d): Segment '%s' has no valid header.\n",
+							__FILE__, __LINE__, mmp->memName);
+					unmapSeg(&memMaster[i], hdr);
+					return NULL;
+				}
+				memMaster[i].memHdr = hdr;
+				memMaster[i].shmPtr = (unsigned char *)hdr + hdr->hdrSize;
+				__atomic_add_fetch(&memGen, 1, __ATOMIC_RELEASE);
+                ptr = memMaster[i].shmPtr;
 				break;
 			}
 		}
@@ -416,23 +1018,17 @@ int memWrite(const char *memName, const char *data, int offset, int length) {
 		return -1;
 	}
 
-	MemMaster *mmp = memMaster;
-	for (int i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
-		if (mmp->inUse) {
-			if (strcmp(mmp->memName, memName) == 0) {
-				if (mmp->memSize < (long)(offset + length)) {
-					fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
-							__FILE__, __LINE__);
-					return -1;
-				}
+	int memNum = lookupMem(memName);
+	if (memNum >= 0) {
+		MemMaster *mmp = &memMaster[memNum];
+		if (badRange(mmp, offset, length))
+			return -1;
 
-				memLockMemory();
-				memcpy((mmp->shmPtr + offset), data, length);
-				memUnlockMemory();
-				ret = 0;
-				break;
-			}
-		}
+		if (lockRange(mmp, offset, length) != 0)
+			return -1;
+		memcpy((mmp->shmPtr + offset), data, length);
+		unlockRange(mmp, offset, length);
+		ret = 0;
 	}
 
 	return ret;
@@ -458,23 +1054,15 @@ int memRead(const char *memName, char *data, int offset, int length) {
 		return -1;
 	}
 
-	MemMaster *mmp = memMaster;
-	for (int i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
-		if (mmp->inUse) {
-			if (strcmp(mmp->memName, memName) == 0) {
-				if (mmp->memSize < (long)(offset + length)) {
-					fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
-							__FILE__, __LINE__);
-					return -1;
-				}
+	int memNum = lookupMem(memName);
+	if (memNum >= 0) {
+		MemMaster *mmp = &memMaster[memNum];
+		if (badRange(mmp, offset, length))
+			return -1;
 
-				memLockMemory();
-				memcpy(data, (mmp->shmPtr + offset), length);
-				memUnlockMemory();
-				ret = 0;
-				break;
-			}
-		}
+		if (readRange(mmp, data, offset, length) != 0)
+			return -1;
+		ret = 0;
 	}
 
 	return ret;
@@ -491,21 +1079,14 @@ int memReadWL(const char *memName, char *data, int offset, int length) {
 		return -1;
 	}
 
-	MemMaster *mmp = memMaster;
-	for (int i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
-		if (mmp->inUse) {
-			if (strcmp(mmp->memName, memName) == 0) {
-				if (mmp->memSize < (long)(offset + length)) {
-					fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
-							__FILE__, __LINE__);
-					return -1;
-				}
+	int memNum = lookupMem(memName);
+	if (memNum >= 0) {
+		MemMaster *mmp = &memMaster[memNum];
+		if (badRange(mmp, offset, length))
+			return -1;
 
-				memcpy(data, (mmp->shmPtr + offset), length);
-				ret = 0;
-				break;
-			}
-		}
+		memcpy(data, (mmp->shmPtr + offset), length);
+		ret = 0;
 	}
 
 	return ret;
@@ -539,15 +1120,13 @@ int memFastWrite(int memNum, const char *data, int offset, int length) {
 
 	MemMaster *mmp = &memMaster[memNum];
 	if (mmp->inUse) {
-		if (mmp->memSize < (long)(offset + length)) {
-			fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
-					__FILE__, __LINE__);
+		if (badRange(mmp, offset, length))
 			return -1;
-		}
 
-		memLockMemory();
+		if (lockRange(mmp, offset, length) != 0)
+			return -1;
 		memcpy((mmp->shmPtr + offset), data, length);
-		memUnlockMemory();
+		unlockRange(mmp, offset, length);
 		ret = 0;
 	} else {
 		fprintf(stderr, "%s (%d): memNum not in use %d.\n", __FILE__, __LINE__, memNum);
@@ -584,15 +1163,11 @@ int memFastRead(int memNum, char *data, int offset, int length) {
 
 	MemMaster *mmp = &memMaster[memNum];
 	if (mmp->inUse) {
-		if (mmp->memSize < (long)(offset + length)) {
-			fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
-					__FILE__, __LINE__);
+		if (badRange(mmp, offset, length))
 			return -1;
-		}
 
-		memLockMemory();
-		memcpy(data, (mmp->shmPtr + offset), length);
-		memUnlockMemory();
+		if (readRange(mmp, data, offset, length) != 0)
+			return -1;
 		ret = 0;
 	} else {
 		fprintf(stderr, "%s (%d): memNum not in use %d.\n", __FILE__, __LINE__, memNum);
@@ -601,6 +1176,180 @@ int memFastRead(int memNum, char *data, int offset, int length) {
 	return ret;
 }
 
+/*
+ * This function findSegByAddr returns the attached segment holding
+ * the address range shmAddr to shmAddr + length, or NULL.
+ * This function is private to this file.
+ */
+static MemMaster *findSegByAddr(const char *shmAddr, int length) {
+	MemMaster *mmp = memMaster;
+	for (int i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
+		if (mmp->inUse && mmp->memHdr != NULL) {
+			const char *start = (const char *)mmp->shmPtr;
+			if (shmAddr >= start && (shmAddr + length) <= (start + mmp->memSize))
+				return mmp;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * This function seqWrite does the writer side of the seqlock.
+ * Writers are still serialized by the segment lock, the sequence number is
+ * odd while the copy is in progress so readers know to retry.
+ * This function is private to this file.
+ */
+static int seqWrite(MemMaster *mmp, const char *data, int offset, int length) {
+	if (lockSegment(mmp) != 0)
+		return -1;
+
+	MemHeader *hdr = mmp->memHdr;
+
+	__atomic_store_n(&hdr->memSeq, hdr->memSeq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((mmp->shmPtr + offset), data, length);
+	__atomic_store_n(&hdr->memSeq, hdr->memSeq + 1, __ATOMIC_RELEASE);
+
+	unlockSegment(mmp);
+
+	return 0;
+}
+
+/*
+ * This function seqRead does the reader side of the seqlock.
+ * No lock is taken, the copy is retried until the sequence number was even
+ * and unchanged across the copy.  After SEQ_MAX_TRIES it copies under the
+ * segment lock instead, which also recovers from a writer that died mid copy.
+ * This function is private to this file.
+ */
+static int seqRead(MemMaster *mmp, char *data, int offset, int length) {
+	MemHeader *hdr = mmp->memHdr;
+	unsigned long seq;
+
+	if (hdr == NULL) {
+		fprintf(stderr, "%s (%d): Segment '%s' is not attached, call memAttach() first.\n",
+				__FILE__, __LINE__, mmp->memName);
+		return -1;
+	}
+
+	for (int tries = 0; tries < SEQ_MAX_TRIES; tries++) {
+		seq = __atomic_load_n(&hdr->memSeq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;		// writer in progress.
+
+		memcpy(data, (mmp->shmPtr + offset), length);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == __atomic_load_n(&hdr->memSeq, __ATOMIC_RELAXED))
+			return 0;
+	}
+
+	if (lockSegment(mmp) != 0)
+		return -1;
+	memcpy(data, (mmp->shmPtr + offset), length);
+	unlockSegment(mmp);
+
+	return 0;
+}
+
+/*
+ * This function memSeqWrite is used to update shared memory that is read
+ * with memSeqRead().  Best suited to one writer and many readers polling
+ * small status blocks.
+ *
+ *   memName = Shared memory name
+ *   data = Data to write to shared memory
+ *   offset = Offset within the shared memory to write the data.
+ *   length = Length of the data to write.
+ *
+ *   return -1 on error
+ *          0 on success
+ */
+int memSeqWrite(const char *memName, const char *data, int offset, int length) {
+	int memNum = memGetNum(memName);
+
+	if (memNum < 0)
+		return -1;
+
+	return memFastSeqWrite(memNum, data, offset, length);
+}
+
+/*
+ * This function memSeqRead reads shared memory written by memSeqWrite()
+ * without taking any lock, readers never block each other or the writer.
+ * Data written with memWrite() is not covered by the sequence number.
+ *
+ *   memName = Shared memory name
+ *   data = place to return data
+ *   offset = Offset within the shared memory to read the data.
+ *   length = Length of the data to read.
+ *
+ *   return -1 on error
+ *          0 on success
+ */
+int memSeqRead(const char *memName, char *data, int offset, int length) {
+	int memNum = memGetNum(memName);
+
+	if (memNum < 0)
+		return -1;
+
+	return memFastSeqRead(memNum, data, offset, length);
+}
+
+/*
+ * This function memFastSeqWrite is the same as memSeqWrite() but uses
+ * memNum from memGetNum().
+ */
+int memFastSeqWrite(int memNum, const char *data, int offset, int length) {
+	if (memMaster == NULL) {
+		fprintf(stderr, "%s (%d): Need to call memInit() first.\n", __FILE__, __LINE__);
+		return -1;
+	}
+
+	if (memNum < 0 || memNum >= MAX_MEMMASTERS ) {
+		fprintf(stderr, "%s (%d): memNum out of range %d.\n", __FILE__, __LINE__, memNum);
+		return -1;
+	}
+
+	MemMaster *mmp = &memMaster[memNum];
+	if (mmp->inUse == 0) {
+		fprintf(stderr, "%s (%d): memNum not in use %d.\n", __FILE__, __LINE__, memNum);
+		return -1;
+	}
+
+	if (badRange(mmp, offset, length))
+		return -1;
+
+	return seqWrite(mmp, data, offset, length);
+}
+
+/*
+ * This function memFastSeqRead is the same as memSeqRead() but uses
+ * memNum from memGetNum().
+ */
+int memFastSeqRead(int memNum, char *data, int offset, int length) {
+	if (memMaster == NULL) {
+		fprintf(stderr, "%s (%d): Need to call memInit() first.\n", __FILE__, __LINE__);
+		return -1;
+	}
+
+	if (memNum < 0 || memNum >= MAX_MEMMASTERS ) {
+		fprintf(stderr, "%s (%d): memNum out of range %d.\n", __FILE__, __LINE__, memNum);
+		return -1;
+	}
+
+	MemMaster *mmp = &memMaster[memNum];
+	if (mmp->inUse == 0) {
+		fprintf(stderr, "%s (%d): memNum not in use %d.\n", __FILE__, __LINE__, memNum);
+		return -1;
+	}
+
+	if (badRange(mmp, offset, length))
+		return -1;
+
+	return seqRead(mmp, data, offset, length);
+}
+
 /*
  * This function memAddrWrite is used to update the shared memory.
  * This uses a semaphore to keep processes from updating at the same time.
@@ -620,9 +1369,19 @@ int memAddrWrite(char *shmAddr, const char *data, int length) {
 		return -1;
 	}
 
-	memLockMemory();
-	memcpy(shmAddr, data, length);
-	memUnlockMemory();
+	MemMaster *mmp = findSegByAddr(shmAddr, length);
+	if (mmp != NULL) {
+		int offset = shmAddr - (char *)mmp->shmPtr;
+		if (lockRange(mmp, offset, length) != 0)
+			return -1;
+		memcpy(shmAddr, data, length);
+		unlockRange(mmp, offset, length);
+	} else {
+		memLockMemory();
+		memcpy(shmAddr, data, length);
+		memUnlockMemory();
+	}
+	ret = 0;
 
 	return ret;
 }
@@ -646,9 +1405,17 @@ int memAddrRead(char *shmAddr, char *data, int length) {
 		return -1;
 	}
 
-	memLockMemory();
-	memcpy(data, shmAddr, length);
-	memUnlockMemory();
+	MemMaster *mmp = findSegByAddr(shmAddr, length);
+	if (mmp != NULL) {
+		int offset = shmAddr - (char *)mmp->shmPtr;
+		if (readRange(mmp, data, offset, length) != 0)
+			return -1;
+	} else {
+		memLockMemory();
+		memcpy(data, shmAddr, length);
+		memUnlockMemory();
+	}
+	ret = 0;
 
 	return ret;
 }
@@ -673,7 +1440,15 @@ void memDetach(const char *memName) {
 	for (int i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
 		if (mmp->inUse) {
 			if (strcmp(mmp->memName, memName) == 0) {
-				shmdt((void *)memMaster[i].shmPtr);
+				if (memMaster[i].memHdr != NULL)
+					unmapSeg(&memMaster[i], memMaster[i].memHdr);
+				if (memMaster[i].backend == MEM_BACKEND_MEMFD && mmp->ownerPid != getpid()) {
+					// Keep the creator's fd open, it is what others attach through.
+					close(memMaster[i].memFd);
+					memMaster[i].ownerPid = 0;
+				}
+				memMaster[i].memHdr = NULL;
+				memMaster[i].shmPtr = NULL;
 				mmp->usingCnt--;
 				if (mmp->usingCnt < 0) {
 					mmp->usingCnt = 0;
@@ -724,27 +1499,20 @@ int memCheckAndSet(const char *memName, int offset, int length, char *checkVal,
 		return -1;
 	}
 
-	MemMaster *mmp = memMaster;
-	for (int i = 0; i < MAX_MEMMASTERS; i++, mmp++) {
-		if (mmp->inUse) {
-			if (strcmp(mmp->memName, memName) == 0) {
-				if (mmp->memSize < (long)(offset + length)) {
-					fprintf(stderr, "%s (%d): Offset plus length is greater than shared memory size.\n",
-							__FILE__, __LINE__);
-					return -1;
-				}
+	int memNum = lookupMem(memName);
+	if (memNum >= 0) {
+		MemMaster *mmp = &memMaster[memNum];
+		if (badRange(mmp, offset, length))
+			return -1;
 
-				memLockMemory();
-				/* do byte by byte comparison and if it equals to checkVal set it to setVal atomically*/
-				if (0 == memcmp((mmp->shmPtr + offset), checkVal, length)) {
-					memcpy((mmp->shmPtr + offset), setVal, length);
-					ret = 0;
-					memUnlockMemory();
-					break;
-				}
-				memUnlockMemory();
-			}
+		if (lockRange(mmp, offset, length) != 0)
+			return -1;
+		/* do byte by byte comparison and if it equals to checkVal set it to setVal atomically*/
+		if (0 == memcmp((mmp->shmPtr + offset), checkVal, length)) {
+			memcpy((mmp->shmPtr + offset), setVal, length);
+			ret = 0;
 		}
+		unlockRange(mmp, offset, length);
 	}
 
 	return ret;
@@ -766,14 +1534,9 @@ int memGetSize(const char *memName) {
 		return memSize;
 	}
 
-	MemMaster *mp = memMaster;
-	for (int i = 0; i < MAX_MEMMASTERS; i++, mp++) {
-		if (mp->inUse) {
-			if (strcmp(mp->memName, memName) == 0) {
-				return mp->memSize;
-				break;
-			}
-		}
+	int memNum = lookupMem(memName);
+	if (memNum >= 0) {
+		memSize = memMaster[memNum].memSize;
 	}
 
 	return memSize;
@@ -797,7 +1560,23 @@ int memDestroy(const char *memName) {
 	MemMaster *mp = sharedMemMaster;
 	for (int i = 0; i < MAX_MEMMASTERS; i++, mp++) {
 	    if (strcmp(memName, mp->memName) == 0) {
-            if(-1 == shmctl(mp->shmId, IPC_RMID, NULL)) {
+            int r = 0;
+            if (memMaster[i].memHdr != NULL)
+                unmapSeg(&memMaster[i], memMaster[i].memHdr);
+
+            if (mp->backend == MEM_BACKEND_POSIX) {
+                char name[MAX_SEGNAME + 16];
+                posixShmName(mp, name);
+                r = shm_unlink(name);
+            } else if (mp->backend == MEM_BACKEND_MEMFD) {
+                // Memory is freed once every process has closed and unmapped it.
+                if (memMaster[i].ownerPid == getpid())
+                    close(memMaster[i].memFd);
+            } else {
+                r = shmctl(mp->shmId, IPC_RMID, NULL);
+            }
+
+            if(-1 == r) {
                             memset(mp, 0, sizeof(MemMaster));
 			    fprintf(stderr, "%s (%d): Shared Memory destroy failed\n", __FILE__, __LINE__);
 	                    unlockMasterSem();
@@ -807,6 +1586,7 @@ int memDestroy(const char *memName) {
                 memset(mp, 0, sizeof(MemMaster));
                 // clean copy shared mem 
                 memset(&memMaster[i], 0, sizeof(MemMaster)); 
+                __atomic_add_fetch(&memGen, 1, __ATOMIC_RELEASE);
                 break;
             }
 	    }
@@ -38,6 +38,11 @@
 
 MsgMaster *msgMaster = NULL;
 
+// Bumped when an entry is added to msgMaster, kept just past the array.
+static unsigned long *msgMasterGen = NULL;
+
+static NameCache msgCache;
+
 key_t msgMasterId;
 
 typedef struct _msgBuf {
@@ -57,7 +62,7 @@ key_t masterSemId;
 int msgInit() {
 	// Attach or create the message queue master memory segment.
 	msgMasterId = shmget(MSGMASTER_ID,
-			(MAX_MSGMASTERS * sizeof(MsgMaster)),
+			(MAX_MSGMASTERS * sizeof(MsgMaster)) + sizeof(unsigned long),
 			0666);
 
 	if (msgMasterId == -1) {
@@ -65,7 +70,7 @@ int msgInit() {
 			// Memory master not allocated yet.
 
 			msgMasterId = shmget(MSGMASTER_ID,
-					(MAX_MSGMASTERS * sizeof(MsgMaster)),
+					(MAX_MSGMASTERS * sizeof(MsgMaster)) + sizeof(unsigned long),
 					(IPC_CREAT | IPC_EXCL | 0666));
 		} else {
 			fprintf(stderr, "%s (%d): Could create master shared memory segment for message queues.\n", __FILE__, __LINE__);
@@ -78,6 +83,7 @@ int msgInit() {
 		fprintf(stderr, "%s (%d): failed to attach to master shared memory for message queues.", __FILE__, __LINE__);
 		return -1;
 	}
+	msgMasterGen = (unsigned long *)&msgMaster[MAX_MSGMASTERS];
 
 	/*
 	 * The master semaphore set has three semaphore for each of the IPCs.
@@ -238,6 +244,7 @@ int msgCreate(const char *msgName) {
 
 			allocateMsg(foundSpot);
 			ret = 1;
+			__atomic_add_fetch(msgMasterGen, 1, __ATOMIC_RELEASE);
 		}
 	}
 
@@ -246,6 +253,33 @@ int msgCreate(const char *msgName) {
 	return ret;
 }
 
+/*
+ * This function lookupMsg returns the master message array offset for msgName,
+ * using this process's name cache before scanning msgMaster.
+ * This function is private to this file.
+ *
+ *   returns -1 if not found
+ *           else master message array offset.
+ */
+static int lookupMsg(const char *msgName) {
+	unsigned long gen = __atomic_load_n(msgMasterGen, __ATOMIC_ACQUIRE);
+
+	int i = nameCacheGet(&msgCache, msgName, gen);
+	if (i >= 0 && msgMaster[i].inUse && strcmp(msgMaster[i].msgName, msgName) == 0) {
+		return i;
+	}
+
+	MsgMaster *mqp = msgMaster;
+	for (i = 0; i < MAX_MSGMASTERS; i++, mqp++) {
+		if (mqp->inUse && strcmp(mqp->msgName, msgName) == 0) {
+			nameCachePut(&msgCache, msgName, i, gen);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 /*
  * This function msgGetId returns a message queue msgId.
  * Use this function to get the msgId so that you can use msgsnd and msgrcv yourself.
@@ -263,14 +297,9 @@ int msgGetId(const char *msgName) {
 		return msgId;
 	}
 
-	MsgMaster *smp = msgMaster;
-	for (int i = 0; i < MAX_MSGMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->msgName, msgName) == 0) {
-				msgId = smp->msgId;
-				break;
-			}
-		}
+	int msgNum = lookupMsg(msgName);
+	if (msgNum >= 0) {
+		msgId = msgMaster[msgNum].msgId;
 	}
 
 	return msgId;
@@ -286,24 +315,12 @@ int msgGetId(const char *msgName) {
  *           else master message array offset.
  */
 int msgGetNum(const char *msgName) {
-	int msgNum = -1;
-
 	if (msgMaster == NULL) {
 		fprintf(stderr, "%s (%d): Need to call msgInit() first.\n", __FILE__, __LINE__);
-		return msgNum;
-	}
-
-	MsgMaster *smp = msgMaster;
-	for (int i = 0; i < MAX_MSGMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->msgName, msgName) == 0) {
-				msgNum = i;
-				break;
-			}
-		}
+		return -1;
 	}
 
-	return msgNum;
+	return lookupMsg(msgName);
 }
 
 /*
@@ -334,18 +351,14 @@ int msgSend(const char *msgName, const char *msg, int msgFlags) {
 	msgBuf.type = 1;
 	strcpy(msgBuf.data, msg);
 
-	MsgMaster *mqp = msgMaster;
-	for (int i = 0; i < MAX_MSGMASTERS; i++, mqp++) {
-		if (mqp->inUse) {
-			if (strcmp(mqp->msgName, msgName) == 0) {
-				if (msgsnd(mqp->msgId, &msgBuf, msgLen + 1, msgFlags) == -1) {
-					fprintf(stderr, "%s (%d): Failed to place message on queue.\n", __FILE__, __LINE__);
-					perror("msgsnd");
-				} else {
-					ret = 0;
-				}
-				break;
-			}
+	int msgNum = lookupMsg(msgName);
+	if (msgNum >= 0) {
+		MsgMaster *mqp = &msgMaster[msgNum];
+		if (msgsnd(mqp->msgId, &msgBuf, msgLen + 1, msgFlags) == -1) {
+			fprintf(stderr, "%s (%d): Failed to place message on queue.\n", __FILE__, __LINE__);
+			perror("msgsnd");
+		} else {
+			ret = 0;
 		}
 	}
 
@@ -379,18 +392,14 @@ int msgNumSend(const char *msgName, const char *msg, int msgLen, int msgFlags) {
 	msgBuf.type = 1;
 	memcpy(msgBuf.data, msg, msgLen);
 
-	MsgMaster *mqp = msgMaster;
-	for (int i = 0; i < MAX_MSGMASTERS; i++, mqp++) {
-		if (mqp->inUse) {
-			if (strcmp(mqp->msgName, msgName) == 0) {
-				if (msgsnd(mqp->msgId, &msgBuf, msgLen + 1, msgFlags) == -1) {
-					fprintf(stderr, "%s (%d): Failed to place message on queue.\n", __FILE__, __LINE__);
-					perror("msgsnd");
-				} else {
-					ret = 0;
-				}
-				break;
-			}
+	int msgNum = lookupMsg(msgName);
+	if (msgNum >= 0) {
+		MsgMaster *mqp = &msgMaster[msgNum];
+		if (msgsnd(mqp->msgId, &msgBuf, msgLen + 1, msgFlags) == -1) {
+			fprintf(stderr, "%s (%d): Failed to place message on queue.\n", __FILE__, __LINE__);
+			perror("msgsnd");
+		} else {
+			ret = 0;
 		}
 	}
 
@@ -516,22 +525,18 @@ int msgRecv(const char *msgName, char *buf, int msgFlags) {
 	MsgBuf msgBuf;
 	long msgPriority = 0;
 
-	MsgMaster *mqp = msgMaster;
-	for (int i = 0; i < MAX_MSGMASTERS; i++, mqp++) {
-		if (mqp->inUse) {
-			if (strcmp(mqp->msgName, msgName) == 0) {
-				size_t r = msgrcv(mqp->msgId, &msgBuf, sizeof(msgBuf.data), msgPriority, msgFlags);
-				if (r == -1 && errno != ENOMSG) {
-					fprintf(stderr, "%s (%d): Failed to read message from queue.\n", __FILE__, __LINE__);
-					perror("msgrcv");
-				} else if (r == -1 && errno == ENOMSG) {
-					ret = 0;
-				} else {
-					memcpy(buf, msgBuf.data, r);
-					ret = r;
-				}
-				break;
-			}
+	int msgNum = lookupMsg(msgName);
+	if (msgNum >= 0) {
+		MsgMaster *mqp = &msgMaster[msgNum];
+		size_t r = msgrcv(mqp->msgId, &msgBuf, sizeof(msgBuf.data), msgPriority, msgFlags);
+		if (r == -1 && errno != ENOMSG) {
+			fprintf(stderr, "%s (%d): Failed to read message from queue.\n", __FILE__, __LINE__);
+			perror("msgrcv");
+		} else if (r == -1 && errno == ENOMSG) {
+			ret = 0;
+		} else {
+			memcpy(buf, msgBuf.data, r);
+			ret = r;
 		}
 	}
 
@@ -560,32 +565,28 @@ int msgPriorityRecv(const char *msgName, char *buf, int msgFlags, long msgPriori
 
 	MsgBuf msgBuf;
 
-	MsgMaster *mqp = msgMaster;
-	for (int i = 0; i < MAX_MSGMASTERS; i++, mqp++) {
-		if (mqp->inUse) {
-			if (strcmp(mqp->msgName, msgName) == 0) {
-				size_t r = msgrcv(mqp->msgId, &msgBuf, sizeof(msgBuf.data), msgPriority, msgFlags);
-				if (r == -1 && errno != ENOMSG) {
-					fprintf(stderr, "%s (%d): Failed to read message from queue.\n", __FILE__, __LINE__);
-					perror("msgrcv");
-				} else if (r == -1 && errno == ENOMSG) {
-					// No priority messages, try and read the next message in queue.
-					size_t r2 = msgrcv(mqp->msgId, &msgBuf, sizeof(msgBuf.data), 0, msgFlags);
-					if (r2 == -1 && errno != ENOMSG) {
-						fprintf(stderr, "%s (%d): Failed to read message from queue.\n", __FILE__, __LINE__);
-						perror("msgrcv");
-					} else if (r2 == -1 && errno == ENOMSG) {
-						ret = 0;
-					} else {
-						memcpy(buf, msgBuf.data, r2);
-						ret = r2;
-					}
-				} else {
-					memcpy(buf, msgBuf.data, r);
-					ret = r;
-				}
-				break;
+	int msgNum = lookupMsg(msgName);
+	if (msgNum >= 0) {
+		MsgMaster *mqp = &msgMaster[msgNum];
+		size_t r = msgrcv(mqp->msgId, &msgBuf, sizeof(msgBuf.data), msgPriority, msgFlags);
+		if (r == -1 && errno != ENOMSG) {
+			fprintf(stderr, "%s (%d): Failed to read message from queue.\n", __FILE__, __LINE__);
+			perror("msgrcv");
+		} else if (r == -1 && errno == ENOMSG) {
+			// No priority messages, try and read the next message in queue.
+			size_t r2 = msgrcv(mqp->msgId, &msgBuf, sizeof(msgBuf.data), 0, msgFlags);
+			if (r2 == -1 && errno != ENOMSG) {
+				fprintf(stderr, "%s (%d): Failed to read message from queue.\n", __FILE__, __LINE__);
+				perror("msgrcv");
+			} else if (r2 == -1 && errno == ENOMSG) {
+				ret = 0;
+			} else {
+				memcpy(buf, msgBuf.data, r2);
+				ret = r2;
 			}
+		} else {
+			memcpy(buf, msgBuf.data, r);
+			ret = r;
 		}
 	}
 
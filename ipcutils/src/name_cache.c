@@ -0,0 +1,88 @@
+
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Per-process cache from an IPC name to its master array offset.
+ *
+ * The name based functions (memWrite(), msgSend(), semLock() ...) used to scan
+ * the whole master array with strcmp() on every call.  They now look the name up
+ * here first.  Entries are keyed by the address of the name, callers normally pass
+ * the same string literal or buffer every time, so a hit costs one strcmp() instead
+ * of hashing the name.  Each entry is tagged with the generation of the master
+ * array it was filled from, when an entry is created or removed the generation
+ * changes and the cached offsets stop matching.  Callers still check the name at
+ * the returned offset, so a reused buffer or half written entry only costs a rescan.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "ipcutils.h"
+
+/*
+ * This function nameSlot returns the cache entry for the name at address name.
+ * This function is private to this file.
+ */
+static NameCacheEntry *nameSlot(NameCache *nc, const char *name) {
+	uint64_t h = (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ULL;
+
+	return &nc->entry[h >> (64 - NAME_CACHE_BITS)];
+}
+
+/*
+ * This function nameCacheGet looks up name in the cache.
+ *
+ *   nc = Cache to search.
+ *   name = Name of the IPC object.
+ *   gen = Current generation of the master array.
+ *
+ *   returns -1 if not cached or cached from another generation
+ *           else master array offset, which the caller must check.
+ */
+int nameCacheGet(NameCache *nc, const char *name, unsigned long gen) {
+	NameCacheEntry *e = nameSlot(nc, name);
+
+	if (__atomic_load_n(&e->name, __ATOMIC_RELAXED) != name ||
+			__atomic_load_n(&e->gen, __ATOMIC_RELAXED) != gen)
+		return -1;
+
+	return __atomic_load_n(&e->idx, __ATOMIC_RELAXED) - 1;
+}
+
+/*
+ * This function nameCachePut remembers the master array offset of name.
+ *
+ *   nc = Cache to update.
+ *   name = Name of the IPC object.
+ *   idx = Master array offset of name.
+ *   gen = Generation of the master array idx was found in.
+ */
+void nameCachePut(NameCache *nc, const char *name, int idx, unsigned long gen) {
+	NameCacheEntry *e = nameSlot(nc, name);
+
+	__atomic_store_n(&e->idx, idx + 1, __ATOMIC_RELAXED);		// 0 means empty
+	__atomic_store_n(&e->gen, gen, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+}
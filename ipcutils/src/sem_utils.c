@@ -28,20 +28,39 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
-#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "ipcutils.h"
 
 SemMaster *semMaster = NULL;
 
+// Bumped when an entry is added to semMaster, kept just past the array.
+static unsigned long *semMasterGen = NULL;
+
+static NameCache semCache;
+
 key_t semMasterId;
 
 key_t masterSemId;
 
+// One of these per semaphore in a SEM_BACKEND_FUTEX set.
+typedef struct _futexSem {
+	int value;
+	int waiters;
+} FutexSem;
+
+static int semBackend = SEM_BACKEND_SYSV;
+
+// This process's mapping of each SEM_BACKEND_FUTEX set, by semNum.
+static FutexSem *futexSems[MAX_SEMMASTERS];
+
 #if __linux__
 union semun
 {
@@ -62,7 +81,7 @@ union semun
 int semInit() {
 	// Attach or create the master memory segment.
 	semMasterId = shmget(SEMMASTER_ID,
-			(MAX_SEMMASTERS * sizeof(SemMaster)),
+			(MAX_SEMMASTERS * sizeof(SemMaster)) + sizeof(unsigned long),
 			0666);
 
 	if (semMasterId == -1) {
@@ -70,7 +89,7 @@ int semInit() {
 			// Memory master not allocated yet.
 
 			semMasterId = shmget(SEMMASTER_ID,
-					(MAX_SEMMASTERS * sizeof(SemMaster)),
+					(MAX_SEMMASTERS * sizeof(SemMaster)) + sizeof(unsigned long),
 					(IPC_CREAT | IPC_EXCL | 0666));
 		} else {
 			fprintf(stderr, "%s (%d): Could create master shared memory segment for semaphores.\n", __FILE__, __LINE__);
@@ -83,6 +102,7 @@ int semInit() {
 		fprintf(stderr, "%s (%d): failed to attach to master shared memory for semaphores.", __FILE__, __LINE__);
 		return -1;
 	}
+	semMasterGen = (unsigned long *)&semMaster[MAX_SEMMASTERS];
 
 	/*
 	 * The master semaphore set has three semaphore for each of the IPCs.
@@ -165,6 +185,29 @@ int unlockMasterSem() {
 	return 0;
 }
 
+/*
+ * This function semInitBackend selects how semaphore sets created by this process
+ * are implemented.  Sets that already exist keep the backend they were created with.
+ *
+ *   backend = SEM_BACKEND_SYSV for System V semaphore sets (the default), or
+ *             SEM_BACKEND_FUTEX for futex words in a shared memory segment.
+ *             The futex backend only enters the kernel when a caller has to wait,
+ *             but does not undo a lock held by a process that exits.
+ *
+ * returns  0 on success.
+ *         -1 on failure.
+ */
+int semInitBackend(int backend) {
+	if (backend != SEM_BACKEND_SYSV && backend != SEM_BACKEND_FUTEX) {
+		fprintf(stderr, "%s (%d): Unknown semaphore backend %d.\n", __FILE__, __LINE__, backend);
+		return -1;
+	}
+
+	semBackend = backend;
+
+	return 0;
+}
+
 /*
  * This function allocateSem updates the SemMasters segment and creates
  * the user semaphore set if needed.
@@ -181,6 +224,32 @@ int allocateSem(SemMaster *smp, int semSize) {
 	struct sembuf sb;
 	struct semid_ds buf;
 
+	if (smp->backend == SEM_BACKEND_FUTEX) {
+		// The semaphores are futex words in a private segment, semId is its shmid.
+		smp->semId = shmget(IPC_PRIVATE, semSize * sizeof(FutexSem), 0666 | IPC_CREAT);
+		if (smp->semId < 0) {
+			fprintf(stderr, "%s (%d): Could not create futex semaphore segment.  errno: %d\n",
+					__FILE__, __LINE__, errno);
+			return -1;
+		}
+
+		FutexSem *fs = (FutexSem *)shmat(smp->semId, NULL, 0);
+		if (fs == (void *)-1) {
+			int e = errno;
+			shmctl(smp->semId, IPC_RMID, NULL);
+			errno = e;
+			return -1;
+		}
+
+		for (int i = 0; i < semSize; i++) {
+			fs[i].value = 1;
+			fs[i].waiters = 0;
+		}
+		futexSems[smp - semMaster] = fs;
+
+		return 0;
+	}
+
 	// Attach or create the user semaphore set.
 	smp->semId = semget(smp->id, semSize, 0666 | IPC_CREAT | IPC_EXCL);
 
@@ -277,10 +346,17 @@ int semCreate(const char *semName, int semSize) {
 		} else {
 			foundSpot->inUse = 1;
 			foundSpot->semSize = semSize;
+			foundSpot->backend = semBackend;
 			strcpy(foundSpot->semName, semName);
 
-			allocateSem(foundSpot, semSize);
-			ret = 1;
+			if (allocateSem(foundSpot, semSize) == -1) {
+				fprintf(stderr, "%s (%d): Could not allocate semaphore set '%s'.\n", __FILE__, __LINE__, semName);
+				foundSpot->inUse = 0;
+				ret = -1;
+			} else {
+				ret = 1;
+			}
+			__atomic_add_fetch(semMasterGen, 1, __ATOMIC_RELEASE);
 		}
 	}
 
@@ -289,6 +365,33 @@ int semCreate(const char *semName, int semSize) {
 	return ret;
 }
 
+/*
+ * This function lookupSem returns the master semaphore array offset for semName,
+ * using this process's name cache before scanning semMaster.
+ * This function is private to this file.
+ *
+ *   returns -1 if not found
+ *           else master semaphore array offset.
+ */
+static int lookupSem(const char *semName) {
+	unsigned long gen = __atomic_load_n(semMasterGen, __ATOMIC_ACQUIRE);
+
+	int i = nameCacheGet(&semCache, semName, gen);
+	if (i >= 0 && semMaster[i].inUse && strcmp(semMaster[i].semName, semName) == 0) {
+		return i;
+	}
+
+	SemMaster *smp = semMaster;
+	for (i = 0; i < MAX_SEMMASTERS; i++, smp++) {
+		if (smp->inUse && strcmp(smp->semName, semName) == 0) {
+			nameCachePut(&semCache, semName, i, gen);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 /*
  * This function semGetId returns a semaphore sets semId.
  *
@@ -305,14 +408,9 @@ int semGetId(const char *semName) {
 		return semId;
 	}
 
-	SemMaster *smp = semMaster;
-	for (int i = 0; i < MAX_SEMMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->semName, semName) == 0) {
-				semId = smp->semId;
-				break;
-			}
-		}
+	int semNum = lookupSem(semName);
+	if (semNum >= 0) {
+		semId = semMaster[semNum].semId;
 	}
 
 	return semId;
@@ -327,76 +425,295 @@ int semGetId(const char *semName) {
  *           else master semaphore array offset.
  */
 int semGetNum(const char *semName) {
-	int semNum = -1;
+	if (semMaster == NULL) {
+		fprintf(stderr, "%s (%d): Need to call semInit() first.\n", __FILE__, __LINE__);
+		return -1;
+	}
+
+	return lookupSem(semName);
+}
 
+/*
+ * This function findSem returns the master semaphore array offset for semName.
+ * This function is private to this file.
+ *
+ *   returns -1 if not found
+ *           else master semaphore array offset.
+ */
+static int findSem(const char *semName) {
 	if (semMaster == NULL) {
 		fprintf(stderr, "%s (%d): Need to call semInit() first.\n", __FILE__, __LINE__);
-		return semNum;
+		return -1;
 	}
 
-	SemMaster *smp = semMaster;
-	for (int i = 0; i < MAX_SEMMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->semName, semName) == 0) {
-				semNum = i;
-				break;
-			}
-		}
+	int semNum = lookupSem(semName);
+	if (semNum < 0) {
+		fprintf(stderr, "%s (%d): Could not find semaphore set '%s'.\n",
+				__FILE__, __LINE__, semName);
 	}
 
 	return semNum;
 }
 
 /*
- * This function semLock will try to lock a semaphore.
- * This function only allows you to lock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
+ * This function futexAttach returns this process's mapping of a SEM_BACKEND_FUTEX
+ * set, attaching it the first time it is used.
+ * This function is private to this file.
  *
- * This will block until operation can be done.
+ *   returns NULL on error
+ *           else pointer to the first FutexSem of the set.
+ */
+static FutexSem *futexAttach(int semNum) {
+	FutexSem *fs = __atomic_load_n(&futexSems[semNum], __ATOMIC_ACQUIRE);
+	if (fs != NULL) {
+		return fs;
+	}
+
+	fs = (FutexSem *)shmat(semMaster[semNum].semId, NULL, 0);
+	if (fs == (void *)-1) {
+		fprintf(stderr, "%s (%d): Could not attach futex semaphore set.  errno: %d\n",
+				__FILE__, __LINE__, errno);
+		return NULL;
+	}
+
+	// Another thread may have attached it at the same time, keep theirs.
+	FutexSem *expected = NULL;
+	if (__atomic_compare_exchange_n(&futexSems[semNum], &expected, fs, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == 0) {
+		shmdt(fs);
+		fs = expected;
+	}
+
+	return fs;
+}
+
+/*
+ * This function futexWait sleeps while *addr still holds val.
+ * This function is private to this file.
  *
- *   semName = Name of the semaphore set to use.
- *   semIdx = index of the semaphore in the semaphore set to lock.
+ *   deadline = CLOCK_MONOTONIC time to give up at, or NULL to wait forever.
  *
- *   returns -1 on failure.
+ *   returns -1 with errno EAGAIN when deadline has passed, or on error.
+ *           0 when woken up or *addr changed.
+ */
+static int futexWait(int *addr, int val, const struct timespec *deadline) {
+	struct timespec ts;
+	struct timespec *tsp = NULL;
+
+	if (deadline != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec = deadline->tv_sec - ts.tv_sec;
+		ts.tv_nsec = deadline->tv_nsec - ts.tv_nsec;
+		if (ts.tv_nsec < 0) {
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000L;
+		}
+		if (ts.tv_sec < 0) {
+			errno = EAGAIN;		// same as semtimedop()
+			return -1;
+		}
+		tsp = &ts;
+	}
+
+	if (syscall(SYS_futex, addr, FUTEX_WAIT, val, tsp, NULL, 0) == -1) {
+		if (errno == ETIMEDOUT) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (errno != EAGAIN && errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This function futexSemOp applies one semop() style operation to a futex semaphore.
+ * A negative op waits until the value is at least -op and subtracts it, a positive op
+ * adds it, and zero waits for the value to become zero.
+ * The kernel is only entered when the caller has to wait or someone is waiting.
+ * This function is private to this file.
+ *
+ *   returns -1 on failure or timeout.
  *           0 on success
  */
-int semLock(const char *semName, int semIdx) {
-	struct sembuf sb;
+static int futexSemOp(FutexSem *fs, int op, const struct timespec *deadline) {
+	if (op > 0) {
+		__atomic_add_fetch(&fs->value, op, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&fs->waiters, __ATOMIC_SEQ_CST) > 0) {
+			// Waiters may want different amounts, let them all recheck.
+			syscall(SYS_futex, &fs->value, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		}
+		return 0;
+	}
 
-	sb.sem_num = semIdx;
-	sb.sem_op  = -1;
-	sb.sem_flg = SEM_UNDO;
+	for (;;) {
+		int val = __atomic_load_n(&fs->value, __ATOMIC_ACQUIRE);
 
-	int semId = -1;
-	SemMaster *smp = semMaster;
-	for (int i = 0; i < MAX_SEMMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->semName, semName) == 0) {
-				semId = smp->semId;
-				break;
+		if (op == 0 && val == 0) {
+			return 0;
+		}
+
+		if (op < 0 && val >= -op) {
+			if (__atomic_compare_exchange_n(&fs->value, &val, val + op, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				if (val + op == 0 && __atomic_load_n(&fs->waiters, __ATOMIC_SEQ_CST) > 0) {
+					// wake anyone waiting for zero.
+					syscall(SYS_futex, &fs->value, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+				}
+				return 0;
 			}
+			continue;
+		}
+
+		__atomic_add_fetch(&fs->waiters, 1, __ATOMIC_SEQ_CST);
+		int ret = futexWait(&fs->value, val, deadline);
+		__atomic_sub_fetch(&fs->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (ret == -1) {
+			return -1;
 		}
 	}
+}
 
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set '%s'.\n",
-				__FILE__, __LINE__, semName);
+/*
+ * This function semApply applies count operations to semaphore set semNum.
+ * For System V sets this is one semop() call so all operations happen atomically.
+ * For futex sets the operations are applied in semIdx order, so callers locking
+ * several semaphores can not deadlock each other, and are undone if one fails.
+ * An add that can not be taken back at once because another process used it
+ * is reported and left in place rather than waited for.
+ * This function is private to this file.
+ *
+ *   timeout = seconds to wait, or -1 to wait forever.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+static int semApply(int semNum, const SemOp *ops, int count, int timeout) {
+	if (semNum < 0 || semNum >= MAX_SEMMASTERS ) {
+		fprintf(stderr, "%s (%d): semNum out of range %d.\n", __FILE__, __LINE__, semNum);
 		return -1;
 	}
 
-	if (semop(semId, &sb, 1) == -1) {
-		fprintf(stderr, "%s (%d): Could not lock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
+	SemMaster *smp = &semMaster[semNum];
+	if (smp->inUse == 0) {
+		fprintf(stderr, "%s (%d): Could not find semaphore set.\n",	__FILE__, __LINE__);
+		return -1;
+	}
+
+	if (count < 1 || count > MAX_SEM_OPS) {
+		fprintf(stderr, "%s (%d): Operation count out of range %d.\n", __FILE__, __LINE__, count);
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (ops[i].semIdx < 0 || ops[i].semIdx >= smp->semSize) {
+			fprintf(stderr, "%s (%d): Semaphore number (%d) out of range.\n",
+					__FILE__, __LINE__, ops[i].semIdx);
+			return -1;
+		}
+	}
+
+	if (smp->backend == SEM_BACKEND_FUTEX) {
+		FutexSem *fs = futexAttach(semNum);
+		if (fs == NULL) {
+			return -1;
+		}
+
+		struct timespec deadline;
+		struct timespec *dp = NULL;
+		if (timeout >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += timeout;
+			dp = &deadline;
+		}
+
+		// Sort a copy by semIdx so every caller acquires in the same order.
+		SemOp sorted[MAX_SEM_OPS];
+		for (int i = 0; i < count; i++) {
+			int j = i;
+			for (; j > 0 && sorted[j - 1].semIdx > ops[i].semIdx; j--) {
+				sorted[j] = sorted[j - 1];
+			}
+			sorted[j] = ops[i];
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (futexSemOp(&fs[sorted[i].semIdx], sorted[i].op, dp) == -1) {
+				int e = errno;
+				// Undoing an add has to take it back, which only waits if another
+				// process took it since.  Try once rather than wait for it forever.
+				struct timespec past = { 0, 0 };
+				while (--i >= 0) {
+					if (sorted[i].op != 0 &&
+							futexSemOp(&fs[sorted[i].semIdx], -sorted[i].op, &past) == -1) {
+						fprintf(stderr, "%s (%d): Could not undo %d on semaphore %d of set '%s', it is left changed.\n",
+								__FILE__, __LINE__, sorted[i].op, sorted[i].semIdx, smp->semName);
+					}
+				}
+				errno = e;
+				fprintf(stderr, "%s (%d): Could not operate on semaphore set '%s'.  errno: %d\n",
+						__FILE__, __LINE__, smp->semName, errno);
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	struct sembuf sb[MAX_SEM_OPS];
+	for (int i = 0; i < count; i++) {
+		sb[i].sem_num = ops[i].semIdx;
+		sb[i].sem_op  = ops[i].op;
+		sb[i].sem_flg = (ops[i].op == 0) ? 0 : SEM_UNDO;
+	}
+
+	int ret;
+#ifdef _GNU_SOURCE
+	if (timeout >= 0) {
+		struct timespec ts;
+
+		ts.tv_sec = timeout;
+		ts.tv_nsec = 0;
+		ret = semtimedop(smp->semId, sb, count, &ts);
+	} else
+#endif
+	ret = semop(smp->semId, sb, count);
+
+	if (ret == -1) {
+		fprintf(stderr, "%s (%d): Could not operate on semaphore set '%s'.  errno: %d\n",
+				__FILE__, __LINE__, smp->semName, errno);
 		return -1;
 	}
 
 	return 0;
 }
 
+/*
+ * This function semLock will try to lock a semaphore.
+ * This function only allows you to lock one semaphore in the set at a time.
+ * Use semLockMany() to lock several semaphores in the set at the same time.
+ *
+ * This will block until operation can be done.
+ *
+ *   semName = Name of the semaphore set to use.
+ *   semIdx = index of the semaphore in the semaphore set to lock.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+int semLock(const char *semName, int semIdx) {
+	SemOp op = { semIdx, -1 };
+
+	return semApply(findSem(semName), &op, 1, -1);
+}
+
 /*
  * This function semUnlock will try to unlock a semaphore.
  * This function only allows you to unlock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
+ * Use semUnlockMany() to unlock several semaphores in the set at the same time.
  *
  * This will block until operation can be done.
  *
@@ -407,42 +724,15 @@ int semLock(const char *semName, int semIdx) {
  *           0 on success
  */
 int semUnlock(const char *semName, int semIdx) {
-	struct sembuf sb;
-
-	sb.sem_num = semIdx;
-	sb.sem_op  = 1;
-	sb.sem_flg = SEM_UNDO;
+	SemOp op = { semIdx, 1 };
 
-	int semId = -1;
-	SemMaster *smp = semMaster;
-	for (int i = 0; i < MAX_SEMMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->semName, semName) == 0) {
-				semId = smp->semId;
-				break;
-			}
-		}
-	}
-
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set '%s'.\n",
-				__FILE__, __LINE__, semName);
-		return -1;
-	}
-
-	if (semop(semId, &sb, 1) == -1) {
-		fprintf(stderr, "%s (%d): Could not unlock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
-	}
-
-	return 0;
+	return semApply(findSem(semName), &op, 1, -1);
 }
 
 /*
  * This function semFastLock will try to lock a semaphore.
  * This function only allows you to lock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
+ * Use semFastLockMany() to lock several semaphores in the set at the same time.
  * Use the semGteNum() function to get semNum.
  *
  * This will block until operation can be done.
@@ -454,41 +744,15 @@ int semUnlock(const char *semName, int semIdx) {
  *           0 on success
  */
 int semFastLock(int semNum, int semIdx) {
-	struct sembuf sb;
-
-	if (semNum < 0 || semNum >= MAX_SEMMASTERS ) {
-		fprintf(stderr, "%s (%d): semNum out of range %d.\n", __FILE__, __LINE__, semNum);
-		return -1;
-	}
-
-	sb.sem_num = semNum;
-	sb.sem_op  = -1;			// lock semaphore
-	sb.sem_flg = SEM_UNDO;
+	SemOp op = { semIdx, -1 };
 
-	int semId = -1;
-	SemMaster *smp = &semMaster[semNum];
-	if (smp->inUse) {
-		semId = smp->semId;
-	}
-
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set.\n",	__FILE__, __LINE__);
-		return -1;
-	}
-
-	if (semop(semId, &sb, 1) == -1) {
-		fprintf(stderr, "%s (%d): Could not lock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
-	}
-
-	return 0;
+	return semApply(semNum, &op, 1, -1);
 }
 
 /*
  * This function semUnlock will try to unlock a semaphore.
  * This function only allows you to unlock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
+ * Use semFastUnlockMany() to unlock several semaphores in the set at the same time.
  * Use the semGteNum() function to get semNum.
  *
  * This will block until operation can be done.
@@ -500,140 +764,153 @@ int semFastLock(int semNum, int semIdx) {
  *           0 on success
  */
 int semFastUnlock(int semNum, int semIdx) {
-	struct sembuf sb;
+	SemOp op = { semIdx, 1 };
 
-	sb.sem_num = semIdx;
-	sb.sem_op  = 1;
-	sb.sem_flg = SEM_UNDO;
+	return semApply(semNum, &op, 1, -1);
+}
 
-	if (semNum < 0 || semNum >= MAX_SEMMASTERS ) {
-		fprintf(stderr, "%s (%d): semNum out of range %d.\n", __FILE__, __LINE__, semNum);
-		return -1;
-	}
+/*
+ * This function semOpMany applies a vector of operations to a semaphore set.
+ * Each SemOp adds op to semaphore semIdx, a negative op blocks until it can be
+ * subtracted and an op of zero waits for the semaphore to become zero.
+ * System V sets apply all of them in one atomic semop(), nothing is changed until
+ * every operation can be done.  Futex sets apply them in semIdx order.
+ *
+ * This will block until operation can be done.
+ *
+ *   semName = Name of the semaphore set to use.
+ *   ops = Operations to apply.
+ *   count = Number of operations, MAX_SEM_OPS max.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+int semOpMany(const char *semName, const SemOp *ops, int count) {
+	return semApply(findSem(semName), ops, count, -1);
+}
 
-	int semId = -1;
-	SemMaster *smp = &semMaster[semNum];
-	if (smp->inUse) {
-		semId = smp->semId;
-	}
+/*
+ * This function lockMany builds the lock or unlock vector for the *Many functions.
+ * This function is private to this file.
+ */
+static int lockMany(int semNum, const int *semIdx, int count, int op) {
+	SemOp ops[MAX_SEM_OPS];
 
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set.\n",	__FILE__, __LINE__);
+	if (count < 1 || count > MAX_SEM_OPS) {
+		fprintf(stderr, "%s (%d): Semaphore count out of range %d.\n", __FILE__, __LINE__, count);
 		return -1;
 	}
 
-	if (semop(semId, &sb, 1) == -1) {
-		fprintf(stderr, "%s (%d): Could not unlock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
+	for (int i = 0; i < count; i++) {
+		ops[i].semIdx = semIdx[i];
+		ops[i].op = op;
 	}
 
-	return 0;
+	return semApply(semNum, ops, count, -1);
+}
+
+/*
+ * This function semLockMany locks several semaphores in a set at once.
+ * Either all of them are locked or the call blocks, so callers do not need to
+ * agree on a locking order to avoid deadlocks.
+ *
+ * This will block until operation can be done.
+ *
+ *   semName = Name of the semaphore set to use.
+ *   semIdx = Indexes of the semaphores in the semaphore set to lock.
+ *   count = Number of indexes, MAX_SEM_OPS max.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+int semLockMany(const char *semName, const int *semIdx, int count) {
+	return lockMany(findSem(semName), semIdx, count, -1);
+}
+
+/*
+ * This function semUnlockMany unlocks several semaphores in a set at once.
+ *
+ *   semName = Name of the semaphore set to use.
+ *   semIdx = Indexes of the semaphores in the semaphore set to unlock.
+ *   count = Number of indexes, MAX_SEM_OPS max.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+int semUnlockMany(const char *semName, const int *semIdx, int count) {
+	return lockMany(findSem(semName), semIdx, count, 1);
+}
+
+/*
+ * This function semFastLockMany is semLockMany() using the master semaphore array offset.
+ * Use the semGetNum() function to get semNum.
+ *
+ *   semNum = Master semaphore array offset.
+ *   semIdx = Indexes of the semaphores in the semaphore set to lock.
+ *   count = Number of indexes, MAX_SEM_OPS max.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+int semFastLockMany(int semNum, const int *semIdx, int count) {
+	return lockMany(semNum, semIdx, count, -1);
+}
+
+/*
+ * This function semFastUnlockMany is semUnlockMany() using the master semaphore array offset.
+ * Use the semGetNum() function to get semNum.
+ *
+ *   semNum = Master semaphore array offset.
+ *   semIdx = Indexes of the semaphores in the semaphore set to unlock.
+ *   count = Number of indexes, MAX_SEM_OPS max.
+ *
+ *   returns -1 on failure.
+ *           0 on success
+ */
+int semFastUnlockMany(int semNum, const int *semIdx, int count) {
+	return lockMany(semNum, semIdx, count, 1);
 }
 
 #ifdef _GNU_SOURCE		// use compiler switch -D_GNU_SOURCE
 /*
  * This function semTimedLock will try to lock a semaphore.
  * This function only allows you to lock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
  *
  * This will block until operation can be done or timeout in seconds has been reached.
  *
- *   semNum = Master semaphore array offset
+ *   semName = Name of the semaphore set to use.
  *   semIdx = number of the semaphore in the semaphore set to lock.
  *
  *   returns -1 on failure.
  *           0 on success
  */
 int semTimedLock(const char *semName, int semIdx, int timeout) {
-	struct sembuf sb;
-	struct timespec ts;
-
-	sb.sem_num = semIdx;
-	sb.sem_op = -1;
-	sb.sem_flg = SEM_UNDO;
-
-	int semId = -1;
-	SemMaster *smp = semMaster;
-	for (int i = 0; i < MAX_SEMMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->semName, semName) == 0) {
-				semId = smp->semId;
-				break;
-			}
-		}
-	}
-
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set '%s'.\n",
-				__FILE__, __LINE__, semName);
-		return -1;
-	}
+	SemOp op = { semIdx, -1 };
 
-	ts.tv_sec = timeout;
-	ts.tv_nsec = 0;
-	if (semtimedop(semId, &sb, 1, &ts) == -1) {
-		fprintf(stderr, "%s (%d): Could not lock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
-	}
-
-	return 0;
+	return semApply(findSem(semName), &op, 1, timeout);
 }
 
 /*
  * This function semTimedUnlock will try to unlock a semaphore.
  * This function only allows you to unlock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
  *
  * This will block until operation can be done or timeout in seconds has been reached.
  *
- *   semNum = Master semaphore array offset.
+ *   semName = Name of the semaphore set to use.
  *   semIdx = number of the semaphore in the semaphore set to unlock.
  *
  *   returns -1 on failure.
  *           0 on success
  */
 int semTimedUnlock(const char *semName, int semIdx, int timeout) {
-	struct sembuf sb;
-	struct timespec ts;
-
-	sb.sem_num = semIdx;
-	sb.sem_op  = 1;
-	sb.sem_flg = SEM_UNDO;
-
-	int semId = -1;
-	SemMaster *smp = semMaster;
-	for (int i = 0; i < MAX_SEMMASTERS; i++, smp++) {
-		if (smp->inUse) {
-			if (strcmp(smp->semName, semName) == 0) {
-				semId = smp->semId;
-				break;
-			}
-		}
-	}
-
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set '%s'.\n",
-				__FILE__, __LINE__, semName);
-		return -1;
-	}
-
-	ts.tv_sec = timeout;
-	ts.tv_nsec = 0;
-	if (semtimedop(semId, &sb, 1, &ts) == -1) {
-		fprintf(stderr, "%s (%d): Could not unlock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
-	}
+	SemOp op = { semIdx, 1 };
 
-	return 0;
+	return semApply(findSem(semName), &op, 1, timeout);
 }
 
 /*
  * This function semFastTimedLock will try to lock a semaphore.
  * This function only allows you to lock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
  *
  * This will block until operation can be done or timeout in seconds has been reached.
  *
@@ -644,44 +921,14 @@ int semTimedUnlock(const char *semName, int semIdx, int timeout) {
  *           0 on success
  */
 int semFastTimedLock(int semNum, int semIdx, int timeout) {
-	struct sembuf sb;
-	struct timespec ts;
-
-	sb.sem_num = semIdx;
-	sb.sem_op  = -1;
-	sb.sem_flg = SEM_UNDO;
-
-	if (semNum < 0 || semNum >= MAX_SEMMASTERS ) {
-		fprintf(stderr, "%s (%d): semNum out of range %d.\n", __FILE__, __LINE__, semNum);
-		return -1;
-	}
-
-	int semId = -1;
-	SemMaster *smp = &semMaster[semNum];
-	if (smp->inUse) {
-		semId = smp->semId;
-	}
-
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set.\n",	__FILE__, __LINE__);
-		return -1;
-	}
-
-	ts.tv_sec = timeout;
-	ts.tv_nsec = 0;
-	if (semtimedop(semId, &sb, 1, &ts) == -1) {
-		fprintf(stderr, "%s (%d): Could not lock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
-	}
+	SemOp op = { semIdx, -1 };
 
-	return 0;
+	return semApply(semNum, &op, 1, timeout);
 }
 
 /*
  * This function semFastTimedUnlock will try to unlock a semaphore.
  * This function only allows you to unlock one semaphore in the set at a time.
- * You will have to use semGetId and handle multiple operations on multiple semaphores at the same time.
  *
  * This will block until operation can be done or timeout in seconds has been reached.
  *
@@ -692,37 +939,8 @@ int semFastTimedLock(int semNum, int semIdx, int timeout) {
  *           0 on success
  */
 int semFastTimedUnlock(int semNum, int semIdx, int timeout) {
-	struct sembuf sb;
-	struct timespec ts;
-
-	sb.sem_num = semIdx;
-	sb.sem_op  = 1;
-	sb.sem_flg = SEM_UNDO;
+	SemOp op = { semIdx, 1 };
 
-	if (semNum < 0 || semNum >= MAX_SEMMASTERS ) {
-		fprintf(stderr, "%s (%d): semNum out of range %d.\n", __FILE__, __LINE__, semNum);
-		return -1;
-	}
-
-	int semId = -1;
-	SemMaster *smp = &semMaster[semNum];
-	if (smp->inUse) {
-		semId = smp->semId;
-	}
-
-	if (semId == -1) {
-		fprintf(stderr, "%s (%d): Could not find semaphore set.\n",	__FILE__, __LINE__);
-		return -1;
-	}
-
-	ts.tv_sec = timeout;
-	ts.tv_nsec = 0;
-	if (semtimedop(semId, &sb, 1, &ts) == -1) {
-		fprintf(stderr, "%s (%d): Could not unlock semaphore number (%d).\n",
-				__FILE__, __LINE__, semIdx);
-		return -1;
-	}
-
-	return 0;
+	return semApply(semNum, &op, 1, timeout);
 }
 #endif		// _GNU_SOURCE
@@ -0,0 +1,411 @@
+
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Hash table kept in a heap made with heapCreate(), usable from every process
+ * that has the heap open.  Keys and values are byte strings copied into the heap.
+ *
+ * Buckets are chains of heap offsets.  A bucket is covered by one of SHASH_LOCKS
+ * stripes, each a robust process-shared mutex and a sequence number the way
+ * striped segments are in mem_utils.c.  Writers take the mutex and make the
+ * sequence number odd while they change a chain, the lock of a writer that died
+ * is recovered.  Lookups take no lock, they walk the chain and retry if the
+ * sequence number moved, so a reader never waits on another reader and a reader
+ * that dies holds nothing.  Entries are allocated and freed outside the locks,
+ * a reader that meets a freed entry is caught by the sequence number.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ipcutils.h"
+
+#define SHASH_MAGIC		0x53484153		// "SHAS"
+#define SHASH_MAX_TRIES	10000			// lock-free lookups before shashGet() takes the lock
+
+typedef struct _shashTable {
+	unsigned int magic;
+	int numBuckets;
+	long count;
+	MemStripe stripes[SHASH_LOCKS];
+	unsigned long buckets[0];	// heap offset of the first entry in each chain
+} ShashTable;
+
+typedef struct _shashEntry {
+	unsigned long next;
+	unsigned long hash;
+	int keyLen;
+	int valLen;
+	char data[0];				// key followed by value
+} ShashEntry;
+
+/*
+ * This function shashHash returns the FNV-1a hash of key.
+ * This function is private to this file.
+ */
+static unsigned long shashHash(const char *key, int keyLen) {
+	unsigned long h = 14695981039346656037UL;
+
+	for (int i = 0; i < keyLen; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
+
+static ShashTable *getTable(int heapNum, unsigned long tblOff) {
+	ShashTable *tp = (ShashTable *)heapPtr(heapNum, tblOff);
+
+	if (tp == NULL || tp->magic != SHASH_MAGIC) {
+		fprintf(stderr, "%s (%d): Offset %lu is not a hash table.\n", __FILE__, __LINE__, tblOff);
+		return NULL;
+	}
+
+	return tp;
+}
+
+/*
+ * This function shashCreate creates or attaches to the hash table in one of the
+ * heap's root slots.  If two processes create it at the same time one table wins
+ * and both get it.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   slot = Heap root slot to keep the table in, see heapSetRoot().
+ *   numBuckets = Number of hash chains, only used when the table is created.
+ *
+ *   returns 0 on error
+ *           else offset of the table used by the other shash functions.
+ */
+unsigned long shashCreate(int heapNum, int slot, int numBuckets) {
+	unsigned long tblOff = heapGetRoot(heapNum, slot);
+	if (tblOff != 0)
+		return tblOff;
+
+	if (numBuckets <= 0) {
+		fprintf(stderr, "%s (%d): numBuckets must be greater than zero.\n", __FILE__, __LINE__);
+		return 0;
+	}
+
+	tblOff = heapAlloc(heapNum, sizeof(ShashTable) + (numBuckets * sizeof(unsigned long)));
+	if (tblOff == 0)
+		return 0;
+
+	ShashTable *tp = (ShashTable *)heapPtr(heapNum, tblOff);
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (int i = 0; i < SHASH_LOCKS; i++) {
+		pthread_mutex_init(&tp->stripes[i].stripeLock, &attr);
+		tp->stripes[i].stripeSeq = 0;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	tp->numBuckets = numBuckets;
+	tp->count = 0;
+	memset(tp->buckets, 0, numBuckets * sizeof(unsigned long));
+	__atomic_store_n(&tp->magic, SHASH_MAGIC, __ATOMIC_RELEASE);
+
+	unsigned long root = heapSetRoot(heapNum, slot, tblOff);
+	if (root != tblOff) {
+		// Someone else published theirs first.
+		tp->magic = 0;
+		heapFree(heapNum, tblOff);
+	}
+
+	return root;
+}
+
+/*
+ * This function lockStripe locks stripe sp for writing and makes its sequence
+ * number odd so lookups retry.  The lock of a process that died holding it is
+ * recovered.
+ * This function is private to this file.
+ *
+ * returns -1 on error
+ *         0 on success
+ */
+static int lockStripe(MemStripe *sp) {
+	int r = pthread_mutex_lock(&sp->stripeLock);
+
+	if (r == EOWNERDEAD) {
+		fprintf(stderr, "%s (%d): Owner of a hash table lock died, recovering it.\n", __FILE__, __LINE__);
+		pthread_mutex_consistent(&sp->stripeLock);
+		// it may have died mid change, leaving the sequence number odd.
+		sp->stripeSeq |= 1;
+		r = 0;
+	} else if (r == 0) {
+		__atomic_store_n(&sp->stripeSeq, sp->stripeSeq + 1, __ATOMIC_RELAXED);
+	}
+
+	if (r != 0) {
+		fprintf(stderr, "%s (%d): Could not lock hash table stripe. errno: %d\n", __FILE__, __LINE__, r);
+		return -1;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * This function unlockStripe undoes lockStripe().
+ * This function is private to this file.
+ */
+static void unlockStripe(MemStripe *sp) {
+	__atomic_store_n(&sp->stripeSeq, sp->stripeSeq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sp->stripeLock);
+}
+
+/*
+ * This function seqGet looks key up in bucket b without a lock and copies its
+ * value into buf.  Entries may be freed and reused under it, so every offset is
+ * checked against the heap before it is used and the walk gives up as soon as
+ * the stripe's sequence number moves.
+ * This function is private to this file.
+ *
+ * returns -2 if a writer got in the way, try again.
+ *         -1 if key was not found.
+ *         else length of the value.
+ */
+static int seqGet(int heapNum, ShashTable *tp, int b, unsigned long h, const char *key, int keyLen,
+		char *buf, int bufLen) {
+	MemStripe *sp = &tp->stripes[b % SHASH_LOCKS];
+	unsigned long seq = __atomic_load_n(&sp->stripeSeq, __ATOMIC_ACQUIRE);
+	unsigned long off;
+	int ret = -1;
+
+	if (seq & 1)
+		return -2;			// writer in progress.
+
+	off = __atomic_load_n(&tp->buckets[b], __ATOMIC_ACQUIRE);
+	while (off != 0) {
+		long size = heapAllocSize(heapNum, off);
+		ShashEntry *ep = (ShashEntry *)heapPtr(heapNum, off);
+		int kl = (size < 0) ? -1 : ep->keyLen;
+		int vl = (size < 0) ? -1 : ep->valLen;
+
+		if (kl < 0 || vl < 0 || (long)sizeof(ShashEntry) + kl + vl > size)
+			return -2;		// freed and reused under us.
+
+		if (ep->hash == h && kl == keyLen && memcmp(ep->data, key, keyLen) == 0) {
+			memcpy(buf, ep->data + keyLen, (vl < bufLen) ? vl : bufLen);
+			ret = vl;
+			break;
+		}
+
+		off = __atomic_load_n(&ep->next, __ATOMIC_ACQUIRE);
+
+		// a reused entry can make a loop, stop as soon as the chain changed.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != __atomic_load_n(&sp->stripeSeq, __ATOMIC_RELAXED))
+			return -2;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (seq != __atomic_load_n(&sp->stripeSeq, __ATOMIC_RELAXED))
+		return -2;
+
+	return ret;
+}
+
+/*
+ * This function findEntry walks the chain at *link for key.
+ * The bucket lock must be held.  This function is private to this file.
+ *
+ *   returns NULL if not found, else the entry and *link is left
+ *           pointing at the offset that refers to it.
+ */
+static ShashEntry *findEntry(int heapNum, unsigned long **link, unsigned long h,
+		const char *key, int keyLen) {
+	while (**link != 0) {
+		ShashEntry *ep = (ShashEntry *)heapPtr(heapNum, **link);
+
+		if (ep->hash == h && ep->keyLen == keyLen && memcmp(ep->data, key, keyLen) == 0)
+			return ep;
+
+		*link = &ep->next;
+	}
+
+	return NULL;
+}
+
+/*
+ * This function shashPut adds key to the table or replaces its value.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   tblOff = Table offset from shashCreate().
+ *   key = Key bytes, keyLen long.
+ *   val = Value bytes, valLen long.
+ *
+ *   returns -1 on error or heap full.
+ *           0 if an existing value was replaced.
+ *           1 if key was added.
+ */
+int shashPut(int heapNum, unsigned long tblOff, const char *key, int keyLen, const char *val, int valLen) {
+	ShashTable *tp = getTable(heapNum, tblOff);
+	if (tp == NULL || keyLen < 0 || valLen < 0)
+		return -1;
+
+	unsigned long off = heapAlloc(heapNum, sizeof(ShashEntry) + keyLen + valLen);
+	if (off == 0)
+		return -1;
+
+	unsigned long h = shashHash(key, keyLen);
+	ShashEntry *np = (ShashEntry *)heapPtr(heapNum, off);
+	np->hash = h;
+	np->keyLen = keyLen;
+	np->valLen = valLen;
+	memcpy(np->data, key, keyLen);
+	memcpy(np->data + keyLen, val, valLen);
+
+	int b = h % tp->numBuckets;
+	MemStripe *sp = &tp->stripes[b % SHASH_LOCKS];
+	unsigned long *link = &tp->buckets[b];
+	unsigned long oldOff = 0;
+
+	if (lockStripe(sp) != 0) {
+		heapFree(heapNum, off);
+		return -1;
+	}
+	ShashEntry *ep = findEntry(heapNum, &link, h, key, keyLen);
+	if (ep != NULL) {
+		np->next = ep->next;
+		oldOff = *link;
+	} else {
+		np->next = 0;
+		__atomic_add_fetch(&tp->count, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(link, off, __ATOMIC_RELEASE);
+	unlockStripe(sp);
+
+	if (oldOff != 0) {
+		heapFree(heapNum, oldOff);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * This function shashGet copies the value of key into buf.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   tblOff = Table offset from shashCreate().
+ *   key = Key bytes, keyLen long.
+ *   buf = Place to copy the value, at most bufLen bytes are copied.
+ *
+ *   returns -1 on error or key not found.
+ *           else length of the value, which may be more than bufLen.
+ */
+int shashGet(int heapNum, unsigned long tblOff, const char *key, int keyLen, char *buf, int bufLen) {
+	ShashTable *tp = getTable(heapNum, tblOff);
+	if (tp == NULL || keyLen < 0)
+		return -1;
+
+	unsigned long h = shashHash(key, keyLen);
+	int b = h % tp->numBuckets;
+
+	for (int tries = 0; tries < SHASH_MAX_TRIES; tries++) {
+		int ret = seqGet(heapNum, tp, b, h, key, keyLen, buf, bufLen);
+		if (ret != -2)
+			return ret;
+	}
+
+	// Writers kept getting in the way, look under the lock.
+	MemStripe *sp = &tp->stripes[b % SHASH_LOCKS];
+	unsigned long *link = &tp->buckets[b];
+	int ret = -1;
+
+	if (lockStripe(sp) != 0)
+		return -1;
+	ShashEntry *ep = findEntry(heapNum, &link, h, key, keyLen);
+	if (ep != NULL) {
+		memcpy(buf, ep->data + keyLen, (ep->valLen < bufLen) ? ep->valLen : bufLen);
+		ret = ep->valLen;
+	}
+	unlockStripe(sp);
+
+	return ret;
+}
+
+/*
+ * This function shashDelete removes key from the table.
+ *
+ *   heapNum = Number from heapGetNum().
+ *   tblOff = Table offset from shashCreate().
+ *   key = Key bytes, keyLen long.
+ *
+ *   returns -1 on error
+ *           0 if key was not found.
+ *           1 if key was removed.
+ */
+int shashDelete(int heapNum, unsigned long tblOff, const char *key, int keyLen) {
+	ShashTable *tp = getTable(heapNum, tblOff);
+	if (tp == NULL || keyLen < 0)
+		return -1;
+
+	unsigned long h = shashHash(key, keyLen);
+	int b = h % tp->numBuckets;
+	MemStripe *sp = &tp->stripes[b % SHASH_LOCKS];
+	unsigned long *link = &tp->buckets[b];
+	unsigned long oldOff = 0;
+
+	if (lockStripe(sp) != 0)
+		return -1;
+	ShashEntry *ep = findEntry(heapNum, &link, h, key, keyLen);
+	if (ep != NULL) {
+		oldOff = *link;
+		__atomic_store_n(link, ep->next, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&tp->count, 1, __ATOMIC_RELAXED);
+	}
+	unlockStripe(sp);
+
+	if (oldOff == 0)
+		return 0;
+
+	heapFree(heapNum, oldOff);
+
+	return 1;
+}
+
+/*
+ * This function shashCount returns the number of keys in the table.
+ *
+ *   returns -1 on error
+ *           else number of keys.
+ */
+long shashCount(int heapNum, unsigned long tblOff) {
+	ShashTable *tp = getTable(heapNum, tblOff);
+	if (tp == NULL)
+		return -1;
+
+	return __atomic_load_n(&tp->count, __ATOMIC_RELAXED);
+}
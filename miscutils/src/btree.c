@@ -0,0 +1,764 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions implement a named B+tree of call records ordered by timestamp.
+ * Nodes are wide (BT_ORDER keys) and the keys of a node are packed together in
+ * one array so a search only touches a few cache lines.  Leaves are chained
+ * together so range scans and ordered walks never go back up the tree.
+ *
+ * Duplicate timestamps are allowed, a record is identified by timestamp plus key.
+ * Readers (btFind, btRange, btForEach, btCount) share a reader-writer lock,
+ * writers take it exclusively.
+ *
+ * Nodes are not merged when they become under full, a node is only freed once it
+ * is empty.  This keeps removal cheap for the usual insert new / expire old pattern.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "miscutils.h"
+
+typedef struct _btNode {
+	int isLeaf;
+	int numKeys;
+	struct _btNode *parent;
+	struct _btNode *next;			// leaf chain, leaves only
+	struct _btNode *prev;
+	time_t keys[BT_ORDER];
+	struct _btNode *child[BT_ORDER + 1];	// inner nodes only
+	BtRecord recs[0];				// leaves only
+} BtNode;
+
+int maxBtrees;
+Btree *btrees = NULL;
+
+pthread_mutex_t createBtreeLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * This function initializes the B+tree array.
+ *
+ *   btreeCnt = max number of named btrees you can have.
+ *
+ *   return -1 on error
+ *          0 on success
+ */
+int btInit(int btreeCnt) {
+	if (btreeCnt <= 0)
+		maxBtrees = MAX_BTREES;
+	else
+		maxBtrees = btreeCnt;
+
+	btrees = (Btree *)calloc(maxBtrees, sizeof (Btree));
+	if (btrees == NULL) {
+		pErr("Can not allocate Btree memory.\n");
+		return -1;
+	}
+
+	Btree *bp = btrees;
+	for (int i = 0; i < maxBtrees; i++, bp++) {
+		if (pthread_rwlock_init(&bp->btreeLock, NULL) != 0) {
+			pErr("Reader-writer lock init failed.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This function getBtree is private to this file.
+ * Validates btNum and returns the Btree entry or NULL.
+ */
+static Btree *getBtree(int btNum) {
+	if (btrees == NULL) {
+		pErr("Must call btInit() first.\n");
+		return NULL;
+	}
+
+	if (btNum < 0 || btNum >= maxBtrees) {
+		pErr("btNum out of range %d.\n", btNum);
+		return NULL;
+	}
+
+	Btree *bp = &btrees[btNum];
+	if (bp->inUse == 0)
+		return NULL;
+
+	return bp;
+}
+
+/*
+ * This function btCreate creates a named B+tree.
+ *
+ *   btName = B+tree name to create.
+ *
+ *   returns -1 on error
+ *           else 0 or greater on success
+ */
+int btCreate(const char *btName) {
+	int ret = -1;
+
+	if (btrees == NULL) {
+		pErr("Must call btInit() first.\n");
+		return ret;
+	}
+
+	if (strlen(btName) > MAX_BTNAME) {
+		pErr("B+tree name is too long, %d max.\n", MAX_BTNAME);
+		return ret;
+	}
+
+	pthread_mutex_lock(&createBtreeLock);
+
+	// Look for empty slot or an exiting entry.
+	int foundIt = -1;
+	int freeSpot = -1;
+	Btree *foundSpot = NULL;
+	Btree *bp = btrees;
+	for (int i = 0; i < maxBtrees; i++, bp++) {
+		if (bp->inUse == 0 && foundSpot == NULL) {
+			foundSpot = bp;
+			freeSpot = i;
+		} else if (bp->inUse == 1 && strcmp(bp->btName, btName) == 0) {
+			// already been created.
+			ret = i;
+			foundIt = i;
+		}
+	}
+
+	if (foundIt == -1) {
+		if (freeSpot == -1) {
+			pErr("No empty slots in Btree array.\n");
+			pthread_mutex_unlock(&createBtreeLock);
+			return ret;
+		}
+
+		foundSpot->inUse = 1;
+		foundSpot->itemCount = 0;
+		foundSpot->root = NULL;
+		strcpy(foundSpot->btName, btName);
+
+		ret = freeSpot;
+	}
+
+	pthread_mutex_unlock(&createBtreeLock);
+
+	return ret;
+}
+
+/*
+ * This function btGetNum returns the btNum for the given name.
+ *
+ *   btName = B+tree name to look for.
+ *
+ *   returns -1 if not found
+ *           else 0 or greater
+ */
+int btGetNum(const char *btName) {
+	if (btrees == NULL) {
+		pErr("Must call btInit() first.\n");
+		return -1;
+	}
+
+	Btree *bp = btrees;
+	for (int i = 0; i < maxBtrees; i++, bp++) {
+		if (bp->inUse == 1 && strcmp(bp->btName, btName) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+char *btGetName(int btNum) {
+	Btree *bp = getBtree(btNum);
+
+	return (bp == NULL) ? NULL : bp->btName;
+}
+
+/*
+ * These two functions are private to this file.
+ * lowerIdx returns the first index whose key is >= ts,
+ * upperIdx returns the first index whose key is > ts.
+ */
+static int lowerIdx(BtNode *n, time_t ts) {
+	int lo = 0;
+	int hi = n->numKeys;
+
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (n->keys[mid] < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int upperIdx(BtNode *n, time_t ts) {
+	int lo = 0;
+	int hi = n->numKeys;
+
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (n->keys[mid] <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static BtNode *newNode(int isLeaf) {
+	size_t size = sizeof(BtNode);
+
+	if (isLeaf)
+		size += BT_ORDER * sizeof(BtRecord);
+
+	BtNode *n = (BtNode *)calloc(1, size);
+	if (n == NULL) {
+		pErr("Can not allocate B+tree node.\n");
+		return NULL;
+	}
+
+	n->isLeaf = isLeaf;
+
+	return n;
+}
+
+/*
+ * This function childIdx is private to this file.
+ * Returns the index of child c within its parent.
+ */
+static int childIdx(BtNode *p, BtNode *c) {
+	for (int i = 0; i <= p->numKeys; i++) {
+		if (p->child[i] == c)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * This function insertParent is private to this file.
+ * Places sep and right into the parent of left after a split,
+ * splitting the parent as needed.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int insertParent(Btree *bp, BtNode *left, time_t sep, BtNode *right) {
+	BtNode *p = left->parent;
+
+	if (p == NULL) {
+		BtNode *root = newNode(0);
+		if (root == NULL)
+			return -1;
+
+		root->numKeys = 1;
+		root->keys[0] = sep;
+		root->child[0] = left;
+		root->child[1] = right;
+		left->parent = root;
+		right->parent = root;
+		bp->root = root;
+		return 0;
+	}
+
+	int idx = childIdx(p, left);
+
+	if (p->numKeys < BT_ORDER) {
+		memmove(&p->keys[idx + 1], &p->keys[idx], (p->numKeys - idx) * sizeof(time_t));
+		memmove(&p->child[idx + 2], &p->child[idx + 1], (p->numKeys - idx) * sizeof(BtNode *));
+		p->keys[idx] = sep;
+		p->child[idx + 1] = right;
+		right->parent = p;
+		p->numKeys++;
+		return 0;
+	}
+
+	// Parent is full, split it around the middle key.
+	time_t keys[BT_ORDER + 1];
+	BtNode *child[BT_ORDER + 2];
+
+	memcpy(keys, p->keys, idx * sizeof(time_t));
+	keys[idx] = sep;
+	memcpy(&keys[idx + 1], &p->keys[idx], (BT_ORDER - idx) * sizeof(time_t));
+
+	memcpy(child, p->child, (idx + 1) * sizeof(BtNode *));
+	child[idx + 1] = right;
+	memcpy(&child[idx + 2], &p->child[idx + 1], (BT_ORDER - idx) * sizeof(BtNode *));
+
+	BtNode *np = newNode(0);
+	if (np == NULL)
+		return -1;
+
+	int total = BT_ORDER + 1;
+	int mid = total / 2;
+
+	p->numKeys = mid;
+	memcpy(p->keys, keys, mid * sizeof(time_t));
+	memcpy(p->child, child, (mid + 1) * sizeof(BtNode *));
+	for (int i = 0; i <= mid; i++)
+		p->child[i]->parent = p;
+
+	np->numKeys = total - mid - 1;
+	memcpy(np->keys, &keys[mid + 1], np->numKeys * sizeof(time_t));
+	memcpy(np->child, &child[mid + 1], (np->numKeys + 1) * sizeof(BtNode *));
+	for (int i = 0; i <= np->numKeys; i++)
+		np->child[i]->parent = np;
+
+	return insertParent(bp, p, keys[mid], np);
+}
+
+/*
+ * This function btInsert adds a record to the B+tree.
+ * Records with the same timestamp are kept in insertion order.
+ *
+ *   btNum = Number returned by btCreate()
+ *   key = key string, MAX_KEY_SIZE max.
+ *   callType = 'V'oice or 'S'MS
+ *   timestamp = time used to order the record.
+ *
+ *   return -1 on error
+ *          0 on success
+ */
+int btInsert(int btNum, const char *key, char callType, time_t timestamp) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	if (strlen(key) > MAX_KEY_SIZE) {
+		pErr("Key is too long, %d max.\n", MAX_KEY_SIZE);
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&bp->btreeLock);
+
+	if (bp->root == NULL) {
+		bp->root = newNode(1);
+		if (bp->root == NULL) {
+			pthread_rwlock_unlock(&bp->btreeLock);
+			return -1;
+		}
+	}
+
+	BtNode *n = bp->root;
+	while (n->isLeaf == 0)
+		n = n->child[upperIdx(n, timestamp)];
+
+	int pos = upperIdx(n, timestamp);
+
+	if (n->numKeys == BT_ORDER) {
+		// Leaf is full, move the upper half into a new leaf.
+		BtNode *nl = newNode(1);
+		if (nl == NULL) {
+			pthread_rwlock_unlock(&bp->btreeLock);
+			return -1;
+		}
+
+		int mid = BT_ORDER / 2;
+		nl->numKeys = BT_ORDER - mid;
+		memcpy(nl->keys, &n->keys[mid], nl->numKeys * sizeof(time_t));
+		memcpy(nl->recs, &n->recs[mid], nl->numKeys * sizeof(BtRecord));
+		n->numKeys = mid;
+
+		nl->next = n->next;
+		nl->prev = n;
+		if (n->next != NULL)
+			n->next->prev = nl;
+		n->next = nl;
+
+		if (insertParent(bp, n, nl->keys[0], nl) != 0) {
+			pthread_rwlock_unlock(&bp->btreeLock);
+			return -1;
+		}
+
+		if (pos > mid) {
+			n = nl;
+			pos -= mid;
+		}
+	}
+
+	memmove(&n->keys[pos + 1], &n->keys[pos], (n->numKeys - pos) * sizeof(time_t));
+	memmove(&n->recs[pos + 1], &n->recs[pos], (n->numKeys - pos) * sizeof(BtRecord));
+
+	n->keys[pos] = timestamp;
+	BtRecord *rp = &n->recs[pos];
+	strcpy(rp->key, key);
+	rp->call_type = callType;
+	rp->timestamp = timestamp;
+	n->numKeys++;
+
+	bp->itemCount++;
+
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return 0;
+}
+
+/*
+ * This function seekLeaf is private to this file.
+ * Finds the first record with a timestamp >= ts.
+ *
+ *   returns leaf and sets *pos, or NULL if there is no such record.
+ */
+static BtNode *seekLeaf(Btree *bp, time_t ts, int *pos) {
+	BtNode *n = bp->root;
+	if (n == NULL)
+		return NULL;
+
+	while (n->isLeaf == 0)
+		n = n->child[lowerIdx(n, ts)];
+
+	int i = lowerIdx(n, ts);
+	while (n != NULL && i >= n->numKeys) {
+		n = n->next;
+		i = 0;
+	}
+
+	*pos = i;
+
+	return n;
+}
+
+/*
+ * This function findRec is private to this file.
+ * Finds the record matching timestamp and key, key NULL matches any key.
+ */
+static BtNode *findRec(Btree *bp, const char *key, time_t timestamp, int *pos) {
+	int i = 0;
+	BtNode *n = seekLeaf(bp, timestamp, &i);
+
+	for (; n != NULL; n = n->next, i = 0) {
+		for (; i < n->numKeys; i++) {
+			if (n->keys[i] != timestamp)
+				return NULL;
+
+			if (key == NULL || strcmp(n->recs[i].key, key) == 0) {
+				*pos = i;
+				return n;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * This function btFind looks up a record.
+ *
+ *   btNum = Number returned by btCreate()
+ *   key = key to find, NULL matches the first record with timestamp.
+ *   timestamp = timestamp of the record.
+ *   rec = place to copy record into, can be NULL.
+ *
+ *   returns 1 if found
+ *           0 if not found
+ *           -1 on error
+ */
+int btFind(int btNum, const char *key, time_t timestamp, BtRecord *rec) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	int ret = 0;
+	int pos = 0;
+
+	pthread_rwlock_rdlock(&bp->btreeLock);
+
+	BtNode *n = findRec(bp, key, timestamp, &pos);
+	if (n != NULL) {
+		if (rec != NULL)
+			memcpy(rec, &n->recs[pos], sizeof(BtRecord));
+		ret = 1;
+	}
+
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return ret;
+}
+
+/*
+ * This function removeNode is private to this file.
+ * Frees an empty node and removes it from its parent, parents
+ * left without children are removed as well.
+ */
+static void removeNode(Btree *bp, BtNode *n) {
+	BtNode *p = n->parent;
+
+	if (n->isLeaf) {
+		if (n->prev != NULL)
+			n->prev->next = n->next;
+		if (n->next != NULL)
+			n->next->prev = n->prev;
+	}
+
+	if (p == NULL) {
+		free(n);
+		bp->root = NULL;
+		return;
+	}
+
+	int idx = childIdx(p, n);
+	free(n);
+
+	if (p->numKeys == 0) {
+		// n was the only child.
+		removeNode(bp, p);
+		return;
+	}
+
+	int keyIdx = (idx > 0) ? idx - 1 : 0;
+
+	memmove(&p->keys[keyIdx], &p->keys[keyIdx + 1], (p->numKeys - keyIdx - 1) * sizeof(time_t));
+	memmove(&p->child[idx], &p->child[idx + 1], (p->numKeys - idx) * sizeof(BtNode *));
+	p->numKeys--;
+
+	// Shrink the tree while the root only has one child.
+	while (bp->root->isLeaf == 0 && bp->root->numKeys == 0) {
+		BtNode *r = bp->root;
+		bp->root = r->child[0];
+		bp->root->parent = NULL;
+		free(r);
+	}
+}
+
+/*
+ * This function removeAt is private to this file.
+ * Removes cnt records starting at pos from leaf n.
+ */
+static void removeAt(Btree *bp, BtNode *n, int pos, int cnt) {
+	memmove(&n->keys[pos], &n->keys[pos + cnt], (n->numKeys - pos - cnt) * sizeof(time_t));
+	memmove(&n->recs[pos], &n->recs[pos + cnt], (n->numKeys - pos - cnt) * sizeof(BtRecord));
+	n->numKeys -= cnt;
+	bp->itemCount -= cnt;
+
+	if (n->numKeys == 0)
+		removeNode(bp, n);
+}
+
+/*
+ * This function btRemove removes a record from the B+tree.
+ *
+ *   btNum = Number returned by btCreate()
+ *   key = key of record to remove, NULL removes the first record with timestamp.
+ *   timestamp = timestamp of the record.
+ *
+ *   returns -1 on error or not found
+ *           0 on success
+ */
+int btRemove(int btNum, const char *key, time_t timestamp) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	int ret = -1;
+	int pos = 0;
+
+	pthread_rwlock_wrlock(&bp->btreeLock);
+
+	BtNode *n = findRec(bp, key, timestamp, &pos);
+	if (n != NULL) {
+		removeAt(bp, n, pos, 1);
+		ret = 0;
+	}
+
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return ret;
+}
+
+/*
+ * This function btRemoveExpired removes all records older than before.
+ *
+ *   btNum = Number returned by btCreate()
+ *   before = records with a timestamp less than this are removed.
+ *
+ *   returns -1 on error
+ *           else number of records removed.
+ */
+int btRemoveExpired(int btNum, time_t before) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	int removed = 0;
+
+	pthread_rwlock_wrlock(&bp->btreeLock);
+
+	while (bp->root != NULL) {
+		BtNode *n = bp->root;
+		while (n->isLeaf == 0)
+			n = n->child[0];
+
+		int cnt = lowerIdx(n, before);
+		if (cnt == 0)
+			break;
+
+		int whole = (cnt == n->numKeys);
+		removed += cnt;
+		removeAt(bp, n, 0, cnt);
+
+		if (whole == 0)
+			break;
+	}
+
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return removed;
+}
+
+/*
+ * This function btRange calls cb for each record with a timestamp
+ * between from and to inclusive, in timestamp order.
+ * The B+tree is read locked during the walk so cb must not modify it.
+ *
+ *   btNum = Number returned by btCreate()
+ *   from = first timestamp
+ *   to = last timestamp
+ *   cb = function to call, return non-zero to stop.
+ *   arg = passed to cb.
+ *
+ *   returns -1 on error
+ *           else number of records passed to cb.
+ */
+int btRange(int btNum, time_t from, time_t to, BtCallback cb, void *arg) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	int cnt = 0;
+	int i = 0;
+
+	pthread_rwlock_rdlock(&bp->btreeLock);
+
+	BtNode *n = seekLeaf(bp, from, &i);
+	for (; n != NULL; n = n->next, i = 0) {
+		for (; i < n->numKeys; i++) {
+			if (n->keys[i] > to)
+				goto done;
+
+			cnt++;
+			if (cb(&n->recs[i], arg) != 0)
+				goto done;
+		}
+	}
+
+done:
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return cnt;
+}
+
+/*
+ * This function btForEach calls cb for every record in timestamp order.
+ * See btRange() for details.
+ */
+int btForEach(int btNum, BtCallback cb, void *arg) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	int cnt = 0;
+
+	pthread_rwlock_rdlock(&bp->btreeLock);
+
+	BtNode *n = bp->root;
+	if (n != NULL) {
+		while (n->isLeaf == 0)
+			n = n->child[0];
+	}
+
+	for (; n != NULL; n = n->next) {
+		for (int i = 0; i < n->numKeys; i++) {
+			cnt++;
+			if (cb(&n->recs[i], arg) != 0)
+				goto done;
+		}
+	}
+
+done:
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return cnt;
+}
+
+/*
+ * This function btCount return the number of records in the named B+tree.
+ *
+ *   btNum = Number returned by btCreate()
+ *
+ *   returns number records in B+tree.
+ */
+int btCount(int btNum) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return 0;
+
+	pthread_rwlock_rdlock(&bp->btreeLock);
+
+	int count = bp->itemCount;
+
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return count;
+}
+
+static void freeNode(BtNode *n) {
+	if (n->isLeaf == 0) {
+		for (int i = 0; i <= n->numKeys; i++)
+			freeNode(n->child[i]);
+	}
+
+	free(n);
+}
+
+/* This function btDestroy frees up the memory used by the given named B+tree.
+ *
+ *   btNum = Number returned by btCreate()
+ *
+ *   return -1 on error
+ *          else 0 on success
+ */
+int btDestroy(int btNum) {
+	Btree *bp = getBtree(btNum);
+	if (bp == NULL)
+		return -1;
+
+	pthread_rwlock_wrlock(&bp->btreeLock);
+
+	if (bp->root != NULL)
+		freeNode(bp->root);
+
+	bp->root = NULL;
+	bp->itemCount = 0;
+	bp->inUse = 0;
+
+	pthread_rwlock_unlock(&bp->btreeLock);
+
+	return 0;
+}
@@ -0,0 +1,815 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions implement a TCP event loop, one thread serving many connections.
+ * Sockets are non-blocking and registered once with epoll, edge triggered, for both
+ * reading and writing.  On a read event everything the socket holds is read into
+ * the connection's read buffer and handed to the read callback, which says how many
+ * bytes it used.  It is called again with the rest until it uses none, what is
+ * left is kept for the next event.  evSend() writes straight to the socket and
+ * queues whatever does not fit, the queue is written out when the socket becomes
+ * writable again.
+ *
+ * Timers are kept in a heap ordered by due time, epoll_wait() sleeps until the
+ * first one is due.  Connections closed during a batch of events are freed once
+ * the batch is done, so a later event in the same batch never sees freed memory.
+ *
+ * evRunThreads() runs one loop per CPU the process may use, each with its own
+ * SO_REUSEPORT listening socket on the same port so the kernel spreads new
+ * connections over the loops.
+ */
+
+#define _GNU_SOURCE		// accept4(), pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "miscutils.h"
+
+#define EV_LISTEN	1
+#define EV_CONN		2
+#define EV_WAKE		3
+
+#define EV_BATCH		256				// events per epoll_wait()
+#define EV_READ_SIZE	(16 * 1024)		// read buffer grows by this much
+#define EV_MAX_READ		(1024 * 1024)	// default most a connection may buffer
+
+struct _evConn {
+	int type;					// EV_CONN, must be first
+	int sock;
+	EvLoop *loop;
+	void *data;					// set by evConnSetData()
+	char *rbuf;
+	int rlen;
+	int rsize;
+	char *wbuf;
+	int wlen;
+	int wsize;
+	int closed;
+	struct _evConn *prev;		// open connections of the loop
+	struct _evConn *next;
+	struct _evConn *nextFree;	// connections closed in this batch
+};
+
+typedef struct _evListener {
+	int type;					// EV_LISTEN
+	int sock;
+} EvListener;
+
+typedef struct _evTimer {
+	unsigned long due;			// CLOCK_MONOTONIC milliseconds
+	int id;
+	int interval;				// 0 for a one shot timer
+	EvTimerCb cb;
+	void *arg;
+} EvTimer;
+
+struct _evLoop {
+	int epfd;
+	int wakeFd;
+	int wakeType;				// EV_WAKE, points epoll at this
+	volatile int stop;
+	int numConns;
+	int maxConns;
+	int maxRead;				// most bytes a connection may buffer, see evSetMaxRead()
+	EvListener listener;
+	EvAcceptCb acceptCb;
+	EvReadCb readCb;
+	EvCloseCb closeCb;
+	void *arg;
+	EvTimer *timers;			// heap, earliest first
+	int numTimers;
+	int maxTimers;
+	int nextTimerId;
+	EvConn *conns;				// open connections
+	EvConn *freeList;
+};
+
+/*
+ * This function nowMs returns CLOCK_MONOTONIC in milliseconds.
+ * This function is private to this file.
+ */
+static unsigned long nowMs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000UL) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * This function evCreate creates an event loop.  The open file limit is raised
+ * toward maxConns if the hard limit allows it.
+ *
+ *   maxConns = Most connections the loop will hold, more are closed on accept.
+ *
+ *   returns NULL on error
+ *           else the loop.
+ */
+EvLoop *evCreate(int maxConns) {
+	struct rlimit rl;
+	struct epoll_event ev;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)maxConns + 64) {
+		rl.rlim_cur = ((rlim_t)maxConns + 64 < rl.rlim_max) ? (rlim_t)maxConns + 64 : rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	EvLoop *loop = (EvLoop *)calloc(1, sizeof(EvLoop));
+	loop->maxConns = maxConns;
+	loop->maxRead = EV_MAX_READ;
+	loop->listener.type = EV_LISTEN;
+	loop->listener.sock = -1;
+	loop->wakeType = EV_WAKE;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->epfd == -1 || loop->wakeFd == -1) {
+		pErr("epoll_create1() or eventfd() failed. %s\n", strerror(errno));
+		evDestroy(loop);
+		return NULL;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop->wakeType;
+	epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakeFd, &ev);
+
+	return loop;
+}
+
+/*
+ * This function evSetCallbacks sets the functions called by the loop.
+ *
+ *   acceptCb = Called for each new connection, may be NULL.
+ *   readCb = Called with the unused bytes read so far, returns how many it used
+ *            or -1 to close the connection.  It is called again while it uses some.
+ *   closeCb = Called before a connection is freed, may be NULL.
+ *   arg = Passed to each callback.
+ */
+void evSetCallbacks(EvLoop *loop, EvAcceptCb acceptCb, EvReadCb readCb, EvCloseCb closeCb, void *arg) {
+	loop->acceptCb = acceptCb;
+	loop->readCb = readCb;
+	loop->closeCb = closeCb;
+	loop->arg = arg;
+}
+
+/*
+ * This function evSetMaxRead sets the most bytes a connection may have read and
+ * not yet used by the read callback, EV_MAX_READ unless set.  A connection whose
+ * callback will not take any of a full buffer is closed.
+ */
+void evSetMaxRead(EvLoop *loop, int maxRead) {
+	loop->maxRead = (maxRead < EV_READ_SIZE) ? EV_READ_SIZE : maxRead;
+}
+
+/*
+ * This function evListen creates the loop's non-blocking listening socket, as
+ * tcpServer() does.
+ *
+ *   port = Port number to listen on.
+ *   maxPending = Max number of pending connections.
+ *   reusePort = 1 to set SO_REUSEPORT so other loops can listen on the same port.
+ *
+ *   returns -1 if socket create failed.
+ *           -2 setsockopt failed.
+ *           -3 if bind fails.
+ *           else the listening socket.
+ */
+int evListen(EvLoop *loop, int port, int maxPending, int reusePort) {
+	struct sockaddr_in servAddr;
+	struct epoll_event ev;
+	int num = 1;
+
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (sock < 0) {
+		pErr("socket failed.\n");
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &num, sizeof(int)) == -1 ||
+			(reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &num, sizeof(int)) == -1)) {
+		pErr("Error setting socket options: %d\n", errno);
+		close(sock);
+		return -2;
+	}
+
+	memset(&servAddr, 0, sizeof(servAddr));
+	servAddr.sin_family = AF_INET;
+	servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servAddr.sin_port = htons(port);
+
+	if (bind(sock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0) {
+		pErr("bind failed. %s\n", strerror(errno));
+		close(sock);
+		return -3;
+	}
+
+	listen(sock, (maxPending <= 0) ? SOMAXCONN : maxPending);
+
+	loop->listener.sock = sock;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &loop->listener;
+	epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev);
+
+	return sock;
+}
+
+/*
+ * This function evAddConn hands a connected socket to the loop, for example one
+ * from tcpConnect().  The socket is made non-blocking.
+ *
+ *   returns NULL on error
+ *           else the connection.
+ */
+EvConn *evAddConn(EvLoop *loop, int sock) {
+	struct epoll_event ev;
+	int num = 1;
+
+	if (loop->numConns >= loop->maxConns) {
+		pErr("Loop is full, %d connections.\n", loop->maxConns);
+		return NULL;
+	}
+
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &num, sizeof(num));
+
+	EvConn *conn = (EvConn *)calloc(1, sizeof(EvConn));
+	conn->type = EV_CONN;
+	conn->sock = sock;
+	conn->loop = loop;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		pErr("epoll_ctl() failed. %s\n", strerror(errno));
+		free(conn);
+		return NULL;
+	}
+	loop->numConns++;
+
+	conn->next = loop->conns;
+	if (loop->conns != NULL)
+		loop->conns->prev = conn;
+	loop->conns = conn;
+
+	if (loop->acceptCb != NULL)
+		loop->acceptCb(conn, loop->arg);
+
+	return conn;
+}
+
+/*
+ * This function evCloseConn closes a connection, anything still queued to send
+ * is dropped.  The connection is freed after the current batch of events.
+ */
+void evCloseConn(EvConn *conn) {
+	if (conn->closed)
+		return;
+
+	EvLoop *loop = conn->loop;
+
+	if (loop->closeCb != NULL)
+		loop->closeCb(conn, loop->arg);
+
+	conn->closed = 1;
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	close(conn->sock);
+	loop->numConns--;
+
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		loop->conns = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	conn->nextFree = loop->freeList;
+	loop->freeList = conn;
+}
+
+/*
+ * This function flushConn writes queued bytes until the socket is full.
+ * This function is private to this file.
+ *
+ *   returns -1 if the connection failed.
+ *           else bytes still queued.
+ */
+static int flushConn(EvConn *conn) {
+	int off = 0;
+
+	while (off < conn->wlen) {
+		int r = send(conn->sock, conn->wbuf + off, conn->wlen - off, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		off += r;
+	}
+
+	conn->wlen -= off;
+	if (off > 0 && conn->wlen > 0)
+		memmove(conn->wbuf, conn->wbuf + off, conn->wlen);
+
+	return conn->wlen;
+}
+
+/*
+ * This function evSend sends len bytes, whatever the socket will not take now is
+ * queued and sent as soon as it is writable.  Bytes are never sent out of order.
+ *
+ *   returns -1 on error, the connection is closed.
+ *           else number of bytes queued, not yet sent.
+ */
+int evSend(EvConn *conn, const char *data, int len) {
+	int off = 0;
+
+	if (conn->closed)
+		return -1;
+
+	if (conn->wlen == 0) {
+		while (off < len) {
+			int r = send(conn->sock, data + off, len - off, MSG_NOSIGNAL);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				evCloseConn(conn);
+				return -1;
+			}
+			off += r;
+		}
+	}
+
+	if (off < len) {
+		int need = conn->wlen + (len - off);
+		if (need > conn->wsize) {
+			conn->wsize = (need > conn->wsize * 2) ? need : conn->wsize * 2;
+			conn->wbuf = (char *)realloc(conn->wbuf, conn->wsize);
+		}
+		memcpy(conn->wbuf + conn->wlen, data + off, len - off);
+		conn->wlen = need;
+	}
+
+	return conn->wlen;
+}
+
+/*
+ * This function feedConn passes the bytes read to the read callback until it
+ * has used them all or takes no more, so every whole request a client sent
+ * together is answered without waiting for another read event.
+ * This function is private to this file.
+ *
+ *   returns -1 if the connection was closed
+ *           0 on success
+ */
+static int feedConn(EvLoop *loop, EvConn *conn) {
+	while (conn->rlen > 0 && conn->closed == 0 && loop->readCb != NULL) {
+		int used = loop->readCb(conn, conn->rbuf, conn->rlen, loop->arg);
+
+		if (used < 0) {
+			evCloseConn(conn);
+			break;
+		}
+		if (used == 0 || conn->closed)
+			break;
+
+		conn->rlen -= (used < conn->rlen) ? used : conn->rlen;
+		memmove(conn->rbuf, conn->rbuf + used, conn->rlen);
+	}
+
+	return conn->closed ? -1 : 0;
+}
+
+/*
+ * This function readConn reads everything the socket holds and passes it to
+ * the read callback.  The buffer grows up to the loop's maxRead, past that the
+ * callback is given what is there to make room, and if it takes none the
+ * connection is closed.  This function is private to this file.
+ */
+static void readConn(EvLoop *loop, EvConn *conn) {
+	int eof = 0;
+
+	while (conn->closed == 0) {
+		if (conn->rsize - conn->rlen < EV_READ_SIZE / 4) {
+			if (conn->rsize >= loop->maxRead) {
+				if (feedConn(loop, conn) == -1)
+					return;
+				if (conn->rsize - conn->rlen < EV_READ_SIZE / 4) {
+					pErr("Connection %d sent more than %d bytes the callback would not take.\n",
+							conn->sock, loop->maxRead);
+					evCloseConn(conn);
+					return;
+				}
+			} else {
+				conn->rsize += EV_READ_SIZE;
+				if (conn->rsize > loop->maxRead)
+					conn->rsize = loop->maxRead;
+				conn->rbuf = (char *)realloc(conn->rbuf, conn->rsize);
+			}
+		}
+
+		int r = recv(conn->sock, conn->rbuf + conn->rlen, conn->rsize - conn->rlen, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				eof = 1;
+			break;
+		}
+		if (r == 0) {
+			eof = 1;
+			break;
+		}
+		conn->rlen += r;
+
+		if (r < conn->rsize - (conn->rlen - r))
+			break;			// drained, saves a recv() that would only say EAGAIN
+	}
+
+	if (feedConn(loop, conn) == -1)
+		return;
+
+	if (eof)
+		evCloseConn(conn);
+}
+
+/*
+ * This function acceptConns accepts every pending connection.
+ * This function is private to this file.
+ */
+static void acceptConns(EvLoop *loop) {
+	while (1) {
+		int sock = accept4(loop->listener.sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pErr("accept failed. %s\n", strerror(errno));
+			break;
+		}
+
+		if (evAddConn(loop, sock) == NULL)
+			close(sock);
+	}
+}
+
+/*
+ * Timer heap helpers.  These functions are private to this file.
+ */
+static void timerSwap(EvLoop *loop, int a, int b) {
+	EvTimer t = loop->timers[a];
+	loop->timers[a] = loop->timers[b];
+	loop->timers[b] = t;
+}
+
+static void timerUp(EvLoop *loop, int i) {
+	while (i > 0 && loop->timers[(i - 1) / 2].due > loop->timers[i].due) {
+		timerSwap(loop, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timerDown(EvLoop *loop, int i) {
+	while (1) {
+		int l = (2 * i) + 1;
+		int m = i;
+
+		if (l < loop->numTimers && loop->timers[l].due < loop->timers[m].due)
+			m = l;
+		if (l + 1 < loop->numTimers && loop->timers[l + 1].due < loop->timers[m].due)
+			m = l + 1;
+		if (m == i)
+			break;
+		timerSwap(loop, i, m);
+		i = m;
+	}
+}
+
+static void timerRemoveAt(EvLoop *loop, int i) {
+	loop->numTimers--;
+	if (i < loop->numTimers) {
+		loop->timers[i] = loop->timers[loop->numTimers];
+		timerDown(loop, i);
+		timerUp(loop, i);
+	}
+}
+
+/*
+ * This function evTimer calls cb after ms milliseconds, from the loop's thread.
+ *
+ *   ms = Delay in milliseconds.
+ *   repeat = 1 to call cb every ms milliseconds until evCancelTimer().
+ *
+ *   returns timer id for evCancelTimer().
+ */
+int evTimer(EvLoop *loop, int ms, int repeat, EvTimerCb cb, void *arg) {
+	if (loop->numTimers == loop->maxTimers) {
+		loop->maxTimers = (loop->maxTimers == 0) ? 16 : loop->maxTimers * 2;
+		loop->timers = (EvTimer *)realloc(loop->timers, loop->maxTimers * sizeof(EvTimer));
+	}
+
+	EvTimer *t = &loop->timers[loop->numTimers];
+	t->due = nowMs() + ms;
+	t->id = ++loop->nextTimerId;
+	t->interval = repeat ? ms : 0;
+	t->cb = cb;
+	t->arg = arg;
+	timerUp(loop, loop->numTimers++);
+
+	return loop->nextTimerId;
+}
+
+/*
+ * This function evCancelTimer stops a timer.
+ *
+ *   returns 0 if the timer was not found.
+ *           1 if it was cancelled.
+ */
+int evCancelTimer(EvLoop *loop, int id) {
+	for (int i = 0; i < loop->numTimers; i++) {
+		if (loop->timers[i].id == id) {
+			timerRemoveAt(loop, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This function runTimers calls every timer that is due and returns how long
+ * epoll_wait() may sleep.  This function is private to this file.
+ */
+static int runTimers(EvLoop *loop) {
+	unsigned long now = nowMs();
+
+	while (loop->numTimers > 0 && loop->timers[0].due <= now) {
+		EvTimer t = loop->timers[0];
+
+		if (t.interval > 0) {
+			loop->timers[0].due = now + t.interval;
+			timerDown(loop, 0);
+		} else {
+			timerRemoveAt(loop, 0);
+		}
+		t.cb(loop, t.arg);
+	}
+
+	if (loop->numTimers == 0)
+		return -1;
+
+	return (int)(loop->timers[0].due - now);
+}
+
+/*
+ * This function freeConns frees the connections closed since the last call.
+ * This function is private to this file.
+ */
+static void freeConns(EvLoop *loop) {
+	while (loop->freeList != NULL) {
+		EvConn *conn = loop->freeList;
+		loop->freeList = conn->nextFree;
+		free(conn->rbuf);
+		free(conn->wbuf);
+		free(conn);
+	}
+}
+
+/*
+ * This function evRun handles events until evStop() is called.
+ *
+ *   returns -1 on error
+ *           0 when stopped.
+ */
+int evRun(EvLoop *loop) {
+	struct epoll_event events[EV_BATCH];
+
+	while (loop->stop == 0) {
+		int n = epoll_wait(loop->epfd, events, EV_BATCH, runTimers(loop));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pErr("epoll_wait() failed. %s\n", strerror(errno));
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++) {
+			int type = *(int *)events[i].data.ptr;
+
+			if (type == EV_LISTEN) {
+				acceptConns(loop);
+			} else if (type == EV_WAKE) {
+				uint64_t v;
+				if (read(loop->wakeFd, &v, sizeof(v)) < 0) { }
+			} else {
+				EvConn *conn = (EvConn *)events[i].data.ptr;
+				uint32_t e = events[i].events;
+
+				if (conn->closed)
+					continue;
+				if (e & EPOLLOUT && conn->wlen > 0 && flushConn(conn) < 0) {
+					evCloseConn(conn);
+					continue;
+				}
+				if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					readConn(loop, conn);
+			}
+		}
+
+		freeConns(loop);
+	}
+
+	return 0;
+}
+
+/*
+ * This function evStop makes evRun() return, it may be called from any thread.
+ */
+void evStop(EvLoop *loop) {
+	uint64_t v = 1;
+
+	loop->stop = 1;
+	if (write(loop->wakeFd, &v, sizeof(v)) < 0) { }
+}
+
+/*
+ * This function evDestroy closes every connection and frees the loop.
+ */
+void evDestroy(EvLoop *loop) {
+	if (loop == NULL)
+		return;
+
+	while (loop->conns != NULL)
+		evCloseConn(loop->conns);
+	freeConns(loop);
+
+	if (loop->listener.sock != -1)
+		close(loop->listener.sock);
+	if (loop->wakeFd != -1)
+		close(loop->wakeFd);
+	if (loop->epfd != -1)
+		close(loop->epfd);
+	free(loop->timers);
+	free(loop);
+}
+
+int evConnSock(EvConn *conn) {
+	return conn->sock;
+}
+
+EvLoop *evConnLoop(EvConn *conn) {
+	return conn->loop;
+}
+
+void *evConnData(EvConn *conn) {
+	return conn->data;
+}
+
+void evConnSetData(EvConn *conn, void *data) {
+	conn->data = data;
+}
+
+/*
+ * This function evConnPending returns the bytes queued by evSend() not yet sent.
+ */
+int evConnPending(EvConn *conn) {
+	return conn->wlen;
+}
+
+typedef struct _evThread {
+	pthread_t tid;
+	int idx;
+	int cpu;					// the loop is pinned to
+	int port;
+	int maxPending;
+	int maxConns;
+	EvSetupCb setup;
+	void *arg;
+	int ret;
+} EvThread;
+
+/*
+ * This function evThread runs one loop of evRunThreads(), pinned to a CPU.
+ * This function is private to this file.
+ */
+static void *evThread(void *p) {
+	EvThread *et = (EvThread *)p;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(et->cpu, &cpus);
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (r != 0)
+		pErr("Could not pin loop %d to CPU %d, it runs unpinned. %s\n", et->idx, et->cpu, strerror(r));
+
+	EvLoop *loop = evCreate(et->maxConns);
+	if (loop == NULL || evListen(loop, et->port, et->maxPending, 1) < 0) {
+		evDestroy(loop);
+		et->ret = -1;
+		return NULL;
+	}
+
+	et->setup(loop, et->idx, et->arg);
+	et->ret = evRun(loop);
+	evDestroy(loop);
+
+	return NULL;
+}
+
+/*
+ * This function evRunThreads runs numLoops event loops, each in a thread with its
+ * own SO_REUSEPORT listening socket on port, pinned in turn to the CPUs this
+ * process may run on.  setup is called in each thread to set the loop's callbacks,
+ * keep the loop to evStop() it.
+ * Returns once every loop has stopped.
+ *
+ *   numLoops = Loops to run, 0 for one per online CPU.
+ *   maxConns = Most connections per loop.
+ *
+ *   returns -1 if any loop failed to start or run.
+ *           0 on success
+ */
+int evRunThreads(int port, int maxPending, int numLoops, int maxConns, EvSetupCb setup, void *arg) {
+	int ret = 0;
+
+	if (numLoops <= 0)
+		numLoops = sysconf(_SC_NPROCESSORS_ONLN);
+
+	cpu_set_t allowed;
+	int cpuList[CPU_SETSIZE];
+	int numCpus = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int c = 0; c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &allowed))
+				cpuList[numCpus++] = c;
+		}
+	}
+	if (numCpus == 0)
+		cpuList[numCpus++] = 0;
+
+	EvThread *threads = (EvThread *)calloc(numLoops, sizeof(EvThread));
+
+	for (int i = 0; i < numLoops; i++) {
+		threads[i].idx = i;
+		threads[i].cpu = cpuList[i % numCpus];
+		threads[i].port = port;
+		threads[i].maxPending = maxPending;
+		threads[i].maxConns = maxConns;
+		threads[i].setup = setup;
+		threads[i].arg = arg;
+		if (pthread_create(&threads[i].tid, NULL, evThread, &threads[i]) != 0) {
+			pErr("Could not start loop %d.\n", i);
+			threads[i].ret = -1;
+			threads[i].tid = 0;
+		}
+	}
+
+	for (int i = 0; i < numLoops; i++) {
+		if (threads[i].tid != 0)
+			pthread_join(threads[i].tid, NULL);
+		if (threads[i].ret != 0)
+			ret = -1;
+	}
+
+	free(threads);
+
+	return ret;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions receive a multicast feed in batches and keep count of what
+ * was lost.  recvmmsg() takes every queued datagram in one call, the kernel adds
+ * its receive time (SO_TIMESTAMPNS) and the socket's running drop count
+ * (SO_RXQ_OVFL) to each one.  Datagrams sent with mcastSeqSend() carry a NKX2
+ * header whose ID is a sequence number, so gaps are found per sender even when
+ * the loss was upstream of this host.
+ */
+
+#define _GNU_SOURCE		// recvmmsg()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "miscutils.h"
+
+#define MCAST_RX_BUF		9216		// room for a jumbo frame
+#define MCAST_MAX_SOURCES	32			// senders tracked for sequence gaps
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL		40
+#endif
+
+typedef struct _mcastSource {
+	struct sockaddr_in addr;
+	unsigned int nextSeq;
+} McastSource;
+
+struct _mcastRx {
+	McastInfo *mi;
+	int batch;
+	char *bufs;
+	struct mmsghdr *mh;
+	struct iovec *iov;
+	char *ctrl;
+	int ctrlLen;
+	struct sockaddr_in *addrs;
+	McastPkt *pkts;
+	uint32_t lastDrops;			// SO_RXQ_OVFL count seen last
+	int numSources;
+	McastSource sources[MCAST_MAX_SOURCES];
+	McastStats stats;
+};
+
+/*
+ * This function mcastRxOpen sets up batched receiving on a socket joined with
+ * mcastJoin().  The socket stays open after mcastRxClose().
+ *
+ *   mi = Joined multicast group.
+ *   rcvBuf = Socket receive buffer in bytes, 0 to leave it.  Root may go past
+ *            net.core.rmem_max, st.rcvBuf reports what the kernel gave.
+ *   batch = Most datagrams returned by one mcastRxRecv().
+ *
+ *   returns NULL on error
+ *           else receiver handle.
+ */
+McastRx *mcastRxOpen(McastInfo *mi, int rcvBuf, int batch) {
+	int on = 1;
+
+	if (rcvBuf > 0) {
+		if (setsockopt(mi->mSock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvBuf, sizeof(rcvBuf)) < 0)
+			setsockopt(mi->mSock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+	}
+
+	if (setsockopt(mi->mSock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0 ||
+			setsockopt(mi->mSock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		pErr("Error setting socket options: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	McastRx *rx = (McastRx *)calloc(1, sizeof(McastRx));
+	rx->mi = mi;
+	rx->batch = batch;
+	rx->ctrlLen = CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t));
+	rx->bufs = (char *)malloc((size_t)batch * MCAST_RX_BUF);
+	rx->mh = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+	rx->iov = (struct iovec *)calloc(batch, sizeof(struct iovec));
+	rx->ctrl = (char *)calloc(batch, rx->ctrlLen);
+	rx->addrs = (struct sockaddr_in *)calloc(batch, sizeof(struct sockaddr_in));
+	rx->pkts = (McastPkt *)calloc(batch, sizeof(McastPkt));
+
+	socklen_t len = sizeof(rx->stats.rcvBuf);
+	getsockopt(mi->mSock, SOL_SOCKET, SO_RCVBUF, &rx->stats.rcvBuf, &len);
+	if (rcvBuf > 0 && rx->stats.rcvBuf < rcvBuf)
+		pErr("Receive buffer is %d bytes, %d asked for, raise net.core.rmem_max.\n", rx->stats.rcvBuf, rcvBuf);
+
+	return rx;
+}
+
+/*
+ * This function checkSeq follows the sender's sequence numbers and returns how
+ * many were skipped before seq.  This function is private to this file.
+ */
+static unsigned int checkSeq(McastRx *rx, struct sockaddr_in *from, unsigned int seq, McastPkt *pkt) {
+	McastSource *src = NULL;
+	int i;
+
+	for (i = 0; i < rx->numSources; i++) {
+		McastSource *s = &rx->sources[i];
+		if (s->addr.sin_addr.s_addr == from->sin_addr.s_addr && s->addr.sin_port == from->sin_port) {
+			src = s;
+			break;
+		}
+	}
+
+	if (src == NULL) {
+		if (rx->numSources == MCAST_MAX_SOURCES)
+			return 0;
+		src = &rx->sources[rx->numSources++];
+		src->addr = *from;
+		src->nextSeq = seq + 1;
+		return 0;
+	}
+
+	int diff = (int)(seq - src->nextSeq);		// wraps at 2^32
+	if (diff < 0) {
+		rx->stats.outOfOrder++;
+		pkt->late = 1;
+		return 0;
+	}
+
+	src->nextSeq = seq + 1;
+	if (diff > 0) {
+		rx->stats.gaps++;
+		rx->stats.missing += diff;
+		rx->stats.lastGapTime = pkt->ts;
+		rx->stats.lastGapSeq = seq - diff;
+		rx->stats.lastGapSize = diff;
+	}
+
+	return diff;
+}
+
+/*
+ * This function mcastRxRecv receives up to batch datagrams.  NKX1 and NKX2
+ * headers are taken off, NKX2 sequence numbers are checked per sender.
+ *
+ *   rx = Receiver from mcastRxOpen().
+ *   pkts = Set to the array of datagrams, good until the next call.
+ *   wait = 1 to wait for the first datagram, 0 to return at once.
+ *
+ *   returns -1 on error
+ *           0 if nothing arrived, or the socket's receive timeout ran out.
+ *           else Number of datagrams in *pkts.
+ */
+int mcastRxRecv(McastRx *rx, McastPkt **pkts, int wait) {
+	int i;
+
+	for (i = 0; i < rx->batch; i++) {
+		rx->iov[i].iov_base = rx->bufs + (size_t)i * MCAST_RX_BUF;
+		rx->iov[i].iov_len = MCAST_RX_BUF;
+		memset(&rx->mh[i].msg_hdr, 0, sizeof(struct msghdr));
+		rx->mh[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->mh[i].msg_hdr.msg_iovlen = 1;
+		rx->mh[i].msg_hdr.msg_name = &rx->addrs[i];
+		rx->mh[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		rx->mh[i].msg_hdr.msg_control = rx->ctrl + i * rx->ctrlLen;
+		rx->mh[i].msg_hdr.msg_controllen = rx->ctrlLen;
+	}
+
+	int n;
+	do {
+		n = recvmmsg(rx->mi->mSock, rx->mh, rx->batch, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		pErr("recvmmsg() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *hdr = &rx->mh[i].msg_hdr;
+		McastPkt *pkt = &rx->pkts[i];
+		struct cmsghdr *cm;
+		uint32_t drops = rx->lastDrops;
+
+		memset(pkt, 0, sizeof(McastPkt));
+		pkt->data = (char *)rx->iov[i].iov_base;
+		pkt->len = rx->mh[i].msg_len;
+		pkt->from = rx->addrs[i];
+
+		for (cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm)) {
+			if (cm->cmsg_level != SOL_SOCKET)
+				continue;
+			if (cm->cmsg_type == SCM_TIMESTAMPNS)
+				memcpy(&pkt->ts, CMSG_DATA(cm), sizeof(struct timespec));
+			else if (cm->cmsg_type == SO_RXQ_OVFL)
+				memcpy(&drops, CMSG_DATA(cm), sizeof(uint32_t));
+		}
+
+		// The count only comes with datagrams received after a drop.
+		pkt->dropsBefore = drops - rx->lastDrops;
+		rx->stats.kernelDrops += pkt->dropsBefore;
+		rx->lastDrops = drops;
+
+		unsigned char *h = (unsigned char *)pkt->data;
+		if (pkt->len >= 12 && memcmp(h, "NKX2", 4) == 0 && recGetWord(h + 4) == (uint32_t)pkt->len - 12) {
+			pkt->seq = recGetWord(h + 8);
+			pkt->hasSeq = 1;
+			pkt->data += 12;
+			pkt->len -= 12;
+			pkt->missingBefore = checkSeq(rx, &pkt->from, pkt->seq, pkt);
+		} else if (pkt->len >= 8 && memcmp(h, "NKX1", 4) == 0 && recGetWord(h + 4) == (uint32_t)pkt->len - 8) {
+			pkt->data += 8;
+			pkt->len -= 8;
+		}
+
+		rx->stats.packets++;
+		rx->stats.bytes += pkt->len;
+	}
+
+	*pkts = rx->pkts;
+
+	return n;
+}
+
+/*
+ * This function mcastRxStats copies the receiver's counters.
+ */
+void mcastRxStats(McastRx *rx, McastStats *st) {
+	*st = rx->stats;
+}
+
+void mcastRxClose(McastRx *rx) {
+	if (rx == NULL)
+		return;
+
+	free(rx->bufs);
+	free(rx->mh);
+	free(rx->iov);
+	free(rx->ctrl);
+	free(rx->addrs);
+	free(rx->pkts);
+	free(rx);
+}
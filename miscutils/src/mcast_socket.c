@@ -27,6 +27,7 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -170,6 +171,78 @@ int mcastNumSend(McastInfo *mi, const char *msg, int numBytes) {
 	return r;
 }
 
+/*
+ * This function sendRec sends a record header and msg to the group as one
+ * datagram.  This function is private to this file.
+ */
+static int sendRec(McastInfo *mi, char *hdr, int hdrLen, const char *msg, int numBytes) {
+	struct sockaddr_in groupSock;
+	struct iovec iov[2];
+	struct msghdr mh;
+
+	memset((char *) &groupSock, 0, sizeof(groupSock));
+	groupSock.sin_family = AF_INET;
+	groupSock.sin_addr.s_addr = inet_addr(mi->mAddress);
+	groupSock.sin_port = htons(mi->mPort);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdrLen;
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = numBytes;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &groupSock;
+	mh.msg_namelen = sizeof(groupSock);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+
+	int r = sendmsg(mi->mSock, &mh, 0);
+	if (r < 0) {
+		pErr("sendmsg() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return r - hdrLen;
+}
+
+/*
+ * This function mcastRecSend sends a NULL terminated string with a NKX1 header.
+ *
+ *   returns -1 on error
+ *           else Number of bytes of msg sent.
+ */
+int mcastRecSend(McastInfo *mi, const char *msg) {
+	char hdr[8];
+	int len = strlen(msg);
+
+	memcpy(hdr, "NKX1", 4);
+	recPutWord(hdr + 4, len);
+
+	return sendRec(mi, hdr, sizeof(hdr), msg, len);
+}
+
+/*
+ * This function mcastSeqSend sends msg with a NKX2 header carrying seq, count
+ * seq up by one per datagram so mcastRxRecv() can find lost datagrams.
+ *
+ *   mi = Multicast group.
+ *   seq = Sequence number of this datagram.
+ *   msg = Data to send.
+ *   numBytes = number of bytes to send.
+ *
+ *   returns -1 on error
+ *           else Number of bytes of msg sent.
+ */
+int mcastSeqSend(McastInfo *mi, unsigned int seq, const char *msg, int numBytes) {
+	char hdr[12];
+
+	memcpy(hdr, "NKX2", 4);
+	recPutWord(hdr + 4, numBytes);
+	recPutWord(hdr + 8, seq);
+
+	return sendRec(mi, hdr, sizeof(hdr), msg, numBytes);
+}
+
 int mcastRecv(McastInfo *mi, char *buf, int buf_len) {
 	struct sockaddr_in addr;
 	socklen_t addrlen = 0;
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions send and receive records over TCP, the USE_RCD protocol.
+ * Each record starts with a header, "NKX1" and a 4 byte length, or "NKX2", the
+ * length and a 4 byte message ID.  The header and message go out in a single
+ * sendmsg() so a small record is one system call and usually one packet.
+ * Received bytes are kept in a TcpReader per socket until the records they
+ * belong to are complete.  Close sockets with recClose() or tcpClose() to free
+ * it, a socket closed with close() leaves its reader, and the bytes in it, to
+ * the next socket given the same descriptor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "miscutils.h"
+
+#define REC_MIN_FRAME	(64 * 1024)		// smallest record a socket's reader holds
+
+static pthread_mutex_t readersMutex = PTHREAD_MUTEX_INITIALIZER;
+static TcpReader **readers = NULL;		// indexed by socket
+static int numReaders = 0;
+
+/*
+ * This function recPutWord writes a length or ID into a NKX1 or NKX2 record
+ * header in the byte order tcpRecSend() has always used.  Every record sender
+ * uses it so the header is encoded in one place.
+ */
+void recPutWord(char *p, unsigned int val) {
+	uint32_t nl = htonl(val);
+
+	p[0] = (char)((nl >> 24) & 0xff);
+	p[1] = (char)((nl >> 16) & 0xff);
+	p[2] = (char)((nl >> 8) & 0xff);
+	p[3] = (char)(nl & 0xff);
+}
+
+/*
+ * This function recGetWord reads a length or ID written by recPutWord().
+ */
+unsigned int recGetWord(const unsigned char *h) {
+	return ntohl(((uint32_t)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3]);
+}
+
+/*
+ * This function sendAll sends every byte of iov, picking up after partial sends
+ * and waiting for room on non-blocking sockets, a record is never left half sent
+ * unless the connection fails.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else number of bytes sent.
+ */
+static int sendAll(int sock, struct iovec *iov, int iovCnt) {
+	struct msghdr msg;
+	int total = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovCnt;
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { sock, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			pErr("sendmsg() failed after %d bytes: %s\n", total, strerror(errno));
+			return -1;
+		}
+
+		total += r;
+		while (r > 0) {
+			if ((size_t)r >= msg.msg_iov->iov_len) {
+				r -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			} else {
+				msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + r;
+				msg.msg_iov->iov_len -= r;
+				r = 0;
+			}
+		}
+		while (msg.msg_iovlen > 0 && msg.msg_iov->iov_len == 0) {
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * This function recNumSend sends numBytes of msg as one NKX1 record.
+ *
+ *   sock = Socket descriptor.
+ *   msg = Data to send.
+ *   numBytes = number of bytes to send.
+ *
+ *   returns -1 on error
+ *           else Number of bytes of msg sent.
+ */
+int recNumSend(int sock, const char *msg, int numBytes) {
+	char hdr[8];
+	struct iovec iov[2];
+
+	memcpy(hdr, "NKX1", 4);
+	recPutWord(hdr + 4, numBytes);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = numBytes;
+
+	if (sendAll(sock, iov, 2) < 0)
+		return -1;
+
+	return numBytes;
+}
+
+/*
+ * This function recSend sends a NULL terminated string as one NKX1 record,
+ * the NULL is not sent.
+ *
+ *   returns -1 on error
+ *           else Number of bytes of msg sent.
+ */
+int recSend(int sock, const char *msg) {
+	return recNumSend(sock, msg, strlen(msg));
+}
+
+/*
+ * This function recNumIDSend sends numBytes of msg as one NKX2 record carrying id,
+ * so replies can be matched to requests.
+ *
+ *   sock = Socket descriptor.
+ *   id = Message ID returned by recIDRecv() at the other end.
+ *   msg = Data to send.
+ *   numBytes = number of bytes to send.
+ *
+ *   returns -1 on error
+ *           else Number of bytes of msg sent.
+ */
+int recNumIDSend(int sock, unsigned int id, const char *msg, int numBytes) {
+	char hdr[12];
+	struct iovec iov[2];
+
+	memcpy(hdr, "NKX2", 4);
+	recPutWord(hdr + 4, numBytes);
+	recPutWord(hdr + 8, id);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = numBytes;
+
+	if (sendAll(sock, iov, 2) < 0)
+		return -1;
+
+	return numBytes;
+}
+
+int recIDSend(int sock, unsigned int id, const char *msg) {
+	return recNumIDSend(sock, id, msg, strlen(msg));
+}
+
+/*
+ * This function getReader returns the socket's reader, creating it on first use,
+ * able to hold records of bufLen bytes.  This function is private to this file.
+ *
+ *   returns NULL if sock is not a descriptor.
+ */
+static TcpReader *getReader(int sock, int bufLen) {
+	TcpReader *tr;
+
+	if (sock < 0) {
+		pErr("Socket %d is not valid.\n", sock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&readersMutex);
+
+	if (sock >= numReaders) {
+		int n = (numReaders == 0) ? 64 : numReaders;
+		while (n <= sock)
+			n *= 2;
+
+		readers = (TcpReader **)realloc(readers, n * sizeof(TcpReader *));
+		memset(readers + numReaders, 0, (n - numReaders) * sizeof(TcpReader *));
+		numReaders = n;
+	}
+
+	tr = readers[sock];
+	if (tr == NULL)
+		tr = readers[sock] = trCreate(sock, (bufLen > REC_MIN_FRAME) ? bufLen : REC_MIN_FRAME);
+
+	pthread_mutex_unlock(&readersMutex);
+
+	trSetMaxFrame(tr, bufLen);
+
+	return tr;
+}
+
+/*
+ * This function recIDRecv receives the next record, NKX1 or NKX2.  Bytes read
+ * past it stay with the socket for the next call.
+ *
+ *   sock = Socket descriptor.
+ *   id = Set to the record's message ID, 0 for NKX1 records.
+ *   buf = Buffer to place the record.
+ *   buf_len = Max size of buffer.
+ *
+ *   returns -1 on error
+ *           0 if the connection closed.
+ *           -2 record longer than buf_len, it was dropped.
+ *           -3 stream out of step, no record header where one should be.
+ *           else Number of bytes received.
+ */
+int recIDRecv(int sock, unsigned int *id, char *buf, int buf_len) {
+	TcpReader *tr = getReader(sock, buf_len);
+	int len;
+
+	if (tr == NULL)
+		return -1;
+
+	char *p = trNextIDRec(tr, id, &len);
+	if (p == NULL) {
+		if (len == -3)
+			pErr("No record header on socket %d.\n", sock);
+		return len;
+	}
+
+	if (len > buf_len) {
+		pErr("Record of %d bytes dropped, buffer is %d bytes.\n", len, buf_len);
+		return -2;
+	}
+
+	memcpy(buf, p, len);
+
+	return len;
+}
+
+int recRecv(int sock, char *buf, int buf_len) {
+	return recIDRecv(sock, NULL, buf, buf_len);
+}
+
+/*
+ * This function recRecvString receives the next record as a NULL terminated
+ * string, so buf_len must allow one byte more than the record.
+ *
+ *   returns as recIDRecv().
+ */
+int recRecvString(int sock, char *buf, int buf_len) {
+	int r = recIDRecv(sock, NULL, buf, buf_len - 1);
+
+	if (r >= 0)
+		buf[r] = '\0';
+
+	return r;
+}
+
+/*
+ * This function recClose frees the socket's reader and closes it.  tcpClose()
+ * does the same, so a socket is never closed with its reader left behind.
+ */
+void recClose(int sock) {
+	if (sock < 0)
+		return;
+
+	pthread_mutex_lock(&readersMutex);
+	if (sock < numReaders) {
+		trFree(readers[sock]);
+		readers[sock] = NULL;
+	}
+	pthread_mutex_unlock(&readersMutex);
+
+	close(sock);		// ignore any errors.
+}
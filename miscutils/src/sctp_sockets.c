@@ -36,6 +36,20 @@
 #include "miscutils.h"
 
 #define MAXLISTENING	10
+#define SCTP_STREAMS	16		// streams asked for on each association
+
+/*
+ * This function turns on the sctp_sndrcvinfo control message with each message
+ * received, it tells sctpRecvStream() the stream, PPID and association.
+ * This function is private to this file.
+ */
+static void dataEvents(int sock) {
+	struct sctp_event_subscribe events;
+
+	memset((void *) &events, 0, sizeof(events));
+	events.sctp_data_io_event = 1;
+	setsockopt(sock, SOL_SCTP, SCTP_EVENTS, (const void *) &events, sizeof(events));
+}
 
 /*
  * This function sctpConnect is used to connect to a server over TCP.
@@ -64,10 +78,10 @@ int sctpConnect(const char *server, int port) {
 		return -1;
 	}
 
-	/* Specify that a maximum of 5 streams will be available per socket */
+	/* Specify that a maximum of SCTP_STREAMS streams will be available per socket */
 	memset( &initmsg, 0, sizeof(initmsg) );
-	initmsg.sinit_num_ostreams = 5;
-	initmsg.sinit_max_instreams = 5;
+	initmsg.sinit_num_ostreams = SCTP_STREAMS;
+	initmsg.sinit_max_instreams = SCTP_STREAMS;
 	initmsg.sinit_max_attempts = 4;
 	setsockopt( sock, IPPROTO_SCTP, SCTP_INITMSG, &initmsg, sizeof(initmsg) );
 
@@ -151,10 +165,10 @@ int sctpTimeoutConnect(const char *server, int port, int timeout) {
 		return -1;
 	}
 
-	/* Specify that a maximum of 5 streams will be available per socket */
+	/* Specify that a maximum of SCTP_STREAMS streams will be available per socket */
 	memset( &initmsg, 0, sizeof(initmsg) );
-	initmsg.sinit_num_ostreams = 5;
-	initmsg.sinit_max_instreams = 5;
+	initmsg.sinit_num_ostreams = SCTP_STREAMS;
+	initmsg.sinit_max_instreams = SCTP_STREAMS;
 	initmsg.sinit_max_attempts = 4;
 	setsockopt( sock, IPPROTO_SCTP, SCTP_INITMSG, &initmsg, sizeof(initmsg) );
 
@@ -269,10 +283,10 @@ int sctpServer(int port, int maxPending) {
 		return -3;
 	}
 
-	/* Specify that a maximum of 5 streams will be available per socket */
+	/* Specify that a maximum of SCTP_STREAMS streams will be available per socket */
 	memset( &initmsg, 0, sizeof(initmsg) );
-	initmsg.sinit_num_ostreams = 5;
-	initmsg.sinit_max_instreams = 5;
+	initmsg.sinit_num_ostreams = SCTP_STREAMS;
+	initmsg.sinit_max_instreams = SCTP_STREAMS;
 	initmsg.sinit_max_attempts = 4;
 	setsockopt( sock, IPPROTO_SCTP, SCTP_INITMSG, &initmsg, sizeof(initmsg) );
 
@@ -331,13 +345,76 @@ int sctpServerSubnet(int port, int maxPending, const char *subnet) {
 		return -2;
 	}
 
-	/* Specify that a maximum of 5 streams will be available per socket */
+	/* Specify that a maximum of SCTP_STREAMS streams will be available per socket */
+	memset( &initmsg, 0, sizeof(initmsg) );
+	initmsg.sinit_num_ostreams = SCTP_STREAMS;
+	initmsg.sinit_max_instreams = SCTP_STREAMS;
+	initmsg.sinit_max_attempts = 4;
+	setsockopt( sock, IPPROTO_SCTP, SCTP_INITMSG, &initmsg, sizeof(initmsg) );
+
+	if (maxPending <= 0)
+		listen(sock, MAXLISTENING);
+	else
+		listen(sock, maxPending);
+
+	return sock;
+}
+
+/*
+ * This function sctpManyServer creates a one-to-many (SOCK_SEQPACKET) socket.
+ * There is no accept, every peer's association is on this one socket.
+ * sctpRecvStream() returns each message with the association it came on and
+ * sctpSendStream() with the same SctpMsgInfo answers on that association.
+ *
+ *   port = Port number to listen on for associations.
+ *   maxPending = Max number of pending associations.
+ *   autoClose = Seconds an association may be idle before it is closed, 0 never.
+ *
+ *   returns -1 if socket create failed.
+ *           -2 setsockopt failed.
+ *           -3 if bind fails.
+ *           else a valid socket descriptor is returned.
+ */
+int sctpManyServer(int port, int maxPending, int autoClose) {
+	struct sctp_initmsg initmsg;
+
+	int sock = socket(AF_INET, SOCK_SEQPACKET, IPPROTO_SCTP);
+
+	if (sock < 0) {
+		pErr("socket failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	int num = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &num, sizeof(int)) == -1 ) {
+		pErr("Error setting socket options: %d\n", errno);
+		close(sock);
+		return -2;
+	}
+
+	struct sockaddr_in servAddr;                  // Local address
+	memset(&servAddr, 0, sizeof(servAddr));       // Zero out structure
+	servAddr.sin_family = AF_INET;                // IPv4 address family
+	servAddr.sin_addr.s_addr = htonl(INADDR_ANY); // Any incoming interface
+	servAddr.sin_port = htons(port);              // Local port
+
+	if (bind(sock, (struct sockaddr*) &servAddr, sizeof(servAddr)) < 0) {
+		pErr("bind failed.\n");
+		close(sock);
+		return -3;
+	}
+
 	memset( &initmsg, 0, sizeof(initmsg) );
-	initmsg.sinit_num_ostreams = 5;
-	initmsg.sinit_max_instreams = 5;
+	initmsg.sinit_num_ostreams = SCTP_STREAMS;
+	initmsg.sinit_max_instreams = SCTP_STREAMS;
 	initmsg.sinit_max_attempts = 4;
 	setsockopt( sock, IPPROTO_SCTP, SCTP_INITMSG, &initmsg, sizeof(initmsg) );
 
+	if (autoClose > 0)
+		setsockopt(sock, IPPROTO_SCTP, SCTP_AUTOCLOSE, &autoClose, sizeof(autoClose));
+
+	dataEvents(sock);
+
 	if (maxPending <= 0)
 		listen(sock, MAXLISTENING);
 	else
@@ -364,6 +441,8 @@ int sctpAccept(int sock, struct sockaddr *clientAddr) {
 		return -1;
 	}
 
+	dataEvents(clientSock);
+
 	return clientSock;
 }
 
@@ -458,6 +537,151 @@ int sctpRecvString(int sock, char *buf, int buf_len) {
 	return r;
 }
 
+/*
+ * This function sctpSendStream sends one message on a stream.  Messages on
+ * different streams are delivered independently, a lost packet only holds up
+ * later messages on its own stream.  With SCTP_MSG_UNORDERED set in info->flags
+ * the message is not held up behind any other.
+ *
+ *   sock = Socket descriptor, one-to-one or from sctpManyServer().
+ *   msg = Message to send.
+ *   numBytes = number of bytes to send.
+ *   info = stream, ppid and flags.  On a one-to-many socket assocId picks the
+ *          association, or when it is 0 addr the peer to send to.
+ *
+ *   returns -1 on error
+ *           else Number of bytes sent, the whole message.
+ */
+int sctpSendStream(int sock, const char *msg, int numBytes, SctpMsgInfo *info) {
+	char cbuf[CMSG_SPACE(sizeof(struct sctp_sndrcvinfo))];
+	struct msghdr mh;
+	struct iovec iov;
+
+	iov.iov_base = (void *)msg;
+	iov.iov_len = numBytes;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	if (info->assocId == 0 && info->addr.sin_family == AF_INET) {
+		mh.msg_name = &info->addr;
+		mh.msg_namelen = sizeof(info->addr);
+	}
+
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = IPPROTO_SCTP;
+	cm->cmsg_type = SCTP_SNDRCV;
+	cm->cmsg_len = CMSG_LEN(sizeof(struct sctp_sndrcvinfo));
+
+	struct sctp_sndrcvinfo *si = (struct sctp_sndrcvinfo *)CMSG_DATA(cm);
+	si->sinfo_stream = info->stream;
+	si->sinfo_ppid = htonl(info->ppid);
+	si->sinfo_assoc_id = info->assocId;
+	if (info->flags & SCTP_MSG_UNORDERED)
+		si->sinfo_flags |= SCTP_UNORDERED;
+
+	int r = sendmsg(sock, &mh, MSG_NOSIGNAL);
+
+	if (r < 0)
+		pErr("sendmsg failed, stream %d: %s\n", info->stream, strerror(errno));
+
+	return r;
+}
+
+/*
+ * This function sctpRecvStream receives one message and the stream it came on.
+ * A message larger than buf_len is returned over several calls, all but the
+ * last with SCTP_MSG_PARTIAL set in info->flags.
+ *
+ *   sock = Socket descriptor, one-to-one or from sctpManyServer().
+ *   buf = Buffer to place received bytes.
+ *   buf_len = Max size of buffer.
+ *   info = Set to the stream, ppid, flags, association and peer address.  It
+ *          can be passed to sctpSendStream() to answer on the same stream.
+ *
+ *   returns -1 on error
+ *           0 the peer closed a one-to-one association.
+ *           else Number of bytes received.
+ */
+int sctpRecvStream(int sock, char *buf, int buf_len, SctpMsgInfo *info) {
+	char cbuf[CMSG_SPACE(sizeof(struct sctp_sndrcvinfo))];
+	struct msghdr mh;
+	struct iovec iov;
+	int r;
+
+	while (1) {
+		iov.iov_base = buf;
+		iov.iov_len = buf_len;
+
+		memset(&mh, 0, sizeof(mh));
+		memset(info, 0, sizeof(SctpMsgInfo));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_name = &info->addr;
+		mh.msg_namelen = sizeof(info->addr);
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+
+		r = recvmsg(sock, &mh, 0);
+		if (r <= 0)
+			return r;
+
+		if (!(mh.msg_flags & MSG_NOTIFICATION))
+			break;
+	}
+
+	struct cmsghdr *cm;
+	for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == IPPROTO_SCTP && cm->cmsg_type == SCTP_SNDRCV) {
+			struct sctp_sndrcvinfo *si = (struct sctp_sndrcvinfo *)CMSG_DATA(cm);
+
+			info->stream = si->sinfo_stream;
+			info->ppid = ntohl(si->sinfo_ppid);
+			info->assocId = si->sinfo_assoc_id;
+			if (si->sinfo_flags & SCTP_UNORDERED)
+				info->flags |= SCTP_MSG_UNORDERED;
+		}
+	}
+
+	if (!(mh.msg_flags & MSG_EOR))
+		info->flags |= SCTP_MSG_PARTIAL;
+
+	return r;
+}
+
+/*
+ * This function sctpStreams returns the number of streams agreed with the peer.
+ * The peer may allow fewer than the SCTP_STREAMS asked for.
+ *
+ *   sock = Socket descriptor.
+ *   assocId = Association on a one-to-many socket, 0 on one-to-one.
+ *   inStreams = Set to the streams the peer may send on, may be NULL.
+ *
+ *   returns -1 on error
+ *           else the number of streams messages may be sent on.
+ */
+int sctpStreams(int sock, int assocId, int *inStreams) {
+	struct sctp_status status;
+	socklen_t len = sizeof(status);
+
+	memset(&status, 0, sizeof(status));
+	status.sstat_assoc_id = assocId;
+
+	if (getsockopt(sock, SOL_SCTP, SCTP_STATUS, &status, &len) < 0) {
+		pErr("getsockopt SCTP_STATUS failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (inStreams != NULL)
+		*inStreams = status.sstat_instrms;
+
+	return status.sstat_outstrms;
+}
+
 void sctpClose(int sock) {
 	close(sock);		// ignore any errors.
 }
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * A pool of client connections keyed by server and port.  tcpPoolGet() hands
+ * out an idle connection to the server when one is still good, else connects a
+ * new one, tcpPoolPut() gives it back for the next caller.  Each server has a
+ * limit on connections, idle or in use, callers wait for one to come back when
+ * it is reached.  Idle connections are closed by a thread once they have not
+ * been used for idleSecs.  New connections are set up with TCP_NODELAY,
+ * keepalive probes and TCP_USER_TIMEOUT so a dead peer is found in seconds, not
+ * the many minutes of the system defaults.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "miscutils.h"
+
+#define POOL_MAX_PER_HOST	8
+#define POOL_IDLE_SECS		60
+#define POOL_CONNECT_SECS	5
+#define POOL_KEEP_IDLE		30
+#define POOL_KEEP_INTVL		10
+#define POOL_KEEP_CNT		3
+#define POOL_USER_TIMEOUT	60000
+
+typedef struct _poolIdle {
+	int sock;
+	time_t lastUsed;			// monotonic seconds
+} PoolIdle;
+
+typedef struct _poolHost {
+	struct _poolHost *next;
+	char *server;
+	int port;
+	int open;					// connections idle, in use or connecting
+	int numIdle;
+	PoolIdle *idle;				// maxPerHost long, most recently used last
+	pthread_cond_t freed;		// a connection came back or was closed
+} PoolHost;
+
+struct _tcpPool {
+	TcpPoolOpts opts;
+	pthread_mutex_t lock;
+	PoolHost *hosts;
+	PoolHost **owner;			// host of each checked out socket, by fd
+	int numOwner;
+	int closing;
+	pthread_cond_t reapCond;
+	pthread_t reaper;
+};
+
+/*
+ * This function returns the monotonic clock in seconds.
+ * This function is private to this file.
+ */
+static time_t nowSecs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * This function sets ts to secs from now on the monotonic clock.
+ * This function is private to this file.
+ */
+static void deadline(struct timespec *ts, int secs) {
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += secs;
+}
+
+/*
+ * This function inits a condition variable that waits on the monotonic clock.
+ * This function is private to this file.
+ */
+static int condInit(pthread_cond_t *cond) {
+	pthread_condattr_t ca;
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	int r = pthread_cond_init(cond, &ca);
+	pthread_condattr_destroy(&ca);
+
+	return r;
+}
+
+/*
+ * This function checks an idle connection before it is handed out.  The peer
+ * closing or resetting it shows up as recv() returning 0 or an error, bytes
+ * waiting mean it holds the end of an earlier exchange and can not be reused.
+ * returns 1 if the connection is good, else 0.
+ * This function is private to this file.
+ */
+static int healthy(int sock) {
+	char c;
+
+	int r = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (r >= 0)
+		return 0;
+
+	return (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * This function sets up a new connection.  tcpTimeoutConnect() leaves the
+ * socket non-blocking, callers of the pool expect a blocking one.
+ * This function is private to this file.
+ */
+static void tune(TcpPool *tp, int sock) {
+	TcpPoolOpts *o = &tp->opts;
+	int on = 1;
+
+	long ctrls = fcntl(sock, F_GETFL, NULL);
+	fcntl(sock, F_SETFL, ctrls & ~O_NONBLOCK);
+
+	if (o->connect != NULL)
+		return;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (o->keepIdle > 0) {
+		setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &o->keepIdle, sizeof(o->keepIdle));
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &o->keepIntvl, sizeof(o->keepIntvl));
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &o->keepCnt, sizeof(o->keepCnt));
+	}
+
+	if (o->userTimeout > 0)
+		setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &o->userTimeout, sizeof(o->userTimeout));
+}
+
+/*
+ * This function closes the idle connections of a host not used for idleSecs.
+ * Called with the pool locked.
+ * This function is private to this file.
+ */
+static void expire(TcpPool *tp, PoolHost *h, time_t now) {
+	int i, n = 0;
+
+	for (i = 0; i < h->numIdle; i++) {
+		if (now - h->idle[i].lastUsed >= tp->opts.idleSecs) {
+			close(h->idle[i].sock);
+			h->open--;
+		} else {
+			h->idle[n++] = h->idle[i];
+		}
+	}
+
+	if (n != h->numIdle) {
+		h->numIdle = n;
+		pthread_cond_broadcast(&h->freed);
+	}
+}
+
+/*
+ * This function is the thread that closes idle connections.
+ * This function is private to this file.
+ */
+static void *reapThread(void *arg) {
+	TcpPool *tp = (TcpPool *)arg;
+	int every = tp->opts.idleSecs > 4 ? tp->opts.idleSecs / 4 : 1;
+	struct timespec ts;
+	PoolHost *h;
+
+	pthread_mutex_lock(&tp->lock);
+
+	while (!tp->closing) {
+		deadline(&ts, every);
+		pthread_cond_timedwait(&tp->reapCond, &tp->lock, &ts);
+
+		time_t now = nowSecs();
+		for (h = tp->hosts; h != NULL; h = h->next)
+			expire(tp, h, now);
+	}
+
+	pthread_mutex_unlock(&tp->lock);
+
+	return NULL;
+}
+
+/*
+ * This function finds the entry for server and port, adding it if it is new.
+ * Called with the pool locked.
+ * returns NULL if out of memory.
+ * This function is private to this file.
+ */
+static PoolHost *findHost(TcpPool *tp, const char *server, int port) {
+	PoolHost *h;
+
+	for (h = tp->hosts; h != NULL; h = h->next) {
+		if (h->port == port && strcmp(h->server, server) == 0)
+			return h;
+	}
+
+	h = (PoolHost *)calloc(1, sizeof(PoolHost));
+	if (h == NULL)
+		return NULL;
+
+	h->server = strdup(server);
+	h->idle = (PoolIdle *)calloc(tp->opts.maxPerHost, sizeof(PoolIdle));
+	if (h->server == NULL || h->idle == NULL || condInit(&h->freed) != 0) {
+		free(h->server);
+		free(h->idle);
+		free(h);
+		return NULL;
+	}
+	h->port = port;
+
+	h->next = tp->hosts;
+	tp->hosts = h;
+
+	return h;
+}
+
+/*
+ * This function records the host a checked out socket belongs to.
+ * Called with the pool locked.
+ * returns -1 if out of memory.
+ * This function is private to this file.
+ */
+static int setOwner(TcpPool *tp, int sock, PoolHost *h) {
+	if (sock >= tp->numOwner) {
+		int n = tp->numOwner ? tp->numOwner : 64;
+
+		while (n <= sock)
+			n *= 2;
+
+		PoolHost **p = (PoolHost **)realloc(tp->owner, n * sizeof(PoolHost *));
+		if (p == NULL)
+			return -1;
+
+		memset(p + tp->numOwner, 0, (n - tp->numOwner) * sizeof(PoolHost *));
+		tp->owner = p;
+		tp->numOwner = n;
+	}
+
+	tp->owner[sock] = h;
+
+	return 0;
+}
+
+/*
+ * This function tcpPoolCreate creates a connection pool.
+ *
+ *   opts = Pool settings, NULL or fields of zero take the defaults:
+ *          maxPerHost 8, idleSecs 60, connectTimeout 5, keepIdle 30,
+ *          keepIntvl 10, keepCnt 3 and userTimeout 60000.
+ *          keepIdle or userTimeout less than zero leave that option off.
+ *
+ *   returns NULL on error else the pool.
+ */
+TcpPool *tcpPoolCreate(TcpPoolOpts *opts) {
+	TcpPool *tp = (TcpPool *)calloc(1, sizeof(TcpPool));
+
+	if (tp == NULL) {
+		pErr("Out of memory.\n");
+		return NULL;
+	}
+
+	if (opts != NULL)
+		tp->opts = *opts;
+
+	TcpPoolOpts *o = &tp->opts;
+	if (o->maxPerHost <= 0)
+		o->maxPerHost = POOL_MAX_PER_HOST;
+	if (o->idleSecs <= 0)
+		o->idleSecs = POOL_IDLE_SECS;
+	if (o->connectTimeout <= 0)
+		o->connectTimeout = POOL_CONNECT_SECS;
+	if (o->keepIdle == 0)
+		o->keepIdle = POOL_KEEP_IDLE;
+	if (o->keepIntvl <= 0)
+		o->keepIntvl = POOL_KEEP_INTVL;
+	if (o->keepCnt <= 0)
+		o->keepCnt = POOL_KEEP_CNT;
+	if (o->userTimeout == 0)
+		o->userTimeout = POOL_USER_TIMEOUT;
+
+	pthread_mutex_init(&tp->lock, NULL);
+	condInit(&tp->reapCond);
+
+	if (pthread_create(&tp->reaper, NULL, reapThread, tp) != 0) {
+		pErr("pthread_create failed: %s\n", strerror(errno));
+		pthread_cond_destroy(&tp->reapCond);
+		pthread_mutex_destroy(&tp->lock);
+		free(tp);
+		return NULL;
+	}
+
+	return tp;
+}
+
+/*
+ * This function tcpPoolGet checks out a connection to server and port.
+ * The most recently returned idle connection that is still good is used, else a
+ * new one is connected.  With maxPerHost connections open it waits up to
+ * connectTimeout seconds for one to be returned.
+ *
+ *   tp = The pool.
+ *   server = The dotted notation IP address, does NOT handle domain name look ups.
+ *   port = port number to connect to.
+ *
+ *   returns -1 to -6 as tcpTimeoutConnect() does.
+ *           -7 timed out waiting for a connection to be returned.
+ *           -8 out of memory or the pool is being destroyed.
+ *           else a blocking socket, give it back with tcpPoolPut().
+ */
+int tcpPoolGet(TcpPool *tp, const char *server, int port) {
+	struct timespec ts;
+	int waited = 0;
+	int sock;
+
+	pthread_mutex_lock(&tp->lock);
+
+	PoolHost *h = findHost(tp, server, port);
+	if (h == NULL) {
+		pthread_mutex_unlock(&tp->lock);
+		pErr("Out of memory.\n");
+		return -8;
+	}
+
+	while (1) {
+		if (tp->closing) {
+			pthread_mutex_unlock(&tp->lock);
+			return -8;
+		}
+
+		while (h->numIdle > 0) {
+			PoolIdle *pi = &h->idle[--h->numIdle];
+
+			if (nowSecs() - pi->lastUsed < tp->opts.idleSecs && healthy(pi->sock)) {
+				sock = pi->sock;
+				if (setOwner(tp, sock, h) != 0) {
+					close(sock);
+					h->open--;
+					sock = -8;
+				}
+				pthread_mutex_unlock(&tp->lock);
+				return sock;
+			}
+
+			close(pi->sock);
+			h->open--;
+		}
+
+		if (h->open < tp->opts.maxPerHost)
+			break;
+
+		if (!waited) {
+			deadline(&ts, tp->opts.connectTimeout);
+			waited = 1;
+		}
+
+		if (pthread_cond_timedwait(&h->freed, &tp->lock, &ts) == ETIMEDOUT &&
+				h->numIdle == 0 && h->open >= tp->opts.maxPerHost) {
+			pthread_mutex_unlock(&tp->lock);
+			return -7;
+		}
+	}
+
+	h->open++;
+	pthread_mutex_unlock(&tp->lock);
+
+	if (tp->opts.connect != NULL)
+		sock = tp->opts.connect(server, port, tp->opts.connectTimeout);
+	else
+		sock = tcpTimeoutConnect(server, port, tp->opts.connectTimeout);
+
+	if (sock >= 0)
+		tune(tp, sock);
+
+	pthread_mutex_lock(&tp->lock);
+
+	if (sock >= 0 && setOwner(tp, sock, h) != 0) {
+		pErr("Out of memory.\n");
+		close(sock);
+		sock = -8;
+	}
+
+	if (sock < 0) {
+		h->open--;
+		pthread_cond_signal(&h->freed);
+	}
+
+	pthread_mutex_unlock(&tp->lock);
+
+	return sock;
+}
+
+/*
+ * This function tcpPoolPut returns a connection from tcpPoolGet() to the pool.
+ * A connection that had an error, or was left part way through an exchange,
+ * must be returned with broken set so it is closed and not handed out again.
+ *
+ *   tp = The pool.
+ *   sock = The socket from tcpPoolGet().
+ *   broken = 1 to close the connection, 0 to keep it for reuse.
+ */
+void tcpPoolPut(TcpPool *tp, int sock, int broken) {
+	pthread_mutex_lock(&tp->lock);
+
+	PoolHost *h = (sock >= 0 && sock < tp->numOwner) ? tp->owner[sock] : NULL;
+	if (h == NULL) {
+		pthread_mutex_unlock(&tp->lock);
+		pErr("Socket %d is not checked out of the pool.\n", sock);
+		return;
+	}
+	tp->owner[sock] = NULL;
+
+	if (broken || tp->closing) {
+		close(sock);
+		h->open--;
+	} else {
+		h->idle[h->numIdle].sock = sock;
+		h->idle[h->numIdle].lastUsed = nowSecs();
+		h->numIdle++;
+	}
+
+	pthread_cond_signal(&h->freed);
+	pthread_mutex_unlock(&tp->lock);
+}
+
+/*
+ * This function tcpPoolStats returns the number of connections to a server.
+ *
+ *   tp = The pool.
+ *   server, port = The server, or NULL for every server in the pool.
+ *   numIdle = Set to the idle connections, may be NULL.
+ *
+ *   returns the connections open, idle or checked out.
+ */
+int tcpPoolStats(TcpPool *tp, const char *server, int port, int *numIdle) {
+	int open = 0, idle = 0;
+	PoolHost *h;
+
+	pthread_mutex_lock(&tp->lock);
+
+	for (h = tp->hosts; h != NULL; h = h->next) {
+		if (server == NULL || (h->port == port && strcmp(h->server, server) == 0)) {
+			open += h->open;
+			idle += h->numIdle;
+		}
+	}
+
+	pthread_mutex_unlock(&tp->lock);
+
+	if (numIdle != NULL)
+		*numIdle = idle;
+
+	return open;
+}
+
+/*
+ * This function tcpPoolDestroy closes the idle connections and frees the pool.
+ * Connections still checked out are left open and belong to the caller, no
+ * thread may use the pool once this is called.
+ *
+ *   tp = The pool.
+ */
+void tcpPoolDestroy(TcpPool *tp) {
+	PoolHost *h, *next;
+	int i;
+
+	if (tp == NULL)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->closing = 1;
+	pthread_cond_signal(&tp->reapCond);
+	pthread_mutex_unlock(&tp->lock);
+
+	pthread_join(tp->reaper, NULL);
+
+	for (h = tp->hosts; h != NULL; h = next) {
+		next = h->next;
+		for (i = 0; i < h->numIdle; i++)
+			close(h->idle[i].sock);
+		pthread_cond_destroy(&h->freed);
+		free(h->idle);
+		free(h->server);
+		free(h);
+	}
+
+	pthread_cond_destroy(&tp->reapCond);
+	pthread_mutex_destroy(&tp->lock);
+	free(tp->owner);
+	free(tp);
+}
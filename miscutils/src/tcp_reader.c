@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions implement a buffered reader that cuts a TCP byte stream into
+ * JSON objects or NKX1 and NKX2 records, as sent by tcpRecSend() and recSend().
+ * Each recv() asks for as much as the buffer will hold, complete frames are
+ * handed out of the buffer and bytes of the next frame are kept for the next call.
+ *
+ * JSON objects are found by brace depth, braces inside strings and escaped quotes
+ * are skipped.  jsonScan() keeps its state between calls so bytes are looked at
+ * once however the object is split across reads, and with SSE2 or NEON it checks
+ * 16 bytes at a time for the four characters that matter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "miscutils.h"
+
+#define TR_READ_SIZE	(64 * 1024)		// smallest recv() asked for
+#define REC_HDR_SIZE	8				// "NKX1" and the length
+#define REC_ID_HDR_SIZE	12				// "NKX2", the length and an ID
+
+struct _tcpReader {
+	int sock;
+	char *buf;
+	int size;
+	int maxFrame;
+	int start;					// first byte not handed out yet
+	int end;					// end of the bytes read
+	int scan;					// next byte for jsonScan()
+	JsonScan js;
+	int skipping;				// dropping an object longer than maxFrame
+	long skipBytes;				// bytes left of a record longer than maxFrame
+	int nulPos;					// byte under the null put after the last frame
+	char nulSave;
+};
+
+/*
+ * This function findSpecial returns the index of the first '{', '}', '"' or '\'
+ * in p, or n if there is none.  This function is private to this file.
+ */
+static int findSpecial(const char *p, int n) {
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i lb = _mm_set1_epi8('{');
+	const __m128i rb = _mm_set1_epi8('}');
+	const __m128i qt = _mm_set1_epi8('"');
+	const __m128i bs = _mm_set1_epi8('\\');
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lb), _mm_cmpeq_epi8(v, rb)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, qt), _mm_cmpeq_epi8(v, bs)));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t lb = vdupq_n_u8('{');
+	const uint8x16_t rb = vdupq_n_u8('}');
+	const uint8x16_t qt = vdupq_n_u8('"');
+	const uint8x16_t bs = vdupq_n_u8('\\');
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(p + i));
+		uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, lb), vceqq_u8(v, rb)),
+				vorrq_u8(vceqq_u8(v, qt), vceqq_u8(v, bs)));
+		if (vmaxvq_u8(m) != 0)
+			break;				// the loop below finds which byte
+	}
+#endif
+
+	for (; i < n; i++) {
+		char c = p[i];
+		if (c == '{' || c == '}' || c == '"' || c == '\\')
+			return i;
+	}
+
+	return n;
+}
+
+/*
+ * This function jsonScan looks for the end of a JSON object, a piece at a time.
+ * Zero js before the first piece, the first piece must start with the object's
+ * '{'.  Pass each following piece of the stream with the same js.
+ *
+ *   js = Scan state kept between calls.
+ *   data = Next bytes of the object.
+ *   len = Number of bytes in data.
+ *
+ *   returns 0 if the object has not ended in data.
+ *           else number of bytes of data up to and including the closing '}'.
+ */
+int jsonScan(JsonScan *js, const char *data, int len) {
+	int i = 0;
+
+	while (i < len) {
+		if (js->escape) {
+			js->escape = 0;
+			i++;
+			continue;
+		}
+
+		i += findSpecial(data + i, len - i);
+		if (i >= len)
+			break;
+
+		char c = data[i++];
+		if (js->inString) {
+			if (c == '\\')
+				js->escape = 1;
+			else if (c == '"')
+				js->inString = 0;
+		} else if (c == '"') {
+			js->inString = 1;
+		} else if (c == '{') {
+			js->depth++;
+		} else if (c == '}' && js->depth > 0 && --js->depth == 0) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This function trCreate creates a reader for a connected socket.  Use one reader
+ * per socket for everything read from it, JSON or records, bytes read ahead are
+ * only in the reader.
+ *
+ *   sock = Socket to read, it is not closed by trFree().
+ *   maxFrame = Largest JSON object or record that will be returned.
+ *
+ *   returns reader handle.
+ */
+TcpReader *trCreate(int sock, int maxFrame) {
+	TcpReader *tr = (TcpReader *)calloc(1, sizeof(TcpReader));
+
+	tr->sock = sock;
+	tr->maxFrame = maxFrame;
+	tr->size = maxFrame + 2 * TR_READ_SIZE;
+	tr->buf = (char *)malloc(tr->size + 1);		// room for a terminating null
+	tr->nulPos = -1;
+
+	return tr;
+}
+
+void trFree(TcpReader *tr) {
+	if (tr == NULL)
+		return;
+
+	free(tr->buf);
+	free(tr);
+}
+
+/*
+ * This function trBuffered returns the number of bytes read but not yet returned.
+ */
+int trBuffered(TcpReader *tr) {
+	return tr->end - tr->start;
+}
+
+/*
+ * This function restore puts back the byte the last frame's null went over.
+ * This function is private to this file.
+ */
+static void restore(TcpReader *tr) {
+	if (tr->nulPos >= 0) {
+		tr->buf[tr->nulPos] = tr->nulSave;
+		tr->nulPos = -1;
+	}
+}
+
+/*
+ * This function frame null terminates len bytes at the reader's start and moves
+ * start past them.  This function is private to this file.
+ */
+static char *frame(TcpReader *tr, int len) {
+	char *p = tr->buf + tr->start;
+
+	tr->start += len;
+	tr->nulPos = tr->start;
+	tr->nulSave = tr->buf[tr->start];
+	tr->buf[tr->start] = '\0';
+
+	return p;
+}
+
+/*
+ * This function fill moves unread bytes to the front of the buffer when space
+ * runs short and reads as much as fits.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 if the connection closed.
+ *           else number of bytes read.
+ */
+static int fill(TcpReader *tr) {
+	if (tr->start == tr->end) {
+		tr->start = tr->end = tr->scan = 0;
+	} else if (tr->size - tr->end < TR_READ_SIZE) {
+		memmove(tr->buf, tr->buf + tr->start, tr->end - tr->start);
+		tr->end -= tr->start;
+		tr->scan -= tr->start;
+		tr->start = 0;
+	}
+
+	while (1) {
+		int r = recv(tr->sock, tr->buf + tr->end, tr->size - tr->end, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r > 0)
+			tr->end += r;
+		return r;
+	}
+}
+
+/*
+ * This function trNextJson returns the next JSON object from the stream, bytes
+ * before its '{' are skipped.  The object is null terminated in the reader's
+ * buffer and is good until the next call.
+ *
+ *   len = Set to the length of the object, or to why none was returned.
+ *
+ *   returns NULL on error, *len = -1 recv() failed, 0 connection closed,
+ *                -2 an object longer than maxFrame was skipped, call again.
+ *           else start of the object.
+ */
+char *trNextJson(TcpReader *tr, int *len) {
+	restore(tr);
+
+	while (1) {
+		if (tr->js.depth == 0) {
+			char *p = memchr(tr->buf + tr->start, '{', tr->end - tr->start);
+			tr->start = tr->scan = (p == NULL) ? tr->end : p - tr->buf;
+		}
+
+		if (tr->scan < tr->end) {
+			int n = jsonScan(&tr->js, tr->buf + tr->scan, tr->end - tr->scan);
+
+			if (n == 0) {
+				tr->scan = tr->end;
+			} else {
+				int objLen = tr->scan + n - tr->start;
+
+				memset(&tr->js, 0, sizeof(tr->js));
+				tr->scan += n;
+				if (tr->skipping) {
+					tr->skipping = 0;
+					tr->start = tr->scan;
+					*len = -2;
+					return NULL;
+				}
+
+				*len = objLen;
+				return frame(tr, objLen);
+			}
+		}
+
+		if (tr->end - tr->start > tr->maxFrame) {
+			// Too long, drop what there is and the rest of it as it comes.
+			tr->skipping = 1;
+			tr->start = tr->scan = tr->end;
+		}
+
+		int r = fill(tr);
+		if (r <= 0) {
+			*len = r;
+			return NULL;
+		}
+	}
+}
+
+/*
+ * This function trNextIDRec returns the next record from the stream, NKX1 records
+ * have an 8 byte header and no ID, NKX2 records a 12 byte header ending in an ID.
+ * The header is checked and removed.  The record is null terminated in the
+ * reader's buffer and is good until the next call.
+ *
+ *   id = Set to the record's ID, 0 for NKX1 records, may be NULL.
+ *   len = Set to the length of the record, or to why none was returned.
+ *
+ *   returns NULL on error, *len = -1 recv() failed, 0 connection closed,
+ *                -2 a record longer than maxFrame was skipped, call again.
+ *                -3 no NKX1 or NKX2 header, the stream is out of step, close it.
+ *           else start of the record.
+ */
+char *trNextIDRec(TcpReader *tr, unsigned int *id, int *len) {
+	restore(tr);
+
+	while (1) {
+		int have = tr->end - tr->start;
+
+		if (tr->skipBytes > 0) {
+			int n = (tr->skipBytes < have) ? (int)tr->skipBytes : have;
+
+			tr->start += n;
+			tr->scan = tr->start;
+			tr->skipBytes -= n;
+			if (tr->skipBytes == 0) {
+				*len = -2;
+				return NULL;
+			}
+		} else if (have >= REC_HDR_SIZE) {
+			unsigned char *h = (unsigned char *)tr->buf + tr->start;
+			int hdrLen;
+
+			if (memcmp(h, "NKX1", 4) == 0) {
+				hdrLen = REC_HDR_SIZE;
+			} else if (memcmp(h, "NKX2", 4) == 0) {
+				hdrLen = REC_ID_HDR_SIZE;
+			} else {
+				*len = -3;
+				return NULL;
+			}
+
+			long recLen = recGetWord(h + 4);
+
+			if (recLen > tr->maxFrame) {
+				tr->skipBytes = hdrLen + recLen;
+				continue;
+			}
+
+			if (have >= hdrLen + recLen) {
+				if (id != NULL)
+					*id = (hdrLen == REC_ID_HDR_SIZE) ? recGetWord(h + 8) : 0;
+				tr->start += hdrLen;
+				tr->scan = tr->start + recLen;
+				*len = recLen;
+				return frame(tr, recLen);
+			}
+		}
+
+		int r = fill(tr);
+		if (r <= 0) {
+			*len = r;
+			return NULL;
+		}
+	}
+}
+
+/*
+ * This function trNextRec returns the next record like trNextIDRec() without its ID.
+ */
+char *trNextRec(TcpReader *tr, int *len) {
+	return trNextIDRec(tr, NULL, len);
+}
+
+/*
+ * This function trSetMaxFrame raises the largest frame the reader returns, bytes
+ * already read are kept.  It never makes the buffer smaller.
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int trSetMaxFrame(TcpReader *tr, int maxFrame) {
+	if (maxFrame <= tr->maxFrame)
+		return 0;
+
+	int size = maxFrame + 2 * TR_READ_SIZE;
+	char *buf = (char *)realloc(tr->buf, size + 1);
+	if (buf == NULL) {
+		pErr("Could not grow reader buffer to %d bytes.\n", size);
+		return -1;
+	}
+
+	tr->buf = buf;
+	tr->size = size;
+	tr->maxFrame = maxFrame;
+
+	return 0;
+}
@@ -128,9 +128,11 @@ int tcpTimeoutConnect(const char *server, int port, int timeout) {
 
 	if (rtnVal == 0) {
 		pErr("inet_pton() failed, invalid address string.\n");
+		close(sock);
 		return -2;
 	} else if (rtnVal < 0) {
 		pErr("inet_pton() failed.\n");
+		close(sock);
 		return -3;
 	}
 	servAddr.sin_port = htons(port);    // Server port
@@ -143,6 +145,7 @@ int tcpTimeoutConnect(const char *server, int port, int timeout) {
 
 	if (r == -1 && (errno != EINPROGRESS)) {
 		pErr("connection failed: %s\n", strerror(errno));
+		close(sock);
 		return -4;
 	}
 
@@ -156,6 +159,7 @@ int tcpTimeoutConnect(const char *server, int port, int timeout) {
 
 	r = select(sock + 1, NULL, &fdset, NULL, &tv);
 	if (r == 0) {
+		close(sock);
 		return -5;
 	} else if ( r == 1) {
 		int so_error = 0;
@@ -166,6 +170,7 @@ int tcpTimeoutConnect(const char *server, int port, int timeout) {
 		if (so_error != 0) {
 			pErr("Connection failed, getsockopt() error: %d %s\n",
 					 so_error, strerror(so_error));
+			close(sock);
 			return -6;
 		}
 	}
@@ -323,10 +328,9 @@ int tcpSend(int sock, const char *msg) {
 
 /*
  * This function tcpRecSend sends a NULL terminated string to remote host.
- * If number of bytes sent does not equal msg length then the send buffer size
- * has been reached.  Interface can not send data fast enough or a number of
- * other reasons.
- * Prefixes the msg packet with an 8 byte header record.
+ * Prefixes the msg packet with an 8 byte header record, see recNumSend(), the
+ * header and msg are sent with one system call and all of msg is sent unless
+ * the connection fails.
  *
  *   sock = Socket descriptor.
  *   msg = NULL terminated string to send.
@@ -335,33 +339,7 @@ int tcpSend(int sock, const char *msg) {
  *           else Number of bytes sent.
  */
 int tcpRecSend(int sock, const char *msg) {
-	int len = strlen(msg);
-	char cmd[8];
-
-	strcpy(cmd, "NKX1");
-	uint32_t nl = htonl(len);
-	cmd[4] = (char)((nl >> 24) & 0xff);
-	cmd[5] = (char)((nl >> 16) & 0xff);
-	cmd[6] = (char)((nl >> 8) & 0xff);
-	cmd[7] = (char)(nl & 0xff);
-
-//	pOut("cmd: %c %c %c %c 0x%02x 0x%02x 0x%02x 0x%02x, %d\n'%s'\n",
-//			cmd[0], cmd[1], cmd[2], cmd[3],
-//			cmd[4], cmd[5], cmd[6], cmd[7], len, msg);
-
-	send(sock, cmd, 8, 0);
-
-	int r = send(sock, msg, len, 0);
-
-	if (r != len) {
-//		pErr("Could only send %d bytes of message length %d\n", r, len);
-		// Let programmer decide if this is an error.
-		// They may want to resend the data not sent.
-		// This is normally caused by the send socket buffer being full.  This
-		// is not an error but a warning that interface is backing up for some reason.
-	}
-
-	return r;
+	return recNumSend(sock, msg, strlen(msg));
 }
 
 /*
@@ -429,50 +407,67 @@ int tcpRecvString(int sock, char *buf, int buf_len) {
 
 /*
  * This function tcpRecvJson receives a JSON block from remote host.
- * This string is null terminated.
+ * This string is null terminated.  Bytes before the '{' are dropped.
+ * Data is looked at with MSG_PEEK and only the object is taken off the socket,
+ * so what follows it is left for the next call.  Use trNextJson() to read a
+ * stream of objects with fewer system calls.
  *
  *   sock = Socket descriptor.
  *   json = Buffer to place received JSON block into.
  *   json_len = Max size of json buffer.
  *
  *   returns -1 on error
+ *           0 if the connection closed.
  *           else Number of bytes received.
  */
 int tcpRecvJson(int sock, char *json, int json_len) {
-	int totalBytes = 0;
-	char buf[2];
-
+	JsonScan js;
 	int n = 0;
-	int start = 0;
+
+	memset(&js, 0, sizeof(js));
 	while (1) {
-		int r = recv(sock, buf, 1, 0);
-		if (r < 0)
+		char *p = json + n;
+		int r = recv(sock, p, json_len - 1 - n, MSG_PEEK);
+		if (r <= 0)
 			return r;
 
-		if (buf[0] == '{') {
-			start = 1;
+		if (js.depth == 0) {
+			char *b = memchr(p, '{', r);
+			int skip = (b == NULL) ? r : b - p;
+
+			if (skip > 0) {
+				recv(sock, p, skip, 0);
+				r -= skip;
+				if (r == 0)
+					continue;
+				memmove(p, p + skip, r);
+			}
 		}
 
-		if (start == 1) {
-			json[n++] = buf[0];
+		int end = jsonScan(&js, p, r);
+		int take = (end > 0) ? end : r;
+
+		recv(sock, p, take, 0);		// the same bytes that were peeked
+		n += take;
+
+		if (end > 0) {
+			json[n] = '\0';
+			return n;
 		}
 
-		if (n >= json_len) {
+		if (n >= json_len - 1) {
 			pErr("JSON ending '}' not found in %d bytes.\n", json_len);
 			return -1;
 		}
-
-		if (buf[0] == '}') {
-			json[n] = '\0';
-			break;
-		}
 	}
-
-	return totalBytes;
 }
 
+/*
+ * This function tcpClose closes sock.  Bytes a record receive read ahead are
+ * freed with it, see recClose().
+ */
 void tcpClose(int sock) {
-	close(sock);		// ignore any errors.
+	recClose(sock);
 }
 
 /*
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions send large payloads without copying them into the kernel.
+ * tcpSendFile() sends part of a file with sendfile(), or splice() through a pipe
+ * when the source is a pipe or socket.  tcpZcSend() sends a user buffer, a mmap
+ * snapshot for one, with MSG_ZEROCOPY, the pages go to the NIC and the kernel
+ * says on the socket's error queue when it is done with them.
+ */
+
+#define _GNU_SOURCE		// splice()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#include "miscutils.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+
+#define ZC_MIN_SEND		(16 * 1024)		// smaller sends are cheaper to copy
+#define ZC_CHUNK		(1024 * 1024)	// bytes per MSG_ZEROCOPY send()
+#define SPLICE_CHUNK	(64 * 1024)		// a pipe's default capacity
+
+// The kernel numbers each MSG_ZEROCOPY send on a socket, starting at 0.
+static pthread_mutex_t zcMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *zcNext = NULL;			// next send number, indexed by socket
+static int numZc = 0;
+
+/*
+ * This function waitWritable waits for room on a non-blocking socket.
+ * This function is private to this file.
+ */
+static void waitWritable(int sock) {
+	struct pollfd pfd = { sock, POLLOUT, 0 };
+
+	poll(&pfd, 1, -1);
+}
+
+/*
+ * This function spliceFile sends count bytes from fd, a pipe or socket, through
+ * a pipe so the data never comes to user space.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else number of bytes sent, less than count if fd ran out.
+ */
+static long spliceFile(int sock, int fd, long count) {
+	int p[2];
+	long sent = 0;
+
+	if (pipe2(p, O_CLOEXEC) < 0) {
+		pErr("pipe2() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	while (count <= 0 || sent < count) {
+		size_t want = (count > 0 && count - sent < SPLICE_CHUNK) ? count - sent : SPLICE_CHUNK;
+		ssize_t in = splice(fd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in < 0) {
+			pErr("splice() from %d failed: %s\n", fd, strerror(errno));
+			sent = -1;
+			break;
+		}
+		if (in == 0)
+			break;
+
+		while (in > 0) {
+			ssize_t out = splice(p[0], NULL, sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out < 0 && errno == EAGAIN) {
+				waitWritable(sock);
+				continue;
+			}
+			if (out < 0) {
+				pErr("splice() to socket %d failed: %s\n", sock, strerror(errno));
+				close(p[0]);
+				close(p[1]);
+				return -1;
+			}
+			in -= out;
+			sent += out;
+		}
+	}
+
+	close(p[0]);
+	close(p[1]);
+
+	return sent;
+}
+
+/*
+ * This function tcpSendFile sends count bytes of fd starting at offset, the
+ * kernel moves them from the page cache to the socket.  fd may be a regular
+ * file or a pipe or socket, for those offset is not used.
+ *
+ *   sock = Socket descriptor.
+ *   fd = Open file to send from, its file offset is not changed for regular files.
+ *   offset = First byte to send.
+ *   count = Number of bytes to send, 0 for the rest of the file.
+ *
+ *   returns -1 on error
+ *           else Number of bytes sent, less than count if the file is shorter.
+ */
+long tcpSendFile(int sock, int fd, off_t offset, long count) {
+	struct stat st;
+	long sent = 0;
+
+	if (fstat(fd, &st) < 0) {
+		pErr("fstat() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))
+		return spliceFile(sock, fd, count);
+
+	if (count <= 0)
+		count = (st.st_size > offset) ? st.st_size - offset : 0;
+
+	while (sent < count) {
+		ssize_t r = sendfile(sock, fd, &offset, count - sent);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				waitWritable(sock);
+				continue;
+			}
+			pErr("sendfile() failed after %ld bytes: %s\n", sent, strerror(errno));
+			return -1;
+		}
+		if (r == 0)
+			break;				// the file got shorter
+
+		sent += r;
+	}
+
+	return sent;
+}
+
+/*
+ * This function zcNumber gets or sets the number the kernel gives the next
+ * MSG_ZEROCOPY send on sock.  This function is private to this file.
+ *
+ *   next = New number, or NULL to leave it.
+ *
+ *   returns the number before any change.
+ */
+static uint32_t zcNumber(int sock, const uint32_t *next) {
+	uint32_t cur = 0;
+
+	pthread_mutex_lock(&zcMutex);
+
+	if (sock >= numZc && next != NULL) {
+		int n = (numZc == 0) ? 64 : numZc;
+		while (n <= sock)
+			n *= 2;
+
+		uint32_t *p = (uint32_t *)realloc(zcNext, n * sizeof(uint32_t));
+		if (p != NULL) {
+			memset(p + numZc, 0, (n - numZc) * sizeof(uint32_t));
+			zcNext = p;
+			numZc = n;
+		}
+	}
+
+	if (sock < numZc) {
+		cur = zcNext[sock];
+		if (next != NULL)
+			zcNext[sock] = *next;
+	}
+
+	pthread_mutex_unlock(&zcMutex);
+
+	return cur;
+}
+
+/*
+ * This function reapZc reads zero copy completions off the error queue and
+ * returns how many of the count sends numbered from first they cover, -1 on
+ * error.  Completions for other sends are dropped.  This function is private
+ * to this file.
+ */
+static int reapZc(int sock, uint32_t first, int count, int *copied) {
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	int done = 0;
+
+	while (1) {
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return done;
+			if (errno == EINTR)
+				continue;
+			pErr("recvmsg(MSG_ERRQUEUE) failed: %s\n", strerror(errno));
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// A range of send numbers, ee_info to ee_data, relative to ours so
+			// it still works when the numbers wrap.
+			int32_t lo = (int32_t)(ee->ee_info - first);
+			int32_t hi = (int32_t)(ee->ee_data - first);
+			if (lo < 0)
+				lo = 0;
+			if (hi > count - 1)
+				hi = count - 1;
+			if (hi < lo)
+				continue;
+
+			done += hi - lo + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied = 1;
+		}
+	}
+}
+
+/*
+ * This function waitZc waits until the kernel is done with the count sends
+ * numbered from first, *done of them are already.  POLLERR says the error queue
+ * has completions.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int waitZc(int sock, uint32_t first, int count, int *done, int *copied) {
+	while (*done < count) {
+		struct pollfd pfd = { sock, 0, 0 };
+
+		poll(&pfd, 1, 1000);
+
+		int n = reapZc(sock, first, count, copied);
+		if (n < 0)
+			return -1;
+		*done += n;
+	}
+
+	return 0;
+}
+
+/*
+ * This function tcpZcEnable allows MSG_ZEROCOPY on a socket, call it once before
+ * tcpZcSend().  It also starts counting the socket's sends from 0, as the kernel does.
+ *
+ *   returns -1 on error or if the kernel does not support it.
+ *           else 0.
+ */
+int tcpZcEnable(int sock) {
+	int on = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+		pErr("SO_ZEROCOPY not set: %s\n", strerror(errno));
+		return -1;
+	}
+	uint32_t zero = 0;
+	zcNumber(sock, &zero);
+
+	return 0;
+}
+
+/*
+ * This function tcpZcSend sends numBytes of msg without copying them, like
+ * tcpNumSend() but all of msg is sent.  It returns once the kernel is done with
+ * the pages, so msg may be changed or unmapped right after.  Sends under
+ * ZC_MIN_SEND bytes, and sockets without tcpZcEnable(), are copied as usual.
+ *
+ *   sock = Socket descriptor.
+ *   msg = Data to send.
+ *   numBytes = Number of bytes to send.
+ *   copied = Set to 1 if the kernel had to copy after all, as it does over
+ *            loopback, else 0.  May be NULL.
+ *
+ *   returns -1 on error, after waiting for the kernel to let go of what was sent.
+ *           else Number of bytes sent.
+ */
+long tcpZcSend(int sock, const char *msg, long numBytes, int *copied) {
+	int flags = MSG_NOSIGNAL;
+	int issued = 0;
+	int done = 0;
+	int wasCopied = 0;
+	long sent = 0;
+	int on = 0;
+	socklen_t len = sizeof(on);
+	uint32_t first = 0;
+
+	if (numBytes >= ZC_MIN_SEND && getsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, &len) == 0 && on) {
+		flags |= MSG_ZEROCOPY;
+		first = zcNumber(sock, NULL);
+	} else {
+		wasCopied = 1;
+	}
+
+	while (sent < numBytes) {
+		long want = (numBytes - sent < ZC_CHUNK) ? numBytes - sent : ZC_CHUNK;
+		ssize_t r = send(sock, msg + sent, want, flags);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				// Too many pages pinned, let completions catch up.
+				int n = reapZc(sock, first, issued, &wasCopied);
+				if (n < 0)
+					break;
+				done += n;
+				if (n == 0) {
+					struct pollfd pfd = { sock, 0, 0 };
+					poll(&pfd, 1, 10);
+				}
+				continue;
+			}
+			if (errno == EAGAIN) {
+				waitWritable(sock);
+				continue;
+			}
+			pErr("send() failed after %ld bytes: %s\n", sent, strerror(errno));
+			break;
+		}
+
+		sent += r;
+		if (flags & MSG_ZEROCOPY)
+			issued++;
+	}
+
+	if (flags & MSG_ZEROCOPY) {
+		uint32_t next = first + issued;
+		zcNumber(sock, &next);
+
+		// Even after an error the kernel may still hold pages of msg, and
+		// the caller is free to change it once this returns.
+		if (waitZc(sock, first, issued, &done, &wasCopied) < 0)
+			return -1;
+	}
+
+	if (sent < numBytes)
+		return -1;
+
+	if (copied != NULL)
+		*copied = wasCopied;
+
+	return sent;
+}
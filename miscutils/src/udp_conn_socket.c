@@ -182,6 +182,22 @@ int udpConnRecv(int sock, char *buf, int buf_len) {
 	return r;
 }
 
+/*
+ * This function udpConnRecvBatch receives up to num datagrams from the connected
+ * peer, see udpRecvBatch(), addr may be left NULL in msgs.
+ */
+int udpConnRecvBatch(int sock, UdpMsg *msgs, int num, int wait) {
+	return udpRecvBatch(sock, msgs, num, wait);
+}
+
+/*
+ * This function udpConnSendBatch sends num datagrams to the connected peer, see
+ * udpSendBatch(), leave addr NULL in msgs.
+ */
+int udpConnSendBatch(int sock, UdpMsg *msgs, int num) {
+	return udpSendBatch(sock, msgs, num);
+}
+
 
 void udpConnClose(int sock) {
 	close(sock);		// ignore any errors.
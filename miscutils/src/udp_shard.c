@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions run a UDP server across CPUs.  Each receive thread has its own
+ * SO_REUSEPORT socket on the same port and is pinned to a CPU, the kernel hashes
+ * each flow to one socket, or a CBPF program picks it, so the threads share
+ * nothing.  Datagrams are taken in batches with udpRecvBatch() and handed to the
+ * callback in the thread that received them.
+ */
+
+#define _GNU_SOURCE		// pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+#include "miscutils.h"
+
+#define UDP_SHARD_BATCH		64			// datagrams per udpRecvBatch()
+#define UDP_SHARD_BUF		9216		// room for a jumbo frame
+#define UDP_SHARD_POLL_MS	100			// how often threads look for udpShardStop()
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+typedef struct _udpShard {
+	UdpShards *us;
+	int idx;
+	int sock;
+	int cpu;					// the thread is pinned to
+	pthread_t thread;
+} UdpShard;
+
+struct _udpShards {
+	int numShards;
+	UdpShard *shards;
+	UdpShardCb cb;
+	void *arg;
+	volatile int stop;
+};
+
+/*
+ * This function shardSocket creates a SO_REUSEPORT UDP socket bound to server
+ * and port.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else socket descriptor.
+ */
+static int shardSocket(const char *server, int port) {
+	struct sockaddr_in addr;
+	struct timeval tv = { 0, UDP_SHARD_POLL_MS * 1000 };
+	int on = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (server == NULL) {
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	} else if (inet_pton(AF_INET, server, &addr.sin_addr.s_addr) != 1) {
+		pErr("inet_pton() failed, invalid address string %s.\n", server);
+		return -1;
+	}
+
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0) {
+		pErr("socket failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+			setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		pErr("Error setting socket options: %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		pErr("bind to port %d failed: %s\n", port, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+ * This function shardThread receives on one shard's socket until udpShardStop().
+ * This function is private to this file.
+ */
+static void *shardThread(void *p) {
+	UdpShard *sh = (UdpShard *)p;
+	UdpShards *us = sh->us;
+	UdpMsg msgs[UDP_SHARD_BATCH];
+	struct sockaddr_in addrs[UDP_SHARD_BATCH];
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(sh->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	char *bufs = (char *)malloc(UDP_SHARD_BATCH * UDP_SHARD_BUF);
+	for (int i = 0; i < UDP_SHARD_BATCH; i++) {
+		msgs[i].buf = bufs + i * UDP_SHARD_BUF;
+		msgs[i].bufLen = UDP_SHARD_BUF;
+		msgs[i].addr = &addrs[i];
+	}
+
+	while (!us->stop) {
+		int r = udpRecvBatch(sh->sock, msgs, UDP_SHARD_BATCH, 1);
+		if (r > 0)
+			us->cb(sh->idx, sh->sock, msgs, r, us->arg);
+		else if (r < 0)
+			break;
+	}
+
+	free(bufs);
+
+	return NULL;
+}
+
+/*
+ * This function udpShardServer starts numThreads receive threads for port, each
+ * with its own socket and pinned to the CPUs this process may run on in turn,
+ * so with one thread per CPU each has its own.  cb is called in the receiving
+ * thread with each batch of datagrams, the buffers are reused once it returns.
+ * Reply on the sock passed to cb.  Without steering the kernel spreads flows
+ * over the sockets by a hash of the addresses and ports.
+ *
+ *   server = Local address to bind, NULL for all.
+ *   port = Port number.
+ *   numThreads = Threads to run, 0 for one per online CPU.
+ *   cb = Called with the thread's index, its socket and the datagrams received.
+ *   arg = Passed to cb.
+ *
+ *   returns NULL on error
+ *           else handle for udpShardStop().
+ */
+UdpShards *udpShardServer(const char *server, int port, int numThreads, UdpShardCb cb, void *arg) {
+	if (numThreads <= 0)
+		numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	cpu_set_t allowed;
+	int cpuList[CPU_SETSIZE];
+	int numCpus = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int c = 0; c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &allowed))
+				cpuList[numCpus++] = c;
+		}
+	}
+	if (numCpus == 0)
+		cpuList[numCpus++] = 0;
+
+	UdpShards *us = (UdpShards *)calloc(1, sizeof(UdpShards));
+	us->numShards = numThreads;
+	us->shards = (UdpShard *)calloc(numThreads, sizeof(UdpShard));
+	us->cb = cb;
+	us->arg = arg;
+
+	// Bind every socket first, a steering program numbers them in bind order.
+	for (int i = 0; i < numThreads; i++) {
+		us->shards[i].us = us;
+		us->shards[i].idx = i;
+		us->shards[i].cpu = cpuList[i % numCpus];
+		us->shards[i].sock = shardSocket(server, port);
+		if (us->shards[i].sock < 0) {
+			while (--i >= 0)
+				close(us->shards[i].sock);
+			free(us->shards);
+			free(us);
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < numThreads; i++) {
+		if (pthread_create(&us->shards[i].thread, NULL, shardThread, &us->shards[i]) != 0) {
+			pErr("Could not start receive thread %d.\n", i);
+			for (int j = i; j < numThreads; j++)
+				close(us->shards[j].sock);
+			us->numShards = i;
+			udpShardStop(us);
+			return NULL;
+		}
+	}
+
+	return us;
+}
+
+/*
+ * This function udpShardSock returns the socket of thread idx, to set options on.
+ */
+int udpShardSock(UdpShards *us, int idx) {
+	if (idx < 0 || idx >= us->numShards)
+		return -1;
+
+	return us->shards[idx].sock;
+}
+
+/*
+ * This function udpShardSteerProg attaches a classic BPF program that returns
+ * the index of the thread each datagram goes to, 0 to numThreads - 1.  An index
+ * out of range falls back to the kernel's hash.
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int udpShardSteerProg(UdpShards *us, struct sock_fprog *prog) {
+	// The program belongs to the group, attaching it to one socket is enough.
+	if (setsockopt(us->shards[0].sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, prog, sizeof(*prog)) < 0) {
+		pErr("Could not attach steering program: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function udpShardSteerCpu sends each datagram to the thread pinned to the
+ * CPU that took it off the network, so with RSS or RPS a flow stays on one CPU
+ * from the interrupt to the callback.  The program is built from where the
+ * threads are pinned, datagrams taken on a CPU with no thread go by the
+ * kernel's hash, and of threads sharing a CPU the first gets them.
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int udpShardSteerCpu(UdpShards *us) {
+	// Load the CPU, then a compare and return for each thread, then the fall back.
+	int len = 2 + (2 * us->numShards);
+	if (len > BPF_MAXINSNS) {
+		pErr("Too many threads, %d, to steer by CPU.\n", us->numShards);
+		return -1;
+	}
+
+	struct sock_filter *code = (struct sock_filter *)calloc(len, sizeof(struct sock_filter));
+	if (code == NULL)
+		return -1;
+
+	int n = 0;
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (int i = 0; i < us->numShards; i++) {
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, us->shards[i].cpu, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, us->numShards);	// out of range
+
+	struct sock_fprog prog = { n, code };
+	int ret = udpShardSteerProg(us, &prog);
+	free(code);
+
+	return ret;
+}
+
+/*
+ * This function udpShardStop stops the receive threads, waits for them and closes
+ * the sockets.  Call it from outside the callbacks.
+ */
+void udpShardStop(UdpShards *us) {
+	if (us == NULL)
+		return;
+
+	us->stop = 1;
+	for (int i = 0; i < us->numShards; i++)
+		pthread_join(us->shards[i].thread, NULL);
+
+	for (int i = 0; i < us->numShards; i++)
+		close(us->shards[i].sock);
+
+	free(us->shards);
+	free(us);
+}
@@ -20,6 +20,8 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE		// recvmmsg(), sendmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -27,13 +29,18 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 
 #include "miscutils.h"
 
+#define UDP_BATCH	256		// messages per recvmmsg() or sendmmsg()
+
 /*
  * This function udpServer creates a UDP socket.
  *
@@ -219,6 +226,177 @@ int udpRecv (int sock, char *buf, int bufLen, struct sockaddr_in *remote, sockle
     return r;
 }
 
+/*
+ * This function udpRecvBatch receives up to num datagrams with as few system
+ * calls as possible, recvmmsg() takes every datagram queued at the time.
+ *
+ *   sock = Socket descriptor.
+ *   msgs = Array of num messages, buf and bufLen set by the caller.  len is set
+ *          to the bytes received, addr if not NULL to the sender and segSize to
+ *          the datagram size when GRO joined several into buf, else 0.
+ *   num = Number of messages in msgs.
+ *   wait = 1 to wait for the first datagram, 0 to return at once.
+ *
+ *   returns -1 on error
+ *           0 if nothing arrived, or the socket's receive timeout ran out.
+ *           else Number of messages filled.
+ */
+int udpRecvBatch(int sock, UdpMsg *msgs, int num, int wait) {
+	struct mmsghdr mh[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	char ctrl[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+	int got = 0;
+
+	while (got < num) {
+		int n = (num - got < UDP_BATCH) ? num - got : UDP_BATCH;
+
+		memset(mh, 0, n * sizeof(struct mmsghdr));
+		for (int i = 0; i < n; i++) {
+			UdpMsg *m = &msgs[got + i];
+			iov[i].iov_base = m->buf;
+			iov[i].iov_len = m->bufLen;
+			mh[i].msg_hdr.msg_iov = &iov[i];
+			mh[i].msg_hdr.msg_iovlen = 1;
+			mh[i].msg_hdr.msg_name = m->addr;
+			mh[i].msg_hdr.msg_namelen = (m->addr != NULL) ? sizeof(struct sockaddr_in) : 0;
+			mh[i].msg_hdr.msg_control = ctrl[i];
+			mh[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+
+		// Only the first call waits, after that take what is queued.
+		int flags = (wait && got == 0) ? MSG_WAITFORONE : MSG_DONTWAIT;
+		int r = recvmmsg(sock, mh, n, flags, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (got == 0) {
+				pErr("recvmmsg() failed: %s\n", strerror(errno));
+				return -1;
+			}
+			break;
+		}
+
+		for (int i = 0; i < r; i++) {
+			UdpMsg *m = &msgs[got + i];
+			struct cmsghdr *cm;
+
+			m->len = mh[i].msg_len;
+			m->segSize = 0;
+			for (cm = CMSG_FIRSTHDR(&mh[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&mh[i].msg_hdr, cm)) {
+				if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+					memcpy(&m->segSize, CMSG_DATA(cm), sizeof(int));
+			}
+		}
+
+		got += r;
+		if (r < n)
+			break;
+	}
+
+	return got;
+}
+
+/*
+ * This function udpSendBatch sends num datagrams with as few system calls as
+ * possible.  When segSize is set, buf holds several datagrams of segSize bytes
+ * and the kernel splits them (UDP GSO), the last may be shorter.
+ *
+ *   sock = Socket descriptor.
+ *   msgs = Array of num messages, buf and len to send, addr to send to or NULL
+ *          on a connected socket, segSize or 0.
+ *   num = Number of messages in msgs.
+ *
+ *   returns -1 on error
+ *           else Number of messages sent, less than num if an error stopped it.
+ */
+int udpSendBatch(int sock, UdpMsg *msgs, int num) {
+	struct mmsghdr mh[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	char ctrl[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+	int sent = 0;
+
+	while (sent < num) {
+		int n = (num - sent < UDP_BATCH) ? num - sent : UDP_BATCH;
+
+		memset(mh, 0, n * sizeof(struct mmsghdr));
+		for (int i = 0; i < n; i++) {
+			UdpMsg *m = &msgs[sent + i];
+			iov[i].iov_base = m->buf;
+			iov[i].iov_len = m->len;
+			mh[i].msg_hdr.msg_iov = &iov[i];
+			mh[i].msg_hdr.msg_iovlen = 1;
+			mh[i].msg_hdr.msg_name = m->addr;
+			mh[i].msg_hdr.msg_namelen = (m->addr != NULL) ? sizeof(struct sockaddr_in) : 0;
+
+			if (m->segSize > 0) {
+				uint16_t seg = m->segSize;
+				struct cmsghdr *cm;
+
+				mh[i].msg_hdr.msg_control = ctrl[i];
+				mh[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+				cm = CMSG_FIRSTHDR(&mh[i].msg_hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+			}
+		}
+
+		int r = sendmmsg(sock, mh, n, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { sock, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			pErr("sendmmsg() failed after %d messages: %s\n", sent, strerror(errno));
+			return (sent > 0) ? sent : -1;
+		}
+
+		sent += r;
+	}
+
+	return sent;
+}
+
+/*
+ * This function udpSetGso sets the UDP GSO segment size for every send on the
+ * socket, a send of more than segSize bytes goes out as segSize datagrams.
+ * 0 turns it off.
+ *
+ *   returns -1 on error or if the kernel does not support UDP GSO.
+ *           else 0.
+ */
+int udpSetGso(int sock, int segSize) {
+	if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segSize, sizeof(segSize)) < 0) {
+		pErr("UDP GSO not set: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function udpSetGro lets the kernel join datagrams from the same flow into
+ * one receive, udpRecvBatch() reports their size in segSize.  Receive buffers
+ * should be 64K bytes.
+ *
+ *   returns -1 on error or if the kernel does not support UDP GRO.
+ *           else 0.
+ */
+int udpSetGro(int sock, int on) {
+	if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+		pErr("UDP GRO not set: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 void udpClose(int sock) {
 	close(sock);
 	sock = -1;
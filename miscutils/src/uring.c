@@ -0,0 +1,1008 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * These functions run sockets from an io_uring instead of one system call per
+ * accept, recv or send.  A listening socket has one multishot accept and each
+ * connection one multishot recv, the kernel picks a buffer for every completion
+ * from a ring of provided buffers, and sends are queued as submissions.  Each
+ * trip round the loop is one io_uring_enter() that submits everything queued
+ * and collects everything completed.
+ *
+ * The rings are set up with the raw system calls, liburing is not needed.  If
+ * the kernel is older than 6.1 or io_uring is turned off, the same functions
+ * run on epoll with non-blocking calls, urIsUring() tells which.
+ */
+
+#define _GNU_SOURCE		// accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "miscutils.h"
+
+#if defined(IORING_SETUP_DEFER_TASKRUN) && defined(__NR_io_uring_setup)
+#define UR_HAVE_URING	1
+#else
+#define UR_HAVE_URING	0
+#endif
+
+#define UR_SQ_ENTRIES	256
+#define UR_CQ_ENTRIES	4096
+#define UR_WAIT_MS		100			// how often urRun() looks for urStop()
+#define UR_BGID			0			// provided buffer group
+
+#define UR_NONE			0
+#define UR_LISTEN		1
+#define UR_STREAM		2
+#define UR_DGRAM		3
+
+// Completion types, in the low 3 bits of user_data.
+#define OP_ACCEPT		1
+#define OP_RECV			2
+#define OP_RECVMSG		3
+#define OP_SEND			4
+#define OP_CANCEL		5
+
+typedef struct _urSend {
+	struct _urSend *next;
+	int fd;
+	unsigned int gen;			// of the socket when queued
+	int len;
+	int off;					// bytes sent so far
+	struct sockaddr_in to;
+	struct msghdr mh;			// datagrams only
+	struct iovec iov;
+	char data[];
+} UrSend;
+
+typedef struct _urFd {
+	int type;
+	unsigned int gen;			// bumped by urClose(), stale completions are ignored
+	UrAcceptCb acceptCb;
+	UrRecvCb recvCb;
+	UrDgramCb dgramCb;
+	void *arg;
+	UrSend *sendHead;			// waiting to be sent, streams send one at a time
+	UrSend *sendTail;
+	UrSend *inFlight;			// io_uring, the send the kernel has
+	int wantOut;				// epoll, waiting for room to send
+	int closing;				// io_uring, closed once the cancel completes
+	struct msghdr rmh;			// recvmsg() layout for datagrams
+} UrFd;
+
+struct _urLoop {
+	int uring;					// 0 on the epoll path
+	volatile int stop;
+	UrFd **fds;					// indexed by socket
+	int numFds;
+	int numBufs;
+	int bufSize;
+	char *bufs;
+
+	// io_uring
+	int ringFd;
+	void *sqRing;
+	void *cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqArray;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned sqLocal;			// tail not yet given to the kernel
+	unsigned toSubmit;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	size_t brSize;
+	unsigned short brTail;
+
+	// epoll
+	int epfd;
+};
+
+static void urFreeRing(UrLoop *ul);
+
+/*
+ * This function getFd returns the table entry for sock, making it if needed.
+ * Entries do not move, the kernel may hold pointers into them.
+ * This function is private to this file.
+ */
+static UrFd *getFd(UrLoop *ul, int sock) {
+	if (sock >= ul->numFds) {
+		int n = (ul->numFds == 0) ? 1024 : ul->numFds;
+		while (n <= sock)
+			n *= 2;
+
+		ul->fds = (UrFd **)realloc(ul->fds, n * sizeof(UrFd *));
+		memset(ul->fds + ul->numFds, 0, (n - ul->numFds) * sizeof(UrFd *));
+		ul->numFds = n;
+	}
+
+	if (ul->fds[sock] == NULL)
+		ul->fds[sock] = (UrFd *)calloc(1, sizeof(UrFd));
+
+	return ul->fds[sock];
+}
+
+/*
+ * This function findFd returns the entry for sock if it is in use, else NULL.
+ * This function is private to this file.
+ */
+static UrFd *findFd(UrLoop *ul, int sock) {
+	if (sock < 0 || sock >= ul->numFds || ul->fds[sock] == NULL || ul->fds[sock]->type == UR_NONE)
+		return NULL;
+
+	return ul->fds[sock];
+}
+
+#if UR_HAVE_URING
+
+static uint64_t tag(int op, int fd, unsigned int gen) {
+	return ((uint64_t)gen << 32) | ((uint64_t)fd << 3) | op;
+}
+
+/*
+ * This function enter submits what is queued and, with wait, waits up to
+ * UR_WAIT_MS for a completion.  This function is private to this file.
+ */
+static int enter(UrLoop *ul, int wait) {
+	struct __kernel_timespec ts = { 0, UR_WAIT_MS * 1000000L };
+	struct io_uring_getevents_arg arg;
+	unsigned flags = 0;
+	int r;
+
+	__atomic_store_n(ul->sqTail, ul->sqLocal, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	if (wait)
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+	do {
+		r = syscall(__NR_io_uring_enter, ul->ringFd, ul->toSubmit, wait ? 1 : 0, flags,
+				wait ? &arg : NULL, sizeof(arg));
+	} while (r < 0 && errno == EINTR);
+
+	if (r >= 0) {
+		ul->toSubmit -= r;
+	} else if (errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+		pErr("io_uring_enter() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function getSqe returns a zeroed submission entry, submitting first if
+ * the queue is full.  This function is private to this file.
+ */
+static struct io_uring_sqe *getSqe(UrLoop *ul) {
+	while (ul->sqLocal - __atomic_load_n(ul->sqHead, __ATOMIC_ACQUIRE) >= ul->sqEntries)
+		enter(ul, 0);
+
+	unsigned idx = ul->sqLocal & ul->sqMask;
+	struct io_uring_sqe *sqe = &ul->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ul->sqArray[idx] = idx;
+	ul->sqLocal++;
+	ul->toSubmit++;
+
+	return sqe;
+}
+
+/*
+ * This function putBuf gives buffer bid back to the kernel.
+ * This function is private to this file.
+ */
+static void putBuf(UrLoop *ul, int bid) {
+	struct io_uring_buf *b = &ul->br->bufs[ul->brTail & (ul->numBufs - 1)];
+
+	b->addr = (uint64_t)(uintptr_t)(ul->bufs + (size_t)bid * ul->bufSize);
+	b->len = ul->bufSize;
+	b->bid = bid;
+	ul->brTail++;
+	__atomic_store_n(&ul->br->tail, ul->brTail, __ATOMIC_RELEASE);
+}
+
+static void armAccept(UrLoop *ul, int sock, UrFd *f) {
+	struct io_uring_sqe *sqe = getSqe(ul);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = tag(OP_ACCEPT, sock, f->gen);
+}
+
+static void armRecv(UrLoop *ul, int sock, UrFd *f) {
+	struct io_uring_sqe *sqe = getSqe(ul);
+
+	if (f->type == UR_DGRAM) {
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (uint64_t)(uintptr_t)&f->rmh;
+		sqe->len = 1;
+		sqe->user_data = tag(OP_RECVMSG, sock, f->gen);
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->user_data = tag(OP_RECV, sock, f->gen);
+	}
+	sqe->fd = sock;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UR_BGID;
+}
+
+static void armSend(UrLoop *ul, UrSend *s) {
+	struct io_uring_sqe *sqe = getSqe(ul);
+
+	if (s->mh.msg_name != NULL) {
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (uint64_t)(uintptr_t)&s->mh;
+		sqe->len = 1;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)(s->data + s->off);
+		sqe->len = s->len - s->off;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	sqe->fd = s->fd;
+	sqe->user_data = (uint64_t)(uintptr_t)s | OP_SEND;
+}
+
+/*
+ * This function setupRing creates the io_uring, maps its queues and registers
+ * the provided buffers.  This function is private to this file.
+ *
+ *   returns -1 if io_uring can not be used.
+ *           else 0.
+ */
+static int setupRing(UrLoop *ul) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+			IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = UR_CQ_ENTRIES;
+
+	ul->ringFd = syscall(__NR_io_uring_setup, UR_SQ_ENTRIES, &p);
+	if (ul->ringFd < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(ul->ringFd);
+		ul->ringFd = -1;
+		return -1;
+	}
+
+	ul->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ul->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ul->cqRingSize > ul->sqRingSize)
+		ul->sqRingSize = ul->cqRingSize;
+	ul->cqRingSize = 0;			// one map holds both
+
+	ul->sqRing = mmap(NULL, ul->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ul->ringFd, IORING_OFF_SQ_RING);
+	ul->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	ul->sqes = (struct io_uring_sqe *)mmap(NULL, ul->sqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ul->ringFd, IORING_OFF_SQES);
+	if (ul->sqRing == MAP_FAILED || ul->sqes == MAP_FAILED) {
+		pErr("Could not map io_uring queues: %s\n", strerror(errno));
+		urFreeRing(ul);
+		return -1;
+	}
+	ul->cqRing = ul->sqRing;
+
+	char *sq = (char *)ul->sqRing;
+	ul->sqHead = (unsigned *)(sq + p.sq_off.head);
+	ul->sqTail = (unsigned *)(sq + p.sq_off.tail);
+	ul->sqArray = (unsigned *)(sq + p.sq_off.array);
+	ul->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ul->sqEntries = p.sq_entries;
+	ul->sqLocal = *ul->sqTail;
+	ul->cqHead = (unsigned *)(sq + p.cq_off.head);
+	ul->cqTail = (unsigned *)(sq + p.cq_off.tail);
+	ul->cqMask = *(unsigned *)(sq + p.cq_off.ring_mask);
+	ul->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+	// The provided buffer ring, numBufs is a power of 2.
+	ul->brSize = ul->numBufs * sizeof(struct io_uring_buf);
+	ul->br = (struct io_uring_buf_ring *)mmap(NULL, ul->brSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ul->br == MAP_FAILED) {
+		ul->br = NULL;
+		urFreeRing(ul);
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ul->br;
+	reg.ring_entries = ul->numBufs;
+	reg.bgid = UR_BGID;
+	if (syscall(__NR_io_uring_register, ul->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		urFreeRing(ul);
+		return -1;
+	}
+
+	for (int i = 0; i < ul->numBufs; i++)
+		putBuf(ul, i);
+
+	return 0;
+}
+
+static void urFreeRing(UrLoop *ul) {
+	if (ul->br != NULL)
+		munmap(ul->br, ul->brSize);
+	if (ul->sqes != NULL && ul->sqes != MAP_FAILED)
+		munmap(ul->sqes, ul->sqesSize);
+	if (ul->sqRing != NULL && ul->sqRing != MAP_FAILED)
+		munmap(ul->sqRing, ul->sqRingSize);
+	if (ul->ringFd >= 0)
+		close(ul->ringFd);
+
+	ul->br = NULL;
+	ul->sqes = NULL;
+	ul->sqRing = NULL;
+	ul->ringFd = -1;
+}
+
+/*
+ * This function sendDone handles a send completion, the rest of a short send or
+ * the next queued send goes in.  This function is private to this file.
+ */
+static void sendDone(UrLoop *ul, UrSend *s, int res) {
+	UrFd *f = findFd(ul, s->fd);
+
+	if (f == NULL || f->gen != s->gen || f->type == UR_DGRAM) {
+		if (res < 0 && f != NULL && f->gen == s->gen)
+			pErr("sendmsg() on socket %d failed: %s\n", s->fd, strerror(-res));
+		free(s);
+		return;
+	}
+
+	if (res < 0) {
+		int sock = s->fd;
+
+		f->inFlight = NULL;
+		free(s);
+		f->recvCb(ul, sock, NULL, 0, f->arg);
+		urClose(ul, sock);
+		return;
+	}
+
+	s->off += res;
+	if (s->off < s->len) {
+		armSend(ul, s);
+		return;
+	}
+
+	free(s);
+	f->inFlight = f->sendHead;
+	if (f->inFlight != NULL) {
+		f->sendHead = f->inFlight->next;
+		if (f->sendHead == NULL)
+			f->sendTail = NULL;
+		armSend(ul, f->inFlight);
+	}
+}
+
+/*
+ * This function reap handles every completion posted.
+ * This function is private to this file.
+ */
+static void reap(UrLoop *ul) {
+	unsigned head = *ul->cqHead;
+	unsigned tail = __atomic_load_n(ul->cqTail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ul->cqes[head & ul->cqMask];
+		uint64_t ud = cqe->user_data;
+		int res = cqe->res;
+		unsigned cflags = cqe->flags;
+		int op = ud & 7;
+
+		head++;
+
+		if (op == OP_SEND) {
+			sendDone(ul, (UrSend *)(uintptr_t)(ud & ~(uint64_t)7), res);
+			continue;
+		}
+
+		int sock = (ud >> 3) & 0x1fffffff;
+		unsigned int gen = ud >> 32;
+		UrFd *f = findFd(ul, sock);
+		int live = (f != NULL && f->gen == gen);
+		char *buf = NULL;
+		int bid = -1;
+
+		if (cflags & IORING_CQE_F_BUFFER) {
+			bid = cflags >> IORING_CQE_BUFFER_SHIFT;
+			buf = ul->bufs + (size_t)bid * ul->bufSize;
+		}
+
+		switch (op) {
+		case OP_ACCEPT:
+			if (!live) {
+				if (res >= 0)
+					close(res);
+				break;
+			}
+			if (res >= 0)
+				f->acceptCb(ul, res, f->arg);
+			else
+				pErr("accept on socket %d failed: %s\n", sock, strerror(-res));
+			if (!(cflags & IORING_CQE_F_MORE) && findFd(ul, sock) == f && f->gen == gen)
+				armAccept(ul, sock, f);
+			break;
+
+		case OP_RECV:
+			if (!live)
+				break;
+			if (res > 0) {
+				if (f->recvCb(ul, sock, buf, res, f->arg) < 0) {
+					urClose(ul, sock);
+					break;
+				}
+			} else if (res != -ENOBUFS) {
+				f->recvCb(ul, sock, NULL, 0, f->arg);		// closed or failed
+				urClose(ul, sock);
+				break;
+			}
+			if (!(cflags & IORING_CQE_F_MORE) && findFd(ul, sock) == f && f->gen == gen)
+				armRecv(ul, sock, f);
+			break;
+
+		case OP_RECVMSG:
+			if (!live)
+				break;
+			if (res > 0) {
+				struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+				char *name = buf + sizeof(*out);
+				int hdr = sizeof(*out) + f->rmh.msg_namelen + f->rmh.msg_controllen;
+				// payloadlen is the datagram's full length, only res - hdr of it is in the buffer.
+				int len = res - hdr;
+
+				if (len > ul->bufSize - hdr)
+					len = ul->bufSize - hdr;
+				if (len < 0)
+					len = 0;
+
+				f->dgramCb(ul, sock, buf + hdr, len, (struct sockaddr_in *)name,
+						out->flags & MSG_TRUNC, f->arg);
+			} else if (res < 0 && res != -ENOBUFS) {
+				pErr("recvmsg on socket %d failed: %s\n", sock, strerror(-res));
+			}
+			if (!(cflags & IORING_CQE_F_MORE) && findFd(ul, sock) == f && f->gen == gen)
+				armRecv(ul, sock, f);
+			break;
+
+		case OP_CANCEL:
+			if (f == NULL && sock < ul->numFds && ul->fds[sock] != NULL)
+				ul->fds[sock]->closing = 0;
+			close(sock);		// every request on it has been cancelled
+			break;
+		}
+
+		if (bid >= 0)
+			putBuf(ul, bid);
+	}
+
+	__atomic_store_n(ul->cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif	// UR_HAVE_URING
+
+/*
+ * This function urCreate creates a loop, on io_uring when the kernel allows it.
+ *
+ *   numBufs = Receive buffers shared by all sockets, rounded up to a power of 2.
+ *   bufSize = Size of each, the most one completion can carry.
+ *   flags = UR_EPOLL to use epoll even when io_uring works, for comparing.
+ *
+ *   returns NULL on error
+ *           else loop handle.
+ */
+UrLoop *urCreate(int numBufs, int bufSize, int flags) {
+	UrLoop *ul = (UrLoop *)calloc(1, sizeof(UrLoop));
+	int n = 1;
+
+	while (n < numBufs && n < 32768)
+		n *= 2;
+
+	ul->numBufs = n;
+	ul->bufSize = bufSize;
+	ul->ringFd = -1;
+	ul->epfd = -1;
+	ul->bufs = (char *)malloc((size_t)n * bufSize);
+
+#if UR_HAVE_URING
+	if (!(flags & UR_EPOLL) && setupRing(ul) == 0) {
+		ul->uring = 1;
+		return ul;
+	}
+#endif
+
+	ul->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ul->epfd < 0) {
+		pErr("epoll_create1() failed: %s\n", strerror(errno));
+		free(ul->bufs);
+		free(ul);
+		return NULL;
+	}
+
+	return ul;
+}
+
+/*
+ * This function urIsUring returns 1 if the loop runs on io_uring, 0 for epoll.
+ */
+int urIsUring(UrLoop *ul) {
+	return ul->uring;
+}
+
+/*
+ * This function watch adds sock to the epoll set.
+ * This function is private to this file.
+ */
+static int watch(UrLoop *ul, int sock, int events) {
+	struct epoll_event ev;
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	ev.events = events;
+	ev.data.fd = sock;
+	if (epoll_ctl(ul->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		pErr("epoll_ctl() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function urAccept calls cb with every connection accepted on listenSock,
+ * a socket from tcpServer().  Pass the new sockets to urRecv().
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int urAccept(UrLoop *ul, int listenSock, UrAcceptCb cb, void *arg) {
+	UrFd *f = getFd(ul, listenSock);
+
+	f->type = UR_LISTEN;
+	f->acceptCb = cb;
+	f->arg = arg;
+
+#if UR_HAVE_URING
+	if (ul->uring) {
+		armAccept(ul, listenSock, f);
+		return 0;
+	}
+#endif
+
+	return watch(ul, listenSock, EPOLLIN);
+}
+
+/*
+ * This function urRecv calls cb with the bytes of each receive on a connected
+ * socket, as they come, with no framing.  cb gets len 0 once when the connection
+ * closes or fails, the loop then closes sock.  cb returns -1 to close it.
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int urRecv(UrLoop *ul, int sock, UrRecvCb cb, void *arg) {
+	UrFd *f = getFd(ul, sock);
+
+	f->type = UR_STREAM;
+	f->recvCb = cb;
+	f->arg = arg;
+
+#if UR_HAVE_URING
+	if (ul->uring) {
+		armRecv(ul, sock, f);
+		return 0;
+	}
+#endif
+
+	return watch(ul, sock, EPOLLIN);
+}
+
+/*
+ * This function urRecvFrom calls cb with each datagram received on a UDP socket,
+ * a datagram longer than the loop's bufSize is cut short and cb is given
+ * MSG_TRUNC in flags.  With io_uring the address is kept in the same buffer, so
+ * a little less than bufSize of the datagram fits.
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int urRecvFrom(UrLoop *ul, int sock, UrDgramCb cb, void *arg) {
+	UrFd *f = getFd(ul, sock);
+
+	f->type = UR_DGRAM;
+	f->dgramCb = cb;
+	f->arg = arg;
+	memset(&f->rmh, 0, sizeof(f->rmh));
+	f->rmh.msg_namelen = sizeof(struct sockaddr_in);
+
+#if UR_HAVE_URING
+	if (ul->uring) {
+		armRecv(ul, sock, f);
+		return 0;
+	}
+#endif
+
+	return watch(ul, sock, EPOLLIN);
+}
+
+/*
+ * This function newSend copies data for a queued send.
+ * This function is private to this file.
+ */
+static UrSend *newSend(int sock, UrFd *f, const char *data, int len) {
+	UrSend *s = (UrSend *)malloc(sizeof(UrSend) + len);
+
+	s->next = NULL;
+	s->fd = sock;
+	s->gen = f->gen;
+	s->len = len;
+	s->off = 0;
+	memset(&s->mh, 0, sizeof(s->mh));
+	memcpy(s->data, data, len);
+
+	return s;
+}
+
+/*
+ * This function flush sends what is queued on the epoll path, watching for
+ * room when the socket is full.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+static int flush(UrLoop *ul, int sock, UrFd *f) {
+	struct epoll_event ev;
+
+	ev.data.fd = sock;
+	while (f->sendHead != NULL) {
+		UrSend *s = f->sendHead;
+		int r = send(sock, s->data + s->off, s->len - s->off, MSG_NOSIGNAL);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			if (!f->wantOut) {
+				ev.events = EPOLLIN | EPOLLOUT;
+				epoll_ctl(ul->epfd, EPOLL_CTL_MOD, sock, &ev);
+				f->wantOut = 1;
+			}
+			return 0;
+		}
+
+		s->off += r;
+		if (s->off == s->len) {
+			f->sendHead = s->next;
+			if (f->sendHead == NULL)
+				f->sendTail = NULL;
+			free(s);
+		}
+	}
+
+	if (f->wantOut) {
+		ev.events = EPOLLIN;
+		epoll_ctl(ul->epfd, EPOLL_CTL_MOD, sock, &ev);
+		f->wantOut = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * This function urSend queues len bytes of data on a socket given to urRecv(),
+ * data is copied.  Sends on a socket go out in order and in full.
+ *
+ *   returns -1 on error
+ *           else len.
+ */
+int urSend(UrLoop *ul, int sock, const char *data, int len) {
+	UrFd *f = findFd(ul, sock);
+	if (f == NULL || f->type != UR_STREAM) {
+		pErr("Socket %d was not given to urRecv().\n", sock);
+		return -1;
+	}
+
+	UrSend *s = newSend(sock, f, data, len);
+
+#if UR_HAVE_URING
+	if (ul->uring) {
+		if (f->inFlight == NULL) {
+			f->inFlight = s;
+			armSend(ul, s);
+		} else {
+			if (f->sendTail != NULL)
+				f->sendTail->next = s;
+			else
+				f->sendHead = s;
+			f->sendTail = s;
+		}
+		return len;
+	}
+#endif
+
+	int idle = (f->sendHead == NULL);
+
+	if (f->sendTail != NULL)
+		f->sendTail->next = s;
+	else
+		f->sendHead = s;
+	f->sendTail = s;
+
+	// Behind earlier sends, EPOLLOUT sends it.
+	if (idle && flush(ul, sock, f) < 0) {
+		pErr("send() on socket %d failed: %s\n", sock, strerror(errno));
+		return -1;
+	}
+
+	return len;
+}
+
+/*
+ * This function urSendTo sends a datagram on a UDP socket, data is copied.
+ *
+ *   returns -1 on error
+ *           else len.
+ */
+int urSendTo(UrLoop *ul, int sock, const char *data, int len, struct sockaddr_in *to) {
+#if UR_HAVE_URING
+	if (ul->uring) {
+		UrSend *s = newSend(sock, getFd(ul, sock), data, len);
+
+		s->to = *to;
+		s->iov.iov_base = s->data;
+		s->iov.iov_len = len;
+		s->mh.msg_name = &s->to;
+		s->mh.msg_namelen = sizeof(s->to);
+		s->mh.msg_iov = &s->iov;
+		s->mh.msg_iovlen = 1;
+		armSend(ul, s);
+		return len;
+	}
+#endif
+
+	int r = sendto(sock, data, len, 0, (struct sockaddr *)to, sizeof(*to));
+	if (r < 0)
+		pErr("sendto() failed: %s\n", strerror(errno));
+
+	return r;
+}
+
+/*
+ * This function urClose stops receiving on sock and closes it, no callback is
+ * called for it afterwards.  Queued sends are dropped.
+ */
+void urClose(UrLoop *ul, int sock) {
+	UrFd *f = findFd(ul, sock);
+	if (f == NULL)
+		return;
+
+	UrSend *s = f->sendHead;
+	while (s != NULL) {
+		UrSend *next = s->next;
+		free(s);
+		s = next;
+	}
+	f->sendHead = f->sendTail = NULL;
+	f->type = UR_NONE;
+	f->gen++;
+
+#if UR_HAVE_URING
+	if (ul->uring) {
+		// The socket is closed when the cancel completes, so its number is not
+		// reused while requests on it are still in the kernel.
+		struct io_uring_sqe *sqe = getSqe(ul);
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = sock;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = tag(OP_CANCEL, sock, f->gen);
+		f->inFlight = NULL;		// freed by its completion
+		f->closing = 1;
+		return;
+	}
+#endif
+
+	f->wantOut = 0;
+	close(sock);		// also takes it out of the epoll set
+}
+
+/*
+ * This function pollEvents handles one epoll_wait() worth of events.
+ * This function is private to this file.
+ */
+static int pollEvents(UrLoop *ul) {
+	struct epoll_event events[256];
+
+	int n = epoll_wait(ul->epfd, events, 256, UR_WAIT_MS);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		pErr("epoll_wait() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		int sock = events[i].data.fd;
+		UrFd *f = findFd(ul, sock);
+
+		if (f == NULL)
+			continue;
+
+		if (f->type == UR_LISTEN) {
+			int c;
+			while ((c = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+				f->acceptCb(ul, c, f->arg);
+			continue;
+		}
+
+		if (f->type == UR_DGRAM) {
+			struct sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+			int r;
+
+			while (findFd(ul, sock) == f &&
+					(r = recvfrom(sock, ul->bufs, ul->bufSize, MSG_TRUNC, (struct sockaddr *)&from, &fromLen)) >= 0) {
+				if (r > ul->bufSize)
+					f->dgramCb(ul, sock, ul->bufs, ul->bufSize, &from, MSG_TRUNC, f->arg);
+				else
+					f->dgramCb(ul, sock, ul->bufs, r, &from, 0, f->arg);
+				fromLen = sizeof(from);
+			}
+			continue;
+		}
+
+		if ((events[i].events & EPOLLOUT) && flush(ul, sock, f) < 0) {
+			f->recvCb(ul, sock, NULL, 0, f->arg);
+			urClose(ul, sock);
+			continue;
+		}
+
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			while (findFd(ul, sock) == f) {
+				int r = recv(sock, ul->bufs, ul->bufSize, 0);
+
+				if (r > 0) {
+					if (f->recvCb(ul, sock, ul->bufs, r, f->arg) < 0)
+						urClose(ul, sock);
+				} else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					break;
+				} else if (r < 0 && errno == EINTR) {
+					continue;
+				} else {
+					f->recvCb(ul, sock, NULL, 0, f->arg);
+					urClose(ul, sock);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This function urRun runs the loop until urStop().
+ *
+ *   returns -1 on error
+ *           else 0.
+ */
+int urRun(UrLoop *ul) {
+	ul->stop = 0;
+
+	while (!ul->stop) {
+#if UR_HAVE_URING
+		if (ul->uring) {
+			if (enter(ul, 1) < 0)
+				return -1;
+			reap(ul);
+			continue;
+		}
+#endif
+		if (pollEvents(ul) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function urStop makes urRun() return within UR_WAIT_MS, it may be called
+ * from any thread or from a callback.
+ */
+void urStop(UrLoop *ul) {
+	ul->stop = 1;
+}
+
+/*
+ * This function urDestroy closes every socket still in the loop and frees it.
+ */
+void urDestroy(UrLoop *ul) {
+	if (ul == NULL)
+		return;
+
+#if UR_HAVE_URING
+	if (ul->uring)
+		urFreeRing(ul);		// closing the ring cancels what is left
+#endif
+
+	for (int i = 0; i < ul->numFds; i++) {
+		UrFd *f = ul->fds[i];
+		if (f == NULL)
+			continue;
+		if (f->type != UR_NONE || f->closing) {
+			UrSend *s = f->sendHead;
+			while (s != NULL) {
+				UrSend *next = s->next;
+				free(s);
+				s = next;
+			}
+			free(f->inFlight);
+			close(i);
+		}
+		free(f);
+	}
+
+	if (ul->epfd >= 0)
+		close(ul->epfd);
+
+	free(ul->fds);
+	free(ul->bufs);
+	free(ul);
+}
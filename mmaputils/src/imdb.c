@@ -0,0 +1,947 @@
+/*
+ * imdb.c
+ *
+ * Description: Schema driven in memory database kept in a mmap file.
+ *
+ * A table is a mmap file holding a header, a primary key hash index and an
+ * array of fixed size records.  The header keeps the field layout, so every
+ * process opening the file agrees on where each field is.  Field offsets are
+ * worked out once in imdbOpen(), imdbFieldIdx() turns a field name into the
+ * index used by the get and set functions.
+ *
+ * Locking uses robust process shared mutexes kept in the header, so each table
+ * file has its own and taking one costs no system call unless it is contended:
+ *   tableLock                   free list and record counts.
+ *   recLocks[IMDB_LOCKS]        record stripes, record recNo uses recNo % IMDB_LOCKS.
+ *   indexLocks[IMDB_LOCKS]      index stripes, one per group of hash chains.
+ * Locks are always taken in that order, record then index then table.  The
+ * header is mapped a second time on its own so the locks stay put when growing
+ * moves the map, and the first process to open the file sets them up again in
+ * case a crash left one held.
+ *
+ * With a write ahead log from imdbWal(), each change is logged under the same
+ * lock it was made under, so the log holds changes to any one range in the
+ * order they were made and replaying it rebuilds the table after a crash.
+ * Integer updates then take the record lock instead of being lock free.
+ *
+ * imdbGrow() adds records on the end of the file.  Address space for growth is
+ * reserved when the table is opened so the map does not move, past it the map
+ * is moved and pointers from imdbFieldPtr() are no longer good.  The grower bumps
+ * the generation in the header, a process that meets a record number past what
+ * it has mapped sees the new generation and maps the rest of the file.  The
+ * hash index keeps the size it was created with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <errno.h>
+
+#include "mmaputils.h"
+#include "ipcutils.h"
+#include "logutils.h"
+#include "miscutils.h"
+
+#define IMDB_MAGIC		0x494D4442		// "IMDB"
+// address space imdbOpen() holds for imdbGrow(), imdbOpenMax() to choose.
+#if UINTPTR_MAX > 0xffffffffUL
+#define IMDB_RESERVE	((size_t)64 << 30)
+#else
+#define IMDB_RESERVE	((size_t)256 << 20)
+#endif
+
+#define TABLE_LOCK(db)		(&(db)->locks->tableLock.lock)
+#define REC_LOCK(db, r)		(&(db)->locks->recLocks[(r) % IMDB_LOCKS].lock)
+#define INDEX_LOCK(db, b)	(&(db)->locks->indexLocks[(b) % IMDB_LOCKS].lock)
+
+typedef struct _imdbField {
+	char fieldName[32];
+	int fldType;
+	uint32_t fldLength;
+	uint32_t fldOffset;			// from the start of the record
+} ImdbField;
+
+// One to a cache line so stripes do not share.
+typedef struct _imdbLock {
+	pthread_mutex_t lock;
+} __attribute__((aligned(64))) ImdbLock;
+
+typedef struct _imdbHeader {
+	uint32_t magic;
+	int numFields;
+	int keyField;
+	uint32_t recSize;
+	char schemaName[32];
+	uint64_t maxRecs;
+	uint64_t numBuckets;		// power of two
+	uint64_t bucketOffset;		// from the start of the file
+	uint64_t recOffset;
+	uint64_t highWater;			// records handed out so far
+	uint64_t freeHead;			// first deleted record plus one, 0 if none
+	uint64_t count;
+	uint64_t generation;		// bumped each time the table grows
+	ImdbField fields[IMDB_MAX_FIELDS];
+	ImdbLock tableLock;
+	ImdbLock recLocks[IMDB_LOCKS];
+	ImdbLock indexLocks[IMDB_LOCKS];
+} ImdbHeader;
+
+// In front of every record.
+typedef struct _recHeader {
+	uint64_t next;				// next record in hash chain or free list, plus one
+	uint32_t inUse;
+	uint32_t pad;
+} RecHeader;
+
+struct _imdb {
+	MmapHandle *mh;
+	ImdbHeader *hdr;
+	char *base;
+	uint64_t *buckets;
+	char *recs;
+	ImdbHeader *locks;			// header mapped on its own, see imdbOpenMax()
+	Wal *wal;					// NULL if changes are not logged
+	uint64_t mappedRecs;		// records this process has mapped
+	uint64_t generation;		// of the header when last mapped
+	pthread_mutex_t growMutex;
+};
+
+#define IMDB_ALIGN(x, a)	(((x) + ((a) - 1)) & ~((unsigned long)(a) - 1))
+
+/*
+ * This function fieldSize returns the size of a field of type fldType, the
+ * length in the schema is only used for ARRAY_FIELD.
+ * This function is private to this file.
+ */
+static uint32_t fieldSize(fieldType_t fldType, uint32_t fldLength) {
+	switch (fldType) {
+	case CHAR_FIELD:
+	case BOOL_FIELD:
+		return 1;
+	case SHORT_FIELD:
+		return 2;
+	case INT_FIELD:
+		return 4;
+	case LONG_FIELD:
+	case POINTER_FIELD:
+		return 8;
+	case ARRAY_FIELD:
+		return fldLength;
+	}
+
+	return 0;
+}
+
+/*
+ * This function layoutFields fills in fields from the schema.
+ * Each field is aligned to its own size so it can be read and written atomically.
+ * This function is private to this file.
+ *
+ *   returns 0 on error
+ *           else record size.
+ */
+static uint32_t layoutFields(ImdbSchema *schema, ImdbField *fields) {
+	uint32_t off = sizeof(RecHeader);
+
+	for (int i = 0; i < schema->fieldLen; i++) {
+		MmapField *mf = &schema->fields[i];
+		uint32_t size = fieldSize(mf->fldType, mf->fldLength);
+
+		if (size == 0 || mf->fieldName == NULL || strlen(mf->fieldName) > 31) {
+			Err("Field %d of schema '%s' is not valid.\n", i, schema->schemaName);
+			return 0;
+		}
+
+		if (mf->fldType != ARRAY_FIELD)
+			off = IMDB_ALIGN(off, size);
+
+		memset(&fields[i], 0, sizeof(ImdbField));
+		strcpy(fields[i].fieldName, mf->fieldName);
+		fields[i].fldType = mf->fldType;
+		fields[i].fldLength = size;
+		fields[i].fldOffset = off;
+		off += size;
+	}
+
+	return IMDB_ALIGN(off, 8);
+}
+
+/*
+ * This function keyHash returns the FNV-1a hash of a key.
+ * This function is private to this file.
+ */
+static uint64_t keyHash(const void *key, uint32_t keyLen) {
+	const unsigned char *kp = (const unsigned char *)key;
+	uint64_t h = 14695981039346656037UL;
+
+	for (uint32_t i = 0; i < keyLen; i++) {
+		h ^= kp[i];
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
+
+/*
+ * This function setMap points the handle at the current map and works out how
+ * many records it covers.  This function is private to this file.
+ */
+static void setMap(Imdb *db) {
+	char *base = (char *)db->mh->addr;
+	ImdbHeader *hdr = (ImdbHeader *)base;
+
+	db->base = base;
+	db->hdr = hdr;
+	db->buckets = (uint64_t *)(base + hdr->bucketOffset);
+	db->recs = base + hdr->recOffset;
+	db->generation = __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&db->mappedRecs, (db->mh->size - hdr->recOffset) / hdr->recSize, __ATOMIC_RELEASE);
+}
+
+/*
+ * This function remap maps the part of the file another process added with
+ * imdbGrow(), if the header generation says there is one.
+ * This function is private to this file.
+ */
+static void remap(Imdb *db) {
+	pthread_mutex_lock(&db->growMutex);
+	if (__atomic_load_n(&db->hdr->generation, __ATOMIC_ACQUIRE) != db->generation &&
+			mmapRefresh(db->mh) >= 0)
+		setMap(db);
+	pthread_mutex_unlock(&db->growMutex);
+}
+
+static RecHeader *recAt(Imdb *db, uint64_t recNo) {
+	if (recNo >= __atomic_load_n(&db->mappedRecs, __ATOMIC_ACQUIRE))
+		remap(db);
+
+	return (RecHeader *)(db->recs + (recNo * db->hdr->recSize));
+}
+
+/*
+ * This function logChange logs length bytes at p if the table has a log.
+ * Call it under the lock the change was made under.
+ * This function is private to this file.
+ */
+static void logChange(Imdb *db, void *p, size_t length) {
+	if (db->wal != NULL)
+		walLog(db->wal, (char *)p - db->base, length);
+}
+
+// highWater, freeHead and count are next to each other and logged together.
+#define logCounts(db)	logChange((db), &(db)->hdr->highWater, 3 * sizeof(uint64_t))
+
+/*
+ * This function initLocks sets up the table, record and index locks in the header.
+ * Only call it when no other process has the table open.
+ * This function is private to this file.
+ */
+static void initLocks(ImdbHeader *hdr) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&hdr->tableLock.lock, &attr);
+	for (int i = 0; i < IMDB_LOCKS; i++) {
+		pthread_mutex_init(&hdr->recLocks[i].lock, &attr);
+		pthread_mutex_init(&hdr->indexLocks[i].lock, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * This function lockImdb takes one of the table's locks.  If the process holding
+ * it died the lock is taken over, what it guards is left as the holder left it.
+ * This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int lockImdb(Imdb *db, pthread_mutex_t *lock) {
+	int ret = pthread_mutex_lock(lock);
+
+	if (ret == EOWNERDEAD) {
+		Err("A process died holding a lock on table '%s', it may be inconsistent.\n",
+				db->locks->schemaName);
+		pthread_mutex_consistent(lock);
+		ret = 0;
+	}
+	if (ret != 0) {
+		Err("Could not lock table '%s'. %d, %s\n", db->locks->schemaName, ret, strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function unlockImdb releases a lock taken with lockImdb().
+ * This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int unlockImdb(pthread_mutex_t *lock) {
+
+	return (pthread_mutex_unlock(lock) == 0) ? 0 : -1;
+}
+
+/*
+ * This function imdbOpen is imdbOpenMax() with a reservation for growth of
+ * 64 GB on 64 bit systems and 256 MB on 32 bit ones.
+ */
+Imdb *imdbOpen(const char *fileName, ImdbSchema *schema, int keyField, unsigned long maxRecs, int mmapFlags) {
+
+	return imdbOpenMax(fileName, schema, keyField, maxRecs, mmapFlags, IMDB_RESERVE);
+}
+
+/*
+ * This function imdbOpenMax creates or opens a table kept in fileName.
+ * An existing file must have been created with the same schema, it keeps the
+ * size it has unless maxRecs is larger, then it is grown to maxRecs.
+ *
+ *   fileName = mmap file holding the table.
+ *   schema = Fields of each record.
+ *   keyField = Index in schema->fields of the primary key.
+ *   maxRecs = Most records the table can hold.
+ *   mmapFlags = mmapOpen() flags for the file, MMAP_RANDOM suits most tables.
+ *   reserve = Bytes of address space to hold for imdbGrow(), see mmapOpenMax().
+ *             0 holds none and every imdbGrow() may move the map.
+ *
+ *   returns NULL on error
+ *           else table handle used by the other imdb functions.
+ */
+Imdb *imdbOpenMax(const char *fileName, ImdbSchema *schema, int keyField, unsigned long maxRecs,
+		int mmapFlags, size_t reserve) {
+	ImdbField fields[IMDB_MAX_FIELDS];
+
+	if (schema->fieldLen <= 0 || schema->fieldLen > IMDB_MAX_FIELDS ||
+			keyField < 0 || keyField >= schema->fieldLen || maxRecs == 0) {
+		Err("Schema '%s' not valid, 1 to %d fields and a key field are needed.\n",
+				schema->schemaName, IMDB_MAX_FIELDS);
+		return NULL;
+	}
+
+	uint32_t recSize = layoutFields(schema, fields);
+	if (recSize == 0)
+		return NULL;
+
+	uint64_t numBuckets = 1;
+	while (numBuckets < maxRecs)
+		numBuckets <<= 1;
+
+	uint64_t bucketOffset = IMDB_ALIGN(sizeof(ImdbHeader), 64);
+	uint64_t recOffset = IMDB_ALIGN(bucketOffset + (numBuckets * sizeof(uint64_t)), 64);
+	uint64_t total = recOffset + ((uint64_t)maxRecs * recSize);
+
+	MmapHandle *mh = mmapOpenMax(fileName, total, reserve, mmapFlags);
+	if (mh == NULL)
+		return NULL;
+
+	Imdb *db = (Imdb *)calloc(1, sizeof(Imdb));
+	if (db == NULL) {
+		mmapClose(mh);
+		return NULL;
+	}
+	db->mh = mh;
+	db->hdr = (ImdbHeader *)mh->addr;
+	pthread_mutex_init(&db->growMutex, NULL);
+
+	// The locks are used through a map of their own that growing never moves,
+	// a robust mutex must stay at the address it was locked at until unlocked.
+	void *locks = mmap(NULL, sizeof(ImdbHeader), PROT_READ | PROT_WRITE, MAP_SHARED, mh->fd, 0);
+	if (locks == MAP_FAILED) {
+		Err("Failed to mmap the header of %s. %d, %s\n", fileName, errno, strerror(errno));
+		imdbClose(db);
+		return NULL;
+	}
+	db->locks = (ImdbHeader *)locks;
+
+	/*
+	 * Every process using the table holds a shared flock on it.  Getting it
+	 * exclusive means no one else has it open, so a lock may be left held by
+	 * a process that is gone and they are all set up again.  A second opener
+	 * waits here until the first has finished setting up.
+	 */
+	int alone = (flock(mh->fd, LOCK_EX | LOCK_NB) == 0);
+	if (alone)
+		initLocks(db->locks);
+	else
+		flock(mh->fd, LOCK_SH);
+
+	ImdbHeader *hdr = db->hdr;
+
+	if (lockImdb(db, TABLE_LOCK(db)) != 0) {
+		imdbClose(db);
+		return NULL;
+	}
+	if (hdr->magic != IMDB_MAGIC) {
+		// New file, it is all zeros so the index and free list are empty.
+		strncpy(hdr->schemaName, schema->schemaName, sizeof(hdr->schemaName) - 1);
+		hdr->numFields = schema->fieldLen;
+		hdr->keyField = keyField;
+		hdr->recSize = recSize;
+		hdr->maxRecs = maxRecs;
+		hdr->numBuckets = numBuckets;
+		hdr->bucketOffset = bucketOffset;
+		hdr->recOffset = recOffset;
+		memcpy(hdr->fields, fields, schema->fieldLen * sizeof(ImdbField));
+		__atomic_store_n(&hdr->magic, IMDB_MAGIC, __ATOMIC_RELEASE);
+		mmapSync(mh, 0, sizeof(ImdbHeader), 1);		// a log replay needs the layout on disk
+	} else if (hdr->numFields != schema->fieldLen || hdr->keyField != keyField ||
+			hdr->recSize != recSize ||
+			memcmp(hdr->fields, fields, schema->fieldLen * sizeof(ImdbField)) != 0) {
+		unlockImdb(TABLE_LOCK(db));
+		Err("File '%s' was created with a different schema.\n", fileName);
+		imdbClose(db);
+		return NULL;
+	}
+	setMap(db);
+	unlockImdb(TABLE_LOCK(db));
+	if (alone)
+		flock(mh->fd, LOCK_SH);
+
+	if (maxRecs > hdr->maxRecs && imdbGrow(db, maxRecs) == -1) {
+		imdbClose(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+/*
+ * This function imdbClose unmaps the table, the file is left as is.
+ */
+void imdbClose(Imdb *db) {
+	if (db == NULL)
+		return;
+
+	walClose(db->wal);
+	if (db->locks != NULL)
+		munmap(db->locks, sizeof(ImdbHeader));
+	mmapClose(db->mh);
+	pthread_mutex_destroy(&db->growMutex);
+	free(db);
+}
+
+/*
+ * This function imdbFieldIdx returns the index of a field, look it up once
+ * and use it with the get and set functions.
+ *
+ *   returns -1 if not found
+ *           else field index.
+ */
+int imdbFieldIdx(Imdb *db, const char *fieldName) {
+	for (int i = 0; i < db->hdr->numFields; i++) {
+		if (strcmp(db->hdr->fields[i].fieldName, fieldName) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * This function imdbGrow makes room for maxRecs records, growing the file while
+ * other processes keep using the table.  They pick up the new size the first
+ * time they meet a record past the end of their map.
+ *
+ *   returns -1 on error
+ *           0 on success, or if the table already holds maxRecs.
+ */
+int imdbGrow(Imdb *db, unsigned long maxRecs) {
+	int ret = 0;
+
+	if (lockImdb(db, TABLE_LOCK(db)) != 0)
+		return -1;
+	if (maxRecs > db->hdr->maxRecs) {
+		pthread_mutex_lock(&db->growMutex);
+		uint64_t size = db->hdr->recOffset + ((uint64_t)maxRecs * db->hdr->recSize);
+
+		// Catch up first in case another process grew the file past our map.
+		if (mmapRefresh(db->mh) == -1 || mmapGrow(db->mh, size) == -1) {
+			ret = -1;
+		} else {
+			ImdbHeader *hdr = (ImdbHeader *)db->mh->addr;
+
+			hdr->maxRecs = maxRecs;
+			__atomic_add_fetch(&hdr->generation, 1, __ATOMIC_RELEASE);
+			mmapSync(db->mh, 0, sizeof(ImdbHeader), 1);
+			setMap(db);
+		}
+		pthread_mutex_unlock(&db->growMutex);
+	}
+	unlockImdb(TABLE_LOCK(db));
+
+	return ret;
+}
+
+/*
+ * This function findKey walks the hash chain at *link for key.
+ * The index stripe lock must be held.  This function is private to this file.
+ *
+ *   returns -1 if not found, else the record number and *link is left
+ *           pointing at the entry that refers to it.
+ */
+static long findKey(Imdb *db, uint64_t **link, const void *key) {
+	ImdbField *kf = &db->hdr->fields[db->hdr->keyField];
+
+	while (**link != 0) {
+		uint64_t recNo = **link - 1;
+		RecHeader *rp = recAt(db, recNo);
+
+		if (memcmp((char *)rp + kf->fldOffset, key, kf->fldLength) == 0)
+			return recNo;
+
+		*link = &rp->next;
+	}
+
+	return -1;
+}
+
+/*
+ * This function insertRec does the work of imdbInsert().
+ * This function is private to this file.
+ */
+static long insertRec(Imdb *db, const void *key) {
+	ImdbHeader *hdr = db->hdr;
+	ImdbField *kf = &hdr->fields[hdr->keyField];
+	uint64_t b = keyHash(key, kf->fldLength) & (hdr->numBuckets - 1);
+	uint64_t *link = &db->buckets[b];
+	long recNo = -1;
+
+	if (lockImdb(db, INDEX_LOCK(db, b)) != 0)
+		return -1;
+
+	if (findKey(db, &link, key) >= 0) {
+		unlockImdb(INDEX_LOCK(db, b));
+		return -2;
+	}
+
+	if (lockImdb(db, TABLE_LOCK(db)) != 0) {
+		unlockImdb(INDEX_LOCK(db, b));
+		return -1;
+	}
+	if (hdr->freeHead != 0) {
+		recNo = hdr->freeHead - 1;
+		hdr->freeHead = recAt(db, recNo)->next;
+	} else if (hdr->highWater < hdr->maxRecs) {
+		recNo = hdr->highWater++;
+	}
+	if (recNo >= 0) {
+		hdr->count++;
+		logCounts(db);
+	}
+	unlockImdb(TABLE_LOCK(db));
+
+	if (recNo < 0) {
+		unlockImdb(INDEX_LOCK(db, b));
+		Err("Table '%s' is full, %lu records.\n", hdr->schemaName, (unsigned long)hdr->maxRecs);
+		return -1;
+	}
+
+	RecHeader *rp = recAt(db, recNo);
+	memset(rp, 0, hdr->recSize);
+	memcpy((char *)rp + kf->fldOffset, key, kf->fldLength);
+	rp->next = db->buckets[b];
+	__atomic_store_n(&rp->inUse, 1, __ATOMIC_RELEASE);
+	db->buckets[b] = recNo + 1;
+	logChange(db, rp, hdr->recSize);
+	logChange(db, &db->buckets[b], sizeof(uint64_t));
+
+	unlockImdb(INDEX_LOCK(db, b));
+
+	return recNo;
+}
+
+/*
+ * This function imdbInsert adds a record with the given primary key, all other
+ * fields start out zero.
+ *
+ *   key = Value of the key field, as many bytes as the field is long.
+ *
+ *   returns -1 on error or table full.
+ *           -2 if the key already exists.
+ *           else record number of the new record.
+ */
+long imdbInsert(Imdb *db, const void *key) {
+	if (db->wal == NULL)
+		return insertRec(db, key);
+
+	if (walBegin(db->wal) == -1)
+		return -1;
+	long recNo = insertRec(db, key);
+	walEnd(db->wal);
+
+	return recNo;
+}
+
+/*
+ * This function imdbFind looks up a record by primary key.
+ *
+ *   returns -1 if not found
+ *           else record number.
+ */
+long imdbFind(Imdb *db, const void *key) {
+	ImdbField *kf = &db->hdr->fields[db->hdr->keyField];
+	uint64_t b = keyHash(key, kf->fldLength) & (db->hdr->numBuckets - 1);
+	uint64_t *link = &db->buckets[b];
+
+	if (lockImdb(db, INDEX_LOCK(db, b)) != 0)
+		return -1;
+	long recNo = findKey(db, &link, key);
+	unlockImdb(INDEX_LOCK(db, b));
+
+	return recNo;
+}
+
+/*
+ * This function deleteRec does the work of imdbDelete().
+ * This function is private to this file.
+ */
+static int deleteRec(Imdb *db, const void *key) {
+	ImdbHeader *hdr = db->hdr;
+	ImdbField *kf = &hdr->fields[hdr->keyField];
+	uint64_t b = keyHash(key, kf->fldLength) & (hdr->numBuckets - 1);
+	uint64_t *link = &db->buckets[b];
+
+	if (lockImdb(db, INDEX_LOCK(db, b)) != 0)
+		return -1;
+
+	long recNo = findKey(db, &link, key);
+	if (recNo < 0) {
+		unlockImdb(INDEX_LOCK(db, b));
+		return 0;
+	}
+
+	// Take the table lock first so a record is never unlinked and left off the free list.
+	if (lockImdb(db, TABLE_LOCK(db)) != 0) {
+		unlockImdb(INDEX_LOCK(db, b));
+		return -1;
+	}
+
+	RecHeader *rp = recAt(db, recNo);
+	*link = rp->next;
+	__atomic_store_n(&rp->inUse, 0, __ATOMIC_RELEASE);
+	logChange(db, link, sizeof(uint64_t));
+
+	rp->next = hdr->freeHead;
+	hdr->freeHead = recNo + 1;
+	hdr->count--;
+	logChange(db, rp, sizeof(RecHeader));
+	logCounts(db);
+	unlockImdb(TABLE_LOCK(db));
+
+	unlockImdb(INDEX_LOCK(db, b));
+
+	return 1;
+}
+
+/*
+ * This function imdbDelete removes the record with the given primary key.
+ * Its record number may be handed out again by imdbInsert().
+ *
+ *   returns -1 on error
+ *           0 if key was not found.
+ *           1 if the record was removed.
+ */
+int imdbDelete(Imdb *db, const void *key) {
+	if (db->wal == NULL)
+		return deleteRec(db, key);
+
+	if (walBegin(db->wal) == -1)
+		return -1;
+	int ret = deleteRec(db, key);
+	walEnd(db->wal);
+
+	return ret;
+}
+
+/*
+ * This function imdbCount returns the number of records in the table.
+ */
+long imdbCount(Imdb *db) {
+	return __atomic_load_n(&db->hdr->count, __ATOMIC_RELAXED);
+}
+
+/*
+ * This function imdbLockRec locks a record so several fields can be read or
+ * updated together through imdbFieldPtr().  Do not insert or delete records
+ * while holding a record lock on another record in the same stripe.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbLockRec(Imdb *db, long recNo) {
+	if (recNo < 0 || (uint64_t)recNo >= db->hdr->maxRecs)
+		return -1;
+
+	if (db->wal != NULL && walBegin(db->wal) == -1)
+		return -1;
+
+	if (lockImdb(db, REC_LOCK(db, recNo)) != 0) {
+		if (db->wal != NULL)
+			walEnd(db->wal);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function imdbUnlockRec unlocks a record locked with imdbLockRec().
+ * If the table has a log the whole record is logged first.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbUnlockRec(Imdb *db, long recNo) {
+	if (recNo < 0 || (uint64_t)recNo >= db->hdr->maxRecs)
+		return -1;
+
+	if (db->wal == NULL)
+		return unlockImdb(REC_LOCK(db, recNo));
+
+	logChange(db, recAt(db, recNo), db->hdr->recSize);
+	int ret = unlockImdb(REC_LOCK(db, recNo));
+	walEnd(db->wal);
+
+	return ret;
+}
+
+/*
+ * This function imdbFieldPtr returns the address of a field in this process.
+ * No locking is done, use imdbLockRec() around updates that must go together.
+ *
+ *   returns NULL if recNo is not in use or fld is not valid.
+ *           else pointer to the field.
+ */
+void *imdbFieldPtr(Imdb *db, long recNo, int fld) {
+	if (recNo < 0 || (uint64_t)recNo >= db->hdr->highWater || fld < 0 || fld >= db->hdr->numFields)
+		return NULL;
+
+	RecHeader *rp = recAt(db, recNo);
+	if (__atomic_load_n(&rp->inUse, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+
+	return (char *)rp + db->hdr->fields[fld].fldOffset;
+}
+
+/*
+ * This function imdbGet copies a field into val under the record lock.
+ * val must hold as many bytes as the field is long.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbGet(Imdb *db, long recNo, int fld, void *val) {
+	char *fp = (char *)imdbFieldPtr(db, recNo, fld);
+	if (fp == NULL)
+		return -1;
+
+	if (lockImdb(db, REC_LOCK(db, recNo)) != 0)
+		return -1;
+	memcpy(val, fp, db->hdr->fields[fld].fldLength);
+	unlockImdb(REC_LOCK(db, recNo));
+
+	return 0;
+}
+
+/*
+ * This function imdbSet copies val into a field under the record lock.
+ * The primary key can not be changed, delete and insert the record instead.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbSet(Imdb *db, long recNo, int fld, const void *val) {
+	char *fp = (char *)imdbFieldPtr(db, recNo, fld);
+	if (fp == NULL || fld == db->hdr->keyField)
+		return -1;
+
+	if (imdbLockRec(db, recNo) != 0)
+		return -1;
+	memcpy(fp, val, db->hdr->fields[fld].fldLength);
+	logChange(db, fp, db->hdr->fields[fld].fldLength);
+	unlockImdb(REC_LOCK(db, recNo));
+	if (db->wal != NULL)
+		walEnd(db->wal);
+
+	return 0;
+}
+
+/*
+ * This function imdbGetLong reads a CHAR, BOOL, SHORT, INT, LONG or POINTER field
+ * with one atomic load, no lock is taken.
+ *
+ *   returns 0 on error
+ *           else value of the field.
+ */
+long imdbGetLong(Imdb *db, long recNo, int fld) {
+	void *fp = imdbFieldPtr(db, recNo, fld);
+	if (fp == NULL)
+		return 0;
+
+	switch (db->hdr->fields[fld].fldType) {
+	case CHAR_FIELD:
+	case BOOL_FIELD:
+		return __atomic_load_n((uint8_t *)fp, __ATOMIC_RELAXED);
+	case SHORT_FIELD:
+		return __atomic_load_n((uint16_t *)fp, __ATOMIC_RELAXED);
+	case INT_FIELD:
+		return __atomic_load_n((uint32_t *)fp, __ATOMIC_RELAXED);
+	case LONG_FIELD:
+	case POINTER_FIELD:
+		return __atomic_load_n((uint64_t *)fp, __ATOMIC_RELAXED);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * This function storeLong and addLong do the atomic updates for imdbSetLong()
+ * and imdbAddLong().  This function is private to this file.
+ */
+static int storeLong(void *fp, int fldType, long val) {
+	switch (fldType) {
+	case CHAR_FIELD:
+	case BOOL_FIELD:
+		__atomic_store_n((uint8_t *)fp, (uint8_t)val, __ATOMIC_RELAXED);
+		break;
+	case SHORT_FIELD:
+		__atomic_store_n((uint16_t *)fp, (uint16_t)val, __ATOMIC_RELAXED);
+		break;
+	case INT_FIELD:
+		__atomic_store_n((uint32_t *)fp, (uint32_t)val, __ATOMIC_RELAXED);
+		break;
+	case LONG_FIELD:
+	case POINTER_FIELD:
+		__atomic_store_n((uint64_t *)fp, (uint64_t)val, __ATOMIC_RELAXED);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static long addLong(void *fp, int fldType, long delta) {
+	switch (fldType) {
+	case SHORT_FIELD:
+		return __atomic_add_fetch((uint16_t *)fp, (uint16_t)delta, __ATOMIC_RELAXED);
+	case INT_FIELD:
+		return __atomic_add_fetch((uint32_t *)fp, (uint32_t)delta, __ATOMIC_RELAXED);
+	case LONG_FIELD:
+		return __atomic_add_fetch((uint64_t *)fp, (uint64_t)delta, __ATOMIC_RELAXED);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * This function imdbSetLong writes a CHAR, BOOL, SHORT, INT, LONG or POINTER field
+ * with one atomic store, no lock is taken unless the table has a log.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbSetLong(Imdb *db, long recNo, int fld, long val) {
+	void *fp = imdbFieldPtr(db, recNo, fld);
+	if (fp == NULL || fld == db->hdr->keyField)
+		return -1;
+
+	ImdbField *f = &db->hdr->fields[fld];
+	if (db->wal == NULL)
+		return storeLong(fp, f->fldType, val);
+
+	if (imdbLockRec(db, recNo) != 0)
+		return -1;
+	int ret = storeLong(fp, f->fldType, val);
+	logChange(db, fp, f->fldLength);
+	unlockImdb(REC_LOCK(db, recNo));
+	walEnd(db->wal);
+
+	return ret;
+}
+
+/*
+ * This function imdbAddLong atomically adds delta to a SHORT, INT or LONG field,
+ * no lock is taken unless the table has a log.  Use it for counters shared
+ * between processes.
+ *
+ *   returns 0 on error
+ *           else the new value of the field.
+ */
+long imdbAddLong(Imdb *db, long recNo, int fld, long delta) {
+	void *fp = imdbFieldPtr(db, recNo, fld);
+	if (fp == NULL || fld == db->hdr->keyField)
+		return 0;
+
+	ImdbField *f = &db->hdr->fields[fld];
+	if (db->wal == NULL)
+		return addLong(fp, f->fldType, delta);
+
+	if (imdbLockRec(db, recNo) != 0)
+		return 0;
+	long val = addLong(fp, f->fldType, delta);
+	logChange(db, fp, f->fldLength);
+	unlockImdb(REC_LOCK(db, recNo));
+	walEnd(db->wal);
+
+	return val;
+}
+
+/*
+ * This function imdbWal logs every change to the table in walFile from now on.
+ * The first process to open the log replays what a crash left in it, so every
+ * process using the table must call this before making changes.
+ *
+ *   walFile = Log file, see walOpen().
+ *   syncMs = Commit the log every syncMs milliseconds, 0 to only commit on imdbCommit().
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbWal(Imdb *db, const char *walFile, int syncMs) {
+	if (db->wal != NULL)
+		return 0;
+
+	db->wal = walOpen(db->mh, walFile, syncMs);
+
+	return (db->wal == NULL) ? -1 : 0;
+}
+
+/*
+ * This function imdbCommit returns once every change this process made to the
+ * table is on disk.  Commits from many threads share one flush.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int imdbCommit(Imdb *db) {
+	if (db->wal == NULL)
+		return mmapSync(db->mh, 0, db->mh->size, 1);
+
+	return walCommit(db->wal);
+}
+
+/*
+ * This function imdbSnapshot starts writing a point in time copy of the table
+ * to imageFile while every process keeps using it, see walSnapshot().  The
+ * table must have a log from imdbWal().  The image opens with imdbOpen().
+ *
+ *   returns NULL on error
+ *           else snapshot handle for walSnapStatus() and walSnapWait().
+ */
+Snapshot *imdbSnapshot(Imdb *db, const char *imageFile) {
+	if (db->wal == NULL) {
+		Err("Table '%s' has no log, see imdbWal().\n", db->hdr->schemaName);
+		return NULL;
+	}
+
+	return walSnapshot(db->wal, imageFile);
+}
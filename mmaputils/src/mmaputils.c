@@ -6,7 +6,10 @@
  *      Author: Kelly Wiles
  */
 
+#define _GNU_SOURCE		// mremap()
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -14,111 +17,531 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "mmaputils.h"
 #include "ipcutils.h"
 #include "logutils.h"
-#include "nkxutils.h"
-
-typedef struct _imdbSchema {
-	char schemaName[32];
-	int fieldLen;
-	MmapField *fields;
-} ImdbSchema;
-
-ImdbSchema _schema;
+#include "miscutils.h"
 
 int _mmapFd = -1;
 int _semId = -1;
 int _semNum = -1;
 
-// NOTE: Total mapped file size must be less then physical memory minus OS over head.
+MmapHandle *_mmap = NULL;			// map made by mmapInit()
 
-void *mmapInit(char *fileName, unsigned int sizeInPages) {
+/*
+ * This function adviseMap passes the MMAP_* hint flags on to madvise().
+ * This function is private to this file.
+ *
+ *   returns -1 if any hint was refused.
+ *           0 on success
+ */
+static int adviseMap(void *addr, size_t length, int flags) {
+	int ret = 0;
+
+	if ((flags & MMAP_SEQUENTIAL) && madvise(addr, length, MADV_SEQUENTIAL) == -1)
+		ret = -1;
+	if ((flags & MMAP_RANDOM) && madvise(addr, length, MADV_RANDOM) == -1)
+		ret = -1;
+	if ((flags & MMAP_WILLNEED) && madvise(addr, length, MADV_WILLNEED) == -1)
+		ret = -1;
+#ifdef MADV_HUGEPAGE
+	if ((flags & MMAP_HUGEPAGE) && madvise(addr, length, MADV_HUGEPAGE) == -1)
+		ret = -1;
+#endif
+
+	if (ret == -1)
+		Err("madvise() failed. %d, %s\n", errno, strerror(errno));
+
+	return ret;
+}
+
+/*
+ * This function sizeFile grows a file to size bytes, sparse or with
+ * posix_fallocate() for MMAP_FALLOCATE.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int sizeFile(int fd, const char *fileName, size_t size, int flags) {
+	int r;
+
+	if (flags & MMAP_FALLOCATE) {
+		r = posix_fallocate(fd, 0, size);		// returns the error, does not set errno.
+	} else {
+		r = (ftruncate(fd, size) == -1) ? errno : 0;
+	}
+
+	if (r != 0) {
+		Err("Could not size %s to %lu bytes. %d, %s\n", fileName, (unsigned long)size, r, strerror(r));
+		return -1;
+	}
 
-	void *vp = NULL;
+	return 0;
+}
+
+/*
+ * This function mmapOpen maps fileName, creating or extending it to size bytes.
+ * A file already longer than size is mapped whole.
+ * The file is grown with ftruncate(), leaving it sparse so creating a large map
+ * costs nothing up front, or with posix_fallocate() when MMAP_FALLOCATE is given
+ * so running out of disk shows up here rather than as SIGBUS on a later write.
+ *
+ *   fileName = File to map.
+ *   size = Bytes to map, rounded up to the page size.
+ *   flags = MMAP_FALLOCATE, MMAP_POPULATE to fault in the whole map now,
+ *           and madvise() hints MMAP_SEQUENTIAL, MMAP_RANDOM, MMAP_WILLNEED, MMAP_HUGEPAGE.
+ *
+ *   returns NULL on error
+ *           else handle, mh->addr is the start of the map.
+ */
+MmapHandle *mmapOpen(const char *fileName, size_t size, int flags) {
+	return mmapOpenMax(fileName, size, 0, flags);
+}
+
+/*
+ * This function mmapOpenMax is mmapOpen() for a map that will grow.  maxSize bytes
+ * of address space are reserved up front, without using memory, so mmapGrow()
+ * can map more of the file in place and the map never moves.
+ *
+ *   maxSize = Bytes to reserve, 0 reserves none and growing may move the map.
+ *
+ *   returns NULL on error
+ *           else handle, mh->addr is the start of the map.
+ */
+MmapHandle *mmapOpenMax(const char *fileName, size_t size, size_t maxSize, int flags) {
 	struct stat st;
+	long pageSize = getpagesize();
 
-	int pageSize = getpagesize();
+	size = (size + pageSize - 1) & ~(pageSize - 1);
+	if (size == 0) {
+		Err("Map size must be greater than zero.\n");
+		return NULL;
+	}
 
-	int r = access(fileName, F_OK);
+	int fd = open(fileName, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		Err("Could not open %s. %d, %s\n", fileName, errno, strerror(errno));
+		return NULL;
+	}
 
-#ifdef __ARM_ARCH
-	printf("pageSize: %d, %d\n", pageSize, r);
-#else
-	printf("pageSize: %d, %d\n", pageSize, r);
-#endif
+	if (fstat(fd, &st) == -1) {
+		Err("Could not stat %s. %d, %s\n", fileName, errno, strerror(errno));
+		close(fd);
+		return NULL;
+	}
 
-	if (r == -1) {
-		printf("Creating file.\n");
-		_mmapFd = open(fileName, O_RDWR | O_CREAT, 0644);
-
-		char *blk = (char *)calloc(1, pageSize);
-
-		// Increase file size.
-//		lseek(_mmapFd, (sizeInPages * pageSize), SEEK_SET);
-//		ftruncate(_mmapFd, (sizeInPages * pageSize));
-//		if( lseek(_mmapFd, (sizeInPages * pageSize), SEEK_SET) == -1) {
-//			printf("Failed to increase file size. %d, %s\n", errno, strerror(errno));
-//		}
-		for (int i = 0; i < sizeInPages; i++) {
-			r = write(_mmapFd, blk, pageSize);
-			if (r != pageSize) {
-				Err("Create of file failed. %d, %s\n", errno, strerror(r));
-				free(blk);
-				return NULL;
-			}
+	if ((size_t)st.st_size < size) {
+		if (sizeFile(fd, fileName, size, flags) == -1) {
+			close(fd);
+			return NULL;
 		}
+	} else {
+		size = ((size_t)st.st_size + pageSize - 1) & ~(pageSize - 1);
+	}
+
+	maxSize = (maxSize + pageSize - 1) & ~(pageSize - 1);
+	if (maxSize < size)
+		maxSize = size;
 
-		lseek(_mmapFd, 0, SEEK_SET);		// seek back to start of file.
+	int mapFlags = MAP_SHARED;
+	if (flags & MMAP_POPULATE)
+		mapFlags |= MAP_POPULATE;
 
-		free(blk);
+	void *addr = NULL;
+	if (maxSize > size) {
+		addr = mmap(NULL, maxSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (addr == MAP_FAILED) {
+			Err("Could not reserve %lu bytes for %s. %d, %s\n", (unsigned long)maxSize, fileName, errno, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+		mapFlags |= MAP_FIXED;
+	}
+
+	void *map = mmap(addr, size, PROT_READ | PROT_WRITE, mapFlags, fd, 0);
+	if (map == MAP_FAILED) {
+		Err("Failed to mmap %s. %d, %s\n", fileName, errno, strerror(errno));
+		if (addr != NULL)
+			munmap(addr, maxSize);
+		close(fd);
+		return NULL;
+	}
+
+	adviseMap(map, size, flags);
+
+	MmapHandle *mh = (MmapHandle *)calloc(1, sizeof(MmapHandle));
+	size_t numChunks = (maxSize + MMAP_DIRTY_CHUNK - 1) / MMAP_DIRTY_CHUNK;
+	uint8_t *dirty = (uint8_t *)calloc(numChunks, 1);
+	if (mh == NULL || dirty == NULL) {
+		Err("Out of memory.\n");
+		free(mh);
+		free(dirty);
+		munmap(map, maxSize);
+		close(fd);
+		return NULL;
+	}
+
+	strncpy(mh->fileName, fileName, sizeof(mh->fileName) - 1);
+	mh->fd = fd;
+	mh->addr = map;
+	mh->size = size;
+	mh->reserved = maxSize;
+	mh->flags = flags;
+	mh->numChunks = numChunks;
+	mh->dirty = dirty;
+	pthread_rwlock_init(&mh->dirtyLock, NULL);
+	pthread_mutex_init(&mh->syncMutex, NULL);
+	pthread_cond_init(&mh->syncCond, NULL);
+
+	return mh;
+}
+
+/*
+ * This function mmapGrow extends the file to newSize bytes, if it is shorter,
+ * and maps all of it.  Inside the space reserved by mmapOpenMax() the new part
+ * is mapped after the old one and mh->addr stays put.  Past it the map is moved
+ * with mremap(), pointers into the old map are then no longer good.
+ * Other processes with the file open see the new size with mmapRefresh().
+ *
+ *   newSize = Bytes to map, rounded up to the page size.
+ *
+ *   returns -1 on error
+ *           0 if the map grew in place or was already that size.
+ *           1 if the map moved.
+ */
+int mmapGrow(MmapHandle *mh, size_t newSize) {
+	struct stat st;
+	long pageSize = getpagesize();
+	int moved = 0;
+
+	newSize = (newSize + pageSize - 1) & ~(pageSize - 1);
+	if (newSize <= mh->size)
+		return 0;
+
+	if (fstat(mh->fd, &st) == -1) {
+		Err("Could not stat %s. %d, %s\n", mh->fileName, errno, strerror(errno));
+		return -1;
+	}
+	if ((size_t)st.st_size < newSize && sizeFile(mh->fd, mh->fileName, newSize, mh->flags) == -1)
+		return -1;
+
+	if (newSize <= mh->reserved) {
+		int mapFlags = MAP_SHARED | MAP_FIXED;
+		if (mh->flags & MMAP_POPULATE)
+			mapFlags |= MAP_POPULATE;
+
+		char *tail = (char *)mh->addr + mh->size;
+		if (mmap(tail, newSize - mh->size, PROT_READ | PROT_WRITE, mapFlags, mh->fd, mh->size) == MAP_FAILED) {
+			Err("Failed to grow map of %s. %d, %s\n", mh->fileName, errno, strerror(errno));
+			return -1;
+		}
+		adviseMap(tail, newSize - mh->size, mh->flags);
+
+		pthread_rwlock_wrlock(&mh->dirtyLock);
+		mh->size = newSize;
+		pthread_rwlock_unlock(&mh->dirtyLock);
 	} else {
-		_mmapFd = open(fileName, O_RDWR);
+		// Marks for the new size, the flusher and mmapDirty() may be using the old ones.
+		size_t numChunks = (newSize + MMAP_DIRTY_CHUNK - 1) / MMAP_DIRTY_CHUNK;
+		uint8_t *dirty = (uint8_t *)calloc(numChunks, 1);
+		if (dirty == NULL) {
+			Err("Out of memory.\n");
+			return -1;
+		}
+
+		// The flusher reads addr and size under the shared lock, it must not
+		// see the map half way through being moved.
+		pthread_rwlock_wrlock(&mh->dirtyLock);
+
+		if (mh->reserved > mh->size)
+			munmap((char *)mh->addr + mh->size, mh->reserved - mh->size);
+		mh->reserved = mh->size;
+
+		void *addr = mremap(mh->addr, mh->size, newSize, MREMAP_MAYMOVE);
+		if (addr == MAP_FAILED) {
+			pthread_rwlock_unlock(&mh->dirtyLock);
+			Err("Failed to remap %s. %d, %s\n", mh->fileName, errno, strerror(errno));
+			free(dirty);
+			return -1;
+		}
+		adviseMap((char *)addr + mh->size, newSize - mh->size, mh->flags);
+
+		memcpy(dirty, mh->dirty, mh->numChunks);
+		free(mh->dirty);
+		mh->dirty = dirty;
+		mh->numChunks = numChunks;
+
+		moved = (addr != mh->addr);
+		mh->addr = addr;
+		mh->reserved = newSize;
+		mh->size = newSize;
+
+		pthread_rwlock_unlock(&mh->dirtyLock);
 	}
 
-	int mmapFlags = PROT_WRITE | PROT_READ;
+	return moved;
+}
 
-	r = stat(fileName, &st);
-	if (r != -1) {
-#ifdef __ARM_ARCH
-		printf("File size: %lld\n", st.st_size);
-#else
-		printf("File size: %ld\n", st.st_size);
-#endif
+/*
+ * This function mmapRefresh maps any part of the file another process added
+ * with mmapGrow() since this map was made or last refreshed.
+ *
+ *   returns -1 on error
+ *           0 if the map did not move.
+ *           1 if the map moved.
+ */
+int mmapRefresh(MmapHandle *mh) {
+	struct stat st;
+
+	if (fstat(mh->fd, &st) == -1) {
+		Err("Could not stat %s. %d, %s\n", mh->fileName, errno, strerror(errno));
+		return -1;
 	}
 
-	semInit();
+	if ((size_t)st.st_size <= mh->size)
+		return 0;
 
-	semCreate("imdbSem", 2);
+	return mmapGrow(mh, st.st_size);
+}
 
-	_semId = semGetId("imdbSem");
-	_semNum = semGetNum("imdbSem");
+/*
+ * This function mmapAdvise applies MMAP_* hint flags to part of a map,
+ * for example MMAP_WILLNEED before a scan or MMAP_RANDOM for an index.
+ *
+ *   mh = Handle from mmapOpen().
+ *   offset = Start of the range, rounded down to the page size.
+ *   length = Bytes in the range.
+ *   flags = MMAP_SEQUENTIAL, MMAP_RANDOM, MMAP_WILLNEED or MMAP_HUGEPAGE.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int mmapAdvise(MmapHandle *mh, size_t offset, size_t length, int flags) {
+	long pageSize = getpagesize();
+	size_t start = offset & ~(pageSize - 1);
 
-	unsigned long size = (sizeInPages * pageSize);
+	if (mh == NULL || offset + length > mh->size) {
+		Err("Range is outside the map.\n");
+		return -1;
+	}
 
-#ifdef __ARM_ARCH
-	printf("unsigned long size: %u\n", sizeof(unsigned long));
-	printf("size: %lu, %d, %d, %u\n", size, sizeInPages, pageSize, (sizeInPages * pageSize));
-#else
-	printf("unsigned long size: %lu\n", sizeof(unsigned long));
-	printf("size: %lu, %d, %d, %u\n", size, sizeInPages, pageSize, (sizeInPages * pageSize));
-#endif
+	return adviseMap((char *)mh->addr + start, length + (offset - start), flags);
+}
 
-	vp = mmap(0, size, mmapFlags, MAP_SHARED, _mmapFd, 0);
-	if (vp == MAP_FAILED) {
-		printf("Failed to mmap file. %d, %s\n", errno, strerror(errno));
-		return NULL;
+/*
+ * This function mmapClose unmaps the file and frees the handle.
+ */
+void mmapClose(MmapHandle *mh) {
+	if (mh == NULL)
+		return;
+
+	mmapSyncEvery(mh, 0);
+	munmap(mh->addr, mh->reserved);
+	close(mh->fd);
+	pthread_mutex_destroy(&mh->syncMutex);
+	pthread_cond_destroy(&mh->syncCond);
+	pthread_rwlock_destroy(&mh->dirtyLock);
+	free(mh->dirty);
+	free(mh);
+}
+
+/*
+ * This function mmapSync writes part of a map back to the file with msync().
+ *
+ *   mh = Handle from mmapOpen().
+ *   offset = Start of the range, rounded down to the page size.
+ *   length = Bytes in the range.
+ *   wait = 1 to wait for the write to finish (MS_SYNC), 0 to only start it (MS_ASYNC).
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int mmapSync(MmapHandle *mh, size_t offset, size_t length, int wait) {
+	long pageSize = getpagesize();
+	size_t start = offset & ~(pageSize - 1);
+
+	if (mh == NULL || offset + length > mh->size) {
+		Err("Range is outside the map.\n");
+		return -1;
+	}
+
+	if (msync((char *)mh->addr + start, length + (offset - start), wait ? MS_SYNC : MS_ASYNC) == -1) {
+		Err("msync() of %s failed. %d, %s\n", mh->fileName, errno, strerror(errno));
+		return -1;
 	}
 
-	return vp;
+	return 0;
+}
+
+/*
+ * This function mmapDirty marks a range as changed so mmapFlush() and the
+ * mmapSyncEvery() flusher only msync the parts of a large map that were written.
+ * Marks are kept per process in MMAP_DIRTY_CHUNK pieces, marking is one store
+ * under a shared lock that mmapGrow() only takes alone to move the marks.
+ */
+void mmapDirty(MmapHandle *mh, size_t offset, size_t length) {
+	if (mh == NULL || length == 0 || offset >= mh->size)
+		return;
+
+	pthread_rwlock_rdlock(&mh->dirtyLock);
+
+	size_t last = (offset + length - 1) / MMAP_DIRTY_CHUNK;
+	if (last >= mh->numChunks)
+		last = mh->numChunks - 1;
+
+	for (size_t c = offset / MMAP_DIRTY_CHUNK; c <= last; c++) {
+		if (__atomic_load_n(&mh->dirty[c], __ATOMIC_RELAXED) == 0)
+			__atomic_store_n(&mh->dirty[c], 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_rwlock_unlock(&mh->dirtyLock);
+}
+
+/*
+ * This function mmapFlush msyncs each run of chunks marked by mmapDirty() and
+ * clears the marks.  Marks are cleared before the msync so writes made while it
+ * runs are caught by the next flush.
+ *
+ *   wait = 1 to wait for the writes to finish, 0 to only start them.
+ *
+ *   returns -1 on error
+ *           else number of chunks written.
+ */
+int mmapFlush(MmapHandle *mh, int wait) {
+	int ret = 0;
+	int count = 0;
+
+	if (mh == NULL)
+		return -1;
+
+	pthread_rwlock_rdlock(&mh->dirtyLock);
+
+	size_t c = 0;
+	while (c < mh->numChunks) {
+		if (__atomic_exchange_n(&mh->dirty[c], 0, __ATOMIC_ACQ_REL) == 0) {
+			c++;
+			continue;
+		}
+
+		size_t first = c++;
+		while (c < mh->numChunks && __atomic_exchange_n(&mh->dirty[c], 0, __ATOMIC_ACQ_REL) != 0)
+			c++;
+
+		size_t offset = first * MMAP_DIRTY_CHUNK;
+		size_t length = (c * MMAP_DIRTY_CHUNK) - offset;
+		if (offset + length > mh->size)
+			length = mh->size - offset;
+
+		if (mmapSync(mh, offset, length, wait) == -1)
+			ret = -1;
+		count += c - first;
+	}
+
+	pthread_rwlock_unlock(&mh->dirtyLock);
+
+	return (ret == -1) ? -1 : count;
+}
+
+/*
+ * This function syncThread is the mmapSyncEvery() flusher.
+ * This function is private to this file.
+ */
+static void *syncThread(void *arg) {
+	MmapHandle *mh = (MmapHandle *)arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&mh->syncMutex);
+	while (mh->syncMs > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += mh->syncMs / 1000;
+		ts.tv_nsec += (mh->syncMs % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		if (pthread_cond_timedwait(&mh->syncCond, &mh->syncMutex, &ts) == ETIMEDOUT) {
+			pthread_mutex_unlock(&mh->syncMutex);
+			mmapFlush(mh, 1);
+			pthread_mutex_lock(&mh->syncMutex);
+		}
+	}
+	pthread_mutex_unlock(&mh->syncMutex);
+
+	return NULL;
+}
+
+/*
+ * This function mmapSyncEvery starts a thread that calls mmapFlush() every ms
+ * milliseconds, so marked changes reach the file without the writers ever
+ * waiting on a flush.  A ms of 0 stops the thread after one last flush.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int mmapSyncEvery(MmapHandle *mh, int ms) {
+	if (mh == NULL || ms < 0)
+		return -1;
+
+	pthread_mutex_lock(&mh->syncMutex);
+	int running = (mh->syncMs > 0);
+	mh->syncMs = ms;
+	pthread_cond_signal(&mh->syncCond);
+	pthread_mutex_unlock(&mh->syncMutex);
+
+	if (running && ms == 0) {
+		pthread_join(mh->syncThread, NULL);
+		mmapFlush(mh, 1);
+	} else if (running == 0 && ms > 0) {
+		if (pthread_create(&mh->syncThread, NULL, syncThread, mh) != 0) {
+			Err("Could not start flusher for %s.\n", mh->fileName);
+			mh->syncMs = 0;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// NOTE: Total mapped file size must be less then physical memory minus OS over head.
+
+/*
+ * This function mmapInit maps fileName for the mmapLock() and mmapUnlock() functions.
+ * Use mmapOpen() for new code, it allows more than one map per process.
+ *
+ *   returns NULL on error
+ *           else start of the map.
+ */
+void *mmapInit(char *fileName, unsigned int sizeInPages) {
+	if (_mmap != NULL) {
+		mmapClose(_mmap);
+		_mmap = NULL;
+	}
+
+	_mmap = mmapOpen(fileName, (size_t)sizeInPages * getpagesize(), 0);
+	if (_mmap == NULL)
+		return NULL;
+
+	_mmapFd = _mmap->fd;
+
+	semInit();
+
+	semCreate("imdbSem", 2);
+
+	_semId = semGetId("imdbSem");
+	_semNum = semGetNum("imdbSem");
+
+	return _mmap->addr;
 }
 
 int mmapLock() {
-	return semFastLock(_semNum, _semId);
+	return semFastLock(_semNum, 0);
 }
 
 int mmapUnlock() {
-	return semFastUnlock(_semNum, _semId);
+	return semFastUnlock(_semNum, 0);
 }
 
@@ -0,0 +1,867 @@
+/*
+ * wal.c
+ *
+ * Description: Write ahead log for mmap files.
+ *
+ * A change to a map is logged as the bytes it leaves behind, its offset and a
+ * CRC, appended to the log file with one O_APPEND writev().  After a crash,
+ * walOpen() writes the logged bytes back into the map in log order, which
+ * leaves every range as it was when last logged.  walCommit() makes the log
+ * durable, callers arriving while an fdatasync() runs wait and share the next
+ * one, so many updates pay for one flush.  walCheckpoint() msyncs the map and
+ * empties the log.
+ *
+ * The first page of the log file is shared by every process using it and holds
+ * a robust mutex and a slot per process.  An update counts itself in its
+ * process's slot from the change to the map until it is logged (walBegin() and
+ * walEnd()).  walCheckpoint() holds the mutex, which keeps new updates out, and
+ * waits for the counts to drain so it never throws away a record whose change
+ * is not yet in the msync.  Each process holds a fcntl() lock on the byte of the
+ * log numbered after its slot, the kernel drops it when the process dies, so a
+ * slot left counting by a dead process is found and cleared.
+ *
+ * Updates to the same bytes must be made in the same order they are logged,
+ * hold a lock around the change and walLog() as imdb does.
+ *
+ * walSnapshot() makes a point in time image of the map while writers carry on.
+ * fork() does not help here, pages of a MAP_SHARED file are the same pages in
+ * the child.  Instead the map is copied as it changes and the records logged
+ * during the copy are then written over the image, which brings every range the
+ * copy may have caught half way to its value at the end.  Writers are held off
+ * only while the start and end of the log window are read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mmaputils.h"
+#include "logutils.h"
+#include "miscutils.h"
+
+#define WAL_MAGIC		0x57414C31		// "WAL1"
+#define WAL_REC_MAGIC	0x57524543		// "WREC"
+#define WAL_HDR_SIZE	4096			// records start here
+#define WAL_CHECKPOINT_BYTES	(64 * 1024 * 1024)	// flusher checkpoints past this
+#define WAL_SLOTS		256				// processes that can update at once
+#define WAL_DRAIN_USECS	1000			// between looks at the slots while draining
+
+typedef struct _walSlot {
+	int32_t pid;				// process using the slot, 0 if free
+	uint32_t count;				// its updates between walBegin() and walEnd()
+} WalSlot;
+
+typedef struct _walHeader {
+	uint32_t magic;
+	uint32_t snapshots;			// running, checkpoints keep the log while > 0
+	uint64_t checkpoints;
+	pthread_mutex_t lock;		// held by checkpoints, and by walBegin() to count itself
+	WalSlot slots[WAL_SLOTS];
+} WalHeader;
+
+// In front of the bytes of every record.
+typedef struct _walRec {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t offset;			// in the map
+	uint32_t crc;
+	uint32_t pad;
+} WalRec;
+
+#define SNAP_CHUNK		(1024 * 1024)	// bytes copied per step
+
+struct _wal {
+	MmapHandle *mh;
+	int fd;
+	WalHeader *hdr;
+	char fileName[256];
+	pthread_mutex_t mutex;		// group commit state
+	pthread_cond_t cond;
+	uint64_t startedGen;		// fdatasync() calls started
+	uint64_t doneGen;			// and finished
+	int syncing;
+	int syncMs;					// flusher period, 0 if none
+	pthread_cond_t stopCond;	// wakes the flusher to stop
+	pthread_t thread;
+	pid_t pid;					// process that claimed slot, 0 if none yet
+	int slot;
+};
+
+/*
+ * This function recCrc checks a record, covering where it goes as well as its bytes.
+ * This function is private to this file.
+ */
+static uint32_t recCrc(uint64_t offset, const void *data, uint32_t length) {
+	return crc32(data, length) ^ (uint32_t)offset ^ (uint32_t)(offset >> 32) ^ length;
+}
+
+/*
+ * This function lockHdr takes the mutex in the log header.  If the process
+ * holding it died it is taken over, a checkpoint it was in only has to be
+ * done again.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int lockHdr(Wal *w) {
+	int ret = pthread_mutex_lock(&w->hdr->lock);
+
+	if (ret == EOWNERDEAD) {
+		Err("A process died holding the lock of log %s.\n", w->fileName);
+		pthread_mutex_consistent(&w->hdr->lock);
+		ret = 0;
+	}
+	if (ret != 0) {
+		Err("Could not lock log %s. %d, %s\n", w->fileName, ret, strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function slotLock locks, unlocks or tests the byte of the log file
+ * numbered after a slot.  fcntl() locks belong to the process and go when it
+ * dies, but also when it closes any descriptor of the file, so the log is only
+ * ever opened through w->fd.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success, for F_GETLK fl.l_type is F_UNLCK if no other process holds it.
+ */
+static int slotLock(Wal *w, int slot, int cmd, int type, struct flock *fl) {
+	memset(fl, 0, sizeof(*fl));
+	fl->l_type = type;
+	fl->l_whence = SEEK_SET;
+	fl->l_start = slot;
+	fl->l_len = 1;
+
+	return fcntl(w->fd, cmd, fl);
+}
+
+/*
+ * This function slotGone says whether the process using a slot has died, its
+ * count then belongs to nobody.  Call it with the header lock held.
+ * This function is private to this file.
+ */
+static int slotGone(Wal *w, int slot) {
+	WalSlot *sp = &w->hdr->slots[slot];
+	struct flock fl;
+
+	if (sp->pid == 0 || sp->pid == getpid())
+		return 0;
+
+	return (slotLock(w, slot, F_GETLK, F_WRLCK, &fl) == 0 && fl.l_type == F_UNLCK);
+}
+
+/*
+ * This function claimSlot finds a free slot for this process, it keeps it until
+ * walClose().  A fork() child claims its own on its first walBegin().  Call it
+ * with the header lock held.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int claimSlot(Wal *w) {
+	struct flock fl;
+	pid_t pid = getpid();
+
+	for (int i = 0; i < WAL_SLOTS; i++) {
+		WalSlot *sp = &w->hdr->slots[i];
+
+		if (sp->pid != 0 && !slotGone(w, i))
+			continue;
+
+		if (slotLock(w, i, F_SETLK, F_WRLCK, &fl) == -1)
+			continue;
+		sp->pid = pid;
+		w->pid = pid;
+		__atomic_store_n(&sp->count, 0, __ATOMIC_RELEASE);
+		w->slot = i;
+
+		return 0;
+	}
+
+	Err("All %d slots of log %s are in use.\n", WAL_SLOTS, w->fileName);
+
+	return -1;
+}
+
+/*
+ * This function holdWriters takes the header lock, which keeps new updates out,
+ * and waits until every update already in progress has been logged.  A slot
+ * whose process died part way through an update is cleared, its change never
+ * got a record and the log can not hold it up.  Release with unlockHdr().
+ * This function is private to this file.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+static int holdWriters(Wal *w) {
+	if (lockHdr(w) == -1)
+		return -1;
+
+	for (;;) {
+		int busy = 0;
+
+		for (int i = 0; i < WAL_SLOTS; i++) {
+			WalSlot *sp = &w->hdr->slots[i];
+
+			if (__atomic_load_n(&sp->count, __ATOMIC_ACQUIRE) == 0)
+				continue;
+
+			if (slotGone(w, i)) {
+				Err("Process %d died updating the map of log %s.\n", (int)sp->pid, w->fileName);
+				sp->pid = 0;
+				__atomic_store_n(&sp->count, 0, __ATOMIC_RELEASE);
+			} else {
+				busy = 1;
+			}
+		}
+
+		if (busy == 0)
+			return 0;
+
+		usleep(WAL_DRAIN_USECS);
+	}
+}
+
+#define unlockHdr(w)	pthread_mutex_unlock(&(w)->hdr->lock)
+
+/*
+ * This function replay writes every whole record in the log back into the map,
+ * stopping at the first torn or damaged one, then checkpoints.  Only done by
+ * the first process to open the log.  This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else number of records replayed.
+ */
+static long replay(Wal *w) {
+	struct stat st;
+	WalRec rec;
+	long count = 0;
+
+	if (fstat(w->fd, &st) == -1)
+		return -1;
+
+	off_t pos = WAL_HDR_SIZE;
+	while (pos + (off_t)sizeof(WalRec) <= st.st_size) {
+		if (pread(w->fd, &rec, sizeof(rec), pos) != sizeof(rec) || rec.magic != WAL_REC_MAGIC)
+			break;
+		if (rec.offset + rec.length > w->mh->size ||
+				pos + (off_t)sizeof(rec) + rec.length > st.st_size)
+			break;
+
+		char *dst = (char *)w->mh->addr + rec.offset;
+		char *buf = (char *)malloc(rec.length);
+		if (pread(w->fd, buf, rec.length, pos + sizeof(rec)) != rec.length ||
+				recCrc(rec.offset, buf, rec.length) != rec.crc) {
+			free(buf);
+			break;
+		}
+		memcpy(dst, buf, rec.length);
+		free(buf);
+
+		pos += sizeof(rec) + rec.length;
+		count++;
+	}
+
+	if (pos < st.st_size)
+		Err("Log %s has a damaged record at %ld, %ld bytes after it dropped.\n",
+				w->fileName, (long)pos, (long)(st.st_size - pos));
+
+	if (mmapSync(w->mh, 0, w->mh->size, 1) == -1)
+		return -1;
+	if (ftruncate(w->fd, WAL_HDR_SIZE) == -1 || fsync(w->fd) == -1) {
+		Err("Could not empty log %s. %d, %s\n", w->fileName, errno, strerror(errno));
+		return -1;
+	}
+
+	return count;
+}
+
+/*
+ * This function walThread commits the log every syncMs and checkpoints it
+ * once it passes WAL_CHECKPOINT_BYTES.  This function is private to this file.
+ */
+static void *walThread(void *arg) {
+	Wal *w = (Wal *)arg;
+	struct timespec ts;
+	struct stat st;
+
+	pthread_mutex_lock(&w->mutex);
+	while (w->syncMs > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += w->syncMs / 1000;
+		ts.tv_nsec += (w->syncMs % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		if (pthread_cond_timedwait(&w->stopCond, &w->mutex, &ts) == ETIMEDOUT) {
+			pthread_mutex_unlock(&w->mutex);
+			walCommit(w);
+			if (fstat(w->fd, &st) == 0 && st.st_size > WAL_CHECKPOINT_BYTES)
+				walCheckpoint(w);
+			pthread_mutex_lock(&w->mutex);
+		}
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return NULL;
+}
+
+/*
+ * This function walOpen opens or creates the log for a map.  The first process
+ * to open it replays any records left by a crash into the map.
+ *
+ *   mh = Map the log protects, from mmapOpen().
+ *   walFile = Log file.
+ *   syncMs = Start a thread committing the log every syncMs milliseconds and
+ *            checkpointing it as it grows, 0 leaves that to the caller.
+ *
+ *   returns NULL on error
+ *           else log handle.
+ */
+Wal *walOpen(MmapHandle *mh, const char *walFile, int syncMs) {
+	struct stat st;
+
+	int fd = open(walFile, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd == -1) {
+		Err("Could not open %s. %d, %s\n", walFile, errno, strerror(errno));
+		return NULL;
+	}
+
+	/*
+	 * Every process using the log holds a shared flock on it.  Getting it
+	 * exclusive means no one else has it open, so the header lock may be stale
+	 * from a crash and the map may be missing logged changes.  A second opener
+	 * waits here until the first has finished setting up.
+	 */
+	int alone = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+	if (alone == 0)
+		flock(fd, LOCK_SH);
+
+	if (fstat(fd, &st) == -1 || (st.st_size < WAL_HDR_SIZE && ftruncate(fd, WAL_HDR_SIZE) == -1)) {
+		Err("Could not size %s. %d, %s\n", walFile, errno, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	WalHeader *hdr = (WalHeader *)mmap(NULL, WAL_HDR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		Err("Failed to mmap %s. %d, %s\n", walFile, errno, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if (alone) {
+		pthread_mutexattr_t attr;
+
+		hdr->snapshots = 0;				// any left were in processes that are gone
+		memset(hdr->slots, 0, sizeof(hdr->slots));
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&hdr->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		if (hdr->magic != WAL_MAGIC)
+			hdr->checkpoints = 0;
+		hdr->magic = WAL_MAGIC;
+	}
+
+	Wal *w = (Wal *)calloc(1, sizeof(Wal));
+	w->mh = mh;
+	w->fd = fd;
+	w->hdr = hdr;
+	strncpy(w->fileName, walFile, sizeof(w->fileName) - 1);
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	pthread_cond_init(&w->stopCond, NULL);
+
+	if (alone) {
+		long count = replay(w);
+		flock(fd, LOCK_SH);
+
+		if (count < 0) {
+			walClose(w);
+			return NULL;
+		}
+		if (count > 0)
+			Info("Replayed %ld records from %s.\n", count, walFile);
+	}
+
+	if (syncMs > 0) {
+		w->syncMs = syncMs;
+		if (pthread_create(&w->thread, NULL, walThread, w) != 0) {
+			Err("Could not start log flusher for %s.\n", walFile);
+			w->syncMs = 0;
+		}
+	}
+
+	return w;
+}
+
+/*
+ * This function walClose stops the flusher, commits the log and closes it.
+ * The map is left open.
+ */
+void walClose(Wal *w) {
+	if (w == NULL)
+		return;
+
+	pthread_mutex_lock(&w->mutex);
+	int running = (w->syncMs > 0);
+	w->syncMs = 0;
+	pthread_cond_signal(&w->stopCond);
+	pthread_mutex_unlock(&w->mutex);
+	if (running)
+		pthread_join(w->thread, NULL);
+
+	walCommit(w);
+
+	if (w->pid == getpid() && lockHdr(w) == 0) {
+		struct flock fl;
+
+		w->hdr->slots[w->slot].pid = 0;
+		slotLock(w, w->slot, F_SETLK, F_UNLCK, &fl);
+		unlockHdr(w);
+	}
+
+	munmap(w->hdr, WAL_HDR_SIZE);
+	close(w->fd);
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->cond);
+	pthread_cond_destroy(&w->stopCond);
+	free(w);
+}
+
+/*
+ * A checkpoint holds the header lock while it waits for updates to drain, so a
+ * thread that calls walBegin() again before walEnd() only counts it, else it
+ * would wait on the checkpoint that is waiting on it.
+ */
+static __thread Wal *beginWal = NULL;
+static __thread int beginDepth = 0;
+
+/*
+ * This function walBegin is called before changing the map and walEnd after the
+ * change is logged, a checkpoint waits for everything in between.  Calls may nest.
+ * If the process dies in between, the next checkpoint finds it gone and goes on.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int walBegin(Wal *w) {
+	if (beginWal == w) {
+		beginDepth++;
+		return 0;
+	}
+
+	if (lockHdr(w) == -1)
+		return -1;
+
+	if (w->pid != getpid() && claimSlot(w) == -1) {
+		unlockHdr(w);
+		return -1;
+	}
+	__atomic_add_fetch(&w->hdr->slots[w->slot].count, 1, __ATOMIC_ACQ_REL);
+
+	unlockHdr(w);
+
+	if (beginWal == NULL) {
+		beginWal = w;
+		beginDepth = 1;
+	}
+
+	return 0;
+}
+
+int walEnd(Wal *w) {
+	if (beginWal == w) {
+		if (--beginDepth > 0)
+			return 0;
+		beginWal = NULL;
+	}
+
+	if (w->pid != getpid())
+		return -1;
+
+	__atomic_sub_fetch(&w->hdr->slots[w->slot].count, 1, __ATOMIC_ACQ_REL);
+
+	return 0;
+}
+
+/*
+ * This function walLog appends length bytes of the map at offset to the log, as
+ * they are now.  Call it between walBegin() and walEnd() after making a change.
+ * The record is written but not flushed, see walCommit().
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int walLog(Wal *w, size_t offset, size_t length) {
+	WalRec rec;
+	struct iovec iov[2];
+
+	if (offset + length > w->mh->size || length > UINT32_MAX) {
+		Err("Range is outside the map.\n");
+		return -1;
+	}
+
+	char *src = (char *)w->mh->addr + offset;
+	rec.magic = WAL_REC_MAGIC;
+	rec.length = length;
+	rec.offset = offset;
+	rec.crc = recCrc(offset, src, length);
+	rec.pad = 0;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = src;
+	iov[1].iov_len = length;
+
+	// O_APPEND puts the whole record at the end of the file in one go.
+	if (writev(w->fd, iov, 2) != (ssize_t)(sizeof(rec) + length)) {
+		Err("Write to log %s failed. %d, %s\n", w->fileName, errno, strerror(errno));
+		return -1;
+	}
+
+	mmapDirty(w->mh, offset, length);
+
+	return 0;
+}
+
+/*
+ * This function walWrite copies data into the map at offset and logs it.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int walWrite(Wal *w, size_t offset, const void *data, size_t length) {
+	if (offset + length > w->mh->size) {
+		Err("Range is outside the map.\n");
+		return -1;
+	}
+
+	if (walBegin(w) == -1)
+		return -1;
+	memcpy((char *)w->mh->addr + offset, data, length);
+	int ret = walLog(w, offset, length);
+	walEnd(w);
+
+	return ret;
+}
+
+/*
+ * This function walCommit returns once everything this process logged before
+ * the call is on disk.  Only one fdatasync() runs at a time, callers that
+ * arrive while it runs wait and are all covered by the next one.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int walCommit(Wal *w) {
+	int ret = 0;
+
+	pthread_mutex_lock(&w->mutex);
+
+	// A flush already running may have started before our records were written.
+	uint64_t target = w->startedGen + 1;
+
+	while (w->doneGen < target) {
+		if (w->syncing) {
+			pthread_cond_wait(&w->cond, &w->mutex);
+			continue;
+		}
+
+		w->syncing = 1;
+		uint64_t gen = ++w->startedGen;
+		pthread_mutex_unlock(&w->mutex);
+
+		if (fdatasync(w->fd) == -1) {
+			Err("fdatasync() of %s failed. %d, %s\n", w->fileName, errno, strerror(errno));
+			ret = -1;
+		}
+
+		pthread_mutex_lock(&w->mutex);
+		w->doneGen = gen;
+		w->syncing = 0;
+		pthread_cond_broadcast(&w->cond);
+	}
+
+	pthread_mutex_unlock(&w->mutex);
+
+	return ret;
+}
+
+/*
+ * This function walCheckpoint msyncs the whole map and empties the log, unless a
+ * walSnapshot() is running and still needs it.  It waits
+ * for updates between walBegin() and walEnd() in every process and holds off new
+ * ones until it is done.  The map is written back before that, so writers are
+ * only held off for what changed since and for emptying the log.
+ *
+ *   returns -1 on error
+ *           0 on success
+ */
+int walCheckpoint(Wal *w) {
+	int ret = 0;
+
+	/*
+	 * Start on the ranges this process marked, then wait for the whole map,
+	 * dirty marks are kept per process and miss pages other processes wrote.
+	 * This runs with writers going, the msync under the lock then only finds
+	 * the pages written meanwhile.
+	 */
+	mmapFlush(w->mh, 0);
+	if (mmapSync(w->mh, 0, w->mh->size, 1) == -1)
+		return -1;
+
+	if (holdWriters(w) == -1)
+		return -1;
+
+	if (mmapSync(w->mh, 0, w->mh->size, 1) == -1) {
+		ret = -1;
+	} else if (w->hdr->snapshots > 0) {
+		// A snapshot still needs the records, the next checkpoint empties the log.
+	} else if (ftruncate(w->fd, WAL_HDR_SIZE) == -1 || fsync(w->fd) == -1) {
+		Err("Could not empty log %s. %d, %s\n", w->fileName, errno, strerror(errno));
+		ret = -1;
+	} else {
+		w->hdr->checkpoints++;
+	}
+
+	unlockHdr(w);
+
+	return ret;
+}
+
+struct _snapshot {
+	Wal *w;
+	char imageFile[256];
+	pthread_t thread;
+	pthread_mutex_t mutex;		// guards status
+	SnapStatus status;
+};
+
+/*
+ * This function setStatus updates the progress seen by walSnapStatus().
+ * This function is private to this file.
+ */
+static void setStatus(Snapshot *sp, SnapStatus *st) {
+	pthread_mutex_lock(&sp->mutex);
+	sp->status = *st;
+	pthread_mutex_unlock(&sp->mutex);
+}
+
+static double elapsed(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * This function logWindow holds off writers in every process long enough to read
+ * where the log ends, nothing is then half way between a change and its record.
+ * The snapshot count is changed at the same time.
+ * This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else end of the log.
+ */
+static off_t logWindow(Snapshot *sp, int snapshots, SnapStatus *st) {
+	Wal *w = sp->w;
+	struct stat fs;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (holdWriters(w) == -1)
+		return -1;
+
+	off_t end = (fstat(w->fd, &fs) == -1) ? -1 : fs.st_size;
+	w->hdr->snapshots += snapshots;
+
+	unlockHdr(w);
+	st->pauseUsecs += elapsed(&start) * 1e6;
+
+	return end;
+}
+
+/*
+ * This function applyLog writes the records between start and end over the image.
+ * This function is private to this file.
+ *
+ *   returns -1 on error
+ *           else number of records written.
+ */
+static long applyLog(Wal *w, int imageFd, off_t start, off_t end) {
+	WalRec rec;
+	char *buf = NULL;
+	size_t bufLen = 0;
+	long count = 0;
+
+	for (off_t pos = start; pos + (off_t)sizeof(rec) <= end; pos += sizeof(rec) + rec.length) {
+		if (pread(w->fd, &rec, sizeof(rec), pos) != sizeof(rec) || rec.magic != WAL_REC_MAGIC)
+			break;
+
+		if (rec.length > bufLen) {
+			bufLen = rec.length;
+			buf = (char *)realloc(buf, bufLen);
+		}
+		if (pread(w->fd, buf, rec.length, pos + sizeof(rec)) != rec.length ||
+				recCrc(rec.offset, buf, rec.length) != rec.crc ||
+				pwrite(imageFd, buf, rec.length, rec.offset) != rec.length) {
+			free(buf);
+			return -1;
+		}
+		count++;
+	}
+	free(buf);
+
+	return count;
+}
+
+/*
+ * This function snapThread copies the map and applies the log window to the copy.
+ * The image is written to imageFile.tmp and renamed when it is complete.
+ * This function is private to this file.
+ */
+static void *snapThread(void *arg) {
+	Snapshot *sp = (Snapshot *)arg;
+	Wal *w = sp->w;
+	SnapStatus st;
+	struct timespec start;
+	char tmpFile[sizeof(sp->imageFile) + 4];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&st, 0, sizeof(st));
+	snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", sp->imageFile);
+
+	int fd = open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		Err("Could not create %s. %d, %s\n", tmpFile, errno, strerror(errno));
+		st.done = -1;
+		setStatus(sp, &st);
+		return NULL;
+	}
+
+	// Another process may have grown the file, the copy must cover all of it.
+	mmapRefresh(w->mh);
+
+	off_t logStart = logWindow(sp, 1, &st);
+	size_t total = w->mh->size;
+	st.totalBytes = total;
+	setStatus(sp, &st);
+
+	// Chunks of zeros are left as holes, so a sparse map gives a sparse image.
+	char *src = (char *)w->mh->addr;
+	for (size_t off = 0; off < total && st.done == 0; off += SNAP_CHUNK) {
+		size_t len = (total - off < SNAP_CHUNK) ? total - off : SNAP_CHUNK;
+		char *p = src + off;
+
+		if (p[0] != 0 || memcmp(p, p + 1, len - 1) != 0) {
+			if (pwrite(fd, p, len, off) != (ssize_t)len) {
+				Err("Write to %s failed. %d, %s\n", tmpFile, errno, strerror(errno));
+				st.done = -1;
+			}
+		}
+		st.copiedBytes = off + len;
+		setStatus(sp, &st);
+	}
+
+	off_t logEnd = logWindow(sp, 0, &st);
+
+	if (st.done == 0 && (logStart < 0 || logEnd < 0 ||
+			(st.recsApplied = applyLog(w, fd, logStart, logEnd)) < 0)) {
+		Err("Could not apply log %s to %s.\n", w->fileName, tmpFile);
+		st.done = -1;
+	}
+
+	logWindow(sp, -1, &st);
+
+	if (st.done == 0 && (ftruncate(fd, total) == -1 || fsync(fd) == -1 || rename(tmpFile, sp->imageFile) == -1)) {
+		Err("Could not finish %s. %d, %s\n", sp->imageFile, errno, strerror(errno));
+		st.done = -1;
+	}
+	close(fd);
+	if (st.done == -1)
+		unlink(tmpFile);
+
+	st.copySecs = elapsed(&start);
+	if (st.done == 0)
+		st.done = 1;
+	setStatus(sp, &st);
+
+	return NULL;
+}
+
+/*
+ * This function walSnapshot starts writing a point in time image of the map to
+ * imageFile in a thread of its own, writers in every process carry on while it
+ * runs.  The image is as the map was at the moment the copy finished.
+ *
+ *   w = Log of the map, every writer must log its changes.
+ *   imageFile = Where to put the image, it replaces any file there once complete.
+ *
+ *   returns NULL on error
+ *           else snapshot handle for walSnapStatus() and walSnapWait().
+ */
+Snapshot *walSnapshot(Wal *w, const char *imageFile) {
+	Snapshot *sp = (Snapshot *)calloc(1, sizeof(Snapshot));
+
+	sp->w = w;
+	strncpy(sp->imageFile, imageFile, sizeof(sp->imageFile) - 1);
+	pthread_mutex_init(&sp->mutex, NULL);
+
+	if (pthread_create(&sp->thread, NULL, snapThread, sp) != 0) {
+		Err("Could not start snapshot of %s.\n", w->fileName);
+		pthread_mutex_destroy(&sp->mutex);
+		free(sp);
+		return NULL;
+	}
+
+	return sp;
+}
+
+/*
+ * This function walSnapStatus copies the progress of a snapshot into st,
+ * st->done is 0 while it runs, 1 once complete and -1 if it failed.
+ */
+void walSnapStatus(Snapshot *sp, SnapStatus *st) {
+	pthread_mutex_lock(&sp->mutex);
+	*st = sp->status;
+	pthread_mutex_unlock(&sp->mutex);
+}
+
+/*
+ * This function walSnapWait waits for a snapshot to finish and frees the handle.
+ * Its final status and cost are left in st if st is not NULL.
+ *
+ *   returns -1 if the snapshot failed
+ *           0 on success
+ */
+int walSnapWait(Snapshot *sp, SnapStatus *st) {
+	pthread_join(sp->thread, NULL);
+
+	int ret = (sp->status.done == 1) ? 0 : -1;
+	if (st != NULL)
+		*st = sp->status;
+
+	pthread_mutex_destroy(&sp->mutex);
+	free(sp);
+
+	return ret;
+}
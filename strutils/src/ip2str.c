@@ -31,13 +31,10 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "strutils.h"
+
 char *ip2Str(char *s, uint32_t ip) {
-	*s = '\0';
-	sprintf(s, "%d.%d.%d.%d",
-			((ip >> 24) & 0xff),
-			((ip >> 16) & 0xff),
-			((ip >> 8) & 0xff),
-			(ip & 0xff));
+	ipv4Format(s, ip);
 
 	return s;
 }
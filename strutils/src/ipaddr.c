@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2018 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ipaddr.c
+ *
+ * Description: Parse and format IPv4, IPv6 and MAC addresses without stdio.
+ *  Flow records carry millions of addresses, sprintf() and strtok()/atoi()
+ *  cost more than the rest of the record.  These functions make one pass over
+ *  the text with table lookups and write digits straight into the buffer.
+ *
+ *  The parse functions stop at the first character that can not be part of the
+ *  address and return how many characters were used, so an address can be
+ *  parsed in place inside a larger record, "10.1.2.3:443" for one.  They
+ *  return 0 if the text is not an address.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "strutils.h"
+
+// value of each hex digit, -1 for any other character.
+static const signed char hexVal[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+static const char hexDigits[] = "0123456789abcdef";
+
+#define isDigit(c)	((unsigned char)((c) - '0') <= 9)
+
+/*
+ * This function parses the 1 to 3 digits of a dotted quad octet.
+ * returns the number of digits, 0 if not an octet.
+ * This function is private to this file.
+ */
+static inline int octet(const char *s, unsigned int *v) {
+	unsigned int d0 = (unsigned char)(s[0] - '0');
+	if (d0 > 9)
+		return 0;
+
+	unsigned int d1 = (unsigned char)(s[1] - '0');
+	if (d1 > 9) {
+		*v = d0;
+		return 1;
+	}
+
+	unsigned int d2 = (unsigned char)(s[2] - '0');
+	if (d2 > 9) {
+		*v = d0 * 10 + d1;
+		return 2;
+	}
+
+	*v = d0 * 100 + d1 * 10 + d2;
+
+	return (*v > 255 || isDigit(s[3])) ? 0 : 3;
+}
+
+/*
+ * This function ipv4Parse converts a dotted quad to an address.  Octets are
+ * decimal, leading zeros are allowed.
+ *
+ *   s = The dotted notation IP address, "192.168.0.1".
+ *   ip = Set to the address in host byte order.
+ *
+ *   returns the number of characters used, 0 if s is not an address.
+ */
+int ipv4Parse(const char *s, unsigned int *ip) {
+	const char *p = s;
+	unsigned int addr = 0, v;
+	int i, n;
+
+	for (i = 0; i < 4; i++) {
+		n = octet(p, &v);
+		if (n == 0)
+			return 0;
+
+		addr = (addr << 8) | v;
+		p += n;
+
+		if (i < 3) {
+			if (*p != '.')
+				return 0;
+			p++;
+		}
+	}
+
+	*ip = addr;
+
+	return p - s;
+}
+
+/*
+ * This function ipv4Format converts an address to a dotted quad.
+ * Each octet is written as three digits and a dot, then the start is moved past
+ * its leading zeros, no division by 10 loop and no branch on the length.
+ *
+ *   s = Buffer of at least 16 bytes.
+ *   ip = Address in host byte order.
+ *
+ *   returns the length of the string.
+ */
+int ipv4Format(char *s, unsigned int ip) {
+	char *p = s;
+	char d[8];
+	int i;
+
+	for (i = 24; i >= 0; i -= 8) {
+		unsigned int v = (ip >> i) & 0xff;
+		int skip = (v < 100) + (v < 10);
+
+		d[0] = '0' + v / 100;
+		d[1] = '0' + v / 10 % 10;
+		d[2] = '0' + v % 10;
+		d[3] = '.';
+		memcpy(p, d + skip, 4);
+		p += 4 - skip;
+	}
+
+	*--p = '\0';
+
+	return p - s;
+}
+
+/*
+ * This function ipv6Parse converts IPv6 text to an address, with "::" for a run
+ * of zero groups and a dotted quad for the last 32 bits, "::ffff:10.1.2.3".
+ *
+ *   s = The IPv6 address, "2001:db8::1".
+ *   ip = Set to the 16 bytes of the address in network byte order.
+ *
+ *   returns the number of characters used, 0 if s is not an address.
+ */
+int ipv6Parse(const char *s, unsigned char *ip) {
+	const char *p = s;
+	unsigned int g[8];
+	int n = 0, gap = -1;
+	int i;
+
+	if (p[0] == ':') {
+		if (p[1] != ':')
+			return 0;
+		gap = 0;
+		p += 2;
+	}
+
+	while (hexVal[(unsigned char)*p] >= 0) {
+		unsigned int v = 0;
+		int cnt = 0;
+
+		while (cnt < 5 && hexVal[(unsigned char)p[cnt]] >= 0)
+			v = (v << 4) | hexVal[(unsigned char)p[cnt++]];
+
+		if (p[cnt] == '.') {
+			unsigned int v4;
+			int k = ipv4Parse(p, &v4);
+
+			if (k == 0 || n > 6)
+				return 0;
+			g[n++] = v4 >> 16;
+			g[n++] = v4 & 0xffff;
+			p += k;
+			break;
+		}
+
+		if (cnt > 4)
+			return 0;
+
+		g[n++] = v;
+		p += cnt;
+
+		if (n == 8 || *p != ':')
+			break;
+
+		if (p[1] == ':') {
+			if (gap >= 0)
+				return 0;
+			gap = n;
+			p += 2;
+		} else if (hexVal[(unsigned char)p[1]] >= 0) {
+			p++;
+		} else {
+			return 0;
+		}
+	}
+
+	if (gap < 0 ? n != 8 : n == 8)
+		return 0;
+
+	memset(ip, 0, 16);
+
+	int tail = gap < 0 ? 0 : n - gap;
+	for (i = 0; i < n - tail; i++) {
+		ip[i * 2] = g[i] >> 8;
+		ip[i * 2 + 1] = g[i];
+	}
+	for (i = 0; i < tail; i++) {
+		int k = 8 - tail + i;
+		ip[k * 2] = g[gap + i] >> 8;
+		ip[k * 2 + 1] = g[gap + i];
+	}
+
+	return p - s;
+}
+
+/*
+ * This function ipv6Format converts an address to text the RFC 5952 way.
+ * Groups are lower case hex without leading zeros, the longest run of two or
+ * more zero groups is written "::" and IPv4 mapped addresses end in a dotted
+ * quad, "::ffff:10.1.2.3".
+ *
+ *   s = Buffer of at least 46 bytes.
+ *   ip = The 16 bytes of the address in network byte order.
+ *
+ *   returns the length of the string.
+ */
+int ipv6Format(char *s, const unsigned char *ip) {
+	unsigned int g[8];
+	int best = -1, bestLen = 1;
+	int run = 0;
+	char *p = s;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		g[i] = (ip[i * 2] << 8) | ip[i * 2 + 1];
+
+		run = g[i] ? 0 : run + 1;
+		if (run > bestLen) {
+			bestLen = run;
+			best = i - run + 1;
+		}
+	}
+
+	if (best == 0 && bestLen == 5 && g[5] == 0xffff) {
+		memcpy(p, "::ffff:", 7);
+		p += 7;
+		return (p - s) + ipv4Format(p, (g[6] << 16) | g[7]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (i == best) {
+			*p++ = ':';
+			if (i == 0)
+				*p++ = ':';
+			i += bestLen - 1;
+			continue;
+		}
+
+		unsigned int v = g[i];
+		int len = 1 + (v > 0xf) + (v > 0xff) + (v > 0xfff);
+
+		p[0] = hexDigits[(v >> 12) & 0xf];
+		p[1] = hexDigits[(v >> 8) & 0xf];
+		p[2] = hexDigits[(v >> 4) & 0xf];
+		p[3] = hexDigits[v & 0xf];
+		memmove(p, p + 4 - len, len);
+		p += len;
+
+		if (i < 7)
+			*p++ = ':';
+	}
+
+	*p = '\0';
+
+	return p - s;
+}
+
+/*
+ * This function macParse converts "00:1a:2b:3c:4d:5e" to 6 bytes, the
+ * separators may be ':' or '-' and the digits either case.
+ *
+ *   s = The MAC address text.
+ *   mac = Set to the 6 bytes.
+ *
+ *   returns the number of characters used, 17, or 0 if s is not a MAC address.
+ */
+int macParse(const char *s, unsigned char *mac) {
+	const unsigned char *p = (const unsigned char *)s;
+	char sep = 0;
+	int i;
+
+	for (i = 0; i < 6; i++, p += 3) {
+		int hi = hexVal[p[0]];
+		int lo = (hi < 0) ? -1 : hexVal[p[1]];
+
+		if (lo < 0)
+			return 0;
+
+		if (i == 0)
+			sep = p[2];
+
+		if ((i < 5 && p[2] != sep) || (sep != ':' && sep != '-'))
+			return 0;
+
+		mac[i] = (hi << 4) | lo;
+	}
+
+	return 17;
+}
+
+/*
+ * This function macFormat converts 6 bytes to "00:1a:2b:3c:4d:5e".
+ *
+ *   s = Buffer of at least 18 bytes.
+ *   mac = The 6 bytes of the MAC address.
+ *   len = Bytes to write, 6 for a MAC address or 3 for its OUI.
+ *   sep = Separator, ':' or '-', 0 for none.
+ *
+ *   returns the length of the string.
+ */
+int macFormat(char *s, const unsigned char *mac, int len, char sep) {
+	char *p = s;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i > 0 && sep != 0)
+			*p++ = sep;
+		*p++ = hexDigits[mac[i] >> 4];
+		*p++ = hexDigits[mac[i] & 0xf];
+	}
+
+	*p = '\0';
+
+	return p - s;
+}
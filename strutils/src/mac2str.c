@@ -31,35 +31,27 @@
 #include <string.h>
 #include <sys/types.h>
 
-char *mac2Str(char *s, uint8_t *mac) {
-	*s = '\0';
+#include "strutils.h"
 
-	sprintf(s, "%02x:%02x:%02x:%02x:%02x:%02x",
-		mac[0],	mac[1],	mac[2],	mac[3],	mac[4],	mac[5]);
+char *mac2Str(char *s, uint8_t *mac) {
+	macFormat(s, mac, 6, ':');
 
 	return s;
 }
 
 char *uoi2Str(char *s, uint8_t *mac) {
-	*s = '\0';
-
-	sprintf(s, "%02x:%02x:%02x", mac[0], mac[1], mac[2]);
+	macFormat(s, mac, 3, ':');
 
 	return s;
 }
 
 char *uoi2HexStr(char *s, uint8_t *mac) {
-	*s = '\0';
-
-	sprintf(s, "%02x%02x%02x", mac[0], mac[1], mac[2]);
+	macFormat(s, mac, 3, 0);
 
 	return s;
 }
 
 int uoi2Int(uint8_t *mac) {
-	char s[16];
-
-	sprintf(s, "%02x%02x%02x", mac[0], mac[1], mac[2]);
 
-	return (int)strtol(s, NULL, 16);
+	return (mac[0] << 16) | (mac[1] << 8) | mac[2];
 }
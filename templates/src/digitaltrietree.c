@@ -43,28 +43,22 @@ DigitalTrieTree *dttInit() {
 }
 
 static int _removeDots(char *ip, char *str) {
+	unsigned int addr;
 
-	char *args[5];
-	char tmp[32];
-	strcpy(tmp, ip);
-
-	tokenize(tmp, '.', args, 5);
+	int n = ipv4Parse(ip, &addr);
+	if (n == 0 || ip[n] != '\0') {
+		str[0] = '\0';
+		return 1;		// not a dotted quad.
+	}
 
 	for (int i = 0; i < 4; i++) {
-		int len = strlen(args[i]);
-		for(int x = 0; x < len; x++) {
-			if (isdigit(args[i][x]) == 0) {
-				str[0] = '\0';
-				return 1;		// invalid digit found.
-			}
-		}
-		if (len < 3) {
-			int n = atoi(args[i]);
-			sprintf(&str[i*3], "%03d", n);
-		} else {
-			strcpy(&str[i*3], args[i]);
-		}
+		unsigned int v = (addr >> (24 - i * 8)) & 0xff;
+
+		str[i*3] = '0' + v / 100;
+		str[i*3 + 1] = '0' + v / 10 % 10;
+		str[i*3 + 2] = '0' + v % 10;
 	}
+	str[12] = '\0';
 
 	return 0;
 }
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2015 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Reserve and release messages in a channel so they wrap past the end of the
+ * arena, a message as large as the arena must still fit once it is empty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipcutils.h"
+
+#define ARENA	1000
+
+static int fail(const char *what) {
+	printf("chan_test: FAIL %s\n", what);
+	chanDestroy("chan_test");
+	return 1;
+}
+
+int main(void) {
+	ChanMsg cm;
+	char buf[ARENA];
+	int i, n;
+
+	memInitBackend(MEM_BACKEND_POSIX, 0);
+	chanDestroy("chan_test");
+
+	if (chanCreate("chan_test", ARENA, 8) != 1)
+		return fail("chanCreate");
+	int cn = chanGetNum("chan_test");
+
+	// Leave the ring offset at 100 then ask for nearly the whole arena.
+	if (chanSend(cn, buf, 100, 0) != 0 || chanRecvCopy(cn, buf, sizeof(buf), 0) != 100)
+		return fail("first message");
+
+	if (chanReserve(cn, &cm, 952, 0) != 0)
+		return fail("reserve 952 bytes of an empty 1000 byte arena");
+	memset(cm.data, 'x', 952);
+	chanCommit(cn, &cm);
+	if (chanRecvCopy(cn, buf, sizeof(buf), 0) != 952 || buf[951] != 'x')
+		return fail("952 byte message");
+
+	// Messages of odd sizes going round the arena many times.
+	for (i = 0; i < 5000; i++) {
+		int len = 1 + (i * 37) % 400;
+
+		memset(buf, i & 0xff, len);
+		if (chanSend(cn, buf, len, 0) != 0)
+			return fail("chanSend");
+
+		if (chanRecv(cn, &cm, 0) != 1 || cm.length != len)
+			return fail("chanRecv");
+		for (n = 0; n < len; n++) {
+			if ((unsigned char)cm.data[n] != (i & 0xff))
+				return fail("message data");
+		}
+		chanRelease(cn, &cm);
+
+		// The arena must be whole again whatever the offset is now.
+		if (chanReserve(cn, &cm, ARENA, 0) != 0)
+			return fail("reserve whole arena after release");
+		chanCommit(cn, &cm);
+		chanRecv(cn, &cm, 0);
+		chanRelease(cn, &cm);
+	}
+
+	chanDestroy("chan_test");
+	printf("chan_test: OK\n");
+
+	return 0;
+}
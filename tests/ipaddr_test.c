@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2018 Richard Kelly Wiles (rkwiles@twc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Check the address functions in ipaddr.c against inet_pton() and inet_ntop(),
+ * then time them against the stdio, tokenize() and libc versions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "strutils.h"
+
+#define CHECKS	100000
+#define LOOPS	1000000
+
+static int fail(const char *what, const char *text) {
+	printf("ipaddr_test: FAIL %s '%s'\n", what, text);
+	return 1;
+}
+
+/*
+ * Random IPv6 address with runs of zero groups and now and then an IPv4
+ * mapped one, so every way of writing "::" gets tried.
+ */
+static void randomIpv6(unsigned char *ip) {
+	for (int g = 0; g < 8; g++) {
+		unsigned int v = ((random() & 1) == 0) ? 0 : (random() & 0xffff);
+
+		ip[g * 2] = v >> 8;
+		ip[g * 2 + 1] = v & 0xff;
+	}
+
+	if ((random() & 7) == 0) {
+		memset(ip, 0, 10);
+		ip[10] = ip[11] = 0xff;
+	}
+}
+
+static int checkIpv4(void) {
+	const char *bad[] = { "", "1.2.3", "256.1.1.1", "1..2.3", ".1.2.3", "a.b.c.d", NULL };
+	char text[INET_ADDRSTRLEN], mine[16];
+	unsigned int ip, nip;
+
+	for (int i = 0; i < CHECKS; i++) {
+		nip = htonl(random());
+		inet_ntop(AF_INET, &nip, text, sizeof(text));
+
+		if (ipv4Format(mine, ntohl(nip)) != (int)strlen(text) || strcmp(mine, text) != 0)
+			return fail("ipv4Format differs from inet_ntop", text);
+		if (ipv4Parse(text, &ip) != (int)strlen(text) || ip != ntohl(nip))
+			return fail("ipv4Parse differs from inet_pton", text);
+	}
+
+	for (int i = 0; bad[i] != NULL; i++) {
+		if (ipv4Parse(bad[i], &ip) != 0 || inet_pton(AF_INET, bad[i], &nip) == 1)
+			return fail("not an address", bad[i]);
+	}
+
+	return 0;
+}
+
+static int checkIpv6(void) {
+	const char *bad[] = { "", ":", "1:2:3:4:5:6:7", "1::2::3", "12345::", "::ffff:1.2.3", "g::", NULL };
+	char text[INET6_ADDRSTRLEN], mine[46];
+	unsigned char ip[16], back[16];
+
+	for (int i = 0; i < CHECKS; i++) {
+		randomIpv6(ip);
+		inet_ntop(AF_INET6, ip, text, sizeof(text));
+
+		// Both take each other's text, even where they write it differently.
+		if (ipv6Parse(text, back) != (int)strlen(text) || memcmp(ip, back, 16) != 0)
+			return fail("ipv6Parse differs from inet_pton", text);
+
+		if (ipv6Format(mine, ip) != (int)strlen(mine))
+			return fail("ipv6Format length", mine);
+
+		// inet_ntop() writes the old IPv4 compatible ::a.b.c.d, RFC 5952 does not.
+		static const unsigned char zeros[12];
+		if (memcmp(ip, zeros, 12) != 0 && strcmp(mine, text) != 0)
+			return fail("ipv6Format differs from inet_ntop", text);
+		if (inet_pton(AF_INET6, mine, back) != 1 || memcmp(ip, back, 16) != 0)
+			return fail("inet_pton does not take ipv6Format", mine);
+		if (ipv6Parse(mine, back) != (int)strlen(mine) || memcmp(ip, back, 16) != 0)
+			return fail("ipv6Format does not round trip", mine);
+	}
+
+	// ipv6Parse() may take the front of these, but never all of them.
+	for (int i = 0; bad[i] != NULL; i++) {
+		int n = ipv6Parse(bad[i], back);
+
+		if ((n != 0 && n == (int)strlen(bad[i])) || inet_pton(AF_INET6, bad[i], back) == 1)
+			return fail("not an address", bad[i]);
+	}
+
+	return 0;
+}
+
+static int checkMac(void) {
+	unsigned char mac[6], back[6];
+	char text[18], mine[18];
+
+	for (int i = 0; i < CHECKS; i++) {
+		for (int x = 0; x < 6; x++)
+			mac[x] = random();
+		snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x",
+				mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+		if (macFormat(mine, mac, 6, ':') != 17 || strcmp(mine, text) != 0)
+			return fail("macFormat differs from sprintf", text);
+		if (macParse(text, back) != 17 || memcmp(mac, back, 6) != 0)
+			return fail("macParse", text);
+	}
+
+	return 0;
+}
+
+static double nsEach(struct timespec *t0) {
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec)) / LOOPS;
+}
+
+static void bench(void) {
+	static char strs[1024][16];
+	static char strs6[1024][INET6_ADDRSTRLEN];
+	static unsigned char ips6[1024][16];
+	unsigned int ips[1024], ip;
+	unsigned int sum = 0;
+	unsigned char ip6[16];
+	struct timespec t0;
+	char buf[64];
+
+	for (int i = 0; i < 1024; i++) {
+		ips[i] = random();
+		ipv4Format(strs[i], ips[i]);
+		randomIpv6(ips6[i]);
+		ipv6Format(strs6[i], ips6[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		ip = ips[i & 1023];
+		sprintf(buf, "%d.%d.%d.%d", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+		sum += buf[0];
+	}
+	printf("  sprintf     %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++)
+		sum += ipv4Format(buf, ips[i & 1023]);
+	printf("  ipv4Format  %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		char tmp[16], *args[5];
+
+		strcpy(tmp, strs[i & 1023]);
+		tokenize(tmp, '.', args, 5);
+		for (int x = 0; x < 4; x++)
+			sum += atoi(args[x]);
+	}
+	printf("  tokenize    %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		inet_pton(AF_INET, strs[i & 1023], &ip);
+		sum += ip;
+	}
+	printf("  inet_pton   %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		ipv4Parse(strs[i & 1023], &ip);
+		sum += ip;
+	}
+	printf("  ipv4Parse   %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		inet_ntop(AF_INET6, ips6[i & 1023], buf, sizeof(buf));
+		sum += buf[0];
+	}
+	printf("  inet_ntop6  %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++)
+		sum += ipv6Format(buf, ips6[i & 1023]);
+	printf("  ipv6Format  %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		inet_pton(AF_INET6, strs6[i & 1023], ip6);
+		sum += ip6[15];
+	}
+	printf("  inet_pton6  %6.1f ns\n", nsEach(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < LOOPS; i++) {
+		ipv6Parse(strs6[i & 1023], ip6);
+		sum += ip6[15];
+	}
+	printf("  ipv6Parse   %6.1f ns\n", nsEach(&t0));
+
+	if (sum == 0)
+		printf("  checksum 0\n");		// keeps the loops from being optimized away
+}
+
+int main(void) {
+	srandom(time(NULL));
+
+	if (checkIpv4() != 0 || checkIpv6() != 0 || checkMac() != 0)
+		return 1;
+
+	printf("ipaddr_test: OK\n");
+	bench();
+
+	return 0;
+}